@@ -18,18 +18,26 @@
 #include "at_command_manager.h"
 
 #include "util/scope_guard.h"
+#include "util.h"
 #include "update_manager.h"
 #include "xmodem_receiver.h"
+#include "windowed_receiver.h"
+#include "background_update.h"
 #include "stream.h"
 #include "version.h"
+#include "packet_capture.h"
+#include "bridge_latency.h"
+#include "link_profile.h"
 
 #include <esp_system.h>
+#include <esp_heap_caps.h>
 
 #include <freertos/FreeRTOS.h>
 
 #include <cstring>
 #include <cstdio>
 #include <cstdarg>
+#include <cctype>
 
 /* :( */
 extern "C" {
@@ -38,8 +46,15 @@ extern "C" {
 
 #include <memory>
 #include "at_transport_mux.h"
+#include "at_transport_uart.h"
+#include "at_transport_sdio.h"
 
 extern std::unique_ptr<particle::ncp::AtMuxTransport> g_muxTransport;
+extern particle::ncp::AtUartTransport* g_uartTransport;
+#if PLATFORM_ID == PLATFORM_TRACKER
+extern particle::ncp::AtSdioTransport* g_sdioTransport;
+#endif
+size_t bridgeBufferMemory();
 
 namespace particle { namespace ncp {
 
@@ -60,6 +75,104 @@ enum AtGpioPull {
 
 using XmodemStream = ::particle::ncp::AtTransportStream;
 
+// Firmware transfer protocols
+enum FwupdProtocol {
+    FWUPD_PROTOCOL_XMODEM = 0, // XMODEM-1K
+    FWUPD_PROTOCOL_WINDOWED = 1, // Sliding window, see WindowedReceiver
+    FWUPD_PROTOCOL_MUX = 2 // Sliding window on a dedicated mux channel, see BackgroundUpdate
+};
+
+template<typename ReceiverT>
+int runFileReceiver(ReceiverT* receiver) {
+    int ret = 0;
+    do {
+        // The receiver blocks while waiting for data
+        ret = receiver->run();
+    } while (ret == ReceiverT::RUNNING);
+    return ret;
+}
+
+// Parses an image hash given as a hex string
+int parseImageHash(const uint8_t* str, uint8_t* hash) {
+    CHECK_TRUE(strlen((const char*)str) == UpdateManager::HASH_SIZE * 2, RESULT_INVALID_PARAM);
+    for (size_t i = 0; i < UpdateManager::HASH_SIZE; ++i) {
+        unsigned b = 0;
+        CHECK_TRUE(isxdigit(str[i * 2]) && isxdigit(str[i * 2 + 1]) &&
+                sscanf((const char*)str + i * 2, "%2x", &b) == 1, RESULT_INVALID_PARAM);
+        hash[i] = b;
+    }
+    return 0;
+}
+
+// Parses the optional image ID and hash parameters of the firmware update commands. An empty
+// image ID is the same as no image ID
+int parseImageParams(uint8_t argc, uint8_t idIndex, const char** imageId, uint8_t* hash, bool* hasHash) {
+    *imageId = nullptr;
+    *hasHash = false;
+    if (argc > idIndex) {
+        uint8_t* id = nullptr;
+        CHECK_TRUE(esp_at_get_para_as_str(idIndex, &id) == ESP_AT_PARA_PARSE_RESULT_OK, RESULT_INVALID_PARAM);
+        if (*id) {
+            *imageId = (const char*)id;
+        }
+    }
+    if (argc > idIndex + 1) {
+        uint8_t* str = nullptr;
+        CHECK_TRUE(esp_at_get_para_as_str(idIndex + 1, &str) == ESP_AT_PARA_PARSE_RESULT_OK, RESULT_INVALID_PARAM);
+        CHECK(parseImageHash(str, hash));
+        *hasHash = true;
+    }
+    return 0;
+}
+
+// Receives the firmware binary and applies the update
+uint8_t runFirmwareUpdate(size_t size, int protocol, OutputStream* updStrm) {
+    const auto updMgr = UpdateManager::instance();
+    SCOPE_GUARD({
+        updMgr->cancelUpdate();
+    });
+    const auto at = AtTransportBase::instance();
+    XmodemStream atStrm(at);
+    XmodemReceiver xmodem;
+    WindowedReceiver windowed;
+    if (protocol == FWUPD_PROTOCOL_WINDOWED) {
+        CHECK_RETURN(windowed.init(&atStrm, updStrm, size), ESP_AT_RESULT_CODE_ERROR);
+    } else {
+        CHECK_RETURN(xmodem.init(&atStrm, updStrm, size), ESP_AT_RESULT_CODE_ERROR);
+    }
+    // Send an intermediate result code
+    const auto self = AtCommandManager::instance();
+    self->writeString("+FWUPD: ONGOING");
+    self->writeNewLine();
+    // Receive the firmware binary. The sender of the windowed protocol doesn't wait for the
+    // acknowledgements, the receive buffer needs to be able to hold a full window
+    if (protocol == FWUPD_PROTOCOL_WINDOWED) {
+        CHECK_RETURN(at->reserveRxBuffer(WindowedReceiver::maxInFlightSize()), ESP_AT_RESULT_CODE_ERROR);
+    }
+    at->setDirectMode(true);
+    int ret = (protocol == FWUPD_PROTOCOL_WINDOWED) ? runFileReceiver(&windowed) : runFileReceiver(&xmodem);
+    // Discard any extra CAN bytes that might have been sent by the sender at the end of
+    // the transfer
+    at->flushInput();
+    at->setDirectMode(false);
+    at->reserveRxBuffer(0);
+    if (ret != 0) {
+        LOG(ERROR, "File transfer failed: %d", ret);
+        return ESP_AT_RESULT_CODE_ERROR;
+    }
+    // Apply the update
+    ret = updMgr->finishUpdate();
+    if (ret == 0) {
+        LOG(INFO, "Resetting the system to apply the update");
+        // Send a final result code
+        esp_at_response_result(ESP_AT_RESULT_CODE_OK);
+        at->waitWriteComplete(1000);
+        esp_restart();
+    }
+    LOG(ERROR, "Firmware update failed: %d", ret);
+    return ESP_AT_RESULT_CODE_ERROR;
+}
+
 int gpioMapAtPullToEspPull(AtGpioPull pull, gpio_pullup_t& espPullUp, gpio_pulldown_t& espPullDown) {
     switch (pull) {
         case AT_GPIO_PULL_NONE: {
@@ -152,6 +265,11 @@ int gpioMapEspModeToGpioMode(gpio_mode_t espMode, AtGpioMode& mode) {
     return 0;
 }
 
+const unsigned IPR_MIN_BAUD_RATE = 9600;
+const unsigned IPR_MAX_BAUD_RATE = 5000000;
+// Time given to the host to confirm the new baud rate
+const unsigned IPR_HANDSHAKE_TIMEOUT = 1000;
+
 } /* anonymous */
 
 int AtCommandManager::init() {
@@ -203,63 +321,270 @@ int AtCommandManager::init() {
     static esp_at_cmd_struct fwupd = {
         (char*)"+FWUPD",
         nullptr, /* AT+FWUPD=? handler */
-        nullptr, /* AT+FWUPD? handler */
-        [](uint8_t) -> uint8_t { /* AT+FWUPD=(...) handler */
+        [](uint8_t*) -> uint8_t { /* AT+FWUPD? handler */
+            /* +FWUPD: <state>,<received>,<size>,<error>
+             * Status of the background update
+             */
+            BackgroundUpdate::Status st = {};
+            BackgroundUpdate::instance()->status(&st);
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+FWUPD: %d,%u,%u,%d", (int)st.state, (unsigned)st.received, (unsigned)st.size,
+                    st.error);
+            self->writeNewLine();
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+FWUPD=(...) handler */
+            /* +FWUPD=<size>[,<protocol>[,<image ID>[,<SHA-256>]]]
+             * <protocol>: 0 - XMODEM-1K, 1 - sliding window, 2 - sliding window on mux channel 5
+             * <image ID>: if not empty, the update can be resumed with +FWRESUME
+             * <SHA-256>: expected hash of the image, hex-encoded
+             */
             int32_t size;
+            int32_t protocol = FWUPD_PROTOCOL_XMODEM;
+            const char* imageId = nullptr;
+            uint8_t hash[UpdateManager::HASH_SIZE] = {};
+            bool hasHash = false;
             if (esp_at_get_para_as_digit(0, &size) != ESP_AT_PARA_PARSE_RESULT_OK || size <= 0) {
                 return ESP_AT_RESULT_CODE_ERROR;
             }
+            if (argc > 1 && (esp_at_get_para_as_digit(1, &protocol) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                    (protocol != FWUPD_PROTOCOL_XMODEM && protocol != FWUPD_PROTOCOL_WINDOWED &&
+                    protocol != FWUPD_PROTOCOL_MUX))) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            CHECK_RETURN(parseImageParams(argc, 2, &imageId, hash, &hasHash), ESP_AT_RESULT_CODE_ERROR);
+            if (protocol == FWUPD_PROTOCOL_MUX) {
+                // The update runs in the background, its progress can be queried with AT+FWUPD?
+                CHECK_TRUE(g_muxTransport && g_muxTransport->isChannelOpen(MUX_CHANNEL_FWUPD),
+                        ESP_AT_RESULT_CODE_ERROR);
+                CHECK_RETURN(BackgroundUpdate::instance()->start(size, imageId, hasHash ? hash : nullptr),
+                        ESP_AT_RESULT_CODE_ERROR);
+                return ESP_AT_RESULT_CODE_OK;
+            }
+            CHECK_FALSE(BackgroundUpdate::instance()->isPartitionBusy(), ESP_AT_RESULT_CODE_ERROR);
             // Initiate the update
             OutputStream* updStrm = nullptr;
             const auto updMgr = UpdateManager::instance();
-            CHECK_RETURN(updMgr->beginUpdate(size, &updStrm), ESP_AT_RESULT_CODE_ERROR);
-            SCOPE_GUARD({
-                updMgr->cancelUpdate();
-            });
-            const auto at = AtTransportBase::instance();
-            XmodemStream atStrm(at);
-            XmodemReceiver xmodem;
-            CHECK(xmodem.init(&atStrm, updStrm, size));
-            // Send an intermediate result code
+            CHECK_RETURN(updMgr->beginUpdate(size, &updStrm, imageId, hasHash ? hash : nullptr),
+                    ESP_AT_RESULT_CODE_ERROR);
+            return runFirmwareUpdate(size, protocol, updStrm);
+        },
+        nullptr /* AT+FWUPD handler */
+    };
+	CHECK_TRUE(esp_at_custom_cmd_array_regist(&fwupd, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct fwresume = {
+        (char*)"+FWRESUME",
+        nullptr, /* AT+FWRESUME=? handler */
+        [](uint8_t*) -> uint8_t { /* AT+FWRESUME? handler */
+            /* +FWRESUME: <size>,<offset>,<image ID>
+             * Nothing is reported if there's no interrupted update
+             */
+            UpdateManager::Checkpoint cp = {};
+            const int ret = UpdateManager::instance()->getCheckpoint(&cp);
+            if (ret == RESULT_NOT_FOUND) {
+                return ESP_AT_RESULT_CODE_OK;
+            }
+            CHECK_RETURN(ret, ESP_AT_RESULT_CODE_ERROR);
             const auto self = AtCommandManager::instance();
-            self->writeString("+FWUPD: ONGOING");
+            self->writeFormatted("+FWRESUME: %u,%u,\"%s\"", (unsigned)cp.size, (unsigned)cp.offset, cp.imageId);
             self->writeNewLine();
-            // Receive the firmware binary
-            at->setDirectMode(true);
-            int ret = 0;
-            do {
-                ret = xmodem.run();
-                // FIXME: XModem receiver runs in a busy loop and for some reason
-                // under some conditions doesn't allow any other even higher priority
-                // threads to be scheduled. Most likely this is some kind of an issue
-                // with priority inheritance. As a temporary workaround, we'll just
-                // add a 1 tick delay here which should guarantee that other threads
-                // get CPU time.
-                vTaskDelay(1 / portTICK_PERIOD_MS);
-            } while (ret == XmodemReceiver::RUNNING);
-            // Discard any extra CAN bytes that might have been sent by the sender at the end of
-            // the XModem transfer
-            at->flushInput();
-            at->setDirectMode(false);
-            if (ret != XmodemReceiver::DONE) {
-                LOG(ERROR, "XModem transfer failed: %d", ret);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+FWRESUME=(...) handler */
+            /* +FWRESUME=<size>,<protocol>,<image ID>[,<SHA-256>]
+             * Replies with +FWRESUME: <offset>, the host then sends the image starting from <offset>
+             */
+            int32_t size;
+            int32_t protocol;
+            const char* imageId = nullptr;
+            uint8_t hash[UpdateManager::HASH_SIZE] = {};
+            bool hasHash = false;
+            if (argc < 3 || esp_at_get_para_as_digit(0, &size) != ESP_AT_PARA_PARSE_RESULT_OK || size <= 0 ||
+                    esp_at_get_para_as_digit(1, &protocol) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                    (protocol != FWUPD_PROTOCOL_XMODEM && protocol != FWUPD_PROTOCOL_WINDOWED) ||
+                    parseImageParams(argc, 2, &imageId, hash, &hasHash) < 0 || !imageId) {
                 return ESP_AT_RESULT_CODE_ERROR;
             }
-            // Apply the update
-            ret = updMgr->finishUpdate();
+            CHECK_FALSE(BackgroundUpdate::instance()->isPartitionBusy(), ESP_AT_RESULT_CODE_ERROR);
+            OutputStream* updStrm = nullptr;
+            size_t offset = 0;
+            const auto updMgr = UpdateManager::instance();
+            CHECK_RETURN(updMgr->resumeUpdate(size, imageId, &offset, &updStrm, hasHash ? hash : nullptr),
+                    ESP_AT_RESULT_CODE_ERROR);
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+FWRESUME: %u", (unsigned)offset);
+            self->writeNewLine();
+            return runFirmwareUpdate(size - offset, protocol, updStrm);
+        },
+        nullptr /* AT+FWRESUME handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&fwresume, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct ipr = {
+        (char*)"+IPR",
+        [](uint8_t*) -> uint8_t { /* AT+IPR=? handler */
+            /* +IPR=<rate>[,<persist>]
+             * <rate>: 9600-5000000
+             * <persist>: 0 - don't store, 1 - use the rate after reset
+             */
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+IPR: (%u-%u),(0,1)", IPR_MIN_BAUD_RATE, IPR_MAX_BAUD_RATE);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t*) -> uint8_t { /* AT+IPR? handler */
+            const auto at = AtTransportBase::instance();
+            const unsigned rate = at->baudRate();
+            if (!rate) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+IPR: %u", rate);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+IPR=(...) handler */
+            int32_t rate = 0;
+            int32_t persist = 0;
+            if (esp_at_get_para_as_digit(0, &rate) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                    rate < (int32_t)IPR_MIN_BAUD_RATE || rate > (int32_t)IPR_MAX_BAUD_RATE) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            if (argc > 1 && (esp_at_get_para_as_digit(1, &persist) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                    persist < 0 || persist > 1)) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            // The baud rate can only be changed while the physical link is not multiplexed
+            const auto at = AtTransportBase::instance();
+            const unsigned prevRate = at->baudRate();
+            if (!prevRate) {
+                LOG(ERROR, "Baud rate can't be changed on this transport");
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+
+            LOG(INFO, "Received AT+IPR, switching to %d baud", rate);
+
+            esp_at_response_result(ESP_AT_RESULT_CODE_OK);
+            at->waitWriteComplete(1000);
+
+            const int ret = at->changeBaudRate(rate, IPR_HANDSHAKE_TIMEOUT);
+            if (ret == 0 && persist) {
+                util::nvsWriteSetting(util::NVS_SETTING_BAUD_RATE, rate);
+            }
+            BridgeLatency::instance()->setLinkRate(at->baudRate());
             if (ret == 0) {
-                LOG(INFO, "Resetting the system to apply the update");
-                // Send a final result code
+                // Reply to the handshake
                 esp_at_response_result(ESP_AT_RESULT_CODE_OK);
-                at->waitWriteComplete(1000);
-                esp_restart();
             }
-            LOG(ERROR, "Firmware update failed: %d", ret);
-            return ESP_AT_RESULT_CODE_ERROR;
+            return ESP_AT_RESULT_CODE_PROCESS_DONE;
         },
-        nullptr /* AT+FWUPD handler */
+        nullptr /* AT+IPR handler */
     };
-	CHECK_TRUE(esp_at_custom_cmd_array_regist(&fwupd, 1), RESULT_ERROR);
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&ipr, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct uartcfg = {
+        (char*)"+UARTCFG",
+        [](uint8_t*) -> uint8_t { /* AT+UARTCFG=? handler */
+            static const char response[] = "+UARTCFG: (0,1),(1-127),(1-126)";
+            /* +UARTCFG=<autotune>[,<rxfifo_full>,<rx_timeout>]
+             * <autotune>: 0 - disable, 1 - enable
+             * <rxfifo_full>: RX FIFO full interrupt threshold in bytes
+             * <rx_timeout>: RX timeout interrupt threshold in symbol periods
+             */
+            auto self = AtCommandManager::instance();
+            self->writeString(response);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t*) -> uint8_t { /* AT+UARTCFG? handler */
+            CHECK_TRUE(g_uartTransport, ESP_AT_RESULT_CODE_ERROR);
+            const auto& conf = g_uartTransport->config();
+            AtUartTransport::Thresholds t = {};
+            g_uartTransport->thresholds(&t);
+            AtUartTransport::Coalescing c = {};
+            g_uartTransport->coalescing(&c);
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+UARTCFG: %u,%u,%u,%u,%d,%u,%u,%u,%u", (unsigned)conf.rxBufferSize,
+                    (unsigned)conf.txBufferSize, (unsigned)conf.eventQueueSize, (unsigned)conf.config.rx_flow_ctrl_thresh,
+                    (int)g_uartTransport->autoTune(), t.rxFifoFull, t.rxTimeout, (unsigned)c.bytes, c.timeMs);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+UARTCFG=(...) handler */
+            CHECK_TRUE(g_uartTransport, ESP_AT_RESULT_CODE_ERROR);
+            int32_t autoTune = 0;
+            if (esp_at_get_para_as_digit(0, &autoTune) != ESP_AT_PARA_PARSE_RESULT_OK || autoTune < 0 || autoTune > 1) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            if (argc > 1) {
+                // Manual thresholds
+                int32_t rxFifoFull = 0;
+                int32_t rxTimeout = 0;
+                if (autoTune || argc < 3 ||
+                        esp_at_get_para_as_digit(1, &rxFifoFull) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                        esp_at_get_para_as_digit(2, &rxTimeout) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                        rxFifoFull <= 0 || rxTimeout <= 0) {
+                    return ESP_AT_RESULT_CODE_ERROR;
+                }
+                const AtUartTransport::Thresholds t = {(unsigned)rxFifoFull, (unsigned)rxTimeout};
+                CHECK_RETURN(g_uartTransport->setThresholds(t), ESP_AT_RESULT_CODE_ERROR);
+            }
+            g_uartTransport->setAutoTune(autoTune);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr /* AT+UARTCFG handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&uartcfg, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct uartstat = {
+        (char*)"+UARTSTAT",
+        nullptr, /* AT+UARTSTAT=? handler */
+        [](uint8_t*) -> uint8_t { /* AT+UARTSTAT? handler */
+            CHECK_TRUE(g_uartTransport, ESP_AT_RESULT_CODE_ERROR);
+            AtUartTransport::Stats stats = {};
+            g_uartTransport->stats(&stats);
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+UARTSTAT: %u,%u,%u,%u,%u,%u,%d,%u", (unsigned)stats.rxBytes, (unsigned)stats.dataEvents,
+                    (unsigned)stats.fifoOverflows, (unsigned)stats.bufferFull, (unsigned)stats.stalledMs,
+                    (unsigned)stats.adjustments, (int)stats.decision, (unsigned)stats.notifications);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr, /* AT+UARTSTAT=(...) handler */
+        nullptr /* AT+UARTSTAT handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&uartstat, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct linkprof = {
+        (char*)"+LINKPROF",
+        [](uint8_t*) -> uint8_t { /* AT+LINKPROF=? handler */
+            static const char response[] = "+LINKPROF: (0-2)";
+            /* +LINKPROF=<profile>
+             * <profile>: 0 - default, 1 - low latency, 2 - high throughput
+             */
+            auto self = AtCommandManager::instance();
+            self->writeString(response);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t*) -> uint8_t { /* AT+LINKPROF? handler */
+            const auto profile = LinkProfile::instance();
+            LinkProfile::Settings s = {};
+            CHECK_RETURN(profile->settings(profile->current(), &s), ESP_AT_RESULT_CODE_ERROR);
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+LINKPROF: %d,%u,%u,%u,%u,%u,%d,%u,%u,%u", (int)profile->current(),
+                    (unsigned)s.uartPriority, (unsigned)s.muxerPriority, (unsigned)s.bridgePriority,
+                    s.thresholds.rxFifoFull, s.thresholds.rxTimeout, (int)s.autoTune, (unsigned)s.coalescing.bytes,
+                    s.coalescing.timeMs, s.bridgeQuantum);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+LINKPROF=(...) handler */
+            int32_t profile = 0;
+            if (esp_at_get_para_as_digit(0, &profile) != ESP_AT_PARA_PARSE_RESULT_OK || profile < 0 ||
+                    profile >= LinkProfile::PROFILE_COUNT) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            CHECK_RETURN(LinkProfile::instance()->apply((LinkProfile::Profile)profile), ESP_AT_RESULT_CODE_ERROR);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr /* AT+LINKPROF handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&linkprof, 1), RESULT_ERROR);
 
     static esp_at_cmd_struct gpio[] = {
         {
@@ -478,6 +803,219 @@ int AtCommandManager::init() {
     };
     CHECK_TRUE(esp_at_custom_cmd_array_regist(&mac, 1), RESULT_ERROR);
 
+    static esp_at_cmd_struct pcap = {
+        (char*)"+PCAP",
+        [](uint8_t*) -> uint8_t { /* AT+PCAP=? handler */
+            static const char response[] = "+PCAP: (0-1),(14-1536),(1-3),(1-3),(0-65535)";
+            /* +PCAP=<enable>[,<snaplen>[,<iface_mask>[,<dir_mask>[,<ethertype>]]]]
+             * <enable>: 0 - disable, 1 - enable
+             * <snaplen>: maximum number of bytes captured per frame
+             * <iface_mask>: 1 - station, 2 - soft AP
+             * <dir_mask>: 1 - WiFi to host, 2 - host to WiFi
+             * <ethertype>: EtherType to capture, 0 - any
+             */
+            auto self = AtCommandManager::instance();
+            self->writeString(response);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t*) -> uint8_t { /* AT+PCAP? handler */
+            const auto capture = PacketCapture::instance();
+            PacketCapture::Settings settings = {};
+            capture->settings(&settings);
+            PacketCapture::Stats stats = {};
+            capture->stats(&stats);
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+PCAP: %d,%u,%u,%u,%u,%u,%u,%u", (int)capture->isEnabled(), settings.snapLen,
+                    settings.ifaceMask, settings.dirMask, (unsigned)settings.etherType, (unsigned)stats.captured,
+                    (unsigned)stats.dropped, (unsigned)stats.streamed);
+            self->writeNewLine();
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+PCAP=(...) handler */
+            int32_t enable;
+            if (esp_at_get_para_as_digit(0, &enable) != ESP_AT_PARA_PARSE_RESULT_OK || (enable != 0 && enable != 1)) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+
+            const auto capture = PacketCapture::instance();
+            if (!enable) {
+                capture->disable();
+                return ESP_AT_RESULT_CODE_OK;
+            }
+
+            PacketCapture::Settings settings = {};
+            settings.snapLen = 128;
+            settings.ifaceMask = (1 << PacketCapture::INTERFACE_STA) | (1 << PacketCapture::INTERFACE_AP);
+            settings.dirMask = PacketCapture::DIRECTION_IN | PacketCapture::DIRECTION_OUT;
+            settings.etherType = 0;
+
+            int32_t val;
+            if (argc > 1 && esp_at_get_para_as_digit(1, &val) == ESP_AT_PARA_PARSE_RESULT_OK) {
+                settings.snapLen = val;
+            }
+            if (argc > 2 && esp_at_get_para_as_digit(2, &val) == ESP_AT_PARA_PARSE_RESULT_OK) {
+                settings.ifaceMask = val;
+            }
+            if (argc > 3 && esp_at_get_para_as_digit(3, &val) == ESP_AT_PARA_PARSE_RESULT_OK) {
+                settings.dirMask = val;
+            }
+            if (argc > 4 && esp_at_get_para_as_digit(4, &val) == ESP_AT_PARA_PARSE_RESULT_OK) {
+                if (val < 0 || val > 0xffff) {
+                    return ESP_AT_RESULT_CODE_ERROR;
+                }
+                settings.etherType = val;
+            }
+
+            CHECK_RETURN(capture->enable(settings), ESP_AT_RESULT_CODE_ERROR);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr /* AT+PCAP handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&pcap, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct lathist = {
+        (char*)"+LATHIST",
+        [](uint8_t*) -> uint8_t { /* AT+LATHIST=? handler */
+            static const char response[] = "+LATHIST: (0-2)";
+            /* +LATHIST=<mode>
+             * <mode>: 0 - disable, 1 - enable, 2 - reset the histograms
+             */
+            auto self = AtCommandManager::instance();
+            self->writeString(response);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t*) -> uint8_t { /* AT+LATHIST? handler */
+            const auto latency = BridgeLatency::instance();
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+LATHIST: %d", (int)latency->isEnabled());
+            self->writeNewLine();
+            for (int dir = 0; dir < BridgeLatency::DIRECTION_COUNT; ++dir) {
+                for (int iface = 0; iface < BridgeLatency::INTERFACE_COUNT; ++iface) {
+                    for (int stage = 0; stage < BridgeLatency::STAGE_COUNT; ++stage) {
+                        BridgeLatency::Histogram h = {};
+                        if (latency->histogram((BridgeLatency::Direction)dir, (BridgeLatency::Interface)iface,
+                                (BridgeLatency::Stage)stage, &h) < 0 || h.count == 0) {
+                            continue;
+                        }
+                        self->writeFormatted("+LATHIST: %d,%d,%d,%u,%u,%u", dir, iface, stage, (unsigned)h.count,
+                                (unsigned)(h.sum / h.count), (unsigned)h.max);
+                        for (unsigned i = 0; i < BridgeLatency::BUCKET_COUNT; ++i) {
+                            self->writeFormatted(",%u", (unsigned)h.buckets[i]);
+                        }
+                        self->writeNewLine();
+                    }
+                }
+            }
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+LATHIST=(...) handler */
+            int32_t mode;
+            if (esp_at_get_para_as_digit(0, &mode) != ESP_AT_PARA_PARSE_RESULT_OK) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            const auto latency = BridgeLatency::instance();
+            switch (mode) {
+                case 0:
+                case 1: {
+                    latency->enable(mode);
+                    break;
+                }
+                case 2: {
+                    latency->reset();
+                    break;
+                }
+                default: {
+                    return ESP_AT_RESULT_CODE_ERROR;
+                }
+            }
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr /* AT+LATHIST handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&lathist, 1), RESULT_ERROR);
+
+    static esp_at_cmd_struct meminfo = {
+        (char*)"+MEMINFO",
+        nullptr, /* AT+MEMINFO=? handler */
+        [](uint8_t*) -> uint8_t { /* AT+MEMINFO? handler */
+            /* +MEMINFO: <name>,<bytes>
+             * +MEMINFO: "heap",<free>,<min_free>
+             */
+            const auto self = AtCommandManager::instance();
+            // The transport may be running without the muxer
+            const auto transport = g_muxTransport ? g_muxTransport->transport() : AtTransportBase::instance();
+            if (transport) {
+                self->writeFormatted("+MEMINFO: \"transport\",%u", (unsigned)transport->bufferMemory());
+                self->writeNewLine();
+            }
+            if (g_muxTransport) {
+                self->writeFormatted("+MEMINFO: \"mux\",%u", (unsigned)g_muxTransport->bufferMemory());
+                self->writeNewLine();
+            }
+            self->writeFormatted("+MEMINFO: \"bridge\",%u", (unsigned)bridgeBufferMemory());
+            self->writeNewLine();
+            self->writeFormatted("+MEMINFO: \"pcap\",%u", (unsigned)PacketCapture::instance()->bufferMemory());
+            self->writeNewLine();
+            self->writeFormatted("+MEMINFO: \"heap\",%u,%u", (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+                    (unsigned)heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT));
+            self->writeNewLine();
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr, /* AT+MEMINFO=(...) handler */
+        nullptr /* AT+MEMINFO handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&meminfo, 1), RESULT_ERROR);
+
+#if PLATFORM_ID == PLATFORM_TRACKER
+    static esp_at_cmd_struct sdiocfg = {
+        (char*)"+SDIOCFG",
+        [](uint8_t*) -> uint8_t { /* AT+SDIOCFG=? handler */
+            static const char response[] = "+SDIOCFG: (0,2-64),(0,1-64)";
+            /* +SDIOCFG=<buf_num>,<queue_size>
+             * Both zeros restore the default geometry
+             */
+            auto self = AtCommandManager::instance();
+            self->writeString(response);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t*) -> uint8_t { /* AT+SDIOCFG? handler */
+            /* +SDIOCFG: <buf_num>,<queue_size> */
+            CHECK_TRUE(g_sdioTransport, ESP_AT_RESULT_CODE_ERROR);
+            const auto& conf = g_sdioTransport->config();
+            const auto self = AtCommandManager::instance();
+            self->writeFormatted("+SDIOCFG: %u,%u", (unsigned)conf.bufferNum, (unsigned)conf.queueSize);
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        [](uint8_t argc) -> uint8_t { /* AT+SDIOCFG=(...) handler */
+            int32_t num, queue;
+            if (argc != 2 || esp_at_get_para_as_digit(0, &num) != ESP_AT_PARA_PARSE_RESULT_OK ||
+                    esp_at_get_para_as_digit(1, &queue) != ESP_AT_PARA_PARSE_RESULT_OK) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            // The new geometry is applied after a restart
+            if (num == 0 && queue == 0) {
+                util::nvsClearSetting(util::NVS_SETTING_SDIO_BUFFER_NUM);
+                util::nvsClearSetting(util::NVS_SETTING_SDIO_QUEUE_SIZE);
+                return ESP_AT_RESULT_CODE_OK;
+            }
+            if (num < 0 || queue < 0) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            const AtSdioTransport::Config conf = { (size_t)num, (size_t)queue };
+            if (AtSdioTransport::checkConfig(conf) < 0) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            if (util::nvsWriteSetting(util::NVS_SETTING_SDIO_BUFFER_NUM, num) < 0 ||
+                    util::nvsWriteSetting(util::NVS_SETTING_SDIO_QUEUE_SIZE, queue) < 0) {
+                return ESP_AT_RESULT_CODE_ERROR;
+            }
+            return ESP_AT_RESULT_CODE_OK;
+        },
+        nullptr /* AT+SDIOCFG handler */
+    };
+    CHECK_TRUE(esp_at_custom_cmd_array_regist(&sdiocfg, 1), RESULT_ERROR);
+#endif // PLATFORM_ID == PLATFORM_TRACKER
+
     return 0;
 }
 
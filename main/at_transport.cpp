@@ -16,9 +16,40 @@
  */
 
 #include "at_transport.h"
+#include "util.h"
 
 namespace particle { namespace ncp {
 
+namespace {
+
+// Waits for the host to send "AT<CR>" at the current baud rate. Anything else, including
+// the line noise produced while the host was reconfiguring its UART, is ignored
+int waitBaudRateHandshake(AtTransportBase* at, unsigned timeout) {
+    static const char handshake[] = "AT\r";
+    size_t matched = 0;
+    const auto t1 = util::millis();
+    for (;;) {
+        const auto t = util::millis() - t1;
+        if (t >= timeout) {
+            return RESULT_TIMEOUT;
+        }
+        uint8_t c = 0;
+        const int r = CHECK(at->readData(&c, 1, timeout - t));
+        if (r == 0) {
+            continue;
+        }
+        if (c == handshake[matched]) {
+            if (++matched == sizeof(handshake) - 1) {
+                return 0;
+            }
+        } else {
+            matched = (c == handshake[0]) ? 1 : 0;
+        }
+    }
+}
+
+} // anonymous
+
 AtTransportBase* AtTransportBase::instance_ = nullptr;
 
 AtTransportBase::AtTransportBase()
@@ -30,6 +61,10 @@ AtTransportBase::~AtTransportBase() {
 }
 
 int AtTransportBase::init() {
+    if (!dataSem_) {
+        dataSem_ = xSemaphoreCreateBinary();
+        CHECK_TRUE(dataSem_, RESULT_NO_MEMORY);
+    }
     CHECK(initTransport());
 
     esp_at_device_ops_struct deviceOps = {
@@ -89,6 +124,23 @@ bool AtTransportBase::isDirectMode() const {
     return direct_;
 }
 
+int AtTransportBase::waitData(unsigned int timeoutMsec) {
+    CHECK_TRUE(dataSem_, RESULT_INVALID_STATE);
+    // Discard a notification for the data that has already been read
+    xSemaphoreTake(dataSem_, 0);
+    const auto start = util::millis();
+    int len = CHECK(getDataLength());
+    // The driver may report the data that has been read after the notification was discarded
+    while (len == 0) {
+        const auto t = util::millis() - start;
+        if (t >= timeoutMsec || xSemaphoreTake(dataSem_, (timeoutMsec - t) / portTICK_PERIOD_MS) != pdTRUE) {
+            break;
+        }
+        len = CHECK(getDataLength());
+    }
+    return len;
+}
+
 AtTransportBase* AtTransportBase::instance() {
     return instance_;
 }
@@ -101,10 +153,67 @@ bool AtTransportBase::isActive() const {
     return instance_ == this;
 }
 
+int AtTransportBase::setBaudRate(unsigned baudRate) {
+    return RESULT_INVALID_STATE;
+}
+
+unsigned AtTransportBase::baudRate() const {
+    return 0;
+}
+
+int AtTransportBase::changeBaudRate(unsigned baudRate, unsigned handshakeTimeout) {
+    const unsigned prevRate = this->baudRate();
+    CHECK_TRUE(prevRate, RESULT_INVALID_STATE);
+    // The handshake is read in direct mode, bypassing the AT command parser
+    CHECK_FALSE(isDirectMode(), RESULT_INVALID_STATE);
+    setDirectMode(true);
+    int ret = setBaudRate(baudRate);
+    if (ret == 0) {
+        ret = waitBaudRateHandshake(this, handshakeTimeout);
+    }
+    if (ret < 0) {
+        LOG(WARN, "Host didn't confirm the new baud rate, switching back to %u baud", prevRate);
+        setBaudRate(prevRate);
+    }
+    // Discard the noise and the handshake
+    flushInput();
+    setDirectMode(false);
+    return ret;
+}
+
+uint8_t* AtTransportBase::allocPacket(size_t size, unsigned int timeoutMsec) {
+    return nullptr;
+}
+
+int AtTransportBase::sendPacket(uint8_t* packet, size_t size, unsigned int timeoutMsec) {
+    return RESULT_INVALID_STATE;
+}
+
+void AtTransportBase::freePacket(uint8_t* packet) {
+}
+
+int AtTransportBase::borrowData(const uint8_t** data) {
+    return RESULT_INVALID_STATE;
+}
+
+int AtTransportBase::returnData(size_t len) {
+    return RESULT_INVALID_STATE;
+}
+
+size_t AtTransportBase::bufferMemory() const {
+    return 0;
+}
+
+int AtTransportBase::reserveRxBuffer(size_t size) {
+    return 0;
+}
+
 int AtTransportBase::notifyReceivedData(size_t len, unsigned int timeoutMsec) {
     if (direct_) {
         if (handler_) {
             handler_(len, handlerCtx_);
+        } else if (dataSem_) {
+            xSemaphoreGive(dataSem_);
         }
         return 0;
     }
@@ -26,6 +26,8 @@
 #include "stream.h"
 
 #include <esp_attr.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 /* :( */
 extern "C" {
 #include "esp_at.h"
@@ -46,6 +48,10 @@ public:
     void setDirectMode(bool direct, DataNotificationHandler handler = nullptr, void* ctx = nullptr);
     bool isDirectMode() const;
 
+    // Blocks until data is available for reading in direct mode. Returns the amount of
+    // available data or 0 in case of a timeout
+    int waitData(unsigned int timeoutMsec);
+
     static AtTransportBase* instance();
     virtual void setActive();
     bool isActive() const;
@@ -56,6 +62,35 @@ public:
     virtual int getDataLength() const = 0;
     virtual int waitWriteComplete(unsigned int timeoutMsec) = 0;
 
+    // Physical link baud rate. Not supported by all transports
+    virtual int setBaudRate(unsigned baudRate);
+    virtual unsigned baudRate() const;
+
+    // Switches to a new baud rate and waits for the host to send "AT<CR>" at that rate. The previous
+    // baud rate is restored if the handshake is not received within the timeout. Can't be used in
+    // direct mode
+    int changeBaudRate(unsigned baudRate, unsigned handshakeTimeout);
+
+    // Zero-copy transmission of complete frames from DMA-capable transport buffers.
+    // Not supported by all transports. A packet that has been passed to sendPacket()
+    // successfully is returned to the transport once it's been sent
+    virtual uint8_t* allocPacket(size_t size, unsigned int timeoutMsec);
+    virtual int sendPacket(uint8_t* packet, size_t size, unsigned int timeoutMsec);
+    virtual void freePacket(uint8_t* packet);
+
+    // Zero-copy reception. Not supported by all transports. borrowData() returns the size of
+    // the received data available in place at the read position, returnData() consumes it.
+    // The transport can reuse its receive buffer once all of its data has been consumed
+    virtual int borrowData(const uint8_t** data);
+    virtual int returnData(size_t len);
+
+    // DRAM used by the transport's buffers
+    virtual size_t bufferMemory() const;
+
+    // Makes the receive buffer hold at least `size` bytes, 0 restores the default size. Only
+    // needed by transports that can't stop the sender when their receive buffer is full
+    virtual int reserveRxBuffer(size_t size);
+
 protected:
     virtual int initTransport() = 0;
     virtual int destroyTransport() = 0;
@@ -86,6 +121,8 @@ private:
     std::atomic_bool direct_;
     DataNotificationHandler handler_ = nullptr;
     void* handlerCtx_ = nullptr;
+    // Given when data is received in direct mode
+    SemaphoreHandle_t dataSem_ = nullptr;
     static AtTransportBase* instance_;
 };
 
@@ -104,11 +141,15 @@ public:
     }
 
     int waitEvent(unsigned flags, unsigned timeout) override {
-        // FIXME: not implemented
-        return 0;
+        // Writes block until the data is buffered by the transport
+        unsigned events = flags & WRITABLE;
+        if ((flags & READABLE) && CHECK(at_->waitData(events ? 0 : timeout)) > 0) {
+            events |= READABLE;
+        }
+        return events;
     }
 
-private:
+protected:
     AtTransportBase* at_;
 };
 
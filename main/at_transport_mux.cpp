@@ -17,11 +17,17 @@
 
 #include "at_transport_mux.h"
 #include "at_transport_uart.h"
+#include "packet_capture.h"
+#include "background_update.h"
+#include "bridge_latency.h"
 #include <lwip/netif.h>
 #include <tcpip_adapter.h>
 #include <tcpip_adapter_internal.h>
 #include <esp_wifi.h>
 #include <esp_wifi_internal.h>
+#include <algorithm>
+#include <cstring>
+#include <new>
 
 #pragma GCC diagnostic ignored "-Wformat"
 
@@ -31,19 +37,29 @@ namespace {
 
 const char* TAG = "AtMuxTransport";
 
+using particle::ncp::BridgeLatency;
+
 int outputEthernetPacket(tcpip_adapter_if_t iface, const uint8_t* data, size_t len) {
+    const auto latency = BridgeLatency::instance();
     struct Data {
         const uint8_t* data;
         size_t len;
-    } d {data, len};
+        BridgeLatency::WifiFrameTimes times;
+    } d {data, len, {latency->now(), 0, 0}};
     bool tcpip_inited = true;
     auto f = [](struct tcpip_adapter_api_msg_s* msg) -> int {
+        const auto latency = BridgeLatency::instance();
+        Data* d = (Data*)msg->data;
+        d->times.ipc = latency->now();
         netif* iface = nullptr;
         CHECK_ESP(tcpip_adapter_get_netif(msg->tcpip_if, (void**)&iface));
         if (netif_is_up(iface)) {
-            Data* d = (Data*)msg->data;
             esp_wifi_internal_tx((wifi_interface_t)msg->tcpip_if, (void*)d->data, d->len);
         }
+        d->times.wifiTx = latency->now();
+        // Note: TCPIP_ADAPTER_IPC_CALL() returns from the calling function, record the times here
+        latency->recordWifiFrame((msg->tcpip_if == TCPIP_ADAPTER_IF_STA) ? BridgeLatency::INTERFACE_STA :
+                BridgeLatency::INTERFACE_AP, d->times);
 
         return 0;
     };
@@ -54,17 +70,383 @@ int outputEthernetPacket(tcpip_adapter_if_t iface, const uint8_t* data, size_t l
 
 const auto MUXER_MAX_FRAME_SIZE = 1536;
 const auto MUXER_MAX_WRITE_TIMEOUT = 10000; // ms
+const auto MUXER_DIAGNOSTICS_WRITE_TIMEOUT = 1000; // ms
+const auto MUXER_FWUPD_WRITE_TIMEOUT = 1000; // ms
+
+// GSM07.10 basic option framing
+const uint8_t MUXER_FRAME_FLAG = 0xf9;
+const uint8_t MUXER_FRAME_EA = 0x01;
+const uint8_t MUXER_FRAME_UIH = 0xef;
+// Flags, address, control, two length octets and FCS
+const size_t MUXER_FRAME_MAX_OVERHEAD = 7;
+// Received frames spanning several receive buffers of the transport are assembled in a buffer of this size
+const size_t MUXER_FRAME_BUFFER_SIZE = MUXER_MAX_FRAME_SIZE + MUXER_FRAME_MAX_OVERHEAD;
+
+uint8_t frameCheckSequence(const uint8_t* data, size_t len) {
+    uint8_t fcs = 0xff;
+    for (size_t i = 0; i < len; i++) {
+        fcs ^= data[i];
+        for (unsigned bit = 0; bit < 8; bit++) {
+            fcs = (fcs & 0x01) ? ((fcs >> 1) ^ 0xe0) : (fcs >> 1);
+        }
+    }
+    return 0xff - fcs;
+}
+
+// Returns the size of the UIH frame starting at the beginning of the buffer according to its header,
+// or 0. The rest of the frame is not checked
+size_t parseDataFrameHeader(const uint8_t* data, size_t size, uint8_t* channel, size_t* headerSize) {
+    size_t pos = 0;
+    // Flag, address, control and the first length octet
+    if (size < 4 || data[pos++] != MUXER_FRAME_FLAG) {
+        return 0;
+    }
+    const uint8_t address = data[pos++];
+    // Ignore the P/F bit
+    const uint8_t control = data[pos++] & ~0x10;
+    if (!(address & MUXER_FRAME_EA) || control != MUXER_FRAME_UIH) {
+        return 0;
+    }
+    size_t len = data[pos] >> 1;
+    if (!(data[pos++] & MUXER_FRAME_EA)) {
+        if (pos >= size) {
+            return 0;
+        }
+        len |= (size_t)data[pos++] << 7;
+    }
+    *channel = address >> 2;
+    *headerSize = pos;
+    return pos + len + 2;
+}
+
+// Returns the size of the complete UIH frame at the beginning of the buffer, or 0
+size_t parseDataFrame(const uint8_t* data, size_t size, uint8_t* channel, const uint8_t** payload, size_t* payloadSize) {
+    size_t headerSize = 0;
+    const size_t frameSize = parseDataFrameHeader(data, size, channel, &headerSize);
+    if (!frameSize || size < frameSize || data[frameSize - 1] != MUXER_FRAME_FLAG ||
+            data[frameSize - 2] != frameCheckSequence(data + 1, headerSize - 1)) {
+        return 0;
+    }
+    *payload = data + headerSize;
+    *payloadSize = frameSize - headerSize - 2;
+    return frameSize;
+}
 
 } // anonymous
 
 namespace particle { namespace ncp {
 
+MuxerStream::FrameTracker::FrameTracker()
+        : state_(FRAME_NONE),
+          left_(0) {
+}
+
+bool MuxerStream::FrameTracker::update(const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+        const uint8_t b = data[i];
+        switch (state_) {
+            case FRAME_NONE: {
+                if (b != MUXER_FRAME_FLAG) {
+                    return false;
+                }
+                state_ = FRAME_ADDRESS;
+                break;
+            }
+            case FRAME_ADDRESS: {
+                // Skip repeated flags
+                if (b != MUXER_FRAME_FLAG) {
+                    state_ = FRAME_CONTROL;
+                }
+                break;
+            }
+            case FRAME_CONTROL: {
+                state_ = FRAME_LENGTH;
+                break;
+            }
+            case FRAME_LENGTH: {
+                left_ = b >> 1;
+                if (b & MUXER_FRAME_EA) {
+                    // Information field, FCS and the closing flag
+                    left_ += 2;
+                    state_ = FRAME_BODY;
+                } else {
+                    state_ = FRAME_LENGTH_EXT;
+                }
+                break;
+            }
+            case FRAME_LENGTH_EXT: {
+                left_ |= (size_t)b << 7;
+                left_ += 2;
+                state_ = FRAME_BODY;
+                break;
+            }
+            case FRAME_BODY: {
+                if (--left_ == 0) {
+                    state_ = FRAME_NONE;
+                    if (b != MUXER_FRAME_FLAG) {
+                        return false;
+                    }
+                }
+                break;
+            }
+        }
+    }
+    return true;
+}
+
+void MuxerStream::FrameTracker::reset() {
+    state_ = FRAME_NONE;
+    left_ = 0;
+}
+
+bool MuxerStream::FrameTracker::idle() const {
+    return state_ == FRAME_NONE;
+}
+
+MuxerStream::MuxerStream(AtTransportBase* at)
+        : AtTransportStream(at),
+          frameLocked_(false),
+          packet_(nullptr),
+          packetSize_(0),
+          packetCapacity_(0),
+          packetThread_(nullptr),
+          dataFrameHandler_(nullptr),
+          dataFrameHandlerCtx_(nullptr),
+          pending_(0),
+          takingFrames_(false),
+          stashPos_(0),
+          stashSize_(0) {
+}
+
+int MuxerStream::read(char* data, size_t size) {
+    std::lock_guard<std::mutex> lock(rxMutex_);
+    if (takingFrames_) {
+        // The received data is being handled by takeDataFrames(), the muxer will be notified about the rest
+        return 0;
+    }
+    int r = 0;
+    if (stashSize_ > 0) {
+        // A frame read out of the transport but not taken by the handler
+        r = std::min(size, stashSize_);
+        memcpy(data, frameBuf_.get() + stashPos_, r);
+        stashPos_ += r;
+        stashSize_ -= r;
+    } else {
+        r = AtTransportStream::read(data, size);
+    }
+    if (r > 0) {
+        // Received data that doesn't follow the framing is skipped by the muxer as well
+        rx_.update((const uint8_t*)data, r);
+        pending_ -= r;
+    }
+    return r;
+}
+
+int MuxerStream::write(const char* data, size_t size) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    const bool toPacket = packet_ && packetThread_ == xTaskGetCurrentTaskHandle();
+    int r = toPacket ? writePacket((const uint8_t*)data, size) : writeTransport((const uint8_t*)data, size);
+    if (r < (int)size || !tx_.update((const uint8_t*)data, size)) {
+        // The rest of the frame is not going to follow. The other side resynchronizes on the next flag
+        abandonFrame();
+        return r;
+    }
+    if (!tx_.idle()) {
+        if (!frameLocked_) {
+            // The rest of the frame is going to be written by the same thread
+            mutex_.lock();
+            frameLocked_ = true;
+        }
+        return r;
+    }
+    if (toPacket) {
+        r = sendPacket();
+        if (r == 0) {
+            r = size;
+        }
+    }
+    if (frameLocked_) {
+        frameLocked_ = false;
+        mutex_.unlock();
+    }
+    return r;
+}
+
+int MuxerStream::writeTransport(const uint8_t* data, size_t size) {
+    // Complete the write here so that a frame is never left half-written after a short write.
+    // The transport returns 0 if it times out waiting for space
+    size_t pos = 0;
+    while (pos < size) {
+        const int r = AtTransportStream::write((const char*)data + pos, size - pos);
+        if (r <= 0) {
+            return (pos > 0) ? pos : r;
+        }
+        pos += r;
+    }
+    return pos;
+}
+
+int MuxerStream::writePacket(const uint8_t* data, size_t size) {
+    CHECK_TRUE(packetSize_ + size <= packetCapacity_, RESULT_TOO_LARGE_DATA);
+    memcpy(packet_ + packetSize_, data, size);
+    packetSize_ += size;
+    return size;
+}
+
+int MuxerStream::sendPacket() {
+    uint8_t* const packet = packet_;
+    const size_t size = packetSize_;
+    packet_ = nullptr;
+    packetSize_ = 0;
+    packetThread_ = nullptr;
+    // Everything the muxer has written before this frame is already passed to the transport
+    const int r = at_->sendPacket(packet, size, MUXER_MAX_WRITE_TIMEOUT);
+    if (r < 0) {
+        at_->freePacket(packet);
+        return r;
+    }
+    return 0;
+}
+
+void MuxerStream::abandonFrame() {
+    tx_.reset();
+    if (packet_ && packetThread_ == xTaskGetCurrentTaskHandle()) {
+        at_->freePacket(packet_);
+        packet_ = nullptr;
+        packetSize_ = 0;
+        packetThread_ = nullptr;
+    }
+    if (frameLocked_) {
+        frameLocked_ = false;
+        mutex_.unlock();
+    }
+}
+
+bool MuxerStream::beginPacket(size_t size) {
+    uint8_t* const packet = at_->allocPacket(size, 0);
+    if (!packet) {
+        return false;
+    }
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (packet_) {
+        // Another thread is sending a frame this way
+        at_->freePacket(packet);
+        return false;
+    }
+    packet_ = packet;
+    packetSize_ = 0;
+    packetCapacity_ = size;
+    packetThread_ = xTaskGetCurrentTaskHandle();
+    return true;
+}
+
+void MuxerStream::endPacket() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (packet_ && packetThread_ == xTaskGetCurrentTaskHandle()) {
+        // Nothing of a partially assembled frame has reached the transport
+        abandonFrame();
+    }
+}
+
+void MuxerStream::lock() {
+    mutex_.lock();
+}
+
+void MuxerStream::unlock() {
+    mutex_.unlock();
+}
+
+void MuxerStream::setDataFrameHandler(DataFrameHandler handler, void* ctx) {
+    std::lock_guard<std::mutex> lock(rxMutex_);
+    if (handler && !frameBuf_) {
+        // Without the buffer, frames spanning several receive buffers are passed to the muxer
+        frameBuf_.reset(new(std::nothrow) uint8_t[MUXER_FRAME_BUFFER_SIZE]);
+    }
+    dataFrameHandlerCtx_ = ctx;
+    dataFrameHandler_ = handler;
+    pending_ = 0;
+    stashPos_ = 0;
+    stashSize_ = 0;
+    rx_.reset();
+}
+
+size_t MuxerStream::bufferMemory() const {
+    return frameBuf_ ? MUXER_FRAME_BUFFER_SIZE : 0;
+}
+
+size_t MuxerStream::takeDataFrames(size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(rxMutex_);
+        // Everything the muxer has been notified about must be read by the muxer. If that's the case,
+        // all of the data in the transport is the newly received data
+        if (!dataFrameHandler_ || pending_ > 0 || !rx_.idle() || stashSize_ > 0) {
+            pending_ += size;
+            return 0;
+        }
+        takingFrames_ = true;
+    }
+    // The handler is called without the lock held as it may write to the muxer
+    const size_t taken = readDataFrames();
+    std::lock_guard<std::mutex> lock(rxMutex_);
+    takingFrames_ = false;
+    // The muxer may have read a part of the new data before it was passed here
+    pending_ += (ssize_t)size - (ssize_t)taken;
+    return taken;
+}
+
+size_t MuxerStream::readDataFrames() {
+    // Frames that are completely contained in a receive buffer of the transport are handled in place.
+    // Frames spanning several receive buffers are read into a separate buffer first. The data that
+    // is not taken by the handler is left for the muxer
+    size_t taken = 0;
+    const uint8_t* data = nullptr;
+    int size = 0;
+    while ((size = at_->borrowData(&data)) > 0) {
+        uint8_t channel = 0;
+        const uint8_t* payload = nullptr;
+        size_t payloadSize = 0;
+        size_t frameSize = parseDataFrame(data, size, &channel, &payload, &payloadSize);
+        if (frameSize) {
+            if (dataFrameHandler_(channel, payload, payloadSize, dataFrameHandlerCtx_) != 0) {
+                break;
+            }
+            at_->returnData(frameSize);
+            taken += frameSize;
+            continue;
+        }
+        size_t headerSize = 0;
+        frameSize = parseDataFrameHeader(data, size, &channel, &headerSize);
+        if (!frameSize || (size_t)size >= frameSize || frameSize > MUXER_FRAME_BUFFER_SIZE || !frameBuf_ ||
+                at_->getDataLength() < (int)frameSize) {
+            break;
+        }
+        const int r = at_->readData(frameBuf_.get(), frameSize);
+        if (r <= 0) {
+            break;
+        }
+        if ((size_t)r != frameSize || !parseDataFrame(frameBuf_.get(), r, &channel, &payload, &payloadSize) ||
+                dataFrameHandler_(channel, payload, payloadSize, dataFrameHandlerCtx_) != 0) {
+            stashPos_ = 0;
+            stashSize_ = r;
+            break;
+        }
+        taken += frameSize;
+    }
+    return taken;
+}
+
 AtMuxTransport::AtMuxTransport(AtTransportBase* transport)
         : transport_(transport),
           stream_(transport),
           muxer_(&stream_),
+          diagStream_(&muxer_, MUX_CHANNEL_DIAGNOSTICS, MUXER_DIAGNOSTICS_WRITE_TIMEOUT),
+          fwupdStream_(&muxer_, MUX_CHANNEL_FWUPD, MUXER_FWUPD_WRITE_TIMEOUT),
           rxBuf_(rxBufData_, sizeof(rxBufData_)),
-          started_(false) {
+          started_(false),
+          openChannels_(0),
+          muxerThread_(nullptr),
+          muxerPriority_(gsm0710::portable::taskPriority),
+          muxerActive_(false) {
 }
 
 AtMuxTransport::~AtMuxTransport() {
@@ -72,6 +454,8 @@ AtMuxTransport::~AtMuxTransport() {
 
 int AtMuxTransport::initTransport()  {
     LOG(INFO, "Initializing GSM07.10 mux transport");
+    CHECK(PacketCapture::instance()->init(&diagStream_));
+    CHECK(BackgroundUpdate::instance()->init(&fwupdStream_));
     started_ = true;
     return 0;
 }
@@ -97,27 +481,7 @@ int AtMuxTransport::readData(uint8_t* data, ssize_t len, unsigned int timeoutMse
         return 0;
     }
 
-    if (isDirectMode() && muxer_.isRunning()) {
-        // XModem is running in a busy-loop in AtUartTransport/ATSdioTransport thread,
-        // we have to manually pump the data here, unfortunately.
-        if (transport_->getDataLength() > 0) {
-            CHECK(muxer_.notifyInput(transport_->getDataLength()));
-        }
-        // I have no idea why vTaskDelay is needed here, but without it
-        // muxer thread does not get any execution time, despite the fact
-        // that we've just supposedly unblocked it in notifyInput()
-        vTaskDelay(1 / portTICK_PERIOD_MS);
-    }
-
-    const ssize_t canRead = CHECK(rxBuf_.data());
-    const ssize_t willRead = std::min(len, canRead);
-
-    if (willRead == 0) {
-        return 0;
-    }
-
-    int r = rxBuf_.get(data, willRead);
-    return r;
+    return rxBuf_.get(data, len);
 }
 
 int AtMuxTransport::flushInput() {
@@ -152,6 +516,14 @@ int AtMuxTransport::waitWriteComplete(unsigned int timeoutMsec) {
     return transport_->waitWriteComplete(timeoutMsec);
 }
 
+size_t AtMuxTransport::bufferMemory() const {
+    return rxBuf_.capacity() + sizeof(muxer_) + stream_.bufferMemory();
+}
+
+int AtMuxTransport::reserveRxBuffer(size_t size) {
+    return rxBuf_.reserve(size);
+}
+
 Muxer* AtMuxTransport::getMuxer() {
     return &muxer_;
 }
@@ -159,22 +531,76 @@ Muxer* AtMuxTransport::getMuxer() {
 int AtMuxTransport::startMuxer() {
     muxer_.setChannelStateHandler(channelStateCb, this);
     muxer_.setMaxFrameSize(MUXER_MAX_FRAME_SIZE);
+    stream_.setDataFrameHandler(dataFrameHandlerCb, this);
+    {
+        std::lock_guard<std::mutex> lock(muxerThreadMutex_);
+        muxerActive_ = true;
+    }
     // Start in server mode
     CHECK(muxer_.start(false));
     return 0;
 }
 
+int AtMuxTransport::writeChannel(uint8_t channel, const uint8_t* data, size_t len) {
+    // Do not wait for a packet buffer: while the link is congested the muxer path is as good
+    const bool packet = len > 0 && len <= MUXER_MAX_FRAME_SIZE && muxer_.isRunning() &&
+            (openChannels_ & (1 << channel)) && stream_.beginPacket(len + MUXER_FRAME_MAX_OVERHEAD);
+    // The frame is encoded by the muxer and is subject to the channel's flow control either way
+    const int r = muxer_.writeChannel(channel, data, len);
+    if (packet) {
+        stream_.endPacket();
+    }
+    return r;
+}
+
 void AtMuxTransport::setActive() {
     transport_->setDirectMode(true, dataHandlerCb, this);
     AtTransportBase::setActive();
 }
 
+void AtMuxTransport::setMuxerPriority(UBaseType_t priority) {
+    std::lock_guard<std::mutex> lock(muxerThreadMutex_);
+    muxerPriority_ = priority;
+    const TaskHandle_t thread = muxerThread_;
+    if (thread) {
+        vTaskPrioritySet(thread, priority);
+    }
+}
+
+void AtMuxTransport::updateMuxerThread(bool running) {
+    // Called from the muxer thread
+    std::lock_guard<std::mutex> lock(muxerThreadMutex_);
+    if (!running) {
+        muxerActive_ = false;
+    }
+    if (!muxerActive_) {
+        muxerThread_ = nullptr;
+    } else if (!muxerThread_) {
+        // The thread is created by the muxer with a fixed priority
+        const TaskHandle_t thread = xTaskGetCurrentTaskHandle();
+        if (muxerPriority_ != gsm0710::portable::taskPriority) {
+            vTaskPrioritySet(thread, muxerPriority_);
+        }
+        muxerThread_ = thread;
+    }
+}
+
 int AtMuxTransport::stopMuxer() {
+    {
+        // The muxer thread may exit as soon as it's stopped
+        std::lock_guard<std::mutex> lock(muxerThreadMutex_);
+        muxerActive_ = false;
+        muxerThread_ = nullptr;
+    }
     muxer_.stop();
+    openChannels_ = 0;
+    BackgroundUpdate::instance()->cancel();
     muxer_.setChannelStateHandler(nullptr, nullptr);
+    stream_.setDataFrameHandler(nullptr, nullptr);
     transport_->setActive();
     transport_->setDirectMode(false);
     rxBuf_.reset();
+    rxBuf_.reserve(0);
     return 0;
 }
 
@@ -198,7 +624,12 @@ void AtMuxTransport::dataHandlerCb(size_t len, void* ctx) {
 
 void AtMuxTransport::dataHandler(size_t len) {
     if (muxer_.isRunning()) {
-        muxer_.notifyInput(len);
+        // Bridged frames are handled right away, the muxer is notified only about the data it needs
+        // to read itself, so that its input accounting matches what it actually reads
+        len -= stream_.takeDataFrames(len);
+        if (len > 0) {
+            muxer_.notifyInput(len);
+        }
     }
 
     if (!muxer_.isRunning()) {
@@ -212,25 +643,69 @@ int AtMuxTransport::channelAtDataHandlerCb(const uint8_t* data, size_t len, void
 }
 
 int AtMuxTransport::channelAtDataHandler(const uint8_t* data, size_t len) {
-    rxBuf_.put(data, len);
+    // There's no flow control on the AT channel, a frame that doesn't fit is dropped as a whole and
+    // the error is passed to the muxer
+    const int r = rxBuf_.put(data, len);
+    if (r < 0) {
+        LOG(WARN, "AT channel buffer full, dropped %u bytes (%u frames total)", (unsigned)len,
+                (unsigned)rxBuf_.droppedFrames());
+        return r;
+    }
     notifyReceivedData(len, 1);
     return 0;
 }
 
 int AtMuxTransport::channelStaDataHandlerCb(const uint8_t* data, size_t len, void* ctx) {
+    PacketCapture::instance()->capture(PacketCapture::INTERFACE_STA, PacketCapture::DIRECTION_OUT, data, len);
     return outputEthernetPacket(TCPIP_ADAPTER_IF_STA, data, len);
 }
 
 int AtMuxTransport::channelApDataHandlerCb(const uint8_t* data, size_t len, void* ctx) {
+    PacketCapture::instance()->capture(PacketCapture::INTERFACE_AP, PacketCapture::DIRECTION_OUT, data, len);
     return outputEthernetPacket(TCPIP_ADAPTER_IF_AP, data, len);
 }
 
+int AtMuxTransport::channelFwupdDataHandlerCb(const uint8_t* data, size_t len, void* ctx) {
+    BackgroundUpdate::instance()->receive(data, len);
+    return 0;
+}
+
+int AtMuxTransport::dataFrameHandlerCb(uint8_t channel, const uint8_t* data, size_t len, void* ctx) {
+    auto self = static_cast<AtMuxTransport*>(ctx);
+    return self->dataFrameHandler(channel, data, len);
+}
+
+int AtMuxTransport::dataFrameHandler(uint8_t channel, const uint8_t* data, size_t len) {
+    // Only the bridged frames bypass the muxer
+    if (!(openChannels_ & (1 << channel))) {
+        return 1;
+    }
+    if (channel == MUX_CHANNEL_STATION) {
+        channelStaDataHandlerCb(data, len, this);
+        return 0;
+    } else if (channel == MUX_CHANNEL_SOFTAP) {
+        channelApDataHandlerCb(data, len, this);
+        return 0;
+    }
+    return 1;
+}
+
 int AtMuxTransport::channelStateCb(uint8_t channel, Muxer::ChannelState oldState, Muxer::ChannelState newState, void* ctx) {
     auto self = static_cast<AtMuxTransport*>(ctx);
     return self->channelState(channel, oldState, newState);
 }
 
 int AtMuxTransport::channelState(uint8_t channel, Muxer::ChannelState oldState, Muxer::ChannelState newState) {
+    // Channel state changes are reported from the muxer thread. The thread exits once the control
+    // channel is closed, which may happen before stopMuxer() is called
+    const bool controlClosed = (channel == 0 && oldState == Muxer::ChannelState::Opened &&
+            newState != Muxer::ChannelState::Opened);
+    updateMuxerThread(!controlClosed);
+    if (newState == Muxer::ChannelState::Opened) {
+        openChannels_ |= (1 << channel);
+    } else {
+        openChannels_ &= ~(1 << channel);
+    }
     if (channel == MUX_CHANNEL_AT) {
         muxer_.setChannelDataHandler(channel, channelAtDataHandlerCb, this);
         return 0;
@@ -240,6 +715,16 @@ int AtMuxTransport::channelState(uint8_t channel, Muxer::ChannelState oldState,
     } else if (channel == MUX_CHANNEL_SOFTAP) {
         muxer_.setChannelDataHandler(channel, channelApDataHandlerCb, this);
         return 0;
+    } else if (channel == MUX_CHANNEL_DIAGNOSTICS) {
+        // Output only channel, the consumer needs the pcapng headers again
+        PacketCapture::instance()->resetStream();
+        return 0;
+    } else if (channel == MUX_CHANNEL_FWUPD) {
+        muxer_.setChannelDataHandler(channel, channelFwupdDataHandlerCb, this);
+        if (newState != Muxer::ChannelState::Opened) {
+            BackgroundUpdate::instance()->cancel();
+        }
+        return 0;
     } else if (channel == 0) {
         // Control channel
         return 0;
@@ -20,20 +20,128 @@
 
 #include "at_transport.h"
 #include <atomic>
+#include <memory>
+#include <mutex>
 #include <driver/uart.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include "gsm0710muxer/muxer.h"
 #include "stream.h"
-#include "util/ringbuffer.h"
+#include "channel_buffer.h"
 
 namespace particle { namespace ncp {
 
-using MuxerStream = AtTransportStream;
+// Transport stream used by the muxer. Tracks the boundaries of the frames written by the muxer,
+// so that complete frames can be sent to the transport directly in between them. Likewise,
+// complete data frames received in between the frames read by the muxer can be handled before
+// the muxer is notified about them, in place if the transport supports borrowing its receive buffers
+class MuxerStream: public AtTransportStream {
+public:
+    // Returns 0 if the frame has been handled
+    typedef int (*DataFrameHandler)(uint8_t channel, const uint8_t* data, size_t len, void* ctx);
+
+    explicit MuxerStream(AtTransportBase* at);
+
+    int read(char* data, size_t size) override;
+    int write(const char* data, size_t size) override;
+
+    // Waits until the muxer is not in the middle of a frame and blocks its further writes until unlock()
+    void lock();
+    void unlock();
+
+    // Makes the next frame written by the muxer in the calling thread to be assembled in a packet
+    // buffer of the transport and sent with sendPacket(). Returns false if there's no free buffer
+    bool beginPacket(size_t size);
+    // Returns the packet buffer to the transport if the muxer hasn't written a complete frame
+    void endPacket();
+
+    void setDataFrameHandler(DataFrameHandler handler, void* ctx);
+    // Passes the complete data frames at the beginning of the newly received data to the handler.
+    // Returns the number of bytes taken, the muxer needs to be notified about the rest
+    size_t takeDataFrames(size_t size);
+
+    size_t bufferMemory() const;
+
+private:
+    class FrameTracker {
+    public:
+        FrameTracker();
+
+        // Returns false if the data doesn't follow the framing, the tracker is reset in that case
+        bool update(const uint8_t* data, size_t size);
+        void reset();
+        bool idle() const;
+
+    private:
+        enum FrameState {
+            FRAME_NONE,
+            FRAME_ADDRESS,
+            FRAME_CONTROL,
+            FRAME_LENGTH,
+            FRAME_LENGTH_EXT,
+            FRAME_BODY
+        };
+
+        FrameState state_;
+        size_t left_;
+    };
+
+    std::recursive_mutex mutex_;
+    FrameTracker tx_;
+    FrameTracker rx_;
+    // The mutex is held by the muxer until the end of the current frame
+    bool frameLocked_;
+    // Packet buffer the frame written on behalf of packetThread_ is assembled in
+    uint8_t* packet_;
+    size_t packetSize_;
+    size_t packetCapacity_;
+    TaskHandle_t packetThread_;
+    DataFrameHandler dataFrameHandler_;
+    void* dataFrameHandlerCtx_;
+    std::mutex rxMutex_;
+    // Received data the muxer has been notified about but hasn't read yet
+    ssize_t pending_;
+    bool takingFrames_;
+    // Frame assembled from several receive buffers. Left for the muxer if not taken by the handler
+    std::unique_ptr<uint8_t[]> frameBuf_;
+    size_t stashPos_;
+    size_t stashSize_;
+
+    int writeTransport(const uint8_t* data, size_t size);
+    int writePacket(const uint8_t* data, size_t size);
+    int sendPacket();
+    void abandonFrame();
+    size_t readDataFrames();
+};
+
 using Muxer = gsm0710::Muxer<MuxerStream, std::recursive_mutex>;
 
 enum MuxerChannel {
     MUX_CHANNEL_AT       = 1,
     MUX_CHANNEL_STATION  = 2,
-    MUX_CHANNEL_SOFTAP   = 3
+    MUX_CHANNEL_SOFTAP   = 3,
+    MUX_CHANNEL_DIAGNOSTICS = 4,
+    MUX_CHANNEL_FWUPD    = 5
+};
+
+// Output stream writing to a specific mux channel
+class AtMuxChannelStream: public OutputStream {
+public:
+    AtMuxChannelStream(Muxer* muxer, uint8_t channel, unsigned timeout)
+            : muxer_(muxer),
+              channel_(channel),
+              timeout_(timeout) {
+    }
+
+    int write(const char* data, size_t size) override {
+        CHECK(muxer_->writeChannel(channel_, (const uint8_t*)data, size, timeout_));
+        return size;
+    }
+
+private:
+    Muxer* muxer_;
+    uint8_t channel_;
+    unsigned timeout_;
 };
 
 class AtMuxTransport : public AtTransportBase {
@@ -49,10 +157,24 @@ public:
     virtual int getDataLength() const override;
     virtual int waitWriteComplete(unsigned int timeoutMsec) override;
 
+    // Memory used by the muxer itself, see transport() for the underlying transport
+    virtual size_t bufferMemory() const override;
+
+    virtual int reserveRxBuffer(size_t size) override;
+
+    AtTransportBase* transport() const;
     Muxer* getMuxer();
+    bool isChannelOpen(uint8_t channel) const;
     int startMuxer();
+
+    // Writes a complete frame to a channel. The frame encoded by the muxer is sent from a transport
+    // packet buffer if the transport supports it
+    int writeChannel(uint8_t channel, const uint8_t* data, size_t len);
     int stopMuxer();
 
+    void setMuxerPriority(UBaseType_t priority);
+    UBaseType_t muxerPriority() const;
+
 protected:
     virtual int initTransport() override;
     virtual int destroyTransport() override;
@@ -71,22 +193,49 @@ private:
 
     static int channelStaDataHandlerCb(const uint8_t* data, size_t len, void* ctx);
     static int channelApDataHandlerCb(const uint8_t* data, size_t len, void* ctx);
+    static int channelFwupdDataHandlerCb(const uint8_t* data, size_t len, void* ctx);
+
+    static int dataFrameHandlerCb(uint8_t channel, const uint8_t* data, size_t len, void* ctx);
+    int dataFrameHandler(uint8_t channel, const uint8_t* data, size_t len);
 
     static int channelStateCb(uint8_t channel, Muxer::ChannelState oldState, Muxer::ChannelState newState, void* ctx);
     int channelState(uint8_t channel, Muxer::ChannelState oldState, Muxer::ChannelState newState);
+    void updateMuxerThread(bool running);
 
 private:
     AtTransportBase* transport_;
 
     MuxerStream stream_;
     Muxer muxer_;
+    AtMuxChannelStream diagStream_;
+    AtMuxChannelStream fwupdStream_;
 
-    particle::services::RingBuffer<uint8_t> rxBuf_;
+    ChannelBuffer rxBuf_;
     uint8_t rxBufData_[2048];
 
     std::atomic_bool started_;
+    std::atomic<uint32_t> openChannels_;
+
+    // Set by the muxer thread, cleared before the thread exits. Changed and used with
+    // muxerThreadMutex_ held so that the handle of an exited thread is never used
+    std::atomic<TaskHandle_t> muxerThread_;
+    std::atomic<UBaseType_t> muxerPriority_;
+    std::mutex muxerThreadMutex_;
+    bool muxerActive_;
 };
 
+inline AtTransportBase* AtMuxTransport::transport() const {
+    return transport_;
+}
+
+inline bool AtMuxTransport::isChannelOpen(uint8_t channel) const {
+    return openChannels_ & (1 << channel);
+}
+
+inline UBaseType_t AtMuxTransport::muxerPriority() const {
+    return muxerPriority_;
+}
+
 } } /* particle::ncp */
 
 #endif /* ARGON_NCP_FIRMWARE_AT_TRANSPORT_MUX_H */
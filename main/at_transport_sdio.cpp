@@ -43,41 +43,140 @@
 #include "at_transport_sdio.h"
 #include "logging.h"
 #include "util.h"
+#include <esp_heap_caps.h>
+#include <new>
 
 #if PLATFORM_ID == PLATFORM_TRACKER
 
 namespace particle { namespace ncp {
 
-#define container_of(ptr, type, member) ({      \
-    const decltype( ((type *)0)->member ) *__mptr = (const decltype( ((type *)0)->member ) *)ptr; \
-    (type *)( (char *)__mptr - ((size_t) &((type *)0)->member) );})
-
 namespace {
 
 const auto AT_SDIO_WAKE_UP_PERIOD_MS = 1000;
+// Maximum time writeData() waits for space in the TX ring
+const auto AT_SDIO_WRITE_TIMEOUT_MS = 1000;
+
+// Set by the TX thread when there is no data in the TX ring and no send in flight
+const EventBits_t AT_SDIO_TX_EVENT_DRAINED = (1 << 0);
+// Set by the TX thread whenever a send completes
+const EventBits_t AT_SDIO_TX_EVENT_DONE = (1 << 1);
+
+// The argument of the sends from the TX ring is the number of bytes to commit, which is always
+// a multiple of 4. Packet buffers are 4-byte aligned, this bit tells them apart
+const uintptr_t AT_SDIO_TX_PACKET_TAG = 0x01;
+
+const size_t AT_SDIO_MIN_BUFFER_NUM = 2;
+const size_t AT_SDIO_MAX_BUFFER_NUM = 64;
+const size_t AT_SDIO_MIN_QUEUE_SIZE = 1;
+const size_t AT_SDIO_MAX_QUEUE_SIZE = 64;
 
 } // anonymous
 
-AtSdioTransport::AtSdioTransport()
+AtSdioTransport::AtSdioTransport(const Config& conf)
         : AtTransportBase(),
+          conf_(conf),
+          rxBufData_(nullptr),
           listHead_(nullptr),
           listTail_(nullptr),
           started_(false),
           exit_(false),
           rxThread_(nullptr),
           txThread_(nullptr),
-          txBuf_(txBufData_, sizeof(txBufData_)),
-          transmitting_(false) {
+          txBufData_(nullptr),
+          txInFlight_(0),
+          txEvents_(nullptr)
+#if CONFIG_NCP_SDIO_PACKET_MODE
+          , txPackets_(nullptr),
+          txFreePackets_(nullptr)
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+          {
 }
 
 AtSdioTransport::~AtSdioTransport() {
 }
 
+AtSdioTransport::Config AtSdioTransport::defaultConfig() {
+    Config conf = {};
+    conf.bufferNum = AT_SDIO_BUFFER_NUM;
+    conf.queueSize = AT_SDIO_QUEUE_SIZE;
+    return conf;
+}
+
+int AtSdioTransport::checkConfig(const Config& conf) {
+    CHECK_TRUE(conf.bufferNum >= AT_SDIO_MIN_BUFFER_NUM && conf.bufferNum <= AT_SDIO_MAX_BUFFER_NUM,
+            RESULT_INVALID_PARAM);
+    CHECK_TRUE(conf.queueSize >= AT_SDIO_MIN_QUEUE_SIZE && conf.queueSize <= AT_SDIO_MAX_QUEUE_SIZE,
+            RESULT_INVALID_PARAM);
+    return 0;
+}
+
+size_t AtSdioTransport::bufferMemory() const {
+    if (!list_) {
+        return 0;
+    }
+    // Receive buffers and the TX ring
+    size_t size = conf_.bufferNum * (AT_SDIO_BUFFER_SIZE * 2 + sizeof(Buffer));
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    size += AT_SDIO_TX_PACKET_NUM * AT_SDIO_TX_PACKET_SIZE;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+    return size;
+}
+
+int AtSdioTransport::allocBuffers() {
+    // The buffers are allocated once, changes to the configuration take effect after a restart
+    if (list_) {
+        return 0;
+    }
+    const size_t size = conf_.bufferNum * AT_SDIO_BUFFER_SIZE;
+    list_.reset(new(std::nothrow) Buffer[conf_.bufferNum]());
+    rxBufData_ = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_DMA);
+    txBufData_ = (uint8_t*)heap_caps_malloc(size, MALLOC_CAP_DMA);
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    txPackets_ = (uint8_t*)heap_caps_malloc(AT_SDIO_TX_PACKET_NUM * AT_SDIO_TX_PACKET_SIZE, MALLOC_CAP_DMA);
+    if (!txFreePackets_) {
+        txFreePackets_ = xQueueCreate(AT_SDIO_TX_PACKET_NUM, sizeof(uint8_t*));
+    }
+    const bool packetsAllocated = txPackets_ && txFreePackets_;
+#else
+    const bool packetsAllocated = true;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+    if (!list_ || !rxBufData_ || !txBufData_ || !packetsAllocated) {
+        list_.reset();
+        heap_caps_free(rxBufData_);
+        rxBufData_ = nullptr;
+        heap_caps_free(txBufData_);
+        txBufData_ = nullptr;
+#if CONFIG_NCP_SDIO_PACKET_MODE
+        heap_caps_free(txPackets_);
+        txPackets_ = nullptr;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+        return RESULT_NO_MEMORY;
+    }
+    for (size_t i = 0; i < conf_.bufferNum; i++) {
+        list_[i].pbuf = rxBufData_ + i * AT_SDIO_BUFFER_SIZE;
+    }
+    txBuf_.init(txBufData_, size);
+    return 0;
+}
+
 int AtSdioTransport::initTransport()  {
     LOG(INFO, "Initializing SDIO transport");
+    if (checkConfig(conf_) < 0 || allocBuffers() < 0) {
+        LOG(ERROR, "Invalid SDIO buffer configuration or not enough memory, using defaults");
+        conf_ = defaultConfig();
+        CHECK(allocBuffers());
+    }
+    LOG(INFO, "SDIO buffers: %u x %u bytes, queue size: %u", (unsigned)conf_.bufferNum, (unsigned)AT_SDIO_BUFFER_SIZE,
+            (unsigned)conf_.queueSize);
+
     sdio_slave_config_t config = {};
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    // Every send is reported to the host as a separate packet
+    config.sending_mode = SDIO_SLAVE_SEND_PACKET;
+#else
     config.sending_mode = SDIO_SLAVE_SEND_STREAM;
-    config.send_queue_size = AT_SDIO_QUEUE_SIZE;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+    config.send_queue_size = conf_.queueSize;
     config.recv_buffer_size = AT_SDIO_BUFFER_SIZE;
 
     sdio_slave_buf_handle_t handle;
@@ -85,12 +184,27 @@ int AtSdioTransport::initTransport()  {
     esp_err_t ret = sdio_slave_initialize(&config);
     assert(ret == ESP_OK);
 
+    if (!txEvents_) {
+        txEvents_ = xEventGroupCreate();
+        assert(txEvents_ != nullptr);
+    }
+
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    // Packets that were in flight when the transport was destroyed are not returned by the driver
+    xQueueReset(txFreePackets_);
+    for (int i = 0; i < AT_SDIO_TX_PACKET_NUM; i++) {
+        uint8_t* packet = txPackets_ + i * AT_SDIO_TX_PACKET_SIZE;
+        xQueueSend(txFreePackets_, &packet, 0);
+    }
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+
     rxData_ = 0;
-    transmitting_ = false;
+    txInFlight_ = 0;
     txBuf_.reset();
+    xEventGroupSetBits(txEvents_, AT_SDIO_TX_EVENT_DRAINED);
     exit_ = 0;
 
-    for (int loop = 0; loop < AT_SDIO_BUFFER_NUM; loop++) {
+    for (size_t loop = 0; loop < conf_.bufferNum; loop++) {
         handle = sdio_slave_recv_register_buf(list_[loop].pbuf);
         assert(handle != nullptr);
 
@@ -102,9 +216,11 @@ int AtSdioTransport::initTransport()  {
 
     sdio_slave_start();
 
-    // FIXME: we have to start two threads unfortunately since it's impossible to wait for both
-    // rx and tx events and the same. In order to avoid busy loop, we'll sacrifice 4k of stack here
-    // and having to run an extra thread.
+    // Two threads are needed since it's impossible to wait for both rx and tx events at the same
+    // time: the driver waits on a semaphore and a queue it owns, doesn't report completions through
+    // a callback, and doesn't share its interrupt. The TX thread collects every completed send and
+    // queues the next part of the TX ring, so that the written data gets sent even if nobody writes
+    // or waits afterwards
     if (xTaskCreate([](void* arg) -> void {
                 auto self = static_cast<AtSdioTransport*>(arg);
                 self->rxRun();
@@ -133,7 +249,7 @@ int AtSdioTransport::destroyTransport() {
 
         LOG(INFO, "Waiting for SDIO threads to stop");
 
-        /* Join thread */
+        /* Join threads, they check for exit at least every AT_SDIO_WAKE_UP_PERIOD_MS */
         while (exit_) {
             vTaskDelay(100 / portTICK_PERIOD_MS);
         }
@@ -144,7 +260,12 @@ int AtSdioTransport::destroyTransport() {
         LOG(INFO, "SDIO threads stopped");
     }
 
-    waitWriteComplete(portMAX_DELAY);
+    {
+        // Discard the data that hasn't been sent
+        std::lock_guard<std::recursive_mutex> lock(txMutex_);
+        txBuf_.reset();
+        txInFlight_ = 0;
+    }
 
     started_ = false;
 
@@ -170,7 +291,7 @@ int AtSdioTransport::fetchData(unsigned int timeoutMsec) {
         return RESULT_TIMEOUT;
     }
     CHECK_ESP(ret);
-    Buffer* buf = container_of(ptr, Buffer, pbuf); // get struct list pointer
+    Buffer* buf = &list_[(ptr - rxBufData_) / AT_SDIO_BUFFER_SIZE]; // get struct list pointer
 
     buf->handle = handle;
     buf->leftLen = length;
@@ -210,34 +331,54 @@ int AtSdioTransport::readData(uint8_t* data, ssize_t len, unsigned int timeoutMs
 
         ssize_t canRead = std::min<size_t>(buf->leftLen, toRead);
         memcpy(data + pos, buf->pbuf + buf->pos, canRead);
-        buf->pos += canRead;
-        buf->leftLen -= canRead;
+        consumeData(canRead);
         pos += canRead;
         toRead -= canRead;
+    }
 
-        if (buf->leftLen == 0) {
-            // Can be given back
-            {
-                std::lock_guard<std::mutex> lock(rxMutex_);
-                listHead_ = buf->next;
-                buf->next = nullptr;
+    return pos;
+}
 
-                if (!listHead_) {
-                    listTail_ = nullptr;
-                }
-            }
+int AtSdioTransport::borrowData(const uint8_t** data) {
+    Buffer* buf = (Buffer*)(listHead_);
+    if (!buf) {
+        return 0;
+    }
+    *data = buf->pbuf + buf->pos;
+    return buf->leftLen;
+}
+
+int AtSdioTransport::returnData(size_t len) {
+    Buffer* buf = (Buffer*)(listHead_);
+    CHECK_TRUE(buf && len <= buf->leftLen, RESULT_INVALID_PARAM);
+    consumeData(len);
+    return 0;
+}
 
-            auto ret = sdio_slave_recv_load_buf(buf->handle);
-            assert(ret == ESP_OK);
+void AtSdioTransport::consumeData(size_t len) {
+    Buffer* buf = (Buffer*)(listHead_);
+    buf->pos += len;
+    buf->leftLen -= len;
+    rxData_ -= len;
 
-            // Make sure to notify the host that we have a new buffer available
-            sdio_slave_send_host_int(HOST_SLC0_TOHOST_BIT0_INT_ENA_S);
+    if (buf->leftLen == 0) {
+        // Can be given back
+        {
+            std::lock_guard<std::mutex> lock(rxMutex_);
+            listHead_ = buf->next;
+            buf->next = nullptr;
+
+            if (!listHead_) {
+                listTail_ = nullptr;
+            }
         }
-    }
 
-    rxData_ -= pos;
+        auto ret = sdio_slave_recv_load_buf(buf->handle);
+        assert(ret == ESP_OK);
 
-    return pos;
+        // Make sure to notify the host that we have a new buffer available
+        sdio_slave_send_host_int(HOST_SLC0_TOHOST_BIT0_INT_ENA_S);
+    }
 }
 
 int AtSdioTransport::flushInput() {
@@ -248,93 +389,192 @@ int AtSdioTransport::writeData(const uint8_t* data, size_t len) {
     if (len <= 0 || data == nullptr) {
         return RESULT_ERROR;
     }
+    CHECK_TRUE(txEvents_, RESULT_INVALID_STATE);
 
-    std::lock_guard<std::recursive_mutex> lock(txMutex_);
-    const size_t canWrite = CHECK(txBuf_.space());
-    const size_t willWrite = std::min(canWrite, len);
-
-    if (willWrite > 0) {
-        CHECK(txBuf_.put(data, willWrite));
+    const auto start = util::millis();
+    for (;;) {
+        {
+            std::lock_guard<std::recursive_mutex> lock(txMutex_);
+            const size_t canWrite = CHECK(txBuf_.space());
+            const size_t willWrite = std::min(canWrite, len);
+
+            if (willWrite > 0) {
+                CHECK(txBuf_.put(data, willWrite));
+                xEventGroupClearBits(txEvents_, AT_SDIO_TX_EVENT_DRAINED);
+                // Whatever doesn't fit in the queue is sent by the TX thread as the queued sends complete
+                CHECK(startTransmission());
+                return willWrite;
+            }
+            xEventGroupClearBits(txEvents_, AT_SDIO_TX_EVENT_DONE);
+        }
+        // The TX ring is full of data in flight, wait for some of it to be sent
+        const auto elapsed = util::millis() - start;
+        if (elapsed >= AT_SDIO_WRITE_TIMEOUT_MS || waitTransmissionDone(AT_SDIO_WRITE_TIMEOUT_MS - elapsed) < 0) {
+            return 0;
+        }
     }
-
-    CHECK(startTransmission());
-
-    return willWrite;
 }
 
 int AtSdioTransport::startTransmission() {
     std::lock_guard<std::recursive_mutex> lock(txMutex_);
-    size_t consumable = std::min<size_t>(txBuf_.consumable(), CONFIG_AT_SDIO_BLOCK_SIZE);
-    if (transmitting_ || consumable == 0) {
-        return 0;
-    }
+    // Keep up to queueSize sends queued, each covering the next contiguous region
+    // of the TX ring, so that the host does not have to wait for more data to be queued
+    // after every completed send. Note: the gain has only been measured against the emulated
+    // driver (see the txThroughput benchmark of the host tests), not on the device
+    while (txInFlight_ < conf_.queueSize) {
+        size_t consumable = std::min<size_t>(txBuf_.consumable(), AT_SDIO_BUFFER_SIZE);
+        if (consumable == 0) {
+            break;
+        }
+
+        size_t align = (consumable % 4);
+        if (align) {
+            align = sizeof(uint32_t) - align;
 
-    size_t align = (consumable % 4);
-    if (align) {
-        align = sizeof(uint32_t) - align;
+            if (txBuf_.space() < align) {
+                if (txInFlight_ > 0) {
+                    // Will be retried once one of the queued sends completes
+                    break;
+                }
+                return RESULT_NO_MEMORY;
+            }
 
-        if (txBuf_.space() < align) {
-            return RESULT_NO_MEMORY;
+            // Dummy write to enforce alignment of the next send
+            CHECK(txBuf_.put(nullptr, align));
+            consumable += align;
         }
 
-        // Dummy write to enforce alignment
-        CHECK(txBuf_.put(nullptr, align));
-        consumable = txBuf_.consumable();
-    }
+        if (consumable % 4 != 0) {
+            return RESULT_ERROR;
+        }
 
-    if (consumable % 4 != 0) {
-        return RESULT_ERROR;
-    }
+        auto ptr = txBuf_.consume(consumable);
+        assert(esp_ptr_dma_capable(ptr));
 
-    auto ptr = txBuf_.consume(consumable);
-    assert(esp_ptr_dma_capable(ptr));
+        esp_err_t ret = sdio_slave_send_queue((uint8_t*)ptr, consumable - align, (void*)consumable, 0);
+        if (ret != ESP_OK) {
+            // Cancel
+            txBuf_.consumeCommit(0, consumable);
+        }
+        CHECK_ESP(ret);
 
-    esp_err_t ret = sdio_slave_send_queue((uint8_t*)ptr, consumable - align, (void*)consumable, 0);
-    if (ret != ESP_OK) {
-        // Cancel
-        txBuf_.consumeCommit(0, consumable);
+        ++txInFlight_;
     }
-    CHECK_ESP(ret);
-
-    transmitting_ = true;
 
     return 0;
 }
 
 int AtSdioTransport::waitTransmissionFinished(unsigned int timeoutMsec) {
-    size_t consume = 0;
-    auto ret = sdio_slave_send_get_finished((void**)&consume, timeoutMsec / portTICK_PERIOD_MS);
+    void* arg = nullptr;
+    auto ret = sdio_slave_send_get_finished(&arg, timeoutMsec / portTICK_PERIOD_MS);
     if (ret == ESP_ERR_TIMEOUT) {
         return RESULT_TIMEOUT;
     }
     CHECK_ESP(ret);
+    std::lock_guard<std::recursive_mutex> lock(txMutex_);
+    completeTransmission(arg);
+    // Collect the other sends that have completed in the meantime
+    while (txInFlight_ > 0 && sdio_slave_send_get_finished(&arg, 0) == ESP_OK) {
+        completeTransmission(arg);
+    }
+    return 0;
+}
+
+int AtSdioTransport::waitTransmissionDone(unsigned int timeoutMsec) {
+    const auto bits = xEventGroupWaitBits(txEvents_, AT_SDIO_TX_EVENT_DONE, pdFALSE /* xClearOnExit */,
+            pdTRUE /* xWaitForAllBits */, timeoutMsec / portTICK_PERIOD_MS);
+    if (!(bits & AT_SDIO_TX_EVENT_DONE)) {
+        return RESULT_TIMEOUT;
+    }
+    return 0;
+}
+
+void AtSdioTransport::completeTransmission(void* arg) {
+    const uintptr_t consume = (uintptr_t)arg;
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    if (consume & AT_SDIO_TX_PACKET_TAG) {
+        freePacket((uint8_t*)(consume & ~AT_SDIO_TX_PACKET_TAG));
+    } else
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
     {
-        std::lock_guard<std::recursive_mutex> lock(txMutex_);
+        // Sends from the TX ring complete in the order they were queued
         txBuf_.consumeCommit(consume);
-        transmitting_ = false;
     }
-    return 0;
+    --txInFlight_;
 }
 
-int AtSdioTransport::getDataLength() const {
-    return (int)rxData_;
+#if CONFIG_NCP_SDIO_PACKET_MODE
+
+uint8_t* AtSdioTransport::allocPacket(size_t size, unsigned int timeoutMsec) {
+    if (!started_ || size > AT_SDIO_TX_PACKET_SIZE) {
+        return nullptr;
+    }
+    uint8_t* packet = nullptr;
+    if (xQueueReceive(txFreePackets_, &packet, timeoutMsec / portTICK_PERIOD_MS) != pdTRUE) {
+        return nullptr;
+    }
+    return packet;
 }
 
-int AtSdioTransport::waitWriteComplete(unsigned int timeoutMsec) {
-    // FIXME: busy-ish loop
-    auto start = util::millis();
-    while (util::millis() - start < timeoutMsec) {
-        while(transmitting_) {
-            vTaskDelay(1 / portTICK_PERIOD_MS);
-        }
+int AtSdioTransport::sendPacket(uint8_t* packet, size_t size, unsigned int timeoutMsec) {
+    CHECK_TRUE(started_, RESULT_INVALID_STATE);
+    CHECK_TRUE(size > 0 && size <= AT_SDIO_TX_PACKET_SIZE, RESULT_INVALID_PARAM);
+    const auto start = util::millis();
+    for (;;) {
         {
             std::lock_guard<std::recursive_mutex> lock(txMutex_);
-            if (txBuf_.empty()) {
+            // Everything written before this packet has to be queued first to keep the order
+            CHECK(startTransmission());
+            if (txBuf_.consumable() == 0 && txInFlight_ < conf_.queueSize) {
+                const auto arg = (void*)((uintptr_t)packet | AT_SDIO_TX_PACKET_TAG);
+                CHECK_ESP(sdio_slave_send_queue(packet, size, arg, 0));
+                ++txInFlight_;
+                xEventGroupClearBits(txEvents_, AT_SDIO_TX_EVENT_DRAINED);
                 return 0;
             }
+            xEventGroupClearBits(txEvents_, AT_SDIO_TX_EVENT_DONE);
         }
+        const auto elapsed = util::millis() - start;
+        if (elapsed >= timeoutMsec) {
+            return RESULT_TIMEOUT;
+        }
+        // Wait for one of the queued sends to complete
+        waitTransmissionDone(timeoutMsec - elapsed);
+    }
+}
+
+void AtSdioTransport::freePacket(uint8_t* packet) {
+    if (packet) {
+        xQueueSend(txFreePackets_, &packet, 0);
+    }
+}
+
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+
+void AtSdioTransport::updateTxEvents() {
+    std::lock_guard<std::recursive_mutex> lock(txMutex_);
+    EventBits_t bits = AT_SDIO_TX_EVENT_DONE;
+    if (txInFlight_ == 0 && txBuf_.empty()) {
+        // Wakes up the waiters in waitWriteComplete() right away
+        bits |= AT_SDIO_TX_EVENT_DRAINED;
+    }
+    xEventGroupSetBits(txEvents_, bits);
+}
+
+int AtSdioTransport::getDataLength() const {
+    return (int)rxData_;
+}
+
+int AtSdioTransport::waitWriteComplete(unsigned int timeoutMsec) {
+    if (!txEvents_) {
+        return 0;
     }
-    return RESULT_TIMEOUT;
+    const auto bits = xEventGroupWaitBits(txEvents_, AT_SDIO_TX_EVENT_DRAINED, pdFALSE /* xClearOnExit */,
+            pdTRUE /* xWaitForAllBits */, timeoutMsec / portTICK_PERIOD_MS);
+    if (!(bits & AT_SDIO_TX_EVENT_DRAINED)) {
+        return RESULT_TIMEOUT;
+    }
+    return 0;
 }
 
 int AtSdioTransport::statusChanged(esp_at_status_type status) {
@@ -375,6 +615,7 @@ void AtSdioTransport::txRun() {
     while (!exit_) {
         if (!waitTransmissionFinished(AT_SDIO_WAKE_UP_PERIOD_MS)) {
             startTransmission();
+            updateTxEvents();
         }
     }
 
@@ -384,8 +625,10 @@ void AtSdioTransport::txRun() {
     {
         std::lock_guard<std::recursive_mutex> lock(txMutex_);
         txBuf_.reset();
-        transmitting_ = false;
+        txInFlight_ = 0;
     }
+    // Wake up the waiters
+    xEventGroupSetBits(txEvents_, AT_SDIO_TX_EVENT_DRAINED | AT_SDIO_TX_EVENT_DONE);
     exit_--;
 }
 
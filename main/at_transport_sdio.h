@@ -20,30 +20,60 @@
 #include "at_transport.h"
 #include <atomic>
 #include <mutex>
+#include <memory>
 #include "util/ringbuffer.h"
 #include <driver/sdio_slave.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/event_groups.h>
+#include <freertos/queue.h>
 #include "platforms.h"
 
 #if PLATFORM_ID == PLATFORM_TRACKER
 
 namespace particle { namespace ncp {
 
+// Receive buffer size, must match the block size used by the host driver
 constexpr int AT_SDIO_BUFFER_SIZE = CONFIG_AT_SDIO_BLOCK_SIZE;
+// Default buffer geometry, can be overridden at runtime
 constexpr int AT_SDIO_BUFFER_NUM = CONFIG_AT_SDIO_BUFFER_NUM;
 constexpr int AT_SDIO_QUEUE_SIZE = CONFIG_AT_SDIO_QUEUE_SIZE;
-constexpr int AT_SDIO_TX_BUFFER_SIZE = CONFIG_AT_SDIO_BLOCK_SIZE * CONFIG_AT_SDIO_BUFFER_NUM;
+#if CONFIG_NCP_SDIO_PACKET_MODE
+constexpr int AT_SDIO_TX_PACKET_NUM = CONFIG_NCP_SDIO_TX_PACKET_NUM;
+// Large enough for a mux frame carrying a full Ethernet frame
+constexpr int AT_SDIO_TX_PACKET_SIZE = 1600;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
 
 class AtSdioTransport : public AtTransportBase {
 public:
-    AtSdioTransport();
+    struct Config {
+        size_t bufferNum; // Number of receive buffers, the TX ring is as large as all of them
+        size_t queueSize; // Maximum number of sends in flight
+    };
+
+    explicit AtSdioTransport(const Config& conf = defaultConfig());
     virtual ~AtSdioTransport();
 
+    const Config& config() const;
+    virtual size_t bufferMemory() const override;
+
+    static Config defaultConfig();
+    static int checkConfig(const Config& conf);
+
     virtual int readData(uint8_t* data, ssize_t len, unsigned int timeoutMsec = 1) override;
     virtual int flushInput() override;
     virtual int writeData(const uint8_t* data, size_t len) override;
     virtual int getDataLength() const override;
     virtual int waitWriteComplete(unsigned int timeoutMsec) override;
 
+    virtual int borrowData(const uint8_t** data) override;
+    virtual int returnData(size_t len) override;
+
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    virtual uint8_t* allocPacket(size_t size, unsigned int timeoutMsec) override;
+    virtual int sendPacket(uint8_t* packet, size_t size, unsigned int timeoutMsec) override;
+    virtual void freePacket(uint8_t* packet) override;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+
 protected:
     virtual int initTransport() override;
     virtual int destroyTransport() override;
@@ -55,25 +85,35 @@ protected:
 
 private:
     int fetchData(unsigned int timeoutMsec);
+    void consumeData(size_t len);
     void rxRun();
     void txRun();
 
     int startTransmission();
     int waitTransmissionFinished(unsigned int timeoutMsec);
+    void completeTransmission(void* arg);
+    // Waits until the TX thread collects a completed send. The DONE event has to be cleared
+    // with txMutex_ held after checking the state of the TX ring
+    int waitTransmissionDone(unsigned int timeoutMsec);
+    void updateTxEvents();
+    int allocBuffers();
 
 
 private:
     // Loosely based on esp_at_sdio_list_t
     struct Buffer {
-        uint8_t pbuf[AT_SDIO_BUFFER_SIZE];
+        uint8_t* pbuf;
         struct Buffer* next;
         sdio_slave_buf_handle_t handle;
         uint32_t leftLen;
         uint32_t pos;
     };
 
+    Config conf_;
 
-    Buffer WORD_ALIGNED_ATTR list_[AT_SDIO_BUFFER_NUM];
+    std::unique_ptr<Buffer[]> list_;
+    // DMA-capable receive buffers
+    uint8_t* rxBufData_;
     volatile Buffer* listHead_;
     Buffer* listTail_;
     std::mutex rxMutex_;
@@ -86,10 +126,21 @@ private:
     TaskHandle_t txThread_;
 
     particle::services::RingBuffer<uint8_t> txBuf_;
-    uint8_t txBufData_[AT_SDIO_TX_BUFFER_SIZE] __attribute__((aligned(4)));
-    volatile bool transmitting_;
+    uint8_t* txBufData_;
+    volatile size_t txInFlight_;
+    EventGroupHandle_t txEvents_;
+
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    // DMA-capable buffers for the packets sent bypassing the TX ring
+    uint8_t* txPackets_;
+    QueueHandle_t txFreePackets_;
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
 };
 
+inline const AtSdioTransport::Config& AtSdioTransport::config() const {
+    return conf_;
+}
+
 } } /* particle::ncp */
 
 #endif // PLATFORM_ID == PLATFORM_TRACKER
@@ -17,6 +17,11 @@
 
 #include "at_transport_uart.h"
 #include "platforms.h"
+#include "util.h"
+
+#include <soc/uart_struct.h>
+
+#include <algorithm>
 
 #if PLATFORM_ID == PLATFORM_ARGON
 #define AT_UART_THREAD_PRIORITY    (tskIDLE_PRIORITY + 1)
@@ -28,11 +33,54 @@
 
 namespace particle { namespace ncp {
 
+namespace {
+
+const size_t DEFAULT_BUFFER_SIZE = 2048;
+const size_t DEFAULT_EVENT_QUEUE_SIZE = 30;
+
+// Same as the driver defaults
+const unsigned DEFAULT_RXFIFO_FULL_THRESH = 120;
+const unsigned DEFAULT_RX_TIMEOUT_THRESH = 10;
+
+const unsigned MIN_RXFIFO_FULL_THRESH = 32;
+const unsigned RXFIFO_FULL_THRESH_STEP = 16;
+const unsigned MIN_RX_TIMEOUT_THRESH = 2;
+const unsigned MAX_RX_TIMEOUT_THRESH = 126;
+// Headroom left in the RX FIFO between the full interrupt and the RTS deassertion
+const unsigned RX_FLOW_CTRL_HEADROOM = 8;
+
+const unsigned DEFAULT_COALESCE_TIME_MS = 2;
+const unsigned MAX_COALESCE_TIME_MS = 100;
+
+const unsigned TUNE_PERIOD_MS = 1000;
+// Minimum number of data events in a tuning period for a decision to be made
+const unsigned TUNE_MIN_EVENTS = 16;
+
+uart_dev_t* const UART_DEV[UART_NUM_MAX] = { &UART0, &UART1, &UART2 };
+
+} // anonymous
+
 AtUartTransport::AtUartTransport(const Config& conf)
         : AtTransportBase(),
           conf_(conf),
+          thresh_{DEFAULT_RXFIFO_FULL_THRESH, DEFAULT_RX_TIMEOUT_THRESH},
+          autoTune_(conf.autoTune),
           exit_(false) {
-
+    if (!conf_.rxBufferSize) {
+        conf_.rxBufferSize = DEFAULT_BUFFER_SIZE;
+    }
+    if (!conf_.txBufferSize) {
+        conf_.txBufferSize = DEFAULT_BUFFER_SIZE;
+    }
+    if (!conf_.eventQueueSize) {
+        conf_.eventQueueSize = DEFAULT_EVENT_QUEUE_SIZE;
+    }
+    if (!conf_.coalesceTimeMs) {
+        conf_.coalesceTimeMs = DEFAULT_COALESCE_TIME_MS;
+    }
+    coalesce_.bytes = conf_.coalesceBytes;
+    coalesce_.timeMs = std::min(conf_.coalesceTimeMs, MAX_COALESCE_TIME_MS);
+    thresh_.rxFifoFull = std::min(thresh_.rxFifoFull, maxRxFifoFullThreshold());
 }
 
 AtUartTransport::~AtUartTransport() {
@@ -42,7 +90,12 @@ int AtUartTransport::initTransport()  {
     LOG(INFO, "Initializing UART transport");
     CHECK_ESP(uart_param_config(conf_.uart, &conf_.config));
     CHECK_ESP(uart_set_pin(conf_.uart, conf_.txPin, conf_.rxPin, conf_.rtsPin, conf_.ctsPin));
-    CHECK_ESP(uart_driver_install(conf_.uart, 2048, 2048, 30, &queue_, 0));
+    CHECK_ESP(uart_driver_install(conf_.uart, conf_.rxBufferSize, conf_.txBufferSize, conf_.eventQueueSize,
+            &queue_, 0));
+    // The driver has enabled the RX interrupts with its default thresholds
+    Thresholds t = {};
+    thresholds(&t);
+    applyThresholds(t);
 
     if (xTaskCreate(run, "at_uart_t", 8192, this, AT_UART_THREAD_PRIORITY, &thread_) != pdPASS) {
         destroyTransport();
@@ -140,6 +193,171 @@ int AtUartTransport::waitWriteComplete(unsigned int timeoutMsec) {
     return CHECK_ESP(uart_wait_tx_done(conf_.uart, t));
 }
 
+int AtUartTransport::setBaudRate(unsigned baudRate) {
+    if (!started_) {
+        return -1;
+    }
+
+    CHECK_ESP(uart_set_baudrate(conf_.uart, baudRate));
+    conf_.config.baud_rate = baudRate;
+    return 0;
+}
+
+unsigned AtUartTransport::baudRate() const {
+    return conf_.config.baud_rate;
+}
+
+size_t AtUartTransport::bufferMemory() const {
+    return conf_.rxBufferSize + conf_.txBufferSize + conf_.eventQueueSize * sizeof(uart_event_t);
+}
+
+int AtUartTransport::setThresholds(const Thresholds& thresholds) {
+    CHECK_TRUE(thresholds.rxFifoFull > 0 && thresholds.rxFifoFull <= maxRxFifoFullThreshold(), RESULT_INVALID_PARAM);
+    CHECK_TRUE(thresholds.rxTimeout > 0 && thresholds.rxTimeout <= MAX_RX_TIMEOUT_THRESH, RESULT_INVALID_PARAM);
+    if (started_) {
+        applyThresholds(thresholds);
+    } else {
+        // Applied when the driver is installed
+        portENTER_CRITICAL(&lock_);
+        thresh_ = thresholds;
+        portEXIT_CRITICAL(&lock_);
+    }
+    return 0;
+}
+
+void AtUartTransport::thresholds(Thresholds* thresholds) const {
+    portENTER_CRITICAL(&lock_);
+    *thresholds = thresh_;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void AtUartTransport::setAutoTune(bool enabled) {
+    autoTune_ = enabled;
+    if (!enabled) {
+        stats_.decision = TUNE_NONE;
+    }
+    // Wake up the thread so that it starts using the tuning period
+    if (queue_) {
+        uart_event_t ev = {};
+        ev.type = (uart_event_type_t)TRANSPORT_EVENT_TUNE;
+        xQueueSend(queue_, &ev, 0);
+    }
+}
+
+int AtUartTransport::setCoalescing(const Coalescing& coalescing) {
+    CHECK_TRUE(!coalescing.bytes || (coalescing.timeMs > 0 && coalescing.timeMs <= MAX_COALESCE_TIME_MS),
+            RESULT_INVALID_PARAM);
+    // Changed by the AT thread while the transport thread is running
+    portENTER_CRITICAL(&lock_);
+    coalesce_ = coalescing;
+    portEXIT_CRITICAL(&lock_);
+    return 0;
+}
+
+void AtUartTransport::coalescing(Coalescing* coalescing) const {
+    portENTER_CRITICAL(&lock_);
+    *coalescing = coalesce_;
+    portEXIT_CRITICAL(&lock_);
+}
+
+void AtUartTransport::setThreadPriority(UBaseType_t priority) {
+    if (thread_) {
+        vTaskPrioritySet(thread_, priority);
+    }
+}
+
+UBaseType_t AtUartTransport::threadPriority() const {
+    return thread_ ? uxTaskPriorityGet(thread_) : AT_UART_THREAD_PRIORITY;
+}
+
+void AtUartTransport::stats(Stats* stats) const {
+    *stats = stats_;
+}
+
+bool AtUartTransport::applyThresholds(const Thresholds& thresholds, const Thresholds* expected) {
+    // uart_intr_config() can't be used on a running driver: it clears the pending interrupts and
+    // disables the TX interrupt used by uart_write_bytes(). Only the threshold fields are updated.
+    // The driver modifies the same register in its own critical sections, which can't be entered
+    // concurrently with this one on a single core
+    bool ok = true;
+    portENTER_CRITICAL(&lock_);
+    if (!expected || (expected->rxFifoFull == thresh_.rxFifoFull && expected->rxTimeout == thresh_.rxTimeout)) {
+        UART_DEV[conf_.uart]->conf1.rxfifo_full_thrhd = thresholds.rxFifoFull;
+        UART_DEV[conf_.uart]->conf1.rx_tout_thrhd = thresholds.rxTimeout;
+        thresh_ = thresholds;
+    } else {
+        ok = false;
+    }
+    portEXIT_CRITICAL(&lock_);
+    return ok;
+}
+
+unsigned AtUartTransport::maxRxFifoFullThreshold() const {
+    if (conf_.config.flow_ctrl & UART_HW_FLOWCTRL_RTS) {
+        // The interrupt should fire before the hardware flow control kicks in
+        return std::max(conf_.config.rx_flow_ctrl_thresh, (uint8_t)(MIN_RXFIFO_FULL_THRESH + RX_FLOW_CTRL_HEADROOM)) -
+                RX_FLOW_CTRL_HEADROOM;
+    }
+    return DEFAULT_RXFIFO_FULL_THRESH;
+}
+
+void AtUartTransport::tune() {
+    const auto now = util::millis();
+    if (stallTime_) {
+        // Account for an ongoing stall
+        stats_.stalledMs += now - stallTime_;
+        stallTime_ = now;
+    }
+    Stats delta = {};
+    delta.rxBytes = stats_.rxBytes - tuneStats_.rxBytes;
+    delta.dataEvents = stats_.dataEvents - tuneStats_.dataEvents;
+    delta.fifoOverflows = stats_.fifoOverflows - tuneStats_.fifoOverflows;
+    delta.stalledMs = stats_.stalledMs - tuneStats_.stalledMs;
+    const uint32_t periodMs = now - tuneTime_;
+    tuneStats_ = stats_;
+    tuneTime_ = now;
+
+    Thresholds prev = {};
+    thresholds(&prev);
+    Thresholds t = prev;
+    const auto decision = tuneThresholds(delta, periodMs, maxRxFifoFullThreshold(), &t);
+    stats_.decision = decision;
+    if (t.rxFifoFull != prev.rxFifoFull || t.rxTimeout != prev.rxTimeout) {
+        // Thresholds set by the host in the meantime take precedence
+        if (applyThresholds(t, &prev)) {
+            LOG_DEBUG(TRACE, "UART RX thresholds: %u, %u (%d)", t.rxFifoFull, t.rxTimeout, (int)decision);
+            ++stats_.adjustments;
+        }
+    }
+}
+
+AtUartTransport::TuneDecision AtUartTransport::tuneThresholds(const Stats& delta, uint32_t periodMs,
+        unsigned maxRxFifoFull, Thresholds* t) {
+    if (delta.fifoOverflows > 0) {
+        // The interrupt is serviced too late, start draining the FIFO earlier
+        t->rxFifoFull = std::max(MIN_RXFIFO_FULL_THRESH, t->rxFifoFull - std::min(t->rxFifoFull, RXFIFO_FULL_THRESH_STEP));
+        return TUNE_OVERFLOW;
+    }
+    if (delta.stalledMs * 10 > periodMs) {
+        // The reader doesn't keep up: the thresholds are not the bottleneck
+        return TUNE_STALLED;
+    }
+    if (delta.dataEvents < TUNE_MIN_EVENTS) {
+        return TUNE_NONE;
+    }
+    // A burst ends with a timeout interrupt, so the average is somewhat below the threshold even if
+    // the data is received continuously
+    if ((uint64_t)delta.rxBytes * 4 >= (uint64_t)delta.dataEvents * t->rxFifoFull * 3) {
+        // Mostly FIFO full interrupts: fewer, larger reads
+        t->rxFifoFull = std::min(maxRxFifoFull, t->rxFifoFull + RXFIFO_FULL_THRESH_STEP);
+        t->rxTimeout = DEFAULT_RX_TIMEOUT_THRESH;
+        return TUNE_BULK;
+    }
+    // Mostly short bursts ending with a timeout: report them sooner
+    t->rxTimeout = MIN_RX_TIMEOUT_THRESH;
+    return TUNE_INTERACTIVE;
+}
+
 int AtUartTransport::statusChanged(esp_at_status_type status) {
     /* Nothing to do here, because we don't use any commands that switch to non-AT mode */
     return 0;
@@ -153,6 +371,27 @@ int AtUartTransport::preRestart() {
     return destroyTransport();
 }
 
+void AtUartTransport::receivedData(size_t size, const Coalescing& c) {
+    pendingBytes_ += size;
+    if (!c.bytes || !burst_) {
+        // First data of a burst, wake up the reader right away
+        notifyPendingData();
+        burst_ = c.bytes > 0;
+        coalesceTime_ = util::millis() + c.timeMs;
+    } else if (pendingBytes_ >= c.bytes) {
+        notifyPendingData();
+        coalesceTime_ = util::millis() + c.timeMs;
+    }
+}
+
+void AtUartTransport::notifyPendingData() {
+    if (pendingBytes_ > 0) {
+        ++stats_.notifications;
+        notifyReceivedData(pendingBytes_, portMAX_DELAY);
+        pendingBytes_ = 0;
+    }
+}
+
 void AtUartTransport::run(void* arg) {
     auto self = static_cast<AtUartTransport*>(arg);
     self->run();
@@ -162,13 +401,47 @@ void AtUartTransport::run(void* arg) {
 void AtUartTransport::run() {
     LOG(INFO, "UART transport thread started");
 
+    tuneTime_ = util::millis();
+
     while (!exit_) {
         uart_event_t event = {};
-        if (xQueueReceive(queue_, (void*)&event, portMAX_DELAY)) {
+        // The settings are read once per event, so that a change made in the meantime
+        // applies to the next one as a whole
+        Coalescing c = {};
+        coalescing(&c);
+        TickType_t timeout = autoTune_ ? TUNE_PERIOD_MS / portTICK_PERIOD_MS : portMAX_DELAY;
+        if (burst_) {
+            const auto now = util::millis();
+            const TickType_t t = (coalesceTime_ > now) ? (coalesceTime_ - now) / portTICK_PERIOD_MS : 0;
+            timeout = std::min(timeout, t);
+        }
+        if (xQueueReceive(queue_, (void*)&event, timeout)) {
             switch (event.type) {
-                case UART_DATA:
+                case UART_DATA: {
+                    if (stallTime_) {
+                        stats_.stalledMs += util::millis() - stallTime_;
+                        stallTime_ = 0;
+                    }
+                    ++stats_.dataEvents;
+                    stats_.rxBytes += event.size;
+                    receivedData(event.size, c);
+                    break;
+                }
                 case UART_BUFFER_FULL: {
-                    notifyReceivedData(event.size, portMAX_DELAY);
+                    // The driver stops reading the FIFO until there's space in the buffer,
+                    // the FIFO fills up and RTS gets deasserted
+                    if (!stallTime_) {
+                        stallTime_ = util::millis();
+                    }
+                    ++stats_.bufferFull;
+                    stats_.rxBytes += event.size;
+                    // Make sure the reader frees up some space
+                    pendingBytes_ += event.size;
+                    notifyPendingData();
+                    break;
+                }
+                case UART_FIFO_OVF: {
+                    ++stats_.fifoOverflows;
                     break;
                 }
 
@@ -178,6 +451,18 @@ void AtUartTransport::run() {
                 }
             }
         }
+        if (burst_ && util::millis() >= coalesceTime_) {
+            if (pendingBytes_ > 0) {
+                notifyPendingData();
+                coalesceTime_ = util::millis() + c.timeMs;
+            } else {
+                // No data for a whole coalescing period, the burst is over
+                burst_ = false;
+            }
+        }
+        if (autoTune_ && util::millis() - tuneTime_ >= TUNE_PERIOD_MS) {
+            tune();
+        }
     }
 
     LOG(INFO, "UART transport thread exiting");
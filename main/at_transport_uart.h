@@ -35,6 +35,51 @@ public:
         int ctsPin;
 
         uart_config_t config;
+
+        // Driver buffer sizes, 0 - default
+        size_t rxBufferSize;
+        size_t txBufferSize;
+        size_t eventQueueSize;
+
+        // Adjust the RX interrupt thresholds to the traffic pattern at runtime
+        bool autoTune;
+
+        // RX notification coalescing, see Coalescing
+        size_t coalesceBytes; // 0 - disabled
+        unsigned coalesceTimeMs; // 0 - default
+    };
+
+    // RX notification coalescing. The first data event of a burst is reported right away,
+    // further events are batched until the given number of bytes is received or the timer expires
+    struct Coalescing {
+        size_t bytes; // 0 - disabled
+        unsigned timeMs;
+    };
+
+    // RX interrupt thresholds
+    struct Thresholds {
+        unsigned rxFifoFull; // Bytes
+        unsigned rxTimeout; // Symbol periods
+    };
+
+    // Last decision made by the RX threshold tuning
+    enum TuneDecision {
+        TUNE_NONE = 0, // Not enough traffic, or tuning is disabled
+        TUNE_OVERFLOW = 1, // RX FIFO overflowed, FIFO full threshold lowered
+        TUNE_STALLED = 2, // Host link is throttled by the reader, thresholds unchanged
+        TUNE_BULK = 3, // Bulk transfer, FIFO full threshold raised to reduce the interrupt rate
+        TUNE_INTERACTIVE = 4 // Short bursts, RX timeout lowered to reduce latency
+    };
+
+    struct Stats {
+        uint32_t rxBytes;
+        uint32_t dataEvents;
+        uint32_t fifoOverflows;
+        uint32_t bufferFull;
+        uint32_t stalledMs; // Time spent with the RX buffer full and RTS deasserted
+        uint32_t adjustments;
+        TuneDecision decision;
+        uint32_t notifications; // Number of times the reader has been notified
     };
 
     AtUartTransport(const Config& conf);
@@ -46,6 +91,28 @@ public:
     virtual int getDataLength() const override;
     virtual int waitWriteComplete(unsigned int timeoutMsec) override;
 
+    virtual int setBaudRate(unsigned baudRate) override;
+    virtual unsigned baudRate() const override;
+    virtual size_t bufferMemory() const override;
+
+    const Config& config() const;
+
+    int setThresholds(const Thresholds& thresholds);
+    void thresholds(Thresholds* thresholds) const;
+    void setAutoTune(bool enabled);
+    bool autoTune() const;
+    int setCoalescing(const Coalescing& coalescing);
+    void coalescing(Coalescing* coalescing) const;
+    void setThreadPriority(UBaseType_t priority);
+    UBaseType_t threadPriority() const;
+    unsigned maxRxFifoFullThreshold() const;
+    void stats(Stats* stats) const;
+
+    // Adjusts the RX thresholds to the traffic of a tuning period. `delta` contains the increments
+    // of the counters during the period
+    static TuneDecision tuneThresholds(const Stats& delta, uint32_t periodMs, unsigned maxRxFifoFull,
+            Thresholds* thresholds);
+
 protected:
     virtual int initTransport() override;
     virtual int destroyTransport() override;
@@ -59,18 +126,46 @@ private:
     static void run(void* arg);
     void run();
 
+    void receivedData(size_t size, const Coalescing& coalescing);
+    void notifyPendingData();
+
+    // Updates the RX thresholds of the running driver, unless the current thresholds differ from
+    // `expected`. Returns false in that case
+    bool applyThresholds(const Thresholds& thresholds, const Thresholds* expected = nullptr);
+    void tune();
+
 private:
     Config conf_;
+    Thresholds thresh_; // Protected by lock_
+    Coalescing coalesce_; // Protected by lock_
+    mutable portMUX_TYPE lock_ = portMUX_INITIALIZER_UNLOCKED;
+    std::atomic_bool autoTune_;
+    Stats stats_ = {};
+    Stats tuneStats_ = {}; // Counters at the time of the previous tuning decision
+    uint64_t tuneTime_ = 0;
+    uint64_t stallTime_ = 0;
+    size_t pendingBytes_ = 0; // Received bytes that haven't been reported yet
+    uint64_t coalesceTime_ = 0; // Time when the pending bytes are reported
+    bool burst_ = false;
     std::atomic_bool exit_;
     std::atomic_bool started_;
     QueueHandle_t queue_ = nullptr;
     TaskHandle_t thread_ = nullptr;
 
     enum AdditionalEvents {
-        TRANSPORT_EVENT_EXIT = UART_EVENT_MAX + 1
+        TRANSPORT_EVENT_EXIT = UART_EVENT_MAX + 1,
+        TRANSPORT_EVENT_TUNE = UART_EVENT_MAX + 2
     };
 };
 
+inline const AtUartTransport::Config& AtUartTransport::config() const {
+    return conf_;
+}
+
+inline bool AtUartTransport::autoTune() const {
+    return autoTune_;
+}
+
 } } /* particle::ncp */
 
 #endif /* ARGON_NCP_FIRMWARE_AT_TRANSPORT_UART_H */
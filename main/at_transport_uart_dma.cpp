@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "at_transport_uart_dma.h"
+#include "platforms.h"
+
+#include <algorithm>
+
+#include <driver/periph_ctrl.h>
+#include <esp_heap_caps.h>
+#include <soc/uart_struct.h>
+#include <soc/uhci_reg.h>
+#include <soc/uhci_struct.h>
+
+#if PLATFORM_ID == PLATFORM_ARGON
+#define AT_UART_THREAD_PRIORITY    (tskIDLE_PRIORITY + 1)
+#elif PLATFORM_ID == PLATFORM_TRACKER
+#define AT_UART_THREAD_PRIORITY    (tskIDLE_PRIORITY + 8)
+#else
+#error "UNKOWN PLATFORM!"
+#endif
+
+namespace particle { namespace ncp {
+
+namespace {
+
+// DMA descriptors can't describe buffers larger than 4095 bytes, keep the size word-aligned
+const size_t DMA_BLOCK_SIZE = std::min(CONFIG_NCP_UART_DMA_BLOCK_SIZE, 4092);
+const unsigned RX_BLOCK_COUNT = CONFIG_NCP_UART_DMA_RX_BLOCK_COUNT;
+const unsigned TX_BLOCK_COUNT = CONFIG_NCP_UART_DMA_TX_BLOCK_COUNT;
+
+// Number of idle bit periods after which the current RX descriptor is completed
+const unsigned RX_IDLE_THRESHOLD_BITS = 30;
+
+const uint32_t RX_INTERRUPTS = UHCI_IN_DONE_INT_ENA | UHCI_IN_SUC_EOF_INT_ENA | UHCI_IN_DSCR_ERR_INT_ENA |
+        UHCI_IN_DSCR_EMPTY_INT_ENA;
+const uint32_t TX_INTERRUPTS = UHCI_OUT_TOTAL_EOF_INT_ENA;
+
+uart_dev_t* const UART_DEVICES[UART_NUM_MAX] = {
+    &UART0,
+    &UART1,
+    &UART2
+};
+
+inline uint32_t dmaLinkAddr(const lldesc_t* desc) {
+    return (uint32_t)desc & 0xfffff;
+}
+
+} // anonymous
+
+AtUartDmaTransport::AtUartDmaTransport(const Config& conf)
+        : AtTransportBase(),
+          conf_(conf),
+          exit_(false),
+          started_(false),
+          rxStalled_(false) {
+
+}
+
+AtUartDmaTransport::~AtUartDmaTransport() {
+}
+
+int AtUartDmaTransport::initTransport()  {
+    LOG(INFO, "Initializing UART DMA transport");
+    CHECK_TRUE(conf_.uart < UART_NUM_MAX, RESULT_INVALID_PARAM);
+    CHECK_ESP(uart_param_config(conf_.uart, &conf_.config));
+    CHECK_ESP(uart_set_pin(conf_.uart, conf_.txPin, conf_.rxPin, conf_.rtsPin, conf_.ctsPin));
+    UART_DEVICES[conf_.uart]->idle_conf.rx_idle_thrhd = RX_IDLE_THRESHOLD_BITS;
+
+    if (allocBuffers() < 0) {
+        freeBuffers();
+        return RESULT_NO_MEMORY;
+    }
+
+    if (xTaskCreate(run, "at_uart_t", 8192, this, AT_UART_THREAD_PRIORITY, &thread_) != pdPASS) {
+        freeBuffers();
+        return RESULT_NO_MEMORY;
+    }
+
+    periph_module_enable(PERIPH_UHCI0_MODULE);
+    const auto ret = esp_intr_alloc(ETS_UHCI0_INTR_SOURCE, 0, isr, this, &intr_);
+    if (ret != ESP_OK) {
+        destroyTransport();
+        return RESULT_ERROR;
+    }
+    startDma();
+
+    started_ = true;
+
+    return 0;
+}
+
+int AtUartDmaTransport::destroyTransport() {
+    LOG(INFO, "Deinitializing UART DMA transport");
+    if (started_) {
+        waitWriteComplete(portMAX_DELAY);
+    }
+
+    stopDma();
+    if (intr_) {
+        esp_intr_free(intr_);
+        intr_ = nullptr;
+    }
+
+    if (thread_) {
+        exit_ = true;
+        xTaskNotifyGive(thread_);
+
+        LOG(INFO, "Waiting for UART thread to stop");
+
+        /* Join thread */
+        while (exit_) {
+            vTaskDelay(100 / portTICK_PERIOD_MS);
+        }
+
+        thread_ = nullptr;
+
+        LOG(INFO, "UART thread stopped");
+    }
+
+    started_ = false;
+
+    periph_module_disable(PERIPH_UHCI0_MODULE);
+    freeBuffers();
+
+    gpio_set_direction((gpio_num_t)conf_.txPin, GPIO_MODE_INPUT);
+    gpio_set_direction((gpio_num_t)conf_.rxPin, GPIO_MODE_INPUT);
+    gpio_set_direction((gpio_num_t)conf_.rtsPin, GPIO_MODE_INPUT);
+    gpio_set_direction((gpio_num_t)conf_.ctsPin, GPIO_MODE_INPUT);
+
+    LOG(INFO, "UART DMA transport deinitialized");
+
+    return 0;
+}
+
+int AtUartDmaTransport::postInitTransport() {
+    return 0;
+}
+
+int AtUartDmaTransport::readData(uint8_t* data, ssize_t len, unsigned int timeoutMsec) {
+    if (!data || len < 0 || !started_) {
+        return -1;
+    }
+
+    if (len == 0) {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(rxMutex_);
+    if (rxAvailable() == 0) {
+        lock.unlock();
+        if (xSemaphoreTake(rxSem_, timeoutMsec / portTICK_PERIOD_MS) != pdTRUE) {
+            return 0;
+        }
+        lock.lock();
+    }
+
+    size_t pos = 0;
+    while (pos < (size_t)len && rxCompleted_ > 0) {
+        lldesc_t* desc = &rxDesc_[rxHead_];
+        const size_t n = std::min<size_t>(desc->length - rxOffset_, len - pos);
+        memcpy(data + pos, (const uint8_t*)desc->buf + rxOffset_, n);
+        pos += n;
+        rxOffset_ += n;
+        if (rxOffset_ >= desc->length) {
+            rxRelease(desc);
+        }
+    }
+    if (rxAvailable() > 0) {
+        // Let the next reader through without waiting
+        xSemaphoreGive(rxSem_);
+    }
+    return pos;
+}
+
+int AtUartDmaTransport::flushInput() {
+    std::lock_guard<std::mutex> lock(rxMutex_);
+    while (rxCompleted_ > 0) {
+        rxRelease(&rxDesc_[rxHead_]);
+    }
+    xSemaphoreTake(rxSem_, 0);
+    return 0;
+}
+
+int AtUartDmaTransport::writeData(const uint8_t* data, size_t len) {
+    if (!started_) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(txMutex_);
+    size_t pos = 0;
+    while (pos < len) {
+        xSemaphoreTake(txFree_, portMAX_DELAY);
+        lldesc_t* desc = &txDesc_[txFill_];
+        const size_t n = std::min(len - pos, DMA_BLOCK_SIZE);
+        memcpy((uint8_t*)desc->buf, data + pos, n);
+        desc->length = n;
+        desc->eof = 1;
+        desc->owner = 1;
+        desc->qe.stqe_next = nullptr;
+        txFill_ = (txFill_ + 1) % TX_BLOCK_COUNT;
+        pos += n;
+
+        portENTER_CRITICAL(&txLock_);
+        ++txPending_;
+        if (!txActive_) {
+            txStartNext();
+        }
+        portEXIT_CRITICAL(&txLock_);
+    }
+    return pos;
+}
+
+int AtUartDmaTransport::getDataLength() const {
+    if (!started_) {
+        return -1;
+    }
+
+    std::lock_guard<std::mutex> lock(rxMutex_);
+    return rxAvailable();
+}
+
+int AtUartDmaTransport::waitWriteComplete(unsigned int timeoutMsec) {
+    if (!started_) {
+        return -1;
+    }
+
+    /* Avoid multiplication here */
+    const TickType_t t = timeoutMsec != portMAX_DELAY ? timeoutMsec / portTICK_PERIOD_MS : timeoutMsec;
+    const TickType_t start = xTaskGetTickCount();
+    for (;;) {
+        portENTER_CRITICAL(&txLock_);
+        const bool active = txActive_;
+        portEXIT_CRITICAL(&txLock_);
+        if (!active) {
+            break;
+        }
+        const TickType_t elapsed = xTaskGetTickCount() - start;
+        if (t != portMAX_DELAY && elapsed >= t) {
+            return RESULT_TIMEOUT;
+        }
+        xSemaphoreTake(txDone_, (t != portMAX_DELAY) ? t - elapsed : portMAX_DELAY);
+    }
+
+    // DMA is done, wait until the last bytes leave the UART FIFO
+    const auto uart = UART_DEVICES[conf_.uart];
+    while (uart->status.txfifo_cnt > 0 || uart->status.st_utx_out != 0) {
+        if (t != portMAX_DELAY && xTaskGetTickCount() - start >= t) {
+            return RESULT_TIMEOUT;
+        }
+        vTaskDelay(1);
+    }
+    return 0;
+}
+
+int AtUartDmaTransport::setBaudRate(unsigned baudRate) {
+    if (!started_) {
+        return -1;
+    }
+
+    CHECK_ESP(uart_set_baudrate(conf_.uart, baudRate));
+    conf_.config.baud_rate = baudRate;
+    return 0;
+}
+
+unsigned AtUartDmaTransport::baudRate() const {
+    return conf_.config.baud_rate;
+}
+
+size_t AtUartDmaTransport::bufferMemory() const {
+    return (RX_BLOCK_COUNT + TX_BLOCK_COUNT) * (DMA_BLOCK_SIZE + sizeof(lldesc_t));
+}
+
+int AtUartDmaTransport::statusChanged(esp_at_status_type status) {
+    /* Nothing to do here, because we don't use any commands that switch to non-AT mode */
+    return 0;
+}
+
+int AtUartDmaTransport::preDeepSleep() {
+    return destroyTransport();
+}
+
+int AtUartDmaTransport::preRestart() {
+    return destroyTransport();
+}
+
+int AtUartDmaTransport::allocBuffers() {
+    rxDesc_ = (lldesc_t*)heap_caps_calloc(RX_BLOCK_COUNT, sizeof(lldesc_t), MALLOC_CAP_DMA);
+    rxBuf_ = (uint8_t*)heap_caps_malloc(RX_BLOCK_COUNT * DMA_BLOCK_SIZE, MALLOC_CAP_DMA);
+    txDesc_ = (lldesc_t*)heap_caps_calloc(TX_BLOCK_COUNT, sizeof(lldesc_t), MALLOC_CAP_DMA);
+    txBuf_ = (uint8_t*)heap_caps_malloc(TX_BLOCK_COUNT * DMA_BLOCK_SIZE, MALLOC_CAP_DMA);
+    rxSem_ = xSemaphoreCreateBinary();
+    txFree_ = xSemaphoreCreateCounting(TX_BLOCK_COUNT, TX_BLOCK_COUNT);
+    txDone_ = xSemaphoreCreateBinary();
+    CHECK_TRUE(rxDesc_ && rxBuf_ && txDesc_ && txBuf_ && rxSem_ && txFree_ && txDone_, RESULT_NO_MEMORY);
+
+    // RX descriptors form a ring, all of them are owned by DMA initially
+    for (unsigned i = 0; i < RX_BLOCK_COUNT; ++i) {
+        lldesc_t* desc = &rxDesc_[i];
+        desc->size = DMA_BLOCK_SIZE;
+        desc->length = 0;
+        desc->owner = 1;
+        desc->buf = rxBuf_ + i * DMA_BLOCK_SIZE;
+        desc->qe.stqe_next = &rxDesc_[(i + 1) % RX_BLOCK_COUNT];
+    }
+    rxHead_ = 0;
+    rxOffset_ = 0;
+    rxCompleted_ = 0;
+    rxStalled_ = false;
+
+    // TX descriptors are started one at a time
+    for (unsigned i = 0; i < TX_BLOCK_COUNT; ++i) {
+        lldesc_t* desc = &txDesc_[i];
+        desc->size = DMA_BLOCK_SIZE;
+        desc->buf = txBuf_ + i * DMA_BLOCK_SIZE;
+    }
+    txFill_ = 0;
+    txSend_ = 0;
+    txPending_ = 0;
+    txActive_ = false;
+    return 0;
+}
+
+void AtUartDmaTransport::freeBuffers() {
+    heap_caps_free(rxDesc_);
+    rxDesc_ = nullptr;
+    heap_caps_free(rxBuf_);
+    rxBuf_ = nullptr;
+    heap_caps_free(txDesc_);
+    txDesc_ = nullptr;
+    heap_caps_free(txBuf_);
+    txBuf_ = nullptr;
+    if (rxSem_) {
+        vSemaphoreDelete(rxSem_);
+        rxSem_ = nullptr;
+    }
+    if (txFree_) {
+        vSemaphoreDelete(txFree_);
+        txFree_ = nullptr;
+    }
+    if (txDone_) {
+        vSemaphoreDelete(txDone_);
+        txDone_ = nullptr;
+    }
+}
+
+void AtUartDmaTransport::startDma() {
+    UHCI0.int_ena.val = 0;
+    UHCI0.int_clr.val = 0xffffffff;
+
+    UHCI0.conf0.in_rst = 1;
+    UHCI0.conf0.in_rst = 0;
+    UHCI0.conf0.out_rst = 1;
+    UHCI0.conf0.out_rst = 0;
+    UHCI0.conf0.ahbm_fifo_rst = 1;
+    UHCI0.conf0.ahbm_fifo_rst = 0;
+    UHCI0.conf0.ahbm_rst = 1;
+    UHCI0.conf0.ahbm_rst = 0;
+
+    // Raw data: no SLIP separators, headers, CRC or escaping
+    UHCI0.conf0.val = 0;
+    UHCI0.conf0.clk_en = 1;
+    UHCI0.conf0.uart_idle_eof_en = 1;
+    UHCI0.conf0.outdscr_burst_en = 1;
+    UHCI0.conf0.indscr_burst_en = 1;
+    UHCI0.conf0.out_data_burst_en = 1;
+    switch (conf_.uart) {
+        case UART_NUM_0: {
+            UHCI0.conf0.uart0_ce = 1;
+            break;
+        }
+        case UART_NUM_1: {
+            UHCI0.conf0.uart1_ce = 1;
+            break;
+        }
+        default: {
+            UHCI0.conf0.uart2_ce = 1;
+            break;
+        }
+    }
+    UHCI0.conf1.val = 0;
+    // Don't write into descriptors that haven't been read yet
+    UHCI0.conf1.check_owner = 1;
+    UHCI0.escape_conf.val = 0;
+
+    UHCI0.dma_in_link.addr = dmaLinkAddr(&rxDesc_[0]);
+    UHCI0.dma_in_link.start = 1;
+
+    UHCI0.int_ena.val = RX_INTERRUPTS | TX_INTERRUPTS;
+}
+
+void AtUartDmaTransport::stopDma() {
+    UHCI0.int_ena.val = 0;
+    UHCI0.dma_in_link.stop = 1;
+    UHCI0.dma_out_link.stop = 1;
+    UHCI0.conf0.uart0_ce = 0;
+    UHCI0.conf0.uart1_ce = 0;
+    UHCI0.conf0.uart2_ce = 0;
+    UHCI0.int_clr.val = 0xffffffff;
+}
+
+size_t AtUartDmaTransport::rxAvailable() const {
+    size_t n = 0;
+    for (unsigned i = 0; i < rxCompleted_; ++i) {
+        n += rxDesc_[(rxHead_ + i) % RX_BLOCK_COUNT].length;
+    }
+    return n - rxOffset_;
+}
+
+void AtUartDmaTransport::rxRelease(lldesc_t* desc) {
+    desc->length = 0;
+    desc->eof = 0;
+    desc->owner = 1;
+    rxHead_ = (rxHead_ + 1) % RX_BLOCK_COUNT;
+    rxOffset_ = 0;
+    --rxCompleted_;
+    if (rxStalled_) {
+        // DMA ran out of descriptors and stopped at the one that has just been released
+        rxStalled_ = false;
+        UHCI0.dma_in_link.restart = 1;
+    }
+}
+
+void IRAM_ATTR AtUartDmaTransport::txStartNext() {
+    if (txPending_ == 0) {
+        txActive_ = false;
+        return;
+    }
+    UHCI0.dma_out_link.addr = dmaLinkAddr(&txDesc_[txSend_]);
+    UHCI0.dma_out_link.start = 1;
+    txActive_ = true;
+}
+
+void IRAM_ATTR AtUartDmaTransport::isr(void* arg) {
+    auto self = static_cast<AtUartDmaTransport*>(arg);
+    self->isr();
+}
+
+void IRAM_ATTR AtUartDmaTransport::isr() {
+    const uint32_t status = UHCI0.int_st.val;
+    UHCI0.int_clr.val = status;
+
+    BaseType_t woken = pdFALSE;
+    if (status & (UHCI_IN_DSCR_ERR_INT_ST | UHCI_IN_DSCR_EMPTY_INT_ST)) {
+        rxStalled_ = true;
+    }
+    if (status & RX_INTERRUPTS) {
+        vTaskNotifyGiveFromISR(thread_, &woken);
+    }
+    if (status & TX_INTERRUPTS) {
+        portENTER_CRITICAL_ISR(&txLock_);
+        txSend_ = (txSend_ + 1) % TX_BLOCK_COUNT;
+        --txPending_;
+        txStartNext();
+        portEXIT_CRITICAL_ISR(&txLock_);
+        xSemaphoreGiveFromISR(txFree_, &woken);
+        xSemaphoreGiveFromISR(txDone_, &woken);
+    }
+    if (woken == pdTRUE) {
+        portYIELD_FROM_ISR();
+    }
+}
+
+void AtUartDmaTransport::run(void* arg) {
+    auto self = static_cast<AtUartDmaTransport*>(arg);
+    self->run();
+    vTaskDelete(nullptr);
+}
+
+void AtUartDmaTransport::run() {
+    LOG(INFO, "UART DMA transport thread started");
+
+    while (!exit_) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (exit_) {
+            break;
+        }
+
+        size_t len = 0;
+        {
+            std::lock_guard<std::mutex> lock(rxMutex_);
+            while (rxCompleted_ < RX_BLOCK_COUNT) {
+                const lldesc_t* desc = &rxDesc_[(rxHead_ + rxCompleted_) % RX_BLOCK_COUNT];
+                if (desc->owner) {
+                    break;
+                }
+                len += desc->length;
+                ++rxCompleted_;
+            }
+        }
+
+        if (len > 0) {
+            xSemaphoreGive(rxSem_);
+            notifyReceivedData(len, portMAX_DELAY);
+        }
+    }
+
+    LOG(INFO, "UART DMA transport thread exiting");
+
+    exit_ = false;
+}
+
+} } /* particle::ncp */
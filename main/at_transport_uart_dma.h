@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ARGON_NCP_FIRMWARE_AT_TRANSPORT_UART_DMA_H
+#define ARGON_NCP_FIRMWARE_AT_TRANSPORT_UART_DMA_H
+
+#include "at_transport.h"
+#include <atomic>
+#include <mutex>
+#include <driver/uart.h>
+#include <esp_intr_alloc.h>
+#include <rom/lldesc.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+namespace particle { namespace ncp {
+
+/*
+ * UART transport moving the data between the UART FIFOs and memory using the UHCI DMA engine.
+ *
+ * Received data is written by DMA into a circular chain of descriptors. A descriptor is
+ * completed either when it's full or when the line has been idle for a few characters,
+ * and is handed back to DMA once its contents have been read. When no descriptors are
+ * available the UART FIFO fills up and the hardware flow control stops the host.
+ *
+ * Transmitted data is copied into a pool of DMA buffers, which are sent one after another
+ * from the interrupt handler.
+ *
+ * Unlike AtUartTransport, this transport isn't covered by the host tests in test/: it programs
+ * the UHCI and UART registers directly, and test/stubs only emulates the UART driver API.
+ */
+class AtUartDmaTransport : public AtTransportBase {
+public:
+    struct Config {
+        uart_port_t uart;
+
+        int rxPin;
+        int txPin;
+        int rtsPin;
+        int ctsPin;
+
+        uart_config_t config;
+    };
+
+    AtUartDmaTransport(const Config& conf);
+    virtual ~AtUartDmaTransport();
+
+    virtual int readData(uint8_t* data, ssize_t len, unsigned int timeoutMsec = 1) override;
+    virtual int flushInput() override;
+    virtual int writeData(const uint8_t* data, size_t len) override;
+    virtual int getDataLength() const override;
+    virtual int waitWriteComplete(unsigned int timeoutMsec) override;
+
+    virtual int setBaudRate(unsigned baudRate) override;
+    virtual unsigned baudRate() const override;
+    virtual size_t bufferMemory() const override;
+
+protected:
+    virtual int initTransport() override;
+    virtual int destroyTransport() override;
+    virtual int postInitTransport() override;
+
+    virtual int statusChanged(esp_at_status_type status) override;
+    virtual int preDeepSleep() override;
+    virtual int preRestart() override;
+
+private:
+    static void run(void* arg);
+    void run();
+
+    int allocBuffers();
+    void freeBuffers();
+    void startDma();
+    void stopDma();
+
+    // Returns the number of bytes in the completed RX descriptors that hasn't been read yet
+    size_t rxAvailable() const;
+    void rxRelease(lldesc_t* desc);
+    // Starts the next pending TX descriptor, if any. Called with txLock_ held
+    void txStartNext();
+
+    static void isr(void* arg);
+    void isr();
+
+private:
+    Config conf_;
+    std::atomic_bool exit_;
+    std::atomic_bool started_;
+    TaskHandle_t thread_ = nullptr;
+    intr_handle_t intr_ = nullptr;
+
+    lldesc_t* rxDesc_ = nullptr;
+    uint8_t* rxBuf_ = nullptr;
+    unsigned rxHead_ = 0; // Next descriptor to read from
+    unsigned rxOffset_ = 0; // Read offset in the head descriptor
+    unsigned rxCompleted_ = 0; // Number of completed descriptors starting from the head one
+    std::atomic_bool rxStalled_;
+    mutable std::mutex rxMutex_;
+    SemaphoreHandle_t rxSem_ = nullptr;
+
+    lldesc_t* txDesc_ = nullptr;
+    uint8_t* txBuf_ = nullptr;
+    unsigned txFill_ = 0; // Next descriptor to fill
+    unsigned txSend_ = 0; // Next descriptor to start
+    unsigned txPending_ = 0; // Number of filled descriptors not yet sent
+    bool txActive_ = false;
+    portMUX_TYPE txLock_ = portMUX_INITIALIZER_UNLOCKED;
+    std::mutex txMutex_;
+    SemaphoreHandle_t txFree_ = nullptr; // Number of free TX descriptors
+    SemaphoreHandle_t txDone_ = nullptr;
+};
+
+} } /* particle::ncp */
+
+#endif /* ARGON_NCP_FIRMWARE_AT_TRANSPORT_UART_DMA_H */
@@ -0,0 +1,222 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "background_update.h"
+
+#include "windowed_receiver.h"
+#include "util/scope_guard.h"
+
+#include <algorithm>
+
+namespace particle { namespace ncp {
+
+namespace {
+
+const auto UPDATE_THREAD_STACK_SIZE = 4096;
+// Below the bridge thread, so that the transfer doesn't delay the bridged traffic
+const auto UPDATE_THREAD_PRIORITY = tskIDLE_PRIORITY + 2;
+
+// Enough for a complete window of packets of the sliding window protocol
+const size_t RECEIVE_BUFFER_SIZE = 10240;
+
+} // anonymous
+
+BackgroundUpdate::BackgroundUpdate()
+        : state_(STATE_IDLE),
+          received_(0),
+          error_(0),
+          cancelled_(false),
+          size_(0),
+          imageId_(),
+          hasImageId_(false),
+          hash_(),
+          hasHash_(false),
+          sink_(nullptr),
+          stream_(this),
+          thread_(nullptr),
+          dataSem_(nullptr) {
+}
+
+int BackgroundUpdate::init(OutputStream* sink) {
+    if (!dataSem_) {
+        dataSem_ = xSemaphoreCreateBinary();
+        CHECK_TRUE(dataSem_, RESULT_NO_MEMORY);
+    }
+    sink_ = sink;
+    return 0;
+}
+
+int BackgroundUpdate::start(size_t size, const char* imageId, const uint8_t* hash) {
+    CHECK_TRUE(sink_ && dataSem_, RESULT_INVALID_STATE);
+    CHECK_FALSE(isRunning() || thread_, RESULT_BUSY);
+    // The OTA partition contains the new firmware now
+    CHECK_FALSE(state_ == STATE_DONE, RESULT_INVALID_STATE);
+    CHECK_TRUE(size > 0, RESULT_INVALID_PARAM);
+    CHECK_TRUE(!imageId || strlen(imageId) <= UpdateManager::MAX_IMAGE_ID_LENGTH, RESULT_INVALID_PARAM);
+    {
+        std::lock_guard<std::mutex> lock(bufMutex_);
+        bufData_.reset(new(std::nothrow) uint8_t[RECEIVE_BUFFER_SIZE]);
+        CHECK_TRUE(bufData_, RESULT_NO_MEMORY);
+        buf_.init(bufData_.get(), RECEIVE_BUFFER_SIZE);
+    }
+    size_ = size;
+    hasImageId_ = imageId;
+    if (imageId) {
+        strcpy(imageId_, imageId);
+    }
+    hasHash_ = hash;
+    if (hash) {
+        memcpy(hash_, hash, sizeof(hash_));
+    }
+    received_ = 0;
+    error_ = 0;
+    cancelled_ = false;
+    xSemaphoreTake(dataSem_, 0);
+    state_ = STATE_RUNNING;
+    // The handle is set by the thread itself, it may finish before xTaskCreate() returns
+    if (xTaskCreate(run, "ncp_fwupd_t", UPDATE_THREAD_STACK_SIZE, this, UPDATE_THREAD_PRIORITY,
+            nullptr) != pdPASS) {
+        state_ = STATE_IDLE;
+        std::lock_guard<std::mutex> lock(bufMutex_);
+        bufData_.reset();
+        return RESULT_NO_MEMORY;
+    }
+    LOG(INFO, "Background update started; size: %u", (unsigned)size);
+    return 0;
+}
+
+void BackgroundUpdate::cancel() {
+    if (isRunning()) {
+        cancelled_ = true;
+        xSemaphoreGive(dataSem_);
+    }
+}
+
+void BackgroundUpdate::status(Status* status) const {
+    status->state = state_;
+    status->size = size_;
+    status->received = received_;
+    status->error = error_;
+}
+
+void BackgroundUpdate::receive(const uint8_t* data, size_t size) {
+    {
+        std::lock_guard<std::mutex> lock(bufMutex_);
+        if (!bufData_ || size == 0 || buf_.space() < (ssize_t)size) {
+            return;
+        }
+        buf_.put(data, size);
+    }
+    xSemaphoreGive(dataSem_);
+}
+
+void BackgroundUpdate::run(void* arg) {
+    const auto self = static_cast<BackgroundUpdate*>(arg);
+    self->thread_ = xTaskGetCurrentTaskHandle();
+    self->run();
+    vTaskDelete(nullptr);
+}
+
+void BackgroundUpdate::run() {
+    const int ret = runUpdate();
+    {
+        std::lock_guard<std::mutex> lock(bufMutex_);
+        bufData_.reset();
+    }
+    // Cleared before the final state is published: start() sees either the running state or no
+    // handle, never a handle of a thread that has already finished
+    thread_ = nullptr;
+    if (ret < 0) {
+        LOG(ERROR, "Background update failed: %d", ret);
+        error_ = ret;
+        state_ = STATE_FAILED;
+    } else {
+        LOG(INFO, "Background update finished, reset the NCP to apply it");
+        state_ = STATE_DONE;
+    }
+}
+
+int BackgroundUpdate::runUpdate() {
+    const auto updMgr = UpdateManager::instance();
+    OutputStream* updStrm = nullptr;
+    CHECK(updMgr->beginUpdate(size_, &updStrm, hasImageId_ ? imageId_ : nullptr, hasHash_ ? hash_ : nullptr));
+    NAMED_SCOPE_GUARD(cancelGuard, {
+        updMgr->cancelUpdate();
+    });
+    ProgressStream progStrm(updStrm, &received_);
+    WindowedReceiver receiver;
+    CHECK(receiver.init(&stream_, &progStrm, size_));
+    int ret = 0;
+    do {
+        ret = receiver.run();
+    } while (ret == WindowedReceiver::RUNNING);
+    CHECK(ret);
+    cancelGuard.dismiss();
+    CHECK(updMgr->finishUpdate());
+    return 0;
+}
+
+int BackgroundUpdate::ChannelStream::read(char* data, size_t size) {
+    CHECK_FALSE(update_->cancelled_, RESULT_CANCELLED);
+    std::lock_guard<std::mutex> lock(update_->bufMutex_);
+    const size_t n = std::min<size_t>(size, CHECK(update_->buf_.data()));
+    if (n == 0) {
+        return 0;
+    }
+    return update_->buf_.get((uint8_t*)data, n);
+}
+
+int BackgroundUpdate::ChannelStream::write(const char* data, size_t size) {
+    CHECK_FALSE(update_->cancelled_, RESULT_CANCELLED);
+    CHECK(update_->sink_->write(data, size));
+    return size;
+}
+
+int BackgroundUpdate::ChannelStream::waitEvent(unsigned flags, unsigned timeout) {
+    CHECK_FALSE(update_->cancelled_, RESULT_CANCELLED);
+    // Writes block until the data is passed to the muxer
+    unsigned events = flags & WRITABLE;
+    if (flags & READABLE) {
+        ssize_t n = 0;
+        {
+            std::lock_guard<std::mutex> lock(update_->bufMutex_);
+            n = update_->buf_.data();
+        }
+        if (n == 0 && !events && xSemaphoreTake(update_->dataSem_, timeout / portTICK_PERIOD_MS) == pdTRUE) {
+            CHECK_FALSE(update_->cancelled_, RESULT_CANCELLED);
+            std::lock_guard<std::mutex> lock(update_->bufMutex_);
+            n = update_->buf_.data();
+        }
+        if (n > 0) {
+            events |= READABLE;
+        }
+    }
+    return events;
+}
+
+int BackgroundUpdate::ProgressStream::write(const char* data, size_t size) {
+    const int ret = CHECK(dest_->write(data, size));
+    *count_ += ret;
+    return ret;
+}
+
+BackgroundUpdate* BackgroundUpdate::instance() {
+    static BackgroundUpdate update;
+    return &update;
+}
+
+} } /* particle::ncp */
@@ -0,0 +1,136 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "stream.h"
+#include "update_manager.h"
+#include "util/ringbuffer.h"
+
+#include <atomic>
+#include <mutex>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
+
+namespace particle { namespace ncp {
+
+// Receives a firmware image on a dedicated mux channel using the sliding window protocol (see
+// WindowedReceiver) while the other channels keep running. The update is applied to the OTA
+// partition in a separate thread, the new firmware is started on the next reset
+class BackgroundUpdate {
+public:
+    enum State {
+        STATE_IDLE = 0,
+        STATE_RUNNING = 1,
+        STATE_DONE = 2, // The new firmware will be started after a reset
+        STATE_FAILED = 3
+    };
+
+    struct Status {
+        State state;
+        size_t size; // Image size
+        size_t received; // Number of bytes passed to the update manager
+        int error; // Result code of a failed update
+    };
+
+    int init(OutputStream* sink);
+
+    int start(size_t size, const char* imageId = nullptr, const uint8_t* hash = nullptr);
+    void cancel();
+    bool isRunning() const;
+    // Returns true if the OTA partition is being written or contains an image that is pending a reset
+    bool isPartitionBusy() const;
+
+    void status(Status* status) const;
+
+    // Called by the muxer when data is received on the update channel. Never blocks, the data is
+    // dropped if the buffer is full and recovered by the transfer protocol
+    void receive(const uint8_t* data, size_t size);
+
+    static BackgroundUpdate* instance();
+
+private:
+    // Stream used by the file receiver
+    class ChannelStream: public Stream {
+    public:
+        explicit ChannelStream(BackgroundUpdate* update) :
+                update_(update) {
+        }
+
+        int read(char* data, size_t size) override;
+        int write(const char* data, size_t size) override;
+        int waitEvent(unsigned flags, unsigned timeout) override;
+
+    private:
+        BackgroundUpdate* update_;
+    };
+
+    // Counts the data written to the update manager
+    class ProgressStream: public OutputStream {
+    public:
+        ProgressStream(OutputStream* dest, std::atomic<size_t>* count) :
+                dest_(dest),
+                count_(count) {
+        }
+
+        int write(const char* data, size_t size) override;
+
+    private:
+        OutputStream* dest_;
+        std::atomic<size_t>* count_;
+    };
+
+    std::atomic<State> state_;
+    std::atomic<size_t> received_;
+    std::atomic<int> error_;
+    std::atomic_bool cancelled_;
+    size_t size_;
+    char imageId_[UpdateManager::MAX_IMAGE_ID_LENGTH + 1];
+    bool hasImageId_;
+    uint8_t hash_[UpdateManager::HASH_SIZE];
+    bool hasHash_;
+
+    OutputStream* sink_;
+    ChannelStream stream_;
+    // Set by the update thread while it's running, cleared before it publishes the final state
+    std::atomic<TaskHandle_t> thread_;
+    SemaphoreHandle_t dataSem_;
+
+    std::mutex bufMutex_;
+    particle::services::RingBuffer<uint8_t> buf_;
+    std::unique_ptr<uint8_t[]> bufData_;
+
+    BackgroundUpdate();
+
+    static void run(void* arg);
+    void run();
+    int runUpdate();
+};
+
+inline bool BackgroundUpdate::isRunning() const {
+    return state_ == STATE_RUNNING;
+}
+
+inline bool BackgroundUpdate::isPartitionBusy() const {
+    const State s = state_;
+    return s == STATE_RUNNING || s == STATE_DONE;
+}
+
+} } /* particle::ncp */
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bridge_latency.h"
+
+#include <algorithm>
+
+namespace particle { namespace ncp {
+
+namespace {
+
+// GSM07.10 framing overhead: 2 flags, address, control, up to 2 length bytes and FCS
+const size_t MUX_FRAME_OVERHEAD = 7;
+// 8N1
+const unsigned BITS_PER_BYTE = 10;
+
+unsigned bucketIndex(uint32_t us) {
+    const unsigned n = (us == 0) ? 0 : 32 - __builtin_clz(us);
+    return std::min(n, BridgeLatency::BUCKET_COUNT - 1);
+}
+
+} // anonymous
+
+BridgeLatency::BridgeLatency()
+        : enabled_(false),
+          linkRate_(0),
+          linkIdleTime_(0) {
+    reset();
+}
+
+void BridgeLatency::enable(bool enabled) {
+    enabled_ = enabled;
+}
+
+void BridgeLatency::reset() {
+    memset(hist_, 0, sizeof(hist_));
+}
+
+void BridgeLatency::setLinkRate(unsigned bitsPerSecond) {
+    linkRate_ = bitsPerSecond;
+}
+
+void BridgeLatency::recordHostFrame(Interface iface, const HostFrameTimes& t, size_t size) {
+    if (!isEnabled() || !t.hook) {
+        return;
+    }
+    add(DIRECTION_TO_HOST, iface, STAGE_HOOK_TO_QUEUE, t.hook, t.queue);
+    add(DIRECTION_TO_HOST, iface, STAGE_QUEUE_TO_DEQUEUE, t.queue, t.dequeue);
+    add(DIRECTION_TO_HOST, iface, STAGE_DEQUEUE_TO_MUX_WRITE, t.dequeue, t.muxWrite);
+    uint32_t end = t.muxWrite;
+    const unsigned rate = linkRate_;
+    if (rate) {
+        // The UART driver doesn't report when the data actually leaves the FIFO. Model the link
+        // as a queue drained at the configured bit rate: the frame starts transmitting once it's
+        // been dequeued and the previous frame is done. AT channel traffic and flow control stalls
+        // are not accounted for, so this is a lower bound
+        const uint64_t us = (uint64_t)(size + MUX_FRAME_OVERHEAD) * BITS_PER_BYTE * 1000000 / rate;
+        const uint32_t wireTicks = fromMicros(us);
+        const uint32_t start = ((int32_t)(linkIdleTime_ - t.dequeue) > 0) ? linkIdleTime_ : t.dequeue;
+        linkIdleTime_ = start + wireTicks;
+        if ((int32_t)(linkIdleTime_ - end) > 0) {
+            end = linkIdleTime_;
+        }
+        add(DIRECTION_TO_HOST, iface, STAGE_MUX_WRITE_TO_TX_DONE, t.muxWrite, end);
+    }
+    add(DIRECTION_TO_HOST, iface, STAGE_TOTAL, t.hook, end);
+}
+
+void BridgeLatency::recordWifiFrame(Interface iface, const WifiFrameTimes& t) {
+    if (!isEnabled() || !t.muxDecode) {
+        return;
+    }
+    add(DIRECTION_TO_WIFI, iface, STAGE_MUX_DECODE_TO_IPC, t.muxDecode, t.ipc);
+    add(DIRECTION_TO_WIFI, iface, STAGE_IPC_TO_WIFI_TX, t.ipc, t.wifiTx);
+    add(DIRECTION_TO_WIFI, iface, STAGE_TOTAL, t.muxDecode, t.wifiTx);
+}
+
+int BridgeLatency::histogram(Direction dir, Interface iface, Stage stage, Histogram* hist) const {
+    CHECK_TRUE(dir < DIRECTION_COUNT && iface < INTERFACE_COUNT && stage < STAGE_COUNT, RESULT_INVALID_PARAM);
+    *hist = hist_[dir][iface][stage];
+    return 0;
+}
+
+void BridgeLatency::add(Direction dir, Interface iface, Stage stage, uint32_t start, uint32_t end) {
+    // Each direction is only updated from a single thread
+    const uint32_t us = toMicros(end - start);
+    auto& h = hist_[dir][iface][stage];
+    ++h.count;
+    h.sum += us;
+    h.max = std::max(h.max, us);
+    ++h.buckets[bucketIndex(us)];
+}
+
+BridgeLatency* BridgeLatency::instance() {
+    static BridgeLatency latency;
+    return &latency;
+}
+
+} } /* particle::ncp */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+
+#include <atomic>
+
+#include <sdkconfig.h>
+#include <esp_timer.h>
+#include <xtensa/hal.h>
+
+namespace particle { namespace ncp {
+
+// Per-packet latency statistics of the WiFi <-> host bridge. Every bridged frame is timestamped
+// at each stage of the data path and the time spent between the stages is aggregated into
+// fixed-bucket log2 histograms, separately for each direction and interface.
+class BridgeLatency {
+public:
+    enum Direction {
+        DIRECTION_TO_HOST = 0, // WiFi -> host
+        DIRECTION_TO_WIFI = 1, // Host -> WiFi
+        DIRECTION_COUNT
+    };
+
+    enum Interface {
+        INTERFACE_STA = 0,
+        INTERFACE_AP = 1,
+        INTERFACE_COUNT
+    };
+
+    enum Stage {
+        // WiFi -> host
+        STAGE_HOOK_TO_QUEUE = 0, // Input hook entry -> posted to the input queue
+        STAGE_QUEUE_TO_DEQUEUE = 1, // Waiting in the input queue
+        STAGE_DEQUEUE_TO_MUX_WRITE = 2, // Mux framing and write to the transport
+        STAGE_MUX_WRITE_TO_TX_DONE = 3, // Serial link transmission (estimated from the link rate)
+        // Host -> WiFi
+        STAGE_MUX_DECODE_TO_IPC = 0, // Mux decode -> running in the TCP/IP thread
+        STAGE_IPC_TO_WIFI_TX = 1, // esp_wifi_internal_tx()
+        // Both directions
+        STAGE_TOTAL = 4,
+        STAGE_COUNT
+    };
+
+    static const unsigned BUCKET_COUNT = 20;
+
+    struct Histogram {
+        uint32_t count;
+        uint32_t max; // Microseconds
+        uint64_t sum; // Microseconds
+        // Bucket 0: < 1us, bucket N: [2^(N-1), 2^N) us, the last bucket also counts all larger values
+        uint32_t buckets[BUCKET_COUNT];
+    };
+
+    // Timestamps of a frame sent to the host
+    struct HostFrameTimes {
+        uint32_t hook;
+        uint32_t queue;
+        uint32_t dequeue;
+        uint32_t muxWrite;
+    };
+
+    // Timestamps of a frame sent to WiFi
+    struct WifiFrameTimes {
+        uint32_t muxDecode;
+        uint32_t ipc;
+        uint32_t wifiTx;
+    };
+
+    void enable(bool enabled);
+    bool isEnabled() const;
+    void reset();
+
+    // Bit rate of the host link, used to estimate the serial transmission time. 0 - unknown
+    void setLinkRate(unsigned bitsPerSecond);
+
+    // Returns a timestamp in internal units or 0 if statistics are disabled
+    uint32_t now() const;
+
+    void recordHostFrame(Interface iface, const HostFrameTimes& t, size_t size);
+    void recordWifiFrame(Interface iface, const WifiFrameTimes& t);
+
+    int histogram(Direction dir, Interface iface, Stage stage, Histogram* hist) const;
+
+    static BridgeLatency* instance();
+
+private:
+    std::atomic_bool enabled_;
+    std::atomic<unsigned> linkRate_;
+    uint32_t linkIdleTime_; // Estimated time when the serial link finishes the previous frame
+    Histogram hist_[DIRECTION_COUNT][INTERFACE_COUNT][STAGE_COUNT];
+
+    BridgeLatency();
+
+    void add(Direction dir, Interface iface, Stage stage, uint32_t start, uint32_t end);
+
+    static uint32_t timestamp();
+    static uint32_t toMicros(uint32_t ticks);
+    static uint32_t fromMicros(uint32_t us);
+};
+
+inline bool BridgeLatency::isEnabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+inline uint32_t BridgeLatency::now() const {
+    if (!isEnabled()) {
+        return 0;
+    }
+    return timestamp();
+}
+
+inline uint32_t BridgeLatency::timestamp() {
+#if CONFIG_FREERTOS_UNICORE && !CONFIG_PM_ENABLE
+    // Single core with a fixed CPU frequency: the cycle counter is monotonic
+    return xthal_get_ccount();
+#else
+    // The cycle counter is per-core and its rate changes with DFS
+    return (uint32_t)esp_timer_get_time();
+#endif
+}
+
+inline uint32_t BridgeLatency::toMicros(uint32_t ticks) {
+#if CONFIG_FREERTOS_UNICORE && !CONFIG_PM_ENABLE
+    return ticks / CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+#else
+    return ticks;
+#endif
+}
+
+inline uint32_t BridgeLatency::fromMicros(uint32_t us) {
+#if CONFIG_FREERTOS_UNICORE && !CONFIG_PM_ENABLE
+    return us * CONFIG_ESP32_DEFAULT_CPU_FREQ_MHZ;
+#else
+    return us;
+#endif
+}
+
+} } /* particle::ncp */
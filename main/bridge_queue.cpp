@@ -0,0 +1,187 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "bridge_queue.h"
+
+namespace particle { namespace ncp {
+
+namespace {
+
+// Queue sizes, indexed by AccessCategory
+const UBaseType_t QUEUE_SIZE[] = {
+    8, // Voice
+    8, // Video
+    20, // Best effort
+    8 // Background
+};
+
+// Number of items dequeued in turn from the video, best effort and background queues when the
+// voice queue is empty
+const unsigned QUEUE_WEIGHT[] = {
+    0, // Voice (strict priority)
+    4, // Video
+    2, // Best effort
+    1 // Background
+};
+
+// Expedited Forwarding and Voice Admit, used for voice traffic (RFC 8325)
+const unsigned DSCP_EF = 46;
+const unsigned DSCP_VOICE_ADMIT = 44;
+// User priority of voice traffic
+const unsigned UP_VOICE = 6;
+
+const uint16_t ETHERTYPE_IPV4 = 0x0800;
+const uint16_t ETHERTYPE_IPV6 = 0x86dd;
+const uint16_t ETHERTYPE_VLAN = 0x8100;
+const size_t ETHERNET_HEADER_SIZE = 14;
+
+// The user priority is normally given by the precedence bits of the DSCP, but the voice
+// codepoints have precedence 5, which would map them to the video access category
+AccessCategory dscpToAc(unsigned dscp) {
+    if (dscp == DSCP_EF || dscp == DSCP_VOICE_ADMIT) {
+        return userPriorityToAc(UP_VOICE);
+    }
+    return userPriorityToAc(dscp >> 3);
+}
+
+} // anonymous
+
+AccessCategory userPriorityToAc(unsigned up) {
+    switch (up & 0x07) {
+        case 1:
+        case 2:
+            return AC_BK;
+        case 4:
+        case 5:
+            return AC_VI;
+        case 6:
+        case 7:
+            return AC_VO;
+        default: // 0, 3
+            return AC_BE;
+    }
+}
+
+// By the time a frame reaches the input hook the 802.11 QoS header has been replaced with
+// an Ethernet header, so the user priority is taken from the 802.1Q tag if present, or from
+// the IP DSCP field
+AccessCategory classifyFrame(const uint8_t* d, size_t size) {
+    if (size < ETHERNET_HEADER_SIZE + 2) {
+        return AC_BE;
+    }
+    const uint16_t etherType = (d[12] << 8) | d[13];
+    switch (etherType) {
+        case ETHERTYPE_VLAN: {
+            // PCP
+            return userPriorityToAc(d[14] >> 5);
+        }
+        case ETHERTYPE_IPV4: {
+            // DSCP is the upper 6 bits of the TOS field
+            const unsigned dscp = d[ETHERNET_HEADER_SIZE + 1] >> 2;
+            return dscpToAc(dscp);
+        }
+        case ETHERTYPE_IPV6: {
+            // DSCP is the upper 6 bits of the traffic class field
+            const unsigned tc = ((d[ETHERNET_HEADER_SIZE] & 0x0f) << 4) | (d[ETHERNET_HEADER_SIZE + 1] >> 4);
+            return dscpToAc(tc >> 2);
+        }
+        default: {
+            return AC_BE;
+        }
+    }
+}
+
+BridgeInputQueue::BridgeInputQueue()
+        : queues_(),
+          count_(nullptr),
+          itemSize_(0),
+          credit_(),
+          current_(AC_VI) {
+}
+
+BridgeInputQueue::~BridgeInputQueue() {
+    for (unsigned ac = 0; ac < AC_COUNT; ++ac) {
+        if (queues_[ac]) {
+            vQueueDelete(queues_[ac]);
+        }
+    }
+    if (count_) {
+        vSemaphoreDelete(count_);
+    }
+}
+
+int BridgeInputQueue::init(size_t itemSize) {
+    CHECK_FALSE(count_, RESULT_INVALID_STATE);
+    UBaseType_t total = 0;
+    for (unsigned ac = 0; ac < AC_COUNT; ++ac) {
+        queues_[ac] = xQueueCreate(QUEUE_SIZE[ac], itemSize);
+        CHECK_TRUE(queues_[ac], RESULT_NO_MEMORY);
+        total += QUEUE_SIZE[ac];
+    }
+    itemSize_ = itemSize;
+    count_ = xSemaphoreCreateCounting(total, 0);
+    CHECK_TRUE(count_, RESULT_NO_MEMORY);
+    return 0;
+}
+
+bool BridgeInputQueue::post(AccessCategory ac, const void* item) {
+    if (xQueueSendToBack(queues_[ac], item, 0) != pdTRUE) {
+        return false;
+    }
+    xSemaphoreGive(count_);
+    return true;
+}
+
+bool BridgeInputQueue::receive(void* item, unsigned quantum) {
+    if (xSemaphoreTake(count_, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    if (xQueueReceive(queues_[AC_VO], item, 0) == pdTRUE) {
+        return true;
+    }
+    // The semaphore guarantees that at least one of the queues is not empty
+    for (;;) {
+        const unsigned ac = current_;
+        if (credit_[ac] > 0 && xQueueReceive(queues_[ac], item, 0) == pdTRUE) {
+            --credit_[ac];
+            return true;
+        }
+        // Queue is empty or its share has been used up, move on to the next one. The shares are
+        // renewed when a new round starts, so that the queues are always served in the same order
+        credit_[ac] = 0;
+        if (ac + 1 < AC_COUNT) {
+            current_ = ac + 1;
+        } else {
+            current_ = AC_VI;
+            for (unsigned i = AC_VI; i < AC_COUNT; ++i) {
+                credit_[i] = QUEUE_WEIGHT[i] * quantum;
+            }
+        }
+    }
+}
+
+size_t BridgeInputQueue::bufferMemory() const {
+    size_t size = 0;
+    for (unsigned ac = 0; ac < AC_COUNT; ++ac) {
+        if (queues_[ac]) {
+            size += QUEUE_SIZE[ac] * itemSize_;
+        }
+    }
+    return size;
+}
+
+} } /* particle::ncp */
@@ -0,0 +1,75 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+
+namespace particle { namespace ncp {
+
+// WMM access categories, in the order of decreasing priority
+enum AccessCategory {
+    AC_VO = 0,
+    AC_VI = 1,
+    AC_BE = 2,
+    AC_BK = 3,
+    AC_COUNT
+};
+
+// Maps an 802.1D user priority to a WMM access category
+AccessCategory userPriorityToAc(unsigned up);
+
+// Returns the access category of an Ethernet frame. `size` is the size of the contiguous data
+// at the beginning of the frame
+AccessCategory classifyFrame(const uint8_t* data, size_t size);
+
+// Input queues of the WiFi -> host bridge, one per access category. The voice queue is served
+// with strict priority, the other queues are served in a weighted round-robin order
+class BridgeInputQueue {
+public:
+    BridgeInputQueue();
+    ~BridgeInputQueue();
+
+    int init(size_t itemSize);
+    bool isInitialized() const;
+
+    // Never blocks. Returns false if the queue of the access category is full
+    bool post(AccessCategory ac, const void* item);
+    // Blocks until an item is available. The queue weights are multiplied by `quantum`
+    bool receive(void* item, unsigned quantum);
+
+    // Memory used by the queues
+    size_t bufferMemory() const;
+
+private:
+    QueueHandle_t queues_[AC_COUNT];
+    // Total number of items in all queues
+    SemaphoreHandle_t count_;
+    size_t itemSize_;
+    unsigned credit_[AC_COUNT];
+    unsigned current_;
+};
+
+inline bool BridgeInputQueue::isInitialized() const {
+    return count_;
+}
+
+} } /* particle::ncp */
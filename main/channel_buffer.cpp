@@ -0,0 +1,100 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "channel_buffer.h"
+
+#include <algorithm>
+#include <new>
+
+namespace particle { namespace ncp {
+
+ChannelBuffer::ChannelBuffer(uint8_t* buf, size_t size)
+        : buf_(buf, size),
+          defaultBuf_(buf),
+          defaultSize_(size),
+          droppedFrames_(0) {
+}
+
+int ChannelBuffer::reserve(size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size = std::max(size, defaultSize_);
+    if (size == buf_.size()) {
+        return 0;
+    }
+    const size_t pending = buf_.data();
+    CHECK_TRUE(pending <= size, RESULT_INVALID_STATE);
+    std::unique_ptr<uint8_t[]> reserved;
+    uint8_t* b = defaultBuf_;
+    if (size > defaultSize_) {
+        reserved.reset(new(std::nothrow) uint8_t[size]);
+        CHECK_TRUE(reserved, RESULT_NO_MEMORY);
+        b = reserved.get();
+    }
+    // Move the buffered data to the new buffer
+    std::unique_ptr<uint8_t[]> pendingData;
+    if (pending > 0) {
+        pendingData.reset(new(std::nothrow) uint8_t[pending]);
+        CHECK_TRUE(pendingData, RESULT_NO_MEMORY);
+        buf_.get(pendingData.get(), pending);
+    }
+    buf_.init(b, size);
+    if (pending > 0) {
+        buf_.put(pendingData.get(), pending);
+    }
+    reserved_ = std::move(reserved);
+    return 0;
+}
+
+int ChannelBuffer::put(const uint8_t* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (buf_.space() < (ssize_t)size) {
+        ++droppedFrames_;
+        return RESULT_TOO_LARGE_DATA;
+    }
+    return buf_.put(data, size);
+}
+
+int ChannelBuffer::get(uint8_t* data, size_t size) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    size = std::min<size_t>(size, buf_.data());
+    if (size == 0) {
+        return 0;
+    }
+    return buf_.get(data, size);
+}
+
+int ChannelBuffer::data() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buf_.data();
+}
+
+void ChannelBuffer::reset() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    buf_.reset();
+}
+
+size_t ChannelBuffer::capacity() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return buf_.size();
+}
+
+size_t ChannelBuffer::droppedFrames() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return droppedFrames_;
+}
+
+} } /* particle::ncp */
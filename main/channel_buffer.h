@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "util/ringbuffer.h"
+
+#include <memory>
+#include <mutex>
+
+namespace particle { namespace ncp {
+
+// Receive buffer of a mux channel. The muxer hands over complete frames, a frame that doesn't fit
+// is rejected as a whole. The buffer can be enlarged temporarily for protocols that keep more data
+// in flight than the default buffer can hold
+class ChannelBuffer {
+public:
+    // `buf` is used unless a larger buffer is reserved
+    ChannelBuffer(uint8_t* buf, size_t size);
+
+    // Makes the buffer hold at least `size` bytes, 0 restores the default buffer. The buffered
+    // data is preserved
+    int reserve(size_t size);
+
+    // Returns RESULT_TOO_LARGE_DATA if there's not enough space for the whole frame
+    int put(const uint8_t* data, size_t size);
+    int get(uint8_t* data, size_t size);
+    int data() const;
+    void reset();
+
+    size_t capacity() const;
+    // Number of frames rejected so far
+    size_t droppedFrames() const;
+
+private:
+    services::RingBuffer<uint8_t> buf_;
+    uint8_t* defaultBuf_;
+    size_t defaultSize_;
+    std::unique_ptr<uint8_t[]> reserved_;
+    size_t droppedFrames_;
+    mutable std::mutex mutex_;
+};
+
+} } /* particle::ncp */
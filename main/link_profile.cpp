@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "link_profile.h"
+
+#include "at_transport_mux.h"
+#include "platforms.h"
+
+#include <algorithm>
+
+namespace particle { namespace ncp {
+
+namespace {
+
+#if PLATFORM_ID == PLATFORM_ARGON
+// Above the default priorities of the UART, muxer and bridge threads, below lwIP and WiFi
+const UBaseType_t LATENCY_THREAD_PRIORITY = tskIDLE_PRIORITY + 5;
+#elif PLATFORM_ID == PLATFORM_TRACKER
+const UBaseType_t LATENCY_THREAD_PRIORITY = tskIDLE_PRIORITY + 9;
+#else
+#error "UNKOWN PLATFORM!"
+#endif
+
+// Latency profile: report every byte as soon as possible
+const unsigned LATENCY_RXFIFO_FULL_THRESH = 32;
+const unsigned LATENCY_RX_TIMEOUT_THRESH = 2;
+const unsigned LATENCY_BRIDGE_QUANTUM = 1;
+
+// Throughput profile: fewer interrupts and wakeups, longer runs per bridge queue
+const unsigned THROUGHPUT_RX_TIMEOUT_THRESH = 10;
+const size_t THROUGHPUT_COALESCE_BYTES = 1024;
+const unsigned THROUGHPUT_COALESCE_TIME_MS = 5;
+const unsigned THROUGHPUT_BRIDGE_QUANTUM = 4;
+
+} // anonymous
+
+LinkProfile::LinkProfile()
+        : uart_(nullptr),
+          mux_(nullptr),
+          bridgeThread_(nullptr),
+          defaults_(),
+          current_(PROFILE_DEFAULT),
+          bridgeQuantum_(1) {
+}
+
+int LinkProfile::init(AtUartTransport* uart, AtMuxTransport* mux, TaskHandle_t bridgeThread) {
+    uart_ = uart;
+    mux_ = mux;
+    bridgeThread_ = bridgeThread;
+    Settings& s = defaults_;
+    if (uart_) {
+        s.uartPriority = uart_->threadPriority();
+        uart_->thresholds(&s.thresholds);
+        s.autoTune = uart_->autoTune();
+        uart_->coalescing(&s.coalescing);
+    }
+    if (mux_) {
+        s.muxerPriority = mux_->muxerPriority();
+    }
+    if (bridgeThread_) {
+        s.bridgePriority = uxTaskPriorityGet(bridgeThread_);
+    }
+    s.bridgeQuantum = 1;
+    current_ = PROFILE_DEFAULT;
+    bridgeQuantum_ = s.bridgeQuantum;
+    return 0;
+}
+
+int LinkProfile::settings(Profile profile, Settings* settings) const {
+    Settings s = defaults_;
+    switch (profile) {
+        case PROFILE_DEFAULT: {
+            break;
+        }
+        case PROFILE_LATENCY: {
+            s.uartPriority = std::max(s.uartPriority, LATENCY_THREAD_PRIORITY);
+            s.muxerPriority = std::max(s.muxerPriority, LATENCY_THREAD_PRIORITY);
+            s.bridgePriority = std::max(s.bridgePriority, LATENCY_THREAD_PRIORITY);
+            s.thresholds.rxFifoFull = std::min(s.thresholds.rxFifoFull, LATENCY_RXFIFO_FULL_THRESH);
+            s.thresholds.rxTimeout = LATENCY_RX_TIMEOUT_THRESH;
+            s.autoTune = false;
+            s.coalescing.bytes = 0;
+            s.bridgeQuantum = LATENCY_BRIDGE_QUANTUM;
+            break;
+        }
+        case PROFILE_THROUGHPUT: {
+            // The maximum FIFO full threshold is limited by the flow control threshold
+            s.thresholds.rxFifoFull = 0;
+            s.thresholds.rxTimeout = THROUGHPUT_RX_TIMEOUT_THRESH;
+            s.autoTune = false;
+            s.coalescing.bytes = THROUGHPUT_COALESCE_BYTES;
+            s.coalescing.timeMs = THROUGHPUT_COALESCE_TIME_MS;
+            s.bridgeQuantum = THROUGHPUT_BRIDGE_QUANTUM;
+            break;
+        }
+        default: {
+            return RESULT_INVALID_PARAM;
+        }
+    }
+    *settings = s;
+    return 0;
+}
+
+int LinkProfile::apply(Profile profile) {
+    Settings s = {};
+    CHECK(settings(profile, &s));
+    if (uart_) {
+        if (!s.thresholds.rxFifoFull) {
+            s.thresholds.rxFifoFull = uart_->maxRxFifoFullThreshold();
+        }
+        CHECK(uart_->setThresholds(s.thresholds));
+        CHECK(uart_->setCoalescing(s.coalescing));
+        uart_->setAutoTune(s.autoTune);
+        uart_->setThreadPriority(s.uartPriority);
+    }
+    if (mux_) {
+        mux_->setMuxerPriority(s.muxerPriority);
+    }
+    if (bridgeThread_) {
+        vTaskPrioritySet(bridgeThread_, s.bridgePriority);
+    }
+    bridgeQuantum_ = s.bridgeQuantum;
+    current_ = profile;
+    LOG(INFO, "Link profile: %d", (int)profile);
+    return 0;
+}
+
+LinkProfile* LinkProfile::instance() {
+    static LinkProfile profile;
+    return &profile;
+}
+
+} } /* particle::ncp */
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "at_transport_uart.h"
+
+#include <atomic>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+namespace particle { namespace ncp {
+
+class AtMuxTransport;
+
+// Named sets of host link settings: thread priorities, UART RX thresholds and notification
+// coalescing, and the number of packets the bridge forwards from a queue in one turn
+class LinkProfile {
+public:
+    enum Profile {
+        PROFILE_DEFAULT = 0, // Build time settings
+        PROFILE_LATENCY = 1, // Interactive traffic: small AT exchanges
+        PROFILE_THROUGHPUT = 2, // Bulk transfers
+        PROFILE_COUNT
+    };
+
+    struct Settings {
+        UBaseType_t uartPriority;
+        UBaseType_t muxerPriority;
+        UBaseType_t bridgePriority;
+        AtUartTransport::Thresholds thresholds;
+        bool autoTune;
+        AtUartTransport::Coalescing coalescing;
+        unsigned bridgeQuantum;
+    };
+
+    // Any of the arguments can be null if not applicable to the platform. The current
+    // settings become the default profile
+    int init(AtUartTransport* uart, AtMuxTransport* mux, TaskHandle_t bridgeThread);
+
+    int apply(Profile profile);
+    Profile current() const;
+
+    int settings(Profile profile, Settings* settings) const;
+
+    // Multiplier for the bridge input queue weights
+    unsigned bridgeQuantum() const;
+
+    static LinkProfile* instance();
+
+private:
+    AtUartTransport* uart_;
+    AtMuxTransport* mux_;
+    TaskHandle_t bridgeThread_;
+    Settings defaults_;
+    std::atomic<Profile> current_;
+    std::atomic<unsigned> bridgeQuantum_;
+
+    LinkProfile();
+};
+
+inline LinkProfile::Profile LinkProfile::current() const {
+    return current_;
+}
+
+inline unsigned LinkProfile::bridgeQuantum() const {
+    return bridgeQuantum_.load(std::memory_order_relaxed);
+}
+
+} } /* particle::ncp */
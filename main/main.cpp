@@ -25,10 +25,16 @@
 #include "version.h"
 #include "stream.h"
 #include "at_transport_mux.h"
+#include "packet_capture.h"
+#include "bridge_latency.h"
+#include "bridge_queue.h"
+#include "link_profile.h"
+#include "at_transport_uart.h"
 #include <memory>
 #include <lwip/pbuf.h>
 #include <lwip/netif.h>
 #include <freertos/queue.h>
+#include <freertos/semphr.h>
 #include "nvs_flash.h"
 #include "esp_event_loop.h"
 #include "esp_wifi.h"
@@ -41,7 +47,9 @@ extern "C" {
 }
 
 #if PLATFORM_ID == PLATFORM_ARGON
-#include "at_transport_uart.h"
+#if CONFIG_NCP_UART_DMA_TRANSPORT
+#include "at_transport_uart_dma.h"
+#endif
 #elif PLATFORM_ID == PLATFORM_TRACKER
 #include "at_transport_sdio.h"
 #else
@@ -65,11 +73,15 @@ const auto UART_CONF_DATA_BITS = UART_DATA_8_BITS;
 const auto UART_CONF_PARITY = UART_PARITY_DISABLE;
 const auto UART_CONF_STOP_BITS = UART_STOP_BITS_1;
 const auto UART_CONF_FLOW_CONTROL = UART_HW_FLOWCTRL_CTS_RTS;
-/* magick number */
-const auto UART_CONF_RX_FLOW_CTRL_THRESH = 122;
+const auto UART_CONF_RX_FLOW_CTRL_THRESH = CONFIG_NCP_UART_RX_FLOW_CTRL_THRESH;
+
+#if CONFIG_NCP_UART_DMA_TRANSPORT
+using UartTransport = particle::ncp::AtUartDmaTransport;
+#else
+using UartTransport = particle::ncp::AtUartTransport;
+#endif
 #endif
 
-const auto NETWORK_INPUT_PACKET_QUEUE_SIZE = 20;
 const auto NETWORK_INPUT_PRIORITY = tskIDLE_PRIORITY + 3;
 
 using namespace particle;
@@ -77,29 +89,40 @@ using namespace particle::util;
 using namespace particle::ncp;
 
 std::unique_ptr<AtMuxTransport> g_muxTransport;
+// Set when the host link uses the UART driver based transport
+AtUartTransport* g_uartTransport = nullptr;
+#if PLATFORM_ID == PLATFORM_TRACKER
+AtSdioTransport* g_sdioTransport = nullptr;
+#endif
 
 namespace {
 
 struct InputPacket {
     pbuf* p;
     esp_interface_t iface;
+    uint32_t hookTime;
+    uint32_t queueTime;
 };
 
-QueueHandle_t s_inputPacketQueue = nullptr;
+BridgeInputQueue s_inputQueue;
+
 } // anonymous
 
 int ESP_IRAM_ATTR particle_ethernet_input_hook(struct netif* inp, struct pbuf* p) {
-    if (!g_muxTransport || !s_inputPacketQueue) {
+    if (!g_muxTransport || !s_inputQueue.isInitialized()) {
         return 0;
     }
+    const auto latency = BridgeLatency::instance();
+    const uint32_t hookTime = latency->now();
     auto iface = tcpip_adapter_get_esp_if(inp);
     auto muxer = g_muxTransport->getMuxer();
 
     if (muxer->isRunning() && (iface == ESP_IF_WIFI_STA || iface == ESP_IF_WIFI_AP)) {
-        InputPacket pk = {p, iface};
         pbuf_ref(p);
-        if (xQueueSendToBack(s_inputPacketQueue, &pk, 0) != pdTRUE) {
-            LOG(WARN, "Failed to post packet to queue, consider increasing NETWORK_INPUT_PACKET_QUEUE_SIZE");
+        const auto ac = classifyFrame((const uint8_t*)p->payload, p->len);
+        InputPacket pk = {p, iface, hookTime, latency->now()};
+        if (!s_inputQueue.post(ac, &pk)) {
+            LOG(WARN, "Failed to post packet to queue %d, consider increasing the bridge queue size", (int)ac);
             pbuf_free(p);
         }
         // Eat packet
@@ -113,26 +136,54 @@ int ESP_IRAM_ATTR particle_ethernet_input_hook(struct netif* inp, struct pbuf* p
 int atInitialize() {
 #if PLATFORM_ID == PLATFORM_ARGON
     /* UART transport configuration */
-    AtUartTransport::Config conf = {};
+    UartTransport::Config conf = {};
     conf.uart = UART_CONF_INSTANCE;
     conf.txPin = UART_CONF_TX_PIN;
     conf.rxPin = UART_CONF_RX_PIN;
     conf.rtsPin = UART_CONF_RTS_PIN;
     conf.ctsPin = UART_CONF_CTS_PIN;
 
-    conf.config.baud_rate = UART_CONF_BAUD_RATE;
+    uint32_t baudRate = UART_CONF_BAUD_RATE;
+    if (nvsReadSetting(NVS_SETTING_BAUD_RATE, &baudRate) == 0) {
+        LOG(INFO, "Using stored baud rate: %u", (unsigned)baudRate);
+    }
+    conf.config.baud_rate = baudRate;
     conf.config.data_bits = UART_CONF_DATA_BITS;
     conf.config.parity = UART_CONF_PARITY;
     conf.config.stop_bits = UART_CONF_STOP_BITS;
     conf.config.flow_ctrl = UART_CONF_FLOW_CONTROL;
     conf.config.rx_flow_ctrl_thresh = UART_CONF_RX_FLOW_CTRL_THRESH;
+#if !CONFIG_NCP_UART_DMA_TRANSPORT
+    conf.rxBufferSize = CONFIG_NCP_UART_RX_BUFFER_SIZE;
+    conf.txBufferSize = CONFIG_NCP_UART_TX_BUFFER_SIZE;
+    conf.eventQueueSize = CONFIG_NCP_UART_EVENT_QUEUE_SIZE;
+#if CONFIG_NCP_UART_AUTO_TUNE
+    conf.autoTune = true;
+#endif
+    conf.coalesceBytes = CONFIG_NCP_UART_RX_COALESCE_BYTES;
+    conf.coalesceTimeMs = CONFIG_NCP_UART_RX_COALESCE_TIME;
+#endif
 
     /* Initialize transport first */
-    static AtUartTransport transport(conf);
+    static UartTransport transport(conf);
     CHECK(transport.init());
+    BridgeLatency::instance()->setLinkRate(baudRate);
+#if !CONFIG_NCP_UART_DMA_TRANSPORT
+    g_uartTransport = &transport;
+#endif
 #elif PLATFORM_ID == PLATFORM_TRACKER
-    static AtSdioTransport transport;
+    auto conf = AtSdioTransport::defaultConfig();
+    uint32_t val = 0;
+    if (nvsReadSetting(NVS_SETTING_SDIO_BUFFER_NUM, &val) == 0) {
+        conf.bufferNum = val;
+    }
+    if (nvsReadSetting(NVS_SETTING_SDIO_QUEUE_SIZE, &val) == 0) {
+        conf.queueSize = val;
+    }
+    // The transport falls back to the default geometry if the stored one is invalid
+    static AtSdioTransport transport(conf);
     CHECK(transport.init());
+    g_sdioTransport = &transport;
 #endif
     g_muxTransport.reset(new (std::nothrow) AtMuxTransport(&transport));
     CHECK_TRUE(g_muxTransport, RESULT_NO_MEMORY);
@@ -168,9 +219,13 @@ int miscInitialize() {
     return 0;
 }
 
+// Memory used by the bridge input queues. The queued pbufs are allocated by lwIP
+size_t bridgeBufferMemory() {
+    return s_inputQueue.bufferMemory();
+}
+
 int networkInitialize() {
-    s_inputPacketQueue = xQueueCreate(NETWORK_INPUT_PACKET_QUEUE_SIZE, sizeof(InputPacket));
-    CHECK_TRUE(s_inputPacketQueue, RESULT_NO_MEMORY);
+    CHECK(s_inputQueue.init(sizeof(InputPacket)));
     return 0;
 }
 
@@ -207,19 +262,34 @@ void app_main(void) {
 
     vTaskPrioritySet(nullptr, NETWORK_INPUT_PRIORITY);
 
+    const auto profile = LinkProfile::instance();
+    profile->init(g_uartTransport, g_muxTransport.get(), xTaskGetCurrentTaskHandle());
+    if (CONFIG_NCP_LINK_PROFILE != LinkProfile::PROFILE_DEFAULT) {
+        profile->apply((LinkProfile::Profile)CONFIG_NCP_LINK_PROFILE);
+    }
+
+    const auto latency = BridgeLatency::instance();
+
     while(true) {
         InputPacket pk = {};
-        auto r = xQueueReceive(s_inputPacketQueue, &pk, portMAX_DELAY);
-        if (r == pdTRUE) {
-            auto muxer = g_muxTransport->getMuxer();
+        if (s_inputQueue.receive(&pk, profile->bridgeQuantum())) {
+            BridgeLatency::HostFrameTimes times = {pk.hookTime, pk.queueTime, latency->now(), 0};
 
             switch (pk.iface) {
                 case ESP_IF_WIFI_STA: {
-                    muxer->writeChannel(MUX_CHANNEL_STATION, (const uint8_t*)pk.p->payload, pk.p->tot_len);
+                    PacketCapture::instance()->capture(PacketCapture::INTERFACE_STA, PacketCapture::DIRECTION_IN,
+                            (const uint8_t*)pk.p->payload, pk.p->tot_len);
+                    g_muxTransport->writeChannel(MUX_CHANNEL_STATION, (const uint8_t*)pk.p->payload, pk.p->tot_len);
+                    times.muxWrite = latency->now();
+                    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, times, pk.p->tot_len);
                     break;
                 }
                 case ESP_IF_WIFI_AP: {
-                    muxer->writeChannel(MUX_CHANNEL_SOFTAP, (const uint8_t*)pk.p->payload, pk.p->tot_len);
+                    PacketCapture::instance()->capture(PacketCapture::INTERFACE_AP, PacketCapture::DIRECTION_IN,
+                            (const uint8_t*)pk.p->payload, pk.p->tot_len);
+                    g_muxTransport->writeChannel(MUX_CHANNEL_SOFTAP, (const uint8_t*)pk.p->payload, pk.p->tot_len);
+                    times.muxWrite = latency->now();
+                    latency->recordHostFrame(BridgeLatency::INTERFACE_AP, times, pk.p->tot_len);
                     break;
                 }
                 default: {
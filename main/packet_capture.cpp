@@ -0,0 +1,339 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "packet_capture.h"
+
+#include "stream.h"
+
+#include <esp_timer.h>
+
+#include <algorithm>
+
+namespace particle { namespace ncp {
+
+namespace {
+
+const auto PCAP_THREAD_STACK_SIZE = 3072;
+const auto PCAP_THREAD_PRIORITY = tskIDLE_PRIORITY + 1;
+
+const size_t ETHERNET_HEADER_SIZE = 14;
+const size_t MAX_SNAP_LEN = 1536;
+// Maximum number of bytes passed to the sink in a single write
+const size_t MAX_CHUNK_SIZE = 512;
+
+// pcapng block types
+const uint32_t PCAPNG_SECTION_HEADER_BLOCK = 0x0a0d0d0a;
+const uint32_t PCAPNG_INTERFACE_DESCRIPTION_BLOCK = 0x00000001;
+const uint32_t PCAPNG_ENHANCED_PACKET_BLOCK = 0x00000006;
+const uint32_t PCAPNG_BYTE_ORDER_MAGIC = 0x1a2b3c4d;
+const uint16_t PCAPNG_LINKTYPE_ETHERNET = 1;
+
+// pcapng option codes
+const uint16_t PCAPNG_OPT_ENDOFOPT = 0;
+const uint16_t PCAPNG_OPT_IF_NAME = 2;
+const uint16_t PCAPNG_OPT_IF_TSRESOL = 9;
+const uint16_t PCAPNG_OPT_EPB_FLAGS = 2;
+
+// Timestamps are in microseconds
+const uint8_t PCAPNG_TSRESOL_USEC = 6;
+
+struct __attribute__((packed)) SectionHeaderBlock {
+    uint32_t type;
+    uint32_t length;
+    uint32_t byteOrderMagic;
+    uint16_t majorVersion;
+    uint16_t minorVersion;
+    int64_t sectionLength;
+    uint32_t trailerLength;
+};
+
+struct __attribute__((packed)) InterfaceDescriptionBlock {
+    uint32_t type;
+    uint32_t length;
+    uint16_t linkType;
+    uint16_t reserved;
+    uint32_t snapLen;
+    uint16_t nameCode; // if_name
+    uint16_t nameLength;
+    char name[4];
+    uint16_t tsresolCode; // if_tsresol
+    uint16_t tsresolLength;
+    uint8_t tsresol;
+    uint8_t tsresolPadding[3];
+    uint16_t endCode; // opt_endofopt
+    uint16_t endLength;
+    uint32_t trailerLength;
+};
+
+struct __attribute__((packed)) EnhancedPacketBlockHeader {
+    uint32_t type;
+    uint32_t length;
+    uint32_t interfaceId;
+    uint32_t timeHigh;
+    uint32_t timeLow;
+    uint32_t capturedLength;
+    uint32_t originalLength;
+};
+
+struct __attribute__((packed)) EnhancedPacketBlockTrailer {
+    uint16_t flagsCode; // epb_flags
+    uint16_t flagsLength;
+    uint32_t flags;
+    uint16_t endCode; // opt_endofopt
+    uint16_t endLength;
+    uint32_t trailerLength;
+};
+
+const char* const INTERFACE_NAMES[PacketCapture::INTERFACE_COUNT] = {
+    "sta",
+    "ap"
+};
+
+inline size_t padTo32(size_t size) {
+    return (size + 3) & ~(size_t)3;
+}
+
+} // anonymous
+
+PacketCapture::PacketCapture()
+        : enabled_(false),
+          headerPending_(true),
+          settings_(),
+          captured_(0),
+          dropped_(0),
+          streamed_(0),
+          sink_(nullptr),
+          thread_(nullptr) {
+}
+
+int PacketCapture::init(OutputStream* sink) {
+    sink_ = sink;
+    return 0;
+}
+
+int PacketCapture::enable(const Settings& settings) {
+#if CONFIG_NCP_PACKET_CAPTURE
+    CHECK_TRUE(sink_, RESULT_INVALID_STATE);
+    CHECK_TRUE(settings.snapLen >= ETHERNET_HEADER_SIZE && settings.snapLen <= MAX_SNAP_LEN, RESULT_INVALID_PARAM);
+    CHECK_TRUE(settings.ifaceMask != 0 && settings.dirMask != 0, RESULT_INVALID_PARAM);
+    disable();
+    {
+        std::lock_guard<std::mutex> lock(bufMutex_);
+        // Capture buffers are allocated on first use and never released, since the streaming
+        // thread may still be holding a record while capturing is being disabled
+        if (!bufData_) {
+            bufData_.reset(new(std::nothrow) uint8_t[CONFIG_NCP_PACKET_CAPTURE_BUFFER_SIZE]);
+            recBuf_.reset(new(std::nothrow) uint8_t[MAX_SNAP_LEN]);
+            if (!bufData_ || !recBuf_) {
+                bufData_.reset();
+                recBuf_.reset();
+                return RESULT_NO_MEMORY;
+            }
+            buf_.init(bufData_.get(), CONFIG_NCP_PACKET_CAPTURE_BUFFER_SIZE);
+        }
+        buf_.reset();
+        settings_ = settings;
+    }
+    if (!thread_) {
+        CHECK_TRUE(xTaskCreate(run, "ncp_pcap_t", PCAP_THREAD_STACK_SIZE, this, PCAP_THREAD_PRIORITY,
+                &thread_) == pdPASS, RESULT_NO_MEMORY);
+    }
+    captured_ = 0;
+    dropped_ = 0;
+    streamed_ = 0;
+    headerPending_ = true;
+    enabled_ = true;
+    LOG(INFO, "Packet capture enabled; snaplen: %u", settings.snapLen);
+    return 0;
+#else
+    return RESULT_INVALID_STATE;
+#endif // CONFIG_NCP_PACKET_CAPTURE
+}
+
+void PacketCapture::disable() {
+    if (enabled_) {
+        enabled_ = false;
+        LOG(INFO, "Packet capture disabled");
+    }
+}
+
+void PacketCapture::settings(Settings* settings) const {
+    *settings = settings_;
+}
+
+void PacketCapture::stats(Stats* stats) const {
+    stats->captured = captured_;
+    stats->dropped = dropped_;
+    stats->streamed = streamed_;
+}
+
+void PacketCapture::resetStream() {
+    headerPending_ = true;
+}
+
+void PacketCapture::captureImpl(Interface iface, Direction dir, const uint8_t* data, size_t size) {
+    if (!(settings_.ifaceMask & (1 << iface)) || !(settings_.dirMask & dir) || size == 0) {
+        return;
+    }
+    if (settings_.etherType != 0) {
+        if (size < ETHERNET_HEADER_SIZE || ((data[12] << 8) | data[13]) != settings_.etherType) {
+            return;
+        }
+    }
+
+    RecordHeader h = {};
+    h.time = esp_timer_get_time();
+    h.capLen = std::min<size_t>(size, settings_.snapLen);
+    h.origLen = std::min<size_t>(size, 0xffff);
+    h.iface = iface;
+    h.dir = dir;
+
+    // Never wait for the streaming thread: if the buffer is busy or full, drop the record
+    std::unique_lock<std::mutex> lock(bufMutex_, std::try_to_lock);
+    if (!lock.owns_lock() || buf_.space() < (ssize_t)(sizeof(h) + h.capLen)) {
+        ++dropped_;
+        return;
+    }
+    buf_.put((const uint8_t*)&h, sizeof(h));
+    buf_.put(data, h.capLen);
+    lock.unlock();
+
+    ++captured_;
+    xTaskNotifyGive(thread_);
+}
+
+void PacketCapture::run(void* arg) {
+    auto self = static_cast<PacketCapture*>(arg);
+    self->run();
+    vTaskDelete(nullptr);
+}
+
+void PacketCapture::run() {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        while (enabled_) {
+            RecordHeader h = {};
+            {
+                std::lock_guard<std::mutex> lock(bufMutex_);
+                if (buf_.data() < (ssize_t)sizeof(h)) {
+                    break;
+                }
+                buf_.get((uint8_t*)&h, sizeof(h));
+                buf_.get(recBuf_.get(), h.capLen);
+            }
+            if (headerPending_) {
+                if (writeHeader() < 0) {
+                    ++dropped_;
+                    continue;
+                }
+                headerPending_ = false;
+            }
+            if (writeRecord(h, recBuf_.get()) < 0) {
+                ++dropped_;
+                // The block may have been written partially, start a new section
+                headerPending_ = true;
+            } else {
+                ++streamed_;
+            }
+        }
+    }
+}
+
+int PacketCapture::writeHeader() {
+    SectionHeaderBlock shb = {};
+    shb.type = PCAPNG_SECTION_HEADER_BLOCK;
+    shb.length = sizeof(shb);
+    shb.byteOrderMagic = PCAPNG_BYTE_ORDER_MAGIC;
+    shb.majorVersion = 1;
+    shb.minorVersion = 0;
+    shb.sectionLength = -1; // Unspecified
+    shb.trailerLength = sizeof(shb);
+    CHECK(writeChunked((const uint8_t*)&shb, sizeof(shb)));
+
+    // Interface IDs used in the enhanced packet blocks match the Interface enum
+    for (unsigned i = 0; i < INTERFACE_COUNT; ++i) {
+        InterfaceDescriptionBlock idb = {};
+        idb.type = PCAPNG_INTERFACE_DESCRIPTION_BLOCK;
+        idb.length = sizeof(idb);
+        idb.linkType = PCAPNG_LINKTYPE_ETHERNET;
+        idb.snapLen = settings_.snapLen;
+        idb.nameCode = PCAPNG_OPT_IF_NAME;
+        idb.nameLength = strlen(INTERFACE_NAMES[i]);
+        memcpy(idb.name, INTERFACE_NAMES[i], idb.nameLength);
+        idb.tsresolCode = PCAPNG_OPT_IF_TSRESOL;
+        idb.tsresolLength = sizeof(idb.tsresol);
+        idb.tsresol = PCAPNG_TSRESOL_USEC;
+        idb.endCode = PCAPNG_OPT_ENDOFOPT;
+        idb.trailerLength = sizeof(idb);
+        CHECK(writeChunked((const uint8_t*)&idb, sizeof(idb)));
+    }
+    return 0;
+}
+
+int PacketCapture::writeRecord(const RecordHeader& h, const uint8_t* data) {
+    const size_t paddedLen = padTo32(h.capLen);
+    const size_t blockLen = sizeof(EnhancedPacketBlockHeader) + paddedLen + sizeof(EnhancedPacketBlockTrailer);
+
+    EnhancedPacketBlockHeader epb = {};
+    epb.type = PCAPNG_ENHANCED_PACKET_BLOCK;
+    epb.length = blockLen;
+    epb.interfaceId = h.iface;
+    epb.timeHigh = h.time >> 32;
+    epb.timeLow = h.time & 0xffffffff;
+    epb.capturedLength = h.capLen;
+    epb.originalLength = h.origLen;
+    CHECK(writeChunked((const uint8_t*)&epb, sizeof(epb)));
+    CHECK(writeChunked(data, h.capLen));
+    if (paddedLen != h.capLen) {
+        const uint8_t padding[3] = {};
+        CHECK(writeChunked(padding, paddedLen - h.capLen));
+    }
+
+    EnhancedPacketBlockTrailer trailer = {};
+    trailer.flagsCode = PCAPNG_OPT_EPB_FLAGS;
+    trailer.flagsLength = sizeof(trailer.flags);
+    // Bits 0-1: 01 - inbound, 10 - outbound
+    trailer.flags = (h.dir == DIRECTION_IN) ? 0x01 : 0x02;
+    trailer.endCode = PCAPNG_OPT_ENDOFOPT;
+    trailer.trailerLength = blockLen;
+    CHECK(writeChunked((const uint8_t*)&trailer, sizeof(trailer)));
+    return 0;
+}
+
+int PacketCapture::writeChunked(const uint8_t* data, size_t size) {
+    while (size > 0) {
+        const size_t n = CHECK(sink_->write((const char*)data, std::min(size, MAX_CHUNK_SIZE)));
+        CHECK_TRUE(n > 0, RESULT_IO_ERROR);
+        data += n;
+        size -= n;
+    }
+    return 0;
+}
+
+size_t PacketCapture::bufferMemory() const {
+    if (!bufData_) {
+        return 0;
+    }
+    return CONFIG_NCP_PACKET_CAPTURE_BUFFER_SIZE + MAX_SNAP_LEN;
+}
+
+PacketCapture* PacketCapture::instance() {
+    static PacketCapture capture;
+    return &capture;
+}
+
+} } /* particle::ncp */
@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+#include "util/ringbuffer.h"
+
+#include <atomic>
+#include <mutex>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <sdkconfig.h>
+
+namespace particle {
+
+class OutputStream;
+
+namespace ncp {
+
+// Captures bridged Ethernet frames into a bounded ring buffer and streams them
+// in pcapng format to an output stream (normally a dedicated mux channel).
+// Capturing never blocks the caller: if the buffer is full or busy, the record is dropped.
+class PacketCapture {
+public:
+    enum Interface {
+        INTERFACE_STA = 0,
+        INTERFACE_AP = 1,
+        INTERFACE_COUNT
+    };
+
+    enum Direction {
+        DIRECTION_IN = 0x01, // WiFi -> host
+        DIRECTION_OUT = 0x02 // Host -> WiFi
+    };
+
+    struct Settings {
+        unsigned snapLen; // Maximum number of bytes captured per frame
+        unsigned ifaceMask; // Bitmask of captured interfaces (1 << Interface)
+        unsigned dirMask; // Bitmask of captured directions
+        uint16_t etherType; // EtherType to capture, 0 - any
+    };
+
+    struct Stats {
+        uint32_t captured;
+        uint32_t dropped;
+        uint32_t streamed;
+    };
+
+    int init(OutputStream* sink);
+
+    int enable(const Settings& settings);
+    void disable();
+    bool isEnabled() const;
+
+    void settings(Settings* settings) const;
+    void stats(Stats* stats) const;
+
+    // Memory used by the capture buffers, they are allocated when capture is first enabled
+    size_t bufferMemory() const;
+
+    // Called when the consumer of the pcapng stream changes (e.g. the mux channel was reopened),
+    // so that the section and interface headers are sent again
+    void resetStream();
+
+    void capture(Interface iface, Direction dir, const uint8_t* data, size_t size);
+
+    static PacketCapture* instance();
+
+private:
+    struct __attribute__((packed)) RecordHeader {
+        uint64_t time; // Microseconds since boot
+        uint16_t capLen;
+        uint16_t origLen;
+        uint8_t iface;
+        uint8_t dir;
+    };
+
+    std::atomic_bool enabled_;
+    std::atomic_bool headerPending_;
+    Settings settings_;
+
+    std::atomic<uint32_t> captured_;
+    std::atomic<uint32_t> dropped_;
+    std::atomic<uint32_t> streamed_;
+
+    OutputStream* sink_;
+    TaskHandle_t thread_;
+
+    std::mutex bufMutex_;
+    particle::services::RingBuffer<uint8_t> buf_;
+    std::unique_ptr<uint8_t[]> bufData_;
+    std::unique_ptr<uint8_t[]> recBuf_; // Record being streamed
+
+    PacketCapture();
+
+    void captureImpl(Interface iface, Direction dir, const uint8_t* data, size_t size);
+
+    static void run(void* arg);
+    void run();
+    int writeHeader();
+    int writeRecord(const RecordHeader& h, const uint8_t* data);
+    int writeChunked(const uint8_t* data, size_t size);
+};
+
+inline bool PacketCapture::isEnabled() const {
+    return enabled_.load(std::memory_order_relaxed);
+}
+
+inline void PacketCapture::capture(Interface iface, Direction dir, const uint8_t* data, size_t size) {
+#if CONFIG_NCP_PACKET_CAPTURE
+    if (isEnabled()) {
+        captureImpl(iface, dir, data, size);
+    }
+#endif // CONFIG_NCP_PACKET_CAPTURE
+}
+
+} } /* particle::ncp */
@@ -18,21 +18,625 @@
 #include "update_manager.h"
 
 #include "stream.h"
+#include "util.h"
+#include "util/scope_guard.h"
 
 #include <esp_ota_ops.h>
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#include <esp_image_format.h>
+#include <rom/miniz.h>
+#include <rom/crc.h>
+#include <mbedtls/sha256.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <algorithm>
+#include <atomic>
 
 namespace particle {
 
 namespace ncp {
 
+namespace {
+
+// The received data is written to flash in a separate thread, in chunks of the flash sector size,
+// so that the host can send the next packets while the previous ones are being programmed
+const size_t WRITE_BUFFER_SIZE = 4096;
+const unsigned WRITE_BUFFER_COUNT = 3;
+
+const uint32_t WRITER_THREAD_STACK_SIZE = 4096;
+// Above the bridge thread, so that the buffered data is programmed as soon as the receiver blocks
+const UBaseType_t WRITER_THREAD_PRIORITY = tskIDLE_PRIORITY + 4;
+
+// Maximum time to wait for a buffer to be written
+const unsigned WRITE_TIMEOUT = 10000;
+
+// The partition is erased lazily by the writer thread while it's waiting for data, up to this
+// many bytes ahead of the write position
+const size_t ERASE_AHEAD_SIZE = 4 * SPI_FLASH_SEC_SIZE;
+
+// Compressed images start with this header instead of the ESP32 image magic byte (0xe9),
+// followed by a zlib stream
+struct __attribute__((packed)) CompressedImageHeader {
+    uint32_t magic; // COMPRESSED_IMAGE_MAGIC
+    uint8_t flags; // COMPRESSED_IMAGE_FLAG_*
+    uint8_t windowBits; // Base-2 logarithm of the compressor's window size
+    uint16_t reserved;
+    uint32_t size; // Size of the uncompressed image
+};
+
+const uint32_t COMPRESSED_IMAGE_MAGIC = 0x5a50434e; // "NCPZ"
+const uint8_t COMPRESSED_IMAGE_FLAG_ZLIB = 0x01;
+
+// Maximum window size of a compressed image. The decompressor needs a dictionary of this size
+// in addition to its state (about 11 KB)
+const unsigned MAX_WINDOW_BITS = 12;
+
+const size_t SHA256_SIZE = UpdateManager::HASH_SIZE;
+
+// Delta images start with this header, followed by a patch that is applied to the image in
+// the running partition. The patch can be compressed the same way as a full image
+struct __attribute__((packed)) DeltaImageHeader {
+    uint32_t magic; // DELTA_IMAGE_MAGIC
+    uint8_t flags; // DELTA_IMAGE_FLAG_*
+    uint8_t windowBits; // Base-2 logarithm of the compressor's window size if the patch is compressed
+    uint16_t reserved;
+    uint32_t size; // Size of the resulting image
+    uint32_t baseSize; // Size of the base image
+    uint8_t baseHash[SHA256_SIZE]; // SHA-256 of the base image
+    uint8_t hash[SHA256_SIZE]; // SHA-256 of the resulting image
+};
+
+const uint32_t DELTA_IMAGE_MAGIC = 0x4450434e; // "NCPD"
+const uint8_t DELTA_IMAGE_FLAG_ZLIB = 0x01;
+
+// Patch operation
+struct __attribute__((packed)) PatchOp {
+    uint8_t type; // PATCH_OP_*
+    uint32_t size; // Number of bytes to copy or insert
+    uint32_t offset; // Offset in the base image, ignored for PATCH_OP_DATA
+};
+
+enum PatchOpType {
+    PATCH_OP_COPY = 0x01, // Copy a range of the base image
+    PATCH_OP_DATA = 0x02 // Insert the data following the operation
+};
+
+// Size of the buffer for reading the base image
+const size_t BASE_BUFFER_SIZE = 1024;
+
+// Interval at which the progress of a resumable update is saved in NVS. Must be a multiple of
+// the flash sector size
+const size_t CHECKPOINT_INTERVAL = 4 * SPI_FLASH_SEC_SIZE;
+
+// Progress of a resumable update as stored in NVS
+struct __attribute__((packed)) UpdateCheckpoint {
+    uint32_t size; // Image size
+    uint32_t offset; // Number of bytes written to flash, a multiple of CHECKPOINT_INTERVAL
+    uint32_t crc; // CRC-32 of the written data
+    uint32_t partAddress; // Address of the target partition
+    char imageId[UpdateManager::MAX_IMAGE_ID_LENGTH + 1]; // Image identifier provided by the host
+};
+
+int loadCheckpoint(UpdateCheckpoint* cp) {
+    size_t size = sizeof(UpdateCheckpoint);
+    CHECK(util::nvsReadSetting(util::NVS_SETTING_UPDATE_CHECKPOINT, cp, &size));
+    CHECK_TRUE(size == sizeof(UpdateCheckpoint), RESULT_NOT_FOUND);
+    cp->imageId[sizeof(cp->imageId) - 1] = '\0';
+    return 0;
+}
+
+// Calculates the CRC-32 of a range of the partition. If `sha` is not null, the data is also passed
+// to the SHA-256 calculation
+int partitionCrc32(const esp_partition_t* part, size_t size, uint32_t* crc, mbedtls_sha256_context* sha = nullptr) {
+    std::unique_ptr<uint8_t[]> buf(new(std::nothrow) uint8_t[BASE_BUFFER_SIZE]);
+    CHECK_TRUE(buf, RESULT_NO_MEMORY);
+    uint32_t c = 0;
+    for (size_t offs = 0; offs < size;) {
+        const size_t n = std::min(size - offs, BASE_BUFFER_SIZE);
+        CHECK_ESP(esp_partition_read(part, offs, buf.get(), n));
+        c = crc32_le(c, buf.get(), n);
+        if (sha) {
+            CHECK_TRUE(mbedtls_sha256_update_ret(sha, buf.get(), n) == 0, RESULT_ERROR);
+        }
+        offs += n;
+    }
+    *crc = c;
+    return 0;
+}
+
+} // anonymous
+
 struct UpdateManager::Data: public OutputStream {
-    esp_ota_handle_t ota; // OTA handle
     const esp_partition_t* otaPart; // Target partition
 
+    std::unique_ptr<char[]> bufData; // Write buffers
+    QueueHandle_t freeQueue = nullptr; // Buffers available for filling
+    QueueHandle_t writeQueue = nullptr; // Buffers waiting to be written
+    SemaphoreHandle_t writerStopped = nullptr;
+    TaskHandle_t writer = nullptr;
+    char* buf = nullptr; // Buffer being filled
+    size_t bufSize = 0;
+    std::atomic<int> error;
+
+    // Image format, detected from the first chunk of data
+    bool headerParsed = false;
+    bool compressed = false;
+    bool delta = false;
+    size_t imageSize = 0; // Size of the image written to flash
+    size_t imageOffs = 0; // Number of bytes written to flash
+    size_t erasedSize = 0; // Size of the erased area at the beginning of the partition
+
+    // Checkpoints of a resumable update
+    bool checkpoints = false;
+    size_t nextCheckpoint = 0; // Offset at which the next checkpoint will be saved
+    uint32_t crc = 0; // CRC-32 of the written data
+    char imageId[MAX_IMAGE_ID_LENGTH + 1] = {};
+
+    // Decompression
+    std::unique_ptr<tinfl_decompressor> inflator;
+    std::unique_ptr<uint8_t[]> dict; // Decompressor's output window
+    size_t dictSize = 0;
+    size_t dictOffs = 0;
+    uint8_t zlibHeader[2] = {}; // CMF and FLG bytes of the zlib stream
+    size_t zlibHeaderSize = 0;
+    bool inflated = false; // Set when the end of the zlib stream has been reached
+
+    // Delta updates
+    const esp_partition_t* basePart = nullptr; // Running partition
+    size_t baseSize = 0;
+    std::unique_ptr<uint8_t[]> baseBuf;
+    uint8_t patchOpData[sizeof(PatchOp)]; // Operation being parsed
+    size_t patchOpOffs = 0;
+    size_t patchDataLeft = 0; // Remaining data of the current PATCH_OP_DATA operation
+
+    // Verification of the image as it's being written
+    uint8_t hash[SHA256_SIZE]; // Expected SHA-256 of the image
+    bool hasHash = false;
+    mbedtls_sha256_context sha;
+    bool shaStarted = false;
+
+    // Time spent in different phases of the update
+    uint64_t startTime = 0;
+    uint64_t firstDataTime = 0; // Time when the first chunk of data was received
+    uint32_t stallTime = 0; // Receiver waiting for a free buffer
+    std::atomic<uint32_t> writeTime; // Programming the flash
+    uint32_t eraseTime = 0; // Erasing the flash, including the sectors erased ahead
+    size_t writtenBytes = 0;
+
+    struct Chunk {
+        char* data; // Null if the writer needs to stop
+        size_t size;
+    };
+
+    Data() :
+            error(0),
+            writeTime(0) {
+    }
+
+    ~Data() {
+        stop(false);
+        if (shaStarted) {
+            mbedtls_sha256_free(&sha);
+        }
+        if (freeQueue) {
+            vQueueDelete(freeQueue);
+        }
+        if (writeQueue) {
+            vQueueDelete(writeQueue);
+        }
+        if (writerStopped) {
+            vSemaphoreDelete(writerStopped);
+        }
+    }
+
+    int init() {
+        bufData.reset(new(std::nothrow) char[WRITE_BUFFER_SIZE * WRITE_BUFFER_COUNT]);
+        freeQueue = xQueueCreate(WRITE_BUFFER_COUNT, sizeof(char*));
+        writeQueue = xQueueCreate(WRITE_BUFFER_COUNT + 1, sizeof(Chunk));
+        writerStopped = xSemaphoreCreateBinary();
+        CHECK_TRUE(bufData && freeQueue && writeQueue && writerStopped, RESULT_NO_MEMORY);
+        for (unsigned i = 0; i < WRITE_BUFFER_COUNT; ++i) {
+            char* const b = bufData.get() + i * WRITE_BUFFER_SIZE;
+            xQueueSend(freeQueue, &b, 0);
+        }
+        CHECK_TRUE(xTaskCreate(run, "ncp_upd_t", WRITER_THREAD_STACK_SIZE, this, WRITER_THREAD_PRIORITY,
+                &writer) == pdPASS, RESULT_NO_MEMORY);
+        return 0;
+    }
+
     int write(const char* data, size_t size) override {
-        CHECK_ESP(esp_ota_write(ota, data, size));
+        CHECK(error.load());
+        if (!firstDataTime) {
+            firstDataTime = util::millis();
+        }
+        size_t offs = 0;
+        while (offs < size) {
+            if (!buf) {
+                // Wait until the writer catches up
+                const auto t = util::millis();
+                CHECK_TRUE(xQueueReceive(freeQueue, &buf, WRITE_TIMEOUT / portTICK_PERIOD_MS) == pdTRUE, RESULT_TIMEOUT);
+                stallTime += util::millis() - t;
+                bufSize = 0;
+                CHECK(error.load());
+            }
+            const size_t n = std::min(size - offs, WRITE_BUFFER_SIZE - bufSize);
+            memcpy(buf + bufSize, data + offs, n);
+            bufSize += n;
+            offs += n;
+            if (bufSize == WRITE_BUFFER_SIZE) {
+                submit();
+            }
+        }
         return size;
     }
+
+    // Writes the remaining data and stops the writer thread
+    int finish() {
+        if (buf && bufSize > 0) {
+            submit();
+        }
+        stop(true);
+        CHECK(error.load());
+        if ((compressed && !inflated) || (delta && (patchOpOffs > 0 || patchDataLeft > 0)) ||
+                ((compressed || delta) && imageOffs != imageSize)) {
+            LOG(ERROR, "Incomplete image");
+            return RESULT_INVALID_FORMAT;
+        }
+        if (hasHash) {
+            uint8_t h[SHA256_SIZE] = {};
+            CHECK_TRUE(mbedtls_sha256_finish_ret(&sha, h) == 0, RESULT_ERROR);
+            if (memcmp(h, hash, SHA256_SIZE) != 0) {
+                LOG(ERROR, "Image hash doesn't match");
+                return RESULT_INVALID_FORMAT;
+            }
+        }
+        return 0;
+    }
+
+    void submit() {
+        const Chunk c = { buf, bufSize };
+        xQueueSend(writeQueue, &c, portMAX_DELAY);
+        writtenBytes += bufSize;
+        buf = nullptr;
+        bufSize = 0;
+    }
+
+    void stop(bool flush) {
+        if (!writer) {
+            return;
+        }
+        if (!flush) {
+            // Discard the pending data
+            int expected = 0;
+            error.compare_exchange_strong(expected, RESULT_CANCELLED);
+        }
+        const Chunk c = { nullptr, 0 };
+        xQueueSend(writeQueue, &c, portMAX_DELAY);
+        xSemaphoreTake(writerStopped, portMAX_DELAY);
+        writer = nullptr;
+    }
+
+    void run() {
+        for (;;) {
+            Chunk c = {};
+            // Erase the flash ahead of the write position while there's no data to write
+            const bool eraseAhead = error.load() == 0 && erasedSize < eraseLimit();
+            if (xQueueReceive(writeQueue, &c, eraseAhead ? 0 : portMAX_DELAY) != pdTRUE) {
+                const int ret = eraseSector();
+                if (ret < 0) {
+                    error = ret;
+                }
+                continue;
+            }
+            if (!c.data) {
+                break;
+            }
+            if (error.load() == 0) {
+                const auto t = util::millis();
+                const int ret = writeChunk((const uint8_t*)c.data, c.size);
+                writeTime += util::millis() - t;
+                if (ret < 0) {
+                    error = ret;
+                }
+            }
+            xQueueSend(freeQueue, &c.data, portMAX_DELAY);
+        }
+        xSemaphoreGive(writerStopped);
+    }
+
+    static void run(void* arg) {
+        const auto self = static_cast<Data*>(arg);
+        self->run();
+        vTaskDelete(nullptr);
+    }
+
+    int writeChunk(const uint8_t* data, size_t size) {
+        if (!headerParsed) {
+            const size_t n = CHECK(parseHeader(data, size));
+            data += n;
+            size -= n;
+            headerParsed = true;
+            if (checkpoints && (compressed || delta)) {
+                // Only the offset in a raw image can be mapped to the offset in the transferred file
+                LOG(WARN, "Compressed and delta updates cannot be resumed");
+                checkpoints = false;
+            }
+        }
+        if (compressed) {
+            return inflate(data, size);
+        }
+        return writeImage(data, size);
+    }
+
+    int parseHeader(const uint8_t* data, size_t size) {
+        uint32_t magic = 0;
+        if (size >= sizeof(magic)) {
+            memcpy(&magic, data, sizeof(magic));
+        }
+        if (magic == COMPRESSED_IMAGE_MAGIC && size >= sizeof(CompressedImageHeader)) {
+            CompressedImageHeader h = {};
+            memcpy(&h, data, sizeof(h));
+            CHECK_TRUE(h.flags & COMPRESSED_IMAGE_FLAG_ZLIB, RESULT_INVALID_FORMAT);
+            CHECK(initInflator(h.windowBits));
+            CHECK_TRUE(h.size > 0 && h.size <= otaPart->size, RESULT_TOO_LARGE_DATA);
+            imageSize = h.size;
+            LOG(INFO, "Compressed image; size: %u, window: %u", (unsigned)imageSize, (unsigned)dictSize);
+            return sizeof(h);
+        }
+        if (magic == DELTA_IMAGE_MAGIC && size >= sizeof(DeltaImageHeader)) {
+            DeltaImageHeader h = {};
+            memcpy(&h, data, sizeof(h));
+            if (h.flags & DELTA_IMAGE_FLAG_ZLIB) {
+                CHECK(initInflator(h.windowBits));
+            }
+            CHECK_TRUE(h.size > 0 && h.size <= otaPart->size, RESULT_TOO_LARGE_DATA);
+            CHECK(initDelta(h.baseSize, h.baseHash));
+            if (hasHash && memcmp(hash, h.hash, SHA256_SIZE) != 0) {
+                LOG(ERROR, "Image hash doesn't match the delta image");
+                return RESULT_INVALID_FORMAT;
+            }
+            CHECK(initHash(h.hash));
+            imageSize = h.size;
+            LOG(INFO, "Delta image; size: %u, base size: %u, compressed: %d", (unsigned)imageSize, (unsigned)baseSize,
+                    (int)compressed);
+            return sizeof(h);
+        }
+        return 0;
+    }
+
+    int initInflator(unsigned windowBits) {
+        if (windowBits < 8 || windowBits > MAX_WINDOW_BITS) {
+            LOG(ERROR, "Unsupported window size: %u", windowBits);
+            return RESULT_INVALID_FORMAT;
+        }
+        dictSize = 1 << windowBits;
+        inflator.reset(new(std::nothrow) tinfl_decompressor);
+        dict.reset(new(std::nothrow) uint8_t[dictSize]);
+        CHECK_TRUE(inflator && dict, RESULT_NO_MEMORY);
+        tinfl_init(inflator.get());
+        dictOffs = 0;
+        zlibHeaderSize = 0;
+        compressed = true;
+        return 0;
+    }
+
+    int initDelta(size_t size, const uint8_t* expectedHash) {
+        basePart = esp_ota_get_running_partition();
+        CHECK_TRUE(basePart && size <= basePart->size, RESULT_INVALID_FORMAT);
+        baseSize = size;
+        baseBuf.reset(new(std::nothrow) uint8_t[BASE_BUFFER_SIZE]);
+        CHECK_TRUE(baseBuf, RESULT_NO_MEMORY);
+        // Make sure the patch was made against the running image
+        mbedtls_sha256_context baseSha;
+        mbedtls_sha256_init(&baseSha);
+        SCOPE_GUARD({
+            mbedtls_sha256_free(&baseSha);
+        });
+        CHECK_TRUE(mbedtls_sha256_starts_ret(&baseSha, 0 /* is224 */) == 0, RESULT_ERROR);
+        for (size_t offs = 0; offs < baseSize;) {
+            const size_t n = std::min(baseSize - offs, BASE_BUFFER_SIZE);
+            CHECK_ESP(esp_partition_read(basePart, offs, baseBuf.get(), n));
+            CHECK_TRUE(mbedtls_sha256_update_ret(&baseSha, baseBuf.get(), n) == 0, RESULT_ERROR);
+            offs += n;
+        }
+        uint8_t h[SHA256_SIZE] = {};
+        CHECK_TRUE(mbedtls_sha256_finish_ret(&baseSha, h) == 0, RESULT_ERROR);
+        if (memcmp(h, expectedHash, SHA256_SIZE) != 0) {
+            LOG(ERROR, "Delta image doesn't match the running image");
+            return RESULT_INVALID_FORMAT;
+        }
+        delta = true;
+        return 0;
+    }
+
+    int inflate(const uint8_t* data, size_t size) {
+        if (zlibHeaderSize < sizeof(zlibHeader)) {
+            // The stream header can be split between chunks. Nothing is passed to the decompressor
+            // until it's been checked
+            const size_t n = std::min(sizeof(zlibHeader) - zlibHeaderSize, size);
+            memcpy(zlibHeader + zlibHeaderSize, data, n);
+            zlibHeaderSize += n;
+            data += n;
+            size -= n;
+            if (zlibHeaderSize < sizeof(zlibHeader)) {
+                return 0;
+            }
+            CHECK(checkZlibHeader(zlibHeader[0], zlibHeader[1]));
+            CHECK(decompress(zlibHeader, sizeof(zlibHeader)));
+        }
+        return decompress(data, size);
+    }
+
+    // The window of the stream has to fit in the dictionary allocated for the window size given
+    // in the image header, otherwise the decompressor would fail once it gets to a distant
+    // back reference
+    int checkZlibHeader(uint8_t cmf, uint8_t flg) {
+        const unsigned method = cmf & 0x0f;
+        const unsigned windowBits = (cmf >> 4) + 8;
+        if (method != 8 /* Deflate */ || ((cmf << 8) | flg) % 31 != 0 || (flg & 0x20) /* FDICT */) {
+            LOG(ERROR, "Invalid zlib header: 0x%02x 0x%02x", (unsigned)cmf, (unsigned)flg);
+            return RESULT_INVALID_FORMAT;
+        }
+        if (((size_t)1 << windowBits) > dictSize) {
+            LOG(ERROR, "Window size of the zlib stream exceeds the window size of the image: %u",
+                    (unsigned)(1 << windowBits));
+            return RESULT_INVALID_FORMAT;
+        }
+        return 0;
+    }
+
+    int decompress(const uint8_t* data, size_t size) {
+        while (!inflated) {
+            size_t inSize = size;
+            size_t outSize = dictSize - dictOffs;
+            // The dictionary is used as a circular output buffer
+            const auto status = tinfl_decompress(inflator.get(), data, &inSize, dict.get(), dict.get() + dictOffs,
+                    &outSize, TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+            data += inSize;
+            size -= inSize;
+            if (outSize > 0) {
+                CHECK(writeImage(dict.get() + dictOffs, outSize));
+                dictOffs = (dictOffs + outSize) & (dictSize - 1);
+            }
+            if (status == TINFL_STATUS_DONE) {
+                inflated = true;
+            } else if (status < 0) {
+                LOG(ERROR, "tinfl_decompress() failed: %d", (int)status);
+                return RESULT_INVALID_FORMAT;
+            } else if (status == TINFL_STATUS_NEEDS_MORE_INPUT) {
+                break;
+            }
+        }
+        CHECK_TRUE(size == 0 || !inflated, RESULT_INVALID_FORMAT);
+        return 0;
+    }
+
+    // Starts the SHA-256 calculation of the written data
+    int initHash(const uint8_t* expectedHash) {
+        if (!shaStarted) {
+            mbedtls_sha256_init(&sha);
+            shaStarted = true;
+        }
+        CHECK_TRUE(mbedtls_sha256_starts_ret(&sha, 0 /* is224 */) == 0, RESULT_ERROR);
+        memcpy(hash, expectedHash, SHA256_SIZE);
+        hasHash = true;
+        return 0;
+    }
+
+    int writeImage(const uint8_t* data, size_t size) {
+        if (delta) {
+            return applyPatch(data, size);
+        }
+        return writeFlash(data, size);
+    }
+
+    int applyPatch(const uint8_t* data, size_t size) {
+        while (size > 0) {
+            if (patchDataLeft > 0) {
+                const size_t n = std::min(size, patchDataLeft);
+                CHECK(writeFlash(data, n));
+                patchDataLeft -= n;
+                data += n;
+                size -= n;
+                continue;
+            }
+            const size_t n = std::min(size, sizeof(PatchOp) - patchOpOffs);
+            memcpy(patchOpData + patchOpOffs, data, n);
+            patchOpOffs += n;
+            data += n;
+            size -= n;
+            if (patchOpOffs < sizeof(PatchOp)) {
+                break;
+            }
+            patchOpOffs = 0;
+            PatchOp op = {};
+            memcpy(&op, patchOpData, sizeof(op));
+            if (op.type == PATCH_OP_COPY) {
+                CHECK(copyBase(op.offset, op.size));
+            } else if (op.type == PATCH_OP_DATA) {
+                patchDataLeft = op.size;
+            } else {
+                LOG(ERROR, "Invalid patch operation: %u", (unsigned)op.type);
+                return RESULT_INVALID_FORMAT;
+            }
+        }
+        return 0;
+    }
+
+    int copyBase(size_t offset, size_t size) {
+        CHECK_TRUE(offset <= baseSize && size <= baseSize - offset, RESULT_INVALID_FORMAT);
+        while (size > 0) {
+            const size_t n = std::min(size, BASE_BUFFER_SIZE);
+            CHECK_ESP(esp_partition_read(basePart, offset, baseBuf.get(), n));
+            CHECK(writeFlash(baseBuf.get(), n));
+            offset += n;
+            size -= n;
+        }
+        return 0;
+    }
+
+    int writeFlash(const uint8_t* data, size_t size) {
+        CHECK_TRUE(imageOffs + size <= imageSize, RESULT_TOO_LARGE_DATA);
+        // Erase the sectors that haven't been erased ahead yet
+        while (imageOffs + size > erasedSize) {
+            CHECK(eraseSector());
+        }
+        while (size > 0) {
+            // Checkpoints are saved on sector boundaries
+            const size_t n = checkpoints ? std::min(size, nextCheckpoint - imageOffs) : size;
+            if (imageOffs == 0 && n > 0 && data[0] != ESP_IMAGE_HEADER_MAGIC) {
+                LOG(ERROR, "Invalid image magic byte: 0x%02x", (unsigned)data[0]);
+                return RESULT_INVALID_FORMAT;
+            }
+            CHECK_ESP(esp_partition_write(otaPart, imageOffs, data, n));
+            if (hasHash) {
+                CHECK_TRUE(mbedtls_sha256_update_ret(&sha, data, n) == 0, RESULT_ERROR);
+            }
+            if (checkpoints) {
+                crc = crc32_le(crc, data, n);
+            }
+            imageOffs += n;
+            data += n;
+            size -= n;
+            if (checkpoints && imageOffs == nextCheckpoint) {
+                saveCheckpoint();
+                nextCheckpoint += CHECKPOINT_INTERVAL;
+            }
+        }
+        return 0;
+    }
+
+    int eraseSector() {
+        const auto t = util::millis();
+        CHECK_ESP(esp_partition_erase_range(otaPart, erasedSize, SPI_FLASH_SEC_SIZE));
+        eraseTime += util::millis() - t;
+        erasedSize += SPI_FLASH_SEC_SIZE;
+        return 0;
+    }
+
+    // Returns the offset up to which the partition can be erased in advance
+    size_t eraseLimit() const {
+        const size_t imageEnd = (imageSize + SPI_FLASH_SEC_SIZE - 1) / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+        return std::min({ imageOffs + ERASE_AHEAD_SIZE, imageEnd, (size_t)otaPart->size });
+    }
+
+    void saveCheckpoint() {
+        UpdateCheckpoint cp = {};
+        cp.size = imageSize;
+        cp.offset = imageOffs;
+        cp.crc = crc;
+        cp.partAddress = otaPart->address;
+        memcpy(cp.imageId, imageId, sizeof(cp.imageId));
+        // Failing to save a checkpoint is not critical for the update itself
+        const int ret = util::nvsWriteSetting(util::NVS_SETTING_UPDATE_CHECKPOINT, &cp, sizeof(cp));
+        if (ret < 0) {
+            LOG(WARN, "Unable to save update checkpoint: %d", ret);
+        }
+    }
 };
 
 UpdateManager::UpdateManager() {
@@ -41,29 +645,106 @@ UpdateManager::UpdateManager() {
 UpdateManager::~UpdateManager() {
 }
 
-int UpdateManager::beginUpdate(size_t size, OutputStream** strm) {
+int UpdateManager::beginUpdate(size_t size, OutputStream** strm, const char* imageId, const uint8_t* hash) {
     CHECK_FALSE(d_, RESULT_INVALID_STATE);
+    CHECK_TRUE(!imageId || (*imageId && strlen(imageId) <= MAX_IMAGE_ID_LENGTH), RESULT_INVALID_PARAM);
     std::unique_ptr<Data> d(new(std::nothrow) Data);
     CHECK_TRUE(d, RESULT_NO_MEMORY);
+    d->startTime = util::millis();
+    // The target partition is about to be erased
+    util::nvsClearSetting(util::NVS_SETTING_UPDATE_CHECKPOINT);
     LOG(INFO, "Initiating the update; expected size: %u", (unsigned)size);
     const auto curPart = esp_ota_get_running_partition();
     LOG(INFO, "Running partition: type: %d, subtype: %d, offset: 0x%08x", (int)curPart->type, (int)curPart->subtype,
             (unsigned)curPart->address);
     d->otaPart = esp_ota_get_next_update_partition(nullptr);
+    CHECK_TRUE(d->otaPart && d->otaPart != curPart, RESULT_NOT_FOUND);
+    // The image is written with esp_partition_write(), which requires aligned writes to encrypted partitions
+    CHECK_FALSE(d->otaPart->encrypted, RESULT_INVALID_STATE);
+    CHECK_TRUE(size <= d->otaPart->size, RESULT_TOO_LARGE_DATA);
     LOG(INFO, "Writing to partition: type: %d, subtype: %d, offset: 0x%08x", (int)d->otaPart->type,
             (int)d->otaPart->subtype, (unsigned)d->otaPart->address);
-    CHECK_ESP(esp_ota_begin(d->otaPart, size, &d->ota));
+    // The partition is written directly rather than via esp_ota_write(), so that the image is verified
+    // only once, when the boot partition is changed. Unlike esp_ota_begin(), nothing is erased up front
+    // so that the transfer can start right away
+    d->imageSize = size;
+    if (imageId) {
+        strcpy(d->imageId, imageId);
+        d->checkpoints = true;
+        d->nextCheckpoint = CHECKPOINT_INTERVAL;
+    }
+    if (hash) {
+        CHECK(d->initHash(hash));
+    }
+    CHECK(d->init());
     d_ = std::move(d);
     *strm = d_.get();
     return 0;
 }
 
+int UpdateManager::resumeUpdate(size_t size, const char* imageId, size_t* offset, OutputStream** strm,
+        const uint8_t* hash) {
+    CHECK_FALSE(d_, RESULT_INVALID_STATE);
+    UpdateCheckpoint cp = {};
+    CHECK(loadCheckpoint(&cp));
+    const auto part = esp_ota_get_next_update_partition(nullptr);
+    CHECK_TRUE(part, RESULT_NOT_FOUND);
+    if (cp.size != size || strcmp(cp.imageId, imageId) != 0 || cp.partAddress != part->address ||
+            cp.offset == 0 || cp.offset >= size) {
+        LOG(ERROR, "No matching update checkpoint");
+        return RESULT_NOT_FOUND;
+    }
+    std::unique_ptr<Data> d(new(std::nothrow) Data);
+    CHECK_TRUE(d, RESULT_NO_MEMORY);
+    d->startTime = util::millis();
+    if (hash) {
+        CHECK(d->initHash(hash));
+    }
+    // Make sure the partition still contains the data written before the interruption
+    uint32_t crc = 0;
+    CHECK(partitionCrc32(part, cp.offset, &crc, hash ? &d->sha : nullptr));
+    if (crc != cp.crc) {
+        LOG(ERROR, "Partition contents don't match the update checkpoint");
+        util::nvsClearSetting(util::NVS_SETTING_UPDATE_CHECKPOINT);
+        return RESULT_NOT_FOUND;
+    }
+    LOG(INFO, "Resuming the update; size: %u, offset: %u", (unsigned)size, (unsigned)cp.offset);
+    d->otaPart = part;
+    d->headerParsed = true; // Only raw images can be resumed
+    d->imageSize = size;
+    d->imageOffs = cp.offset;
+    // The sectors following the checkpoint may have been partially written
+    d->erasedSize = cp.offset;
+    d->crc = cp.crc;
+    memcpy(d->imageId, cp.imageId, sizeof(d->imageId));
+    d->checkpoints = true;
+    d->nextCheckpoint = cp.offset + CHECKPOINT_INTERVAL;
+    CHECK(d->init());
+    d_ = std::move(d);
+    *offset = cp.offset;
+    *strm = d_.get();
+    return 0;
+}
+
 int UpdateManager::finishUpdate() {
     CHECK_TRUE(d_, RESULT_INVALID_STATE);
     const std::unique_ptr<Data> d(d_.release());
     LOG(INFO, "Finishing the update");
-    CHECK_ESP(esp_ota_end(d->ota));
+    const auto t = util::millis();
+    const int ret = d->finish();
+    const auto writeEndTime = util::millis();
+    // The image is either complete or can't be used to resume the update
+    util::nvsClearSetting(util::NVS_SETTING_UPDATE_CHECKPOINT);
+    CHECK(ret);
+    // Verifies the image
     CHECK_ESP(esp_ota_set_boot_partition(d->otaPart));
+    const auto endTime = util::millis();
+    LOG(INFO, "Update finished; received: %u, image size: %u, total: %u ms, first data: %u ms, "
+            "receiver stalled: %u ms, flash write: %u ms, flash erase: %u ms, write drain: %u ms, verification: %u ms",
+            (unsigned)d->writtenBytes, (unsigned)d->imageOffs, (unsigned)(endTime - d->startTime),
+            (unsigned)(d->firstDataTime ? d->firstDataTime - d->startTime : 0), (unsigned)d->stallTime,
+            (unsigned)d->writeTime.load(), (unsigned)d->eraseTime, (unsigned)(writeEndTime - t),
+            (unsigned)(endTime - writeEndTime));
     return 0;
 }
 
@@ -71,11 +752,20 @@ void UpdateManager::cancelUpdate() {
     if (d_) {
         // Finish the update but don't change the boot partition
         LOG(INFO, "Cancelling the update");
-        esp_ota_end(d_->ota);
+        d_->stop(false);
         d_.reset();
     }
 }
 
+int UpdateManager::getCheckpoint(Checkpoint* cp) {
+    UpdateCheckpoint c = {};
+    CHECK(loadCheckpoint(&c));
+    cp->size = c.size;
+    cp->offset = c.offset;
+    memcpy(cp->imageId, c.imageId, sizeof(cp->imageId));
+    return 0;
+}
+
 UpdateManager* UpdateManager::instance() {
     static UpdateManager m;
     return &m;
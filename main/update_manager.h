@@ -30,11 +30,33 @@ class UpdateManager {
 public:
     ~UpdateManager();
 
-    // Note: UpdateManager retains ownership over the stream object
-    int beginUpdate(size_t size, OutputStream** strm);
+    // Maximum length of an image identifier
+    static const size_t MAX_IMAGE_ID_LENGTH = 64;
+
+    // Progress of an interrupted update
+    struct Checkpoint {
+        size_t size; // Image size
+        size_t offset; // Number of bytes written to flash
+        char imageId[MAX_IMAGE_ID_LENGTH + 1]; // Image identifier provided by the host
+    };
+
+    // Size of the image hash
+    static const size_t HASH_SIZE = 32;
+
+    // Note: UpdateManager retains ownership over the stream object. If `imageId` is not null, the
+    // progress of the update is saved periodically so that the update can be resumed with resumeUpdate()
+    // if the transfer gets interrupted. If `hash` is not null, the SHA-256 of the image is calculated
+    // while it's being written and the update fails if it doesn't match
+    int beginUpdate(size_t size, OutputStream** strm, const char* imageId = nullptr, const uint8_t* hash = nullptr);
+    // Continues an interrupted update of the same image. `offset` is set to the offset in the image
+    // the transfer needs to be continued from
+    int resumeUpdate(size_t size, const char* imageId, size_t* offset, OutputStream** strm,
+            const uint8_t* hash = nullptr);
     int finishUpdate();
     void cancelUpdate();
 
+    int getCheckpoint(Checkpoint* cp);
+
     static UpdateManager* instance();
 
 private:
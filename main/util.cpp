@@ -18,6 +18,7 @@
 #include "util.h"
 
 #include <nvs_flash.h>
+#include <nvs.h>
 #include <esp_timer.h>
 
 namespace particle { namespace util {
@@ -39,4 +40,84 @@ int nvsInitialize() {
     return 0;
 }
 
+namespace {
+
+const char NVS_SETTINGS_NAMESPACE[] = "ncp";
+
+} // anonymous
+
+int nvsReadSetting(const char* key, uint32_t* value) {
+    nvs_handle handle;
+    const esp_err_t err = nvs_open(NVS_SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        // Nothing has been written to the namespace yet
+        return RESULT_NOT_FOUND;
+    }
+    CHECK_ESP(err);
+    const esp_err_t ret = nvs_get_u32(handle, key, value);
+    nvs_close(handle);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        return RESULT_NOT_FOUND;
+    }
+    CHECK_ESP(ret);
+    return 0;
+}
+
+int nvsWriteSetting(const char* key, uint32_t value) {
+    nvs_handle handle;
+    CHECK_ESP(nvs_open(NVS_SETTINGS_NAMESPACE, NVS_READWRITE, &handle));
+    esp_err_t ret = nvs_set_u32(handle, key, value);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    CHECK_ESP(ret);
+    return 0;
+}
+
+int nvsReadSetting(const char* key, void* data, size_t* size) {
+    nvs_handle handle;
+    const esp_err_t err = nvs_open(NVS_SETTINGS_NAMESPACE, NVS_READONLY, &handle);
+    if (err == ESP_ERR_NVS_NOT_FOUND) {
+        return RESULT_NOT_FOUND;
+    }
+    CHECK_ESP(err);
+    const esp_err_t ret = nvs_get_blob(handle, key, data, size);
+    nvs_close(handle);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        return RESULT_NOT_FOUND;
+    }
+    if (ret == ESP_ERR_NVS_INVALID_LENGTH) {
+        return RESULT_TOO_SMALL_BUFFER;
+    }
+    CHECK_ESP(ret);
+    return 0;
+}
+
+int nvsWriteSetting(const char* key, const void* data, size_t size) {
+    nvs_handle handle;
+    CHECK_ESP(nvs_open(NVS_SETTINGS_NAMESPACE, NVS_READWRITE, &handle));
+    esp_err_t ret = nvs_set_blob(handle, key, data, size);
+    if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    CHECK_ESP(ret);
+    return 0;
+}
+
+int nvsClearSetting(const char* key) {
+    nvs_handle handle;
+    CHECK_ESP(nvs_open(NVS_SETTINGS_NAMESPACE, NVS_READWRITE, &handle));
+    esp_err_t ret = nvs_erase_key(handle, key);
+    if (ret == ESP_ERR_NVS_NOT_FOUND) {
+        ret = ESP_OK;
+    } else if (ret == ESP_OK) {
+        ret = nvs_commit(handle);
+    }
+    nvs_close(handle);
+    CHECK_ESP(ret);
+    return 0;
+}
+
 } } /* particle::util */
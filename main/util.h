@@ -26,6 +26,19 @@ uint64_t millis();
 
 int nvsInitialize();
 
+// Persistent NCP settings
+const char NVS_SETTING_BAUD_RATE[] = "baud_rate"; // Host link baud rate used at boot
+const char NVS_SETTING_SDIO_BUFFER_NUM[] = "sdio_buf_num"; // SDIO buffer geometry used at boot
+const char NVS_SETTING_SDIO_QUEUE_SIZE[] = "sdio_queue";
+const char NVS_SETTING_UPDATE_CHECKPOINT[] = "fwupd_ckpt"; // Progress of an interrupted firmware update
+
+int nvsReadSetting(const char* key, uint32_t* value);
+int nvsWriteSetting(const char* key, uint32_t value);
+// `size` is the size of the buffer and is set to the size of the stored value
+int nvsReadSetting(const char* key, void* data, size_t* size);
+int nvsWriteSetting(const char* key, const void* data, size_t size);
+int nvsClearSetting(const char* key);
+
 } } /* particle::util */
 
 #endif /* ARGON_NCP_FIRMWARE_UTIL_H */
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <array>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+namespace particle {
+
+namespace util {
+
+namespace detail {
+
+// CRC-CCITT of a single byte, computed bitwise
+constexpr uint16_t crc16Byte(uint8_t c) {
+    uint16_t crc = (uint16_t)c << 8;
+    for (unsigned i = 0; i < 8; ++i) {
+        crc = (crc & 0x8000) ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+template<size_t... I>
+constexpr std::array<uint16_t, sizeof...(I)> makeCrc16Table(std::index_sequence<I...>) {
+    return {{ crc16Byte(I)... }};
+}
+
+// Defined as a template so that all translation units share a single copy of the table
+template<typename T = void>
+struct Crc16Table {
+    static constexpr std::array<uint16_t, 256> data = makeCrc16Table(std::make_index_sequence<256>());
+};
+
+template<typename T>
+constexpr std::array<uint16_t, 256> Crc16Table<T>::data;
+
+} // particle::util::detail
+
+// Calculates a 16-bit checksum using the CRC-CCITT (XMODEM) algorithm: polynomial 0x1021,
+// no reflection, no final XOR. The initial value can be used to continue a previous calculation
+constexpr uint16_t calcCrc16(const char* data, size_t size, uint16_t crc = 0) {
+    for (size_t i = 0; i < size; ++i) {
+        crc = (uint16_t)(crc << 8) ^ detail::Crc16Table<>::data[(uint8_t)((crc >> 8) ^ (uint8_t)data[i])];
+    }
+    return crc;
+}
+
+static_assert(detail::Crc16Table<>::data[1] == 0x1021, "Invalid CRC-16 table");
+static_assert(calcCrc16("123456789", 9) == 0x31c3, "Invalid CRC-16 check value");
+
+} // particle::util
+
+} // particle
@@ -19,6 +19,7 @@
 #define SERVICES_RINGBUFFER_H
 
 #include <cstddef>
+#include <algorithm>
 #include "common.h"
 
 namespace particle {
@@ -243,11 +244,8 @@ template <typename T>
 inline size_t RingBuffer<T>::consumable() const {
     // Calculate provisional tail
     size_t tail = wrap(tail_ + tailPending_, curSize_);
-    if (head_ >= tail && !full_) {
-        return head_ - tail;
-    } else {
-        return curSize_ - tail;
-    }
+    // Data that is not pending consumption yet, up to the end of the buffer
+    return std::min(curData() - tailPending_, curSize_ - tail);
 }
 
 template <typename T>
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "windowed_receiver.h"
+
+#include "stream.h"
+#include "util.h"
+#include "util/crc.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace particle {
+
+namespace {
+
+// Control bytes
+enum Ctrl: char {
+    STX = 0x02, // Start of packet
+    EOT = 0x04, // End of transmission
+    ACK = 0x06, // Cumulative acknowledgement
+    NAK = 0x15, // Retransmission request
+    CAN = 0x18, // Cancel transmission
+    START = 0x57 // Receiver is ready ('W')
+};
+
+struct __attribute__((packed)) PacketHeader {
+    uint8_t start; // STX
+    uint16_t num; // Packet number modulo 65536 (little endian)
+    uint16_t size; // Payload size (little endian)
+};
+
+struct __attribute__((packed)) PacketCrc {
+    uint8_t msb; // Most significant byte of the packet's CRC-16
+    uint8_t lsb; // Least significant byte of the packet's CRC-16
+};
+
+// Maximum size of the packet payload. All packets but the last one need to be of this size
+const size_t MAX_PAYLOAD_SIZE = 1024;
+
+// Size of the packet buffer
+const size_t BUFFER_SIZE = sizeof(PacketHeader) + MAX_PAYLOAD_SIZE + sizeof(PacketCrc);
+
+// Timeout settings
+const unsigned START_INTERVAL = 3000;
+const unsigned ACK_INTERVAL = 1000; // The last acknowledgement is repeated if the sender is idle
+const unsigned SEND_TIMEOUT = 3000;
+
+// Maximum number of retries before aborting the transfer
+const unsigned MAX_START_RETRY_COUNT = 10;
+const unsigned MAX_ACK_RETRY_COUNT = 10;
+
+// Maximum number of invalid packets received without the window advancing
+const unsigned MAX_ERROR_COUNT = 16;
+
+// Number of CAN bytes that need to be sent or received in order to cancel the transfer
+const unsigned SEND_CAN_COUNT = 8;
+const unsigned RECV_CAN_COUNT = 2;
+
+} // particle::
+
+const unsigned WindowedReceiver::WINDOW_SIZE;
+
+WindowedReceiver::WindowedReceiver() :
+        state_(State::NEW) {
+}
+
+WindowedReceiver::~WindowedReceiver() {
+    destroy();
+}
+
+size_t WindowedReceiver::maxInFlightSize() {
+    return WINDOW_SIZE * BUFFER_SIZE;
+}
+
+int WindowedReceiver::init(Stream* src, OutputStream* dest, size_t size) {
+    buf_.reset(new(std::nothrow) char[BUFFER_SIZE]);
+    windowBuf_.reset(new(std::nothrow) char[WINDOW_SIZE * MAX_PAYLOAD_SIZE]);
+    if (!buf_ || !windowBuf_) {
+        destroy();
+        return RESULT_NO_MEMORY;
+    }
+    srcStrm_ = src;
+    destStrm_ = dest;
+    fileSize_ = size;
+    fileOffs_ = 0;
+    nextPacket_ = 0;
+    nakPacket_ = (unsigned)-1;
+    packetSize_ = 0;
+    packetOffs_ = 0;
+    memset(slotSize_, 0, sizeof(slotSize_));
+    retryCount_ = 0;
+    errorCount_ = 0;
+    canCount_ = 0;
+    lastError_ = 0;
+    started_ = false;
+    done_ = false;
+    reply(Ctrl::START, WINDOW_SIZE);
+    return 0;
+}
+
+void WindowedReceiver::destroy() {
+    buf_.reset();
+    windowBuf_.reset();
+    state_ = State::NEW;
+}
+
+int WindowedReceiver::run() {
+    int ret = 0;
+    // Keep going while the state changes, so that the reception continues right after
+    // an acknowledgement is sent
+    State state = State::NEW;
+    do {
+        state = state_;
+        ret = runState();
+    } while (ret == Status::RUNNING && state_ != state);
+    if (ret == Status::DONE || ret < 0) {
+        destroy();
+    }
+    return ret;
+}
+
+int WindowedReceiver::runState() {
+    int ret = 0;
+    switch (state_) {
+    case State::RECV_PACKET: {
+        ret = recvPacket();
+        break;
+    }
+    case State::SEND_REPLY: {
+        ret = sendReply();
+        break;
+    }
+    case State::SEND_CAN: {
+        ret = sendCan();
+        break;
+    }
+    default:
+        ret = RESULT_INVALID_STATE;
+        break;
+    }
+    return ret;
+}
+
+int WindowedReceiver::recvPacket() {
+    // Keep reading while the sender is streaming
+    for (;;) {
+        if (packetOffs_ == 0) {
+            char c = 0;
+            const size_t n = CHECK(srcStrm_->read(&c, 1));
+            if (n == 0) {
+                break;
+            }
+            stateTime_ = util::millis();
+            if (c == Ctrl::CAN) {
+                if (++canCount_ == RECV_CAN_COUNT) {
+                    LOG(WARN, "Sender has cancelled the transfer");
+                    setError(RESULT_CANCELLED);
+                    return Status::RUNNING;
+                }
+                continue;
+            }
+            canCount_ = 0;
+            if (c == Ctrl::EOT) {
+                return processEot();
+            }
+            if (c != Ctrl::STX) {
+                // Skip the remaining data of a corrupted packet
+                continue;
+            }
+            buf_[0] = c;
+            packetOffs_ = 1;
+            packetSize_ = sizeof(PacketHeader);
+            continue;
+        }
+        const size_t n = CHECK(srcStrm_->read(buf_.get() + packetOffs_, packetSize_ - packetOffs_));
+        if (n == 0) {
+            break;
+        }
+        stateTime_ = util::millis();
+        packetOffs_ += n;
+        if (packetOffs_ < packetSize_) {
+            continue;
+        }
+        if (packetSize_ == sizeof(PacketHeader)) {
+            // Parse packet header
+            PacketHeader h = {};
+            memcpy(&h, buf_.get(), sizeof(PacketHeader));
+            if (h.size == 0 || h.size > MAX_PAYLOAD_SIZE) {
+                // Not a start of a packet, keep looking for one
+                packetOffs_ = 0;
+                continue;
+            }
+            packetSize_ += h.size + sizeof(PacketCrc);
+            continue;
+        }
+        packetOffs_ = 0;
+        return processPacket();
+    }
+    const unsigned timeout = started_ ? ACK_INTERVAL : START_INTERVAL;
+    if (CHECK(waitData(timeout)) == 0 && checkTimeout(timeout) != 0) {
+        if (++retryCount_ > (started_ ? MAX_ACK_RETRY_COUNT : MAX_START_RETRY_COUNT)) {
+            LOG(ERROR, "No response from sender");
+            setError(RESULT_TIMEOUT);
+            return Status::RUNNING;
+        }
+        // Discard the partially received packet
+        packetOffs_ = 0;
+        if (!started_) {
+            reply(Ctrl::START, WINDOW_SIZE);
+        } else {
+            // The sender might be waiting for an acknowledgement that got lost
+            reply(hasBufferedPackets() ? Ctrl::NAK : Ctrl::ACK, nextPacket_);
+        }
+    }
+    return Status::RUNNING;
+}
+
+int WindowedReceiver::sendReply() {
+    replyOffs_ += CHECK(srcStrm_->write(reply_ + replyOffs_, replySize_ - replyOffs_));
+    if (replyOffs_ == replySize_) {
+        LOG_DEBUG(TRACE, "Sent reply: 0x%02x", (unsigned char)reply_[0]);
+        if (done_) {
+            return Status::DONE;
+        }
+        setState(State::RECV_PACKET);
+    } else {
+        CHECK(checkTimeout(SEND_TIMEOUT));
+    }
+    return Status::RUNNING;
+}
+
+int WindowedReceiver::sendCan() {
+    if (replySize_ == 0) {
+        memset(reply_, Ctrl::CAN, SEND_CAN_COUNT);
+        replySize_ = SEND_CAN_COUNT;
+        replyOffs_ = 0;
+    }
+    replyOffs_ += CHECK(srcStrm_->write(reply_ + replyOffs_, replySize_ - replyOffs_));
+    if (replyOffs_ == replySize_) {
+        LOG_DEBUG(TRACE, "Sent CAN (%u bytes)", (unsigned)replySize_);
+        return lastError_;
+    }
+    CHECK(checkTimeout(SEND_TIMEOUT));
+    return Status::RUNNING;
+}
+
+int WindowedReceiver::processPacket() {
+    PacketHeader h = {};
+    memcpy(&h, buf_.get(), sizeof(PacketHeader));
+    const char* const payload = buf_.get() + sizeof(PacketHeader);
+    // Verify packet checksum
+    PacketCrc c = {};
+    memcpy(&c, payload + h.size, sizeof(PacketCrc));
+    const uint16_t crc = (c.msb << 8) | c.lsb; // Received CRC-16
+    const uint16_t compCrc = util::calcCrc16(buf_.get() + 1, sizeof(PacketHeader) - 1 + h.size); // Computed CRC-16
+    if (compCrc != crc) {
+        LOG(WARN, "Invalid checksum");
+        return invalidPacket();
+    }
+    LOG_DEBUG(TRACE, "Received packet; number: %u, size: %u", (unsigned)h.num, (unsigned)h.size);
+    started_ = true;
+    retryCount_ = 0;
+    // Offset of the packet from the start of the window
+    const unsigned offs = (uint16_t)(h.num - (uint16_t)nextPacket_);
+    if (offs >= 0x8000) {
+        // The packet has already been received, the acknowledgement might have been lost
+        reply(Ctrl::ACK, nextPacket_);
+        return Status::RUNNING;
+    }
+    if (offs >= WINDOW_SIZE) {
+        LOG(ERROR, "Unexpected packet number: %u", (unsigned)h.num);
+        setError(RESULT_PROTOCOL_ERROR);
+        return Status::RUNNING;
+    }
+    const size_t packetFileOffs = (size_t)(nextPacket_ + offs) * MAX_PAYLOAD_SIZE;
+    if (packetFileOffs >= fileSize_ || h.size != std::min(fileSize_ - packetFileOffs, MAX_PAYLOAD_SIZE)) {
+        LOG(ERROR, "Unexpected packet size: %u", (unsigned)h.size);
+        setError(RESULT_PROTOCOL_ERROR);
+        return Status::RUNNING;
+    }
+    if (offs > 0) {
+        // Keep the packet until the missing ones are received
+        const unsigned slot = (nextPacket_ + offs) % WINDOW_SIZE;
+        if (!slotSize_[slot]) {
+            memcpy(windowBuf_.get() + slot * MAX_PAYLOAD_SIZE, payload, h.size);
+            slotSize_[slot] = h.size;
+        }
+        // Request the first missing packet once, the sender retransmits the other packets
+        // when they are requested in turn
+        if (nakPacket_ != nextPacket_) {
+            nakPacket_ = nextPacket_;
+            reply(Ctrl::NAK, nextPacket_);
+        }
+        return Status::RUNNING;
+    }
+    int ret = writeData(payload, h.size);
+    if (ret >= 0) {
+        ++nextPacket_;
+        ret = flushWindow();
+    }
+    if (ret < 0) {
+        setError(ret);
+        return Status::RUNNING;
+    }
+    errorCount_ = 0;
+    reply(Ctrl::ACK, nextPacket_);
+    return Status::RUNNING;
+}
+
+int WindowedReceiver::processEot() {
+    if (fileOffs_ == fileSize_) {
+        done_ = true;
+        reply(Ctrl::ACK, nextPacket_);
+        return Status::RUNNING;
+    }
+    LOG(WARN, "Incomplete file transfer");
+    return invalidPacket();
+}
+
+int WindowedReceiver::invalidPacket() {
+    if (++errorCount_ > MAX_ERROR_COUNT) {
+        LOG(ERROR, "Maximum number of retransmissions exceeded");
+        setError(RESULT_LIMIT_EXCEEDED);
+    } else {
+        nakPacket_ = nextPacket_;
+        reply(Ctrl::NAK, nextPacket_);
+    }
+    return Status::RUNNING;
+}
+
+int WindowedReceiver::flushWindow() {
+    for (;;) {
+        const unsigned slot = nextPacket_ % WINDOW_SIZE;
+        const size_t size = slotSize_[slot];
+        if (!size) {
+            break;
+        }
+        slotSize_[slot] = 0;
+        CHECK(writeData(windowBuf_.get() + slot * MAX_PAYLOAD_SIZE, size));
+        ++nextPacket_;
+    }
+    return 0;
+}
+
+int WindowedReceiver::writeData(const char* data, size_t size) {
+    const size_t n = CHECK(destStrm_->write(data, size));
+    CHECK_TRUE(n == size, RESULT_IO_ERROR);
+    fileOffs_ += n;
+    return 0;
+}
+
+void WindowedReceiver::reply(char ctrl, unsigned value) {
+    reply_[0] = ctrl;
+    reply_[1] = value & 0xff;
+    reply_[2] = (value >> 8) & 0xff;
+    replySize_ = 3;
+    replyOffs_ = 0;
+    setState(State::SEND_REPLY);
+}
+
+bool WindowedReceiver::hasBufferedPackets() const {
+    return std::any_of(slotSize_, slotSize_ + WINDOW_SIZE, [](size_t size) {
+        return size != 0;
+    });
+}
+
+int WindowedReceiver::waitData(unsigned timeout) {
+    const auto t = util::millis() - stateTime_;
+    if (t >= timeout) {
+        return 0;
+    }
+    return srcStrm_->waitEvent(Stream::READABLE, timeout - t);
+}
+
+int WindowedReceiver::checkTimeout(unsigned timeout) {
+    if (util::millis() - stateTime_ >= timeout) {
+        LOG_DEBUG(TRACE, "Timeout; state: %d", (int)state_);
+        return RESULT_TIMEOUT;
+    }
+    return 0;
+}
+
+void WindowedReceiver::setState(State state, bool restartTimer) {
+    state_ = state;
+    if (restartTimer) {
+        stateTime_ = util::millis();
+    }
+}
+
+void WindowedReceiver::setError(int error) {
+    lastError_ = error;
+    replySize_ = 0;
+    replyOffs_ = 0;
+    setState(State::SEND_CAN);
+}
+
+} // particle
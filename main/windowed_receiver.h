@@ -0,0 +1,115 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "common.h"
+
+#include <memory>
+
+namespace particle {
+
+class Stream;
+class OutputStream;
+
+/*
+ * Class implementing a receiver for a sliding window file transfer protocol.
+ *
+ * Unlike XMODEM, the sender doesn't wait for every packet to be acknowledged and keeps up to
+ * a window of packets in flight. The receiver acknowledges the packets cumulatively and
+ * requests a retransmission of the first missing packet, packets received out of order are
+ * buffered until the gap is filled. See README.md for the description of the protocol.
+ */
+class WindowedReceiver {
+public:
+    enum Status {
+        DONE = 0,
+        RUNNING
+    };
+
+    WindowedReceiver();
+    ~WindowedReceiver();
+
+    int init(Stream* src, OutputStream* dest, size_t size);
+    void destroy();
+
+    // Returns one of the values defined by the `Status` enum or a negative value in case of an error.
+    // This method needs to be called in a loop
+    int run();
+
+    // Maximum amount of data the sender can transmit without waiting for an acknowledgement
+    static size_t maxInFlightSize();
+
+private:
+    // Receiver state
+    enum class State {
+        NEW, // Uninitialized
+        RECV_PACKET, // Receiving packets
+        SEND_REPLY, // Sending the start message or an acknowledgement
+        SEND_CAN // Cancelling the transfer
+    };
+
+    // Maximum number of unacknowledged packets
+    static const unsigned WINDOW_SIZE = 8;
+
+    State state_; // Current receiver state
+    uint64_t stateTime_; // Time when the receiver state was last changed or data was last received
+    unsigned retryCount_; // Number of retries
+    unsigned errorCount_; // Number of invalid packets since the window last advanced
+    unsigned canCount_; // Number of received CAN bytes
+    int lastError_; // Last error
+    bool started_; // Set when the first valid packet has been received
+    bool done_; // Set when all data has been received
+
+    Stream* srcStrm_; // Source stream
+    OutputStream* destStrm_; // Destination stream
+    size_t fileSize_; // File size
+    size_t fileOffs_; // Current offset in the file
+
+    unsigned nextPacket_; // Index of the next expected packet
+    unsigned nakPacket_; // Index of the packet a retransmission was last requested for
+    size_t packetSize_; // Size of the current packet including the header and CRC
+    size_t packetOffs_; // Number of received bytes of the current packet
+
+    char reply_[8]; // Reply buffer, also used for the CAN sequence
+    size_t replySize_; // Size of the reply
+    size_t replyOffs_; // Number of sent bytes of the reply
+
+    std::unique_ptr<char[]> buf_; // Packet buffer
+    std::unique_ptr<char[]> windowBuf_; // Payloads of the packets received out of order
+    size_t slotSize_[WINDOW_SIZE]; // Payload sizes of the buffered packets, 0 if not received
+
+    int runState();
+    int recvPacket();
+    int sendReply();
+    int sendCan();
+
+    int processPacket();
+    int processEot();
+    int invalidPacket();
+    int flushWindow();
+    int writeData(const char* data, size_t size);
+    void reply(char ctrl, unsigned value);
+    bool hasBufferedPackets() const;
+
+    int waitData(unsigned timeout);
+    int checkTimeout(unsigned timeout);
+    void setState(State state, bool restartTimer = true);
+    void setError(int error);
+};
+
+} // particle
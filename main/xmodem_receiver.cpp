@@ -19,6 +19,7 @@
 
 #include "stream.h"
 #include "util.h"
+#include "util/crc.h"
 
 #include <algorithm>
 
@@ -65,24 +66,6 @@ const unsigned MAX_PACKET_RETRY_COUNT = 2;
 const unsigned SEND_CAN_COUNT = 8;
 const unsigned RECV_CAN_COUNT = 2;
 
-// Calculates a 16-bit checksum using the CRC-CCITT (XMODEM) algorithm
-uint16_t calcCrc16(const char* data, size_t size) {
-    uint16_t crc = 0;
-    const auto end = data + size;
-    while (data < end) {
-        const uint8_t c = *data++;
-        crc ^= (uint16_t)c << 8;
-        for (unsigned i = 0; i < 8; ++i) {
-            if (crc & 0x8000) {
-                crc = (crc << 1) ^ 0x1021;
-            } else {
-                crc <<= 1;
-            }
-        }
-    }
-    return crc;
-}
-
 } // particle::
 
 XmodemReceiver::XmodemReceiver() :
@@ -116,6 +99,21 @@ void XmodemReceiver::destroy() {
 }
 
 int XmodemReceiver::run() {
+    int ret = 0;
+    // Keep going while the state changes, so that a whole packet is received and acknowledged
+    // in one call if the data is available
+    State state = State::NEW;
+    do {
+        state = state_;
+        ret = runState();
+    } while (ret == Status::RUNNING && state_ != state);
+    if (ret == Status::DONE || ret < 0) {
+        destroy();
+    }
+    return ret;
+}
+
+int XmodemReceiver::runState() {
     int ret = 0;
     switch (state_) {
     case State::SEND_NCG: {
@@ -154,9 +152,6 @@ int XmodemReceiver::run() {
         ret = RESULT_INVALID_STATE;
         break;
     }
-    if (ret == Status::DONE || ret < 0) {
-        destroy();
-    }
     return ret;
 }
 
@@ -207,8 +202,9 @@ int XmodemReceiver::recvSoh() {
             }
         }
     } else if (packetNum_ != 0) {
+        CHECK(waitData(PACKET_TIMEOUT));
         checkPacketTimeout();
-    } else if (checkTimeout(NCG_INTERVAL) != 0) {
+    } else if (CHECK(waitData(NCG_INTERVAL)) == 0 && checkTimeout(NCG_INTERVAL) != 0) {
         if (++retryCount_ > MAX_NCG_RETRY_COUNT) {
             LOG(ERROR, "No response from sender");
             return RESULT_TIMEOUT;
@@ -219,7 +215,8 @@ int XmodemReceiver::recvSoh() {
 }
 
 int XmodemReceiver::recvPacketHeader() {
-    packetOffs_ += CHECK(srcStrm_->read(buf_.get() + packetOffs_, sizeof(PacketHeader) - packetOffs_));
+    const size_t n = CHECK(srcStrm_->read(buf_.get() + packetOffs_, sizeof(PacketHeader) - packetOffs_));
+    packetOffs_ += n;
     if (packetOffs_ == sizeof(PacketHeader)) {
         // Parse packet header
         PacketHeader h = {};
@@ -253,20 +250,24 @@ int XmodemReceiver::recvPacketHeader() {
             }
         }
     } else {
+        if (n == 0) {
+            CHECK(waitData(PACKET_TIMEOUT));
+        }
         checkPacketTimeout();
     }
     return Status::RUNNING;
 }
 
 int XmodemReceiver::recvPacketData() {
-    packetOffs_ += CHECK(srcStrm_->read(buf_.get() + packetOffs_, packetSize_ - packetOffs_));
+    const size_t n = CHECK(srcStrm_->read(buf_.get() + packetOffs_, packetSize_ - packetOffs_));
+    packetOffs_ += n;
     if (packetOffs_ == packetSize_) {
         LOG_DEBUG(TRACE, "Received packet; number: %u, size: %u", packetNum_, (unsigned)packetSize_);
         // Verify packet checksum
         PacketCrc c = {};
         memcpy(&c, buf_.get() + packetSize_ - sizeof(PacketCrc), sizeof(PacketCrc));
         const uint16_t crc = (c.msb << 8) | c.lsb; // Received CRC-16
-        const uint16_t compCrc = calcCrc16(buf_.get() + sizeof(PacketHeader), packetSize_ - sizeof(PacketHeader) -
+        const uint16_t compCrc = util::calcCrc16(buf_.get() + sizeof(PacketHeader), packetSize_ - sizeof(PacketHeader) -
                 sizeof(PacketCrc)); // Computed CRC-16
         if (compCrc == crc) {
             setState(State::SEND_PACKET_ACK);
@@ -281,6 +282,9 @@ int XmodemReceiver::recvPacketData() {
             }
         }
     } else {
+        if (n == 0) {
+            CHECK(waitData(PACKET_TIMEOUT));
+        }
         checkPacketTimeout();
     }
     return Status::RUNNING;
@@ -345,6 +349,14 @@ int XmodemReceiver::flush() {
     return n;
 }
 
+int XmodemReceiver::waitData(unsigned timeout) {
+    const auto t = util::millis() - stateTime_;
+    if (t >= timeout) {
+        return 0;
+    }
+    return srcStrm_->waitEvent(Stream::READABLE, timeout - t);
+}
+
 int XmodemReceiver::checkTimeout(unsigned timeout) {
     if (util::millis() - stateTime_ >= timeout) {
         LOG_DEBUG(TRACE, "Timeout; state: %d", (int)state_);
@@ -73,6 +73,7 @@ private:
 
     std::unique_ptr<char[]> buf_; // Packet buffer
 
+    int runState();
     int sendNcg();
     int recvSoh();
     int recvPacketHeader();
@@ -83,6 +84,7 @@ private:
     int sendCan();
 
     int flush();
+    int waitData(unsigned timeout);
     int checkTimeout(unsigned timeout);
     int checkPacketTimeout();
     void setState(State state, bool restartTimer = true);
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests of the bridge latency histograms and of the serial link model
+
+#include "test.h"
+#include "bridge_latency.h"
+
+#include <cstring>
+
+using namespace particle;
+using namespace particle::ncp;
+
+namespace {
+
+const unsigned LINK_RATE = 921600;
+// Transmission time of a 1500 byte frame with the mux framing overhead, 8N1
+const uint32_t FRAME_WIRE_TIME = (1500 + 7) * 10 * 1000000ull / LINK_RATE;
+
+BridgeLatency* freshLatency(unsigned linkRate = 0) {
+    const auto latency = BridgeLatency::instance();
+    latency->enable(true);
+    latency->reset();
+    latency->setLinkRate(linkRate);
+    return latency;
+}
+
+BridgeLatency::Histogram hostHistogram(BridgeLatency::Stage stage) {
+    BridgeLatency::Histogram h = {};
+    BridgeLatency::instance()->histogram(BridgeLatency::DIRECTION_TO_HOST, BridgeLatency::INTERFACE_STA, stage, &h);
+    return h;
+}
+
+} // anonymous
+
+TEST(buckets) {
+    const auto latency = freshLatency();
+    // Bucket 0: < 1us, bucket N: [2^(N-1), 2^N) us
+    const struct {
+        uint32_t us;
+        unsigned bucket;
+    } cases[] = { { 0, 0 }, { 1, 1 }, { 2, 2 }, { 3, 2 }, { 1023, 10 }, { 1024, 11 }, { 300000, 19 },
+            { 0x7fffffff, 19 } };
+    for (const auto& c: cases) {
+        latency->reset();
+        const BridgeLatency::WifiFrameTimes t = { 1000, 1000 + c.us, 1000 + c.us };
+        latency->recordWifiFrame(BridgeLatency::INTERFACE_AP, t);
+        BridgeLatency::Histogram h = {};
+        ASSERT(latency->histogram(BridgeLatency::DIRECTION_TO_WIFI, BridgeLatency::INTERFACE_AP,
+                BridgeLatency::STAGE_MUX_DECODE_TO_IPC, &h) == 0);
+        EXPECT(h.count == 1 && h.max == c.us && h.sum == c.us);
+        EXPECT(h.buckets[c.bucket] == 1);
+    }
+}
+
+TEST(stages) {
+    const auto latency = freshLatency();
+    const BridgeLatency::HostFrameTimes t = { 100, 110, 1110, 1410 };
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 1500);
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 1500);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_HOOK_TO_QUEUE).sum == 20);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_QUEUE_TO_DEQUEUE).sum == 2000);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_DEQUEUE_TO_MUX_WRITE).sum == 600);
+    // The link rate is unknown
+    EXPECT(hostHistogram(BridgeLatency::STAGE_MUX_WRITE_TO_TX_DONE).count == 0);
+    const auto total = hostHistogram(BridgeLatency::STAGE_TOTAL);
+    EXPECT(total.count == 2 && total.max == 1310);
+    // The other interface and direction are not affected
+    BridgeLatency::Histogram h = {};
+    latency->histogram(BridgeLatency::DIRECTION_TO_HOST, BridgeLatency::INTERFACE_AP, BridgeLatency::STAGE_TOTAL, &h);
+    EXPECT(h.count == 0);
+    latency->histogram(BridgeLatency::DIRECTION_TO_WIFI, BridgeLatency::INTERFACE_STA, BridgeLatency::STAGE_TOTAL, &h);
+    EXPECT(h.count == 0);
+    // Timestamps wrap around
+    latency->reset();
+    const BridgeLatency::HostFrameTimes w = { 0xfffffff0, 0xfffffff8, 0x10, 0x20 };
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, w, 100);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).sum == 0x30);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_QUEUE_TO_DEQUEUE).sum == 0x18);
+}
+
+TEST(serialLinkModel) {
+    const auto latency = freshLatency(LINK_RATE);
+    // The transport accepts the frames faster than the link can send them, so each frame waits
+    // for the previous ones to be transmitted
+    const uint32_t start = 1000000;
+    for (unsigned i = 0; i < 3; ++i) {
+        const uint32_t t0 = start + i * 100;
+        const BridgeLatency::HostFrameTimes t = { t0, t0, t0, t0 + 50 };
+        latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 1500);
+        const uint32_t txDone = start + (i + 1) * FRAME_WIRE_TIME;
+        EXPECT(hostHistogram(BridgeLatency::STAGE_MUX_WRITE_TO_TX_DONE).max == txDone - (t0 + 50));
+        EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).max == txDone - t0);
+    }
+    // The link is idle again, a single frame only takes its own transmission time
+    const uint32_t t0 = start + 10 * FRAME_WIRE_TIME;
+    const BridgeLatency::HostFrameTimes t = { t0, t0, t0, t0 + 50 };
+    latency->reset();
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 1500);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).max == FRAME_WIRE_TIME);
+    // A transport that blocks until the data is sent takes precedence over the estimate
+    latency->reset();
+    const uint32_t t1 = t0 + 10 * FRAME_WIRE_TIME;
+    const BridgeLatency::HostFrameTimes slow = { t1, t1, t1, t1 + 2 * FRAME_WIRE_TIME };
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, slow, 1500);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_MUX_WRITE_TO_TX_DONE).max == 0);
+}
+
+TEST(disabledAndReset) {
+    const auto latency = freshLatency();
+    const BridgeLatency::HostFrameTimes t = { 100, 110, 120, 130 };
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 100);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).count == 1);
+    latency->reset();
+    EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).count == 0);
+    // Frames timestamped before the statistics were enabled are ignored
+    const BridgeLatency::HostFrameTimes untimed = { 0, 0, 120, 130 };
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, untimed, 100);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).count == 0);
+    latency->enable(false);
+    EXPECT(latency->now() == 0);
+    latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 100);
+    EXPECT(hostHistogram(BridgeLatency::STAGE_TOTAL).count == 0);
+    BridgeLatency::Histogram h = {};
+    EXPECT(latency->histogram(BridgeLatency::DIRECTION_COUNT, BridgeLatency::INTERFACE_STA,
+            BridgeLatency::STAGE_TOTAL, &h) == RESULT_INVALID_PARAM);
+}
+
+BENCHMARK(recordOverhead) {
+    const auto latency = freshLatency(LINK_RATE);
+    const unsigned n = 10000000;
+    const double start = test::seconds();
+    for (unsigned i = 0; i < n; ++i) {
+        const uint32_t t0 = latency->now();
+        const BridgeLatency::HostFrameTimes t = { t0 | 1, t0 + 2, t0 + 40, t0 + 300 };
+        latency->recordHostFrame(BridgeLatency::INTERFACE_STA, t, 1500);
+    }
+    const double time = test::seconds() - start;
+    printf("Timestamps and recording: %.1f ns per frame\n", time / n * 1e9);
+}
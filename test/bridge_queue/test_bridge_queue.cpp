@@ -0,0 +1,244 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests of the classification and scheduling of the frames bridged from WiFi to the host
+
+#include "test.h"
+#include "bridge_queue.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+using namespace particle;
+using namespace particle::ncp;
+
+namespace {
+
+// Parameters of the simulated traffic, in units of the time needed to send one frame to the host
+const unsigned SIM_DURATION = 10000;
+// The bulk flow arrives at twice the link rate
+const unsigned BULK_FRAMES_PER_UNIT = 2;
+const unsigned VOICE_INTERVAL = 10;
+const unsigned VIDEO_INTERVAL = 4;
+
+struct Item {
+    unsigned ac; // Flow the item belongs to
+    unsigned time; // Time when the item was posted
+};
+
+std::vector<uint8_t> ipv4Frame(uint8_t tos) {
+    std::vector<uint8_t> f(34);
+    f[12] = 0x08;
+    f[13] = 0x00;
+    f[14] = 0x45;
+    f[15] = tos;
+    return f;
+}
+
+std::vector<uint8_t> ipv6Frame(uint8_t tc) {
+    std::vector<uint8_t> f(54);
+    f[12] = 0x86;
+    f[13] = 0xdd;
+    f[14] = 0x60 | (tc >> 4);
+    f[15] = (tc & 0x0f) << 4;
+    return f;
+}
+
+std::vector<uint8_t> vlanFrame(unsigned pcp) {
+    std::vector<uint8_t> f(18);
+    f[12] = 0x81;
+    f[13] = 0x00;
+    f[14] = pcp << 5;
+    return f;
+}
+
+AccessCategory classify(const std::vector<uint8_t>& f) {
+    return classifyFrame(f.data(), f.size());
+}
+
+struct FlowStats {
+    unsigned count;
+    unsigned dropped;
+    unsigned long long latencySum;
+    unsigned maxLatency;
+
+    double meanLatency() const {
+        return count ? (double)latencySum / count : 0;
+    }
+};
+
+// Simulates a bulk flow that saturates the link to the host, and periodic voice and video flows.
+// The link sends one frame per time unit. If `classify` is false, all frames share one queue as
+// they did before the frames were classified
+void simulate(bool classify, FlowStats* stats) {
+    std::mt19937 rnd(1);
+    BridgeInputQueue queue;
+    ASSERT(queue.init(sizeof(Item)) == 0);
+    std::fill(stats, stats + AC_COUNT, FlowStats());
+    unsigned queued = 0;
+    const auto post = [&](AccessCategory ac, unsigned time) {
+        const Item item = { (unsigned)ac, time };
+        if (queue.post(classify ? ac : AC_BE, &item)) {
+            ++queued;
+        } else {
+            ++stats[ac].dropped;
+        }
+    };
+    std::vector<AccessCategory> arrivals;
+    for (unsigned t = 0; t < SIM_DURATION; ++t) {
+        arrivals.assign(BULK_FRAMES_PER_UNIT, AC_BE);
+        if (t % VOICE_INTERVAL == 0) {
+            arrivals.push_back(AC_VO);
+        }
+        if (t % VIDEO_INTERVAL == 0) {
+            arrivals.push_back(AC_VI);
+        }
+        // Frames of different flows arriving within one time unit are interleaved randomly
+        std::shuffle(arrivals.begin(), arrivals.end(), rnd);
+        for (auto ac: arrivals) {
+            post(ac, t);
+        }
+        if (queued > 0) {
+            Item item = {};
+            ASSERT(queue.receive(&item, 1));
+            --queued;
+            auto& s = stats[item.ac];
+            const unsigned latency = t - item.time;
+            ++s.count;
+            s.latencySum += latency;
+            s.maxLatency = std::max(s.maxLatency, latency);
+        }
+    }
+}
+
+} // anonymous
+
+TEST(classification) {
+    // IPv4 DSCP
+    EXPECT(classify(ipv4Frame(46 << 2)) == AC_VO); // EF
+    EXPECT(classify(ipv4Frame(34 << 2)) == AC_VI); // AF41
+    EXPECT(classify(ipv4Frame(0)) == AC_BE);
+    EXPECT(classify(ipv4Frame(8 << 2)) == AC_BK); // CS1
+    // IPv6 traffic class
+    EXPECT(classify(ipv6Frame(46 << 2)) == AC_VO);
+    EXPECT(classify(ipv6Frame(16 << 2)) == AC_BK); // CS2
+    EXPECT(classify(ipv6Frame(24 << 2)) == AC_BE); // CS3
+    // 802.1Q PCP
+    EXPECT(classify(vlanFrame(7)) == AC_VO);
+    EXPECT(classify(vlanFrame(5)) == AC_VI);
+    EXPECT(classify(vlanFrame(1)) == AC_BK);
+    // ARP and truncated frames
+    std::vector<uint8_t> arp(42);
+    arp[12] = 0x08;
+    arp[13] = 0x06;
+    EXPECT(classify(arp) == AC_BE);
+    EXPECT(classify(std::vector<uint8_t>(15, 0x08)) == AC_BE);
+}
+
+TEST(strictPriority) {
+    BridgeInputQueue queue;
+    ASSERT(queue.init(sizeof(Item)) == 0);
+    for (unsigned i = 0; i < 10; ++i) {
+        const Item item = { AC_BE, i };
+        ASSERT(queue.post(AC_BE, &item));
+    }
+    const Item voice = { AC_VO, 100 };
+    ASSERT(queue.post(AC_VO, &voice));
+    Item item = {};
+    ASSERT(queue.receive(&item, 1));
+    EXPECT(item.ac == AC_VO);
+    ASSERT(queue.receive(&item, 1));
+    EXPECT(item.ac == AC_BE && item.time == 0);
+}
+
+TEST(weightedRoundRobin) {
+    BridgeInputQueue queue;
+    ASSERT(queue.init(sizeof(Item)) == 0);
+    for (unsigned i = 0; i < 8; ++i) {
+        for (unsigned ac = AC_VI; ac < AC_COUNT; ++ac) {
+            const Item item = { ac, i };
+            ASSERT(queue.post((AccessCategory)ac, &item));
+        }
+    }
+    // 4:2:1 while all queues have data
+    const unsigned expected[] = { AC_VI, AC_VI, AC_VI, AC_VI, AC_BE, AC_BE, AC_BK,
+            AC_VI, AC_VI, AC_VI, AC_VI, AC_BE, AC_BE, AC_BK };
+    for (unsigned ac: expected) {
+        Item item = {};
+        ASSERT(queue.receive(&item, 1));
+        EXPECT(item.ac == ac);
+    }
+    // The quantum scales the shares
+    Item item = {};
+    unsigned be = 0;
+    for (unsigned i = 0; i < 4; ++i) {
+        ASSERT(queue.receive(&item, 2));
+        be += (item.ac == AC_BE);
+    }
+    EXPECT(be == 4);
+}
+
+TEST(queueFull) {
+    BridgeInputQueue queue;
+    ASSERT(queue.init(sizeof(Item)) == 0);
+    Item item = { AC_BE, 0 };
+    unsigned n = 0;
+    while (queue.post(AC_BE, &item)) {
+        ++n;
+    }
+    EXPECT(n == 20);
+    // The other queues are independent
+    EXPECT(queue.post(AC_VO, &item));
+    EXPECT(queue.bufferMemory() == 44 * sizeof(Item));
+}
+
+TEST(latencyUnderBulkFlow) {
+    FlowStats fifo[AC_COUNT] = {};
+    simulate(false, fifo);
+    FlowStats prio[AC_COUNT] = {};
+    simulate(true, prio);
+    // With a single queue, the voice and video frames wait behind a full queue of bulk frames, or
+    // get dropped with them
+    EXPECT(fifo[AC_VO].meanLatency() > 15);
+    EXPECT(fifo[AC_VO].dropped > SIM_DURATION / VOICE_INTERVAL / 4);
+    // Voice frames are sent right away
+    EXPECT(prio[AC_VO].maxLatency <= 1);
+    EXPECT(prio[AC_VO].dropped == 0);
+    // Video frames arrive at a rate below their share of the link
+    EXPECT(prio[AC_VI].meanLatency() < 2);
+    EXPECT(prio[AC_VI].dropped == 0);
+    // The bulk flow gets the rest of the link
+    EXPECT(prio[AC_VO].count + prio[AC_VI].count + prio[AC_BE].count == SIM_DURATION);
+}
+
+BENCHMARK(bulkFlowLatencyReport) {
+    FlowStats stats[2][AC_COUNT] = {};
+    simulate(false, stats[0]);
+    simulate(true, stats[1]);
+    // 1500 byte frames at 921600 bps take about 16 ms to send
+    const double frameTime = 1500 * 10 / 921600.0 * 1000;
+    const char* const names[] = { "voice", "video", "bulk" };
+    for (unsigned mode = 0; mode < 2; ++mode) {
+        for (unsigned ac = AC_VO; ac <= AC_BE; ++ac) {
+            const auto& s = stats[mode][ac];
+            printf("%-11s %-5s: queueing delay mean %6.1f ms, max %6.1f ms, sent %5u, dropped %5u\n",
+                    mode ? "per-AC" : "single FIFO", names[ac], s.meanLatency() * frameTime,
+                    s.maxLatency * frameTime, s.count, s.dropped);
+        }
+    }
+}
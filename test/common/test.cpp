@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "test.h"
+
+#include <cstring>
+#include <vector>
+
+namespace test {
+
+namespace {
+
+struct Test {
+    const char* name;
+    TestFunc func;
+    bool bench;
+};
+
+std::vector<Test>& tests() {
+    static std::vector<Test> t;
+    return t;
+}
+
+unsigned g_failures = 0;
+
+} // anonymous
+
+Registrar::Registrar(const char* name, TestFunc func, bool bench) {
+    tests().push_back({ name, func, bench });
+}
+
+void fail(const char* file, int line, const char* expr) {
+    fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+    ++g_failures;
+}
+
+} // test
+
+// Usage: <test> [--bench] [name]
+int main(int argc, char* argv[]) {
+    bool bench = false;
+    const char* filter = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--bench") == 0) {
+            bench = true;
+        } else {
+            filter = argv[i];
+        }
+    }
+    unsigned failed = 0;
+    unsigned count = 0;
+    for (const auto& t: test::tests()) {
+        if (t.bench != bench || (filter && strcmp(filter, t.name) != 0)) {
+            continue;
+        }
+        printf("[ RUN  ] %s\n", t.name);
+        fflush(stdout);
+        const auto failures = test::g_failures;
+        const auto start = test::seconds();
+        t.func();
+        const auto ms = (unsigned)((test::seconds() - start) * 1000);
+        const bool ok = (test::g_failures == failures);
+        printf("[ %s ] %s (%u ms)\n", ok ? " OK " : "FAIL", t.name, ms);
+        if (!ok) {
+            ++failed;
+        }
+        ++count;
+    }
+    printf("%u of %u %s passed\n", count - failed, count, bench ? "benchmarks" : "tests");
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Minimal test runner for the host builds. Tests are registered with TEST() and run in the
+// order of registration, benchmarks are registered with BENCHMARK() and only run when the
+// test binary is started with --bench
+
+#include <cstdio>
+#include <cstdint>
+#include <chrono>
+
+namespace test {
+
+typedef void (*TestFunc)();
+
+struct Registrar {
+    Registrar(const char* name, TestFunc func, bool bench);
+};
+
+void fail(const char* file, int line, const char* expr);
+
+// Seconds since an arbitrary point
+inline double seconds() {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // test
+
+#define TEST(_name) \
+        static void _name(); \
+        static ::test::Registrar _name##_registrar(#_name, _name, false); \
+        static void _name()
+
+#define BENCHMARK(_name) \
+        static void _name(); \
+        static ::test::Registrar _name##_registrar(#_name, _name, true); \
+        static void _name()
+
+// Fails the current test and continues
+#define EXPECT(_expr) \
+        do { \
+            if (!(_expr)) { \
+                ::test::fail(__FILE__, __LINE__, #_expr); \
+            } \
+        } while (false)
+
+// Fails and leaves the current test
+#define ASSERT(_expr) \
+        do { \
+            if (!(_expr)) { \
+                ::test::fail(__FILE__, __LINE__, #_expr); \
+                return; \
+            } \
+        } while (false)
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests and benchmarks of the table-driven CRC-16 against the bitwise implementation it replaced
+
+#include "test.h"
+#include "util/crc.h"
+
+#include <random>
+#include <vector>
+
+using namespace particle::util;
+
+namespace {
+
+// Bitwise CRC-CCITT (XMODEM), as used by the XMODEM receiver before the table was introduced
+uint16_t bitwiseCrc16(const char* data, size_t size, uint16_t crc = 0) {
+    const auto end = data + size;
+    while (data < end) {
+        const uint8_t c = *data++;
+        crc ^= (uint16_t)c << 8;
+        for (unsigned i = 0; i < 8; ++i) {
+            if (crc & 0x8000) {
+                crc = (crc << 1) ^ 0x1021;
+            } else {
+                crc <<= 1;
+            }
+        }
+    }
+    return crc;
+}
+
+std::vector<char> randomData(size_t size, std::mt19937* rnd) {
+    std::vector<char> d(size);
+    for (auto& c: d) {
+        c = (char)(*rnd)();
+    }
+    return d;
+}
+
+// Keeps the compiler from optimizing the benchmarked calls away
+volatile uint16_t g_sink = 0;
+
+template<typename F>
+double crcThroughput(F crcFunc, const std::vector<char>& packet, double duration) {
+    size_t bytes = 0;
+    const double start = test::seconds();
+    double elapsed = 0;
+    do {
+        for (unsigned i = 0; i < 1000; ++i) {
+            g_sink = crcFunc(packet.data(), packet.size(), g_sink);
+        }
+        bytes += packet.size() * 1000;
+        elapsed = test::seconds() - start;
+    } while (elapsed < duration);
+    return bytes / elapsed;
+}
+
+} // anonymous
+
+TEST(matchesBitwise) {
+    std::mt19937 rnd(1);
+    for (size_t size: { 0, 1, 2, 127, 128, 1024, 1029, 4096 }) {
+        const auto d = randomData(size, &rnd);
+        EXPECT(calcCrc16(d.data(), d.size()) == bitwiseCrc16(d.data(), d.size()));
+    }
+}
+
+TEST(continuation) {
+    std::mt19937 rnd(2);
+    const auto d = randomData(3000, &rnd);
+    const uint16_t expected = bitwiseCrc16(d.data(), d.size());
+    for (unsigned i = 0; i < 100; ++i) {
+        const size_t split = rnd() % d.size();
+        const uint16_t crc = calcCrc16(d.data() + split, d.size() - split, calcCrc16(d.data(), split));
+        EXPECT(crc == expected);
+    }
+}
+
+BENCHMARK(crcThroughput) {
+    std::mt19937 rnd(3);
+    // Packet sizes of XMODEM, XMODEM-1K and the sliding window protocol
+    for (size_t size: { 128, 1024, 4096 }) {
+        const auto packet = randomData(size, &rnd);
+        const double table = crcThroughput([](const char* d, size_t n, uint16_t crc) {
+            return calcCrc16(d, n, crc);
+        }, packet, 1.0);
+        const double bitwise = crcThroughput(bitwiseCrc16, packet, 1.0);
+        printf("CRC-16, %4u byte packets: table %7.1f MB/s, bitwise %7.1f MB/s, %.1fx\n", (unsigned)size,
+                table / 1e6, bitwise / 1e6, table / bitwise);
+    }
+}
@@ -0,0 +1,593 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests and benchmarks of the SDIO transport running against the emulated SDIO slave driver
+
+#include "test.h"
+#include "sdio_host.h"
+#include "at_transport_sdio.h"
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace particle;
+using namespace particle::ncp;
+
+namespace {
+
+const unsigned HOST_TIMEOUT = 5000;
+
+#if CONFIG_NCP_SDIO_PACKET_MODE
+// The host reads one packet at a time and needs a buffer large enough for any of them
+const bool PACKET_MODE = true;
+#else
+const bool PACKET_MODE = false;
+#endif
+
+// Deterministic test data
+uint8_t pattern(size_t offs) {
+    return (uint8_t)((offs * 131) ^ (offs >> 8));
+}
+
+class Transport {
+public:
+    explicit Transport(const AtSdioTransport::Config& conf = AtSdioTransport::defaultConfig()) :
+            t_(new AtSdioTransport(conf)) {
+        sdio_host::resetStats();
+        t_->init();
+        t_->postInit();
+        // Received data is read by the test instead of the AT parser
+        t_->setDirectMode(true);
+    }
+
+    ~Transport() {
+        t_->setDirectMode(false);
+        t_->destroy();
+    }
+
+    AtSdioTransport* operator->() {
+        return t_.get();
+    }
+
+private:
+    std::unique_ptr<AtSdioTransport> t_;
+};
+
+// Writes `size` bytes of the test pattern, looping on partial writes
+bool writeAll(AtSdioTransport* t, size_t size, std::mt19937* rnd, size_t maxChunk = 1500) {
+    std::vector<uint8_t> buf(maxChunk);
+    size_t offs = 0;
+    while (offs < size) {
+        const size_t n = std::min<size_t>(size - offs, (*rnd)() % maxChunk + 1);
+        for (size_t i = 0; i < n; ++i) {
+            buf[i] = pattern(offs + i);
+        }
+        size_t done = 0;
+        auto lastWrite = test::seconds();
+        while (done < n) {
+            const int r = t->writeData(buf.data() + done, n - done);
+            if (r < 0) {
+                return false;
+            }
+            if (r > 0) {
+                lastWrite = test::seconds();
+            } else if (test::seconds() - lastWrite > HOST_TIMEOUT / 1000.0) {
+                fprintf(stderr, "Write timed out at offset %u of %u\n", (unsigned)(offs + done), (unsigned)size);
+                return false;
+            }
+            done += r;
+        }
+        offs += n;
+    }
+    return true;
+}
+
+// Reads `size` bytes of the test pattern on the host side
+bool hostReadAll(size_t size, size_t maxChunk = 4096) {
+    std::vector<uint8_t> buf(maxChunk);
+    size_t offs = 0;
+    while (offs < size) {
+        const size_t n = sdio_host::read(buf.data(), buf.size(), HOST_TIMEOUT);
+        if (n == 0) {
+            fprintf(stderr, "Host read timed out at offset %u of %u\n", (unsigned)offs, (unsigned)size);
+            return false;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            if (buf[i] != pattern(offs + i)) {
+                fprintf(stderr, "Data mismatch at offset %u\n", (unsigned)(offs + i));
+                return false;
+            }
+        }
+        offs += n;
+    }
+    return true;
+}
+
+// Reads `size` bytes of the test pattern from the transport
+bool readAll(AtSdioTransport* t, size_t size, std::mt19937* rnd, bool borrow) {
+    std::vector<uint8_t> buf(2048);
+    size_t offs = 0;
+    while (offs < size) {
+        if (t->waitData(HOST_TIMEOUT) <= 0) {
+            fprintf(stderr, "Read timed out at offset %u of %u\n", (unsigned)offs, (unsigned)size);
+            return false;
+        }
+        const uint8_t* data = nullptr;
+        int n = 0;
+        if (borrow) {
+            n = t->borrowData(&data);
+            if (n > 0) {
+                // Consume a part of the buffer to exercise partial returns
+                n = std::min<int>(n, (*rnd)() % 700 + 1);
+            }
+        } else {
+            n = t->readData(buf.data(), (*rnd)() % buf.size() + 1);
+            data = buf.data();
+        }
+        if (n < 0) {
+            return false;
+        }
+        for (int i = 0; i < n; ++i) {
+            if (data[i] != pattern(offs + i)) {
+                fprintf(stderr, "Data mismatch at offset %u\n", (unsigned)(offs + i));
+                return false;
+            }
+        }
+        if (borrow && n > 0 && t->returnData(n) < 0) {
+            return false;
+        }
+        offs += n;
+    }
+    return true;
+}
+
+size_t corruptions() {
+    sdio_host::Stats s = {};
+    sdio_host::stats(&s);
+    return s.corruptions;
+}
+
+} // anonymous
+
+TEST(txIntegrity) {
+    Transport t;
+    const size_t size = 4 * 1024 * 1024;
+    std::atomic_bool hostOk(false);
+    std::thread host([&]() {
+        hostOk = hostReadAll(size, 1000);
+    });
+    std::mt19937 rnd(1);
+    EXPECT(writeAll(t.operator->(), size, &rnd));
+    host.join();
+    EXPECT(hostOk);
+    EXPECT(t->waitWriteComplete(1000) == 0);
+    EXPECT(corruptions() == 0);
+}
+
+// The data left in the TX ring when the host stops reading is sent once the host resumes,
+// without any further writes, and the writes don't wait for the host
+TEST(txTailSentAfterHostStall) {
+    auto conf = AtSdioTransport::defaultConfig();
+    conf.queueSize = 2;
+    Transport t(conf);
+    std::mt19937 rnd(2);
+    // More than the sends in flight can hold
+    const size_t size = conf.bufferNum * AT_SDIO_BUFFER_SIZE - 64;
+    const auto start = test::seconds();
+    EXPECT(writeAll(t.operator->(), size, &rnd, 100));
+    EXPECT(test::seconds() - start < 0.1);
+    // Longer than any timeout in the transport
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    EXPECT(hostReadAll(size));
+    EXPECT(t->waitWriteComplete(1000) == 0);
+    EXPECT(corruptions() == 0);
+}
+
+// Several threads waiting for the TX ring to drain while the data is being written
+TEST(txConcurrentWaiters) {
+    auto conf = AtSdioTransport::defaultConfig();
+    conf.queueSize = 4;
+    Transport t(conf);
+    const size_t size = 1024 * 1024;
+    std::atomic_bool done(false);
+    std::atomic<unsigned> waits(0);
+    std::vector<std::thread> waiters;
+    for (int i = 0; i < 3; ++i) {
+        waiters.emplace_back([&]() {
+            while (!done) {
+                const int r = t->waitWriteComplete(100);
+                EXPECT(r == 0 || r == particle::RESULT_TIMEOUT);
+                ++waits;
+            }
+        });
+    }
+    std::thread host([&]() {
+        std::mt19937 rnd(3);
+        std::vector<uint8_t> buf(4096);
+        size_t offs = 0;
+        while (offs < size) {
+            // Uneven pace
+            const size_t n = sdio_host::read(buf.data(), PACKET_MODE ? buf.size() : rnd() % buf.size() + 1,
+                    HOST_TIMEOUT);
+            if (n == 0) {
+                break;
+            }
+            offs += n;
+            if (rnd() % 16 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+        EXPECT(offs == size);
+    });
+    std::mt19937 rnd(4);
+    EXPECT(writeAll(t.operator->(), size, &rnd));
+    host.join();
+    // Once the host has read everything, the waiters are released right away
+    const auto start = test::seconds();
+    EXPECT(t->waitWriteComplete(1000) == 0);
+    EXPECT(test::seconds() - start < 0.05);
+    done = true;
+    for (auto& w: waiters) {
+        w.join();
+    }
+    EXPECT(waits > 0);
+    EXPECT(corruptions() == 0);
+}
+
+TEST(rxIntegrity) {
+    for (bool borrow: { false, true }) {
+        Transport t;
+        const size_t size = 4 * 1024 * 1024;
+        std::thread host([&]() {
+            std::mt19937 rnd(5);
+            std::vector<uint8_t> buf(3000);
+            size_t offs = 0;
+            while (offs < size) {
+                const size_t n = std::min<size_t>(size - offs, rnd() % buf.size() + 1);
+                for (size_t i = 0; i < n; ++i) {
+                    buf[i] = pattern(offs + i);
+                }
+                const size_t w = sdio_host::write(buf.data(), n, HOST_TIMEOUT);
+                offs += w;
+                if (w < n) {
+                    break;
+                }
+            }
+            EXPECT(offs == size);
+        });
+        std::mt19937 rnd(6);
+        EXPECT(readAll(t.operator->(), size, &rnd, borrow));
+        host.join();
+        EXPECT(t->getDataLength() == 0);
+    }
+}
+
+// Bidirectional traffic, then the transport is destroyed and reinitialized
+TEST(restart) {
+    for (int i = 0; i < 3; ++i) {
+        Transport t;
+        const size_t size = 256 * 1024;
+        std::thread host([&]() {
+            EXPECT(hostReadAll(size));
+        });
+        std::thread hostWriter([&]() {
+            std::vector<uint8_t> buf(size);
+            for (size_t i = 0; i < size; ++i) {
+                buf[i] = pattern(i);
+            }
+            EXPECT(sdio_host::write(buf.data(), size, HOST_TIMEOUT) == size);
+        });
+        std::mt19937 rnd(7);
+        std::thread reader([&]() {
+            std::mt19937 rnd(8);
+            EXPECT(readAll(t.operator->(), size, &rnd, false));
+        });
+        EXPECT(writeAll(t.operator->(), size, &rnd));
+        host.join();
+        hostWriter.join();
+        reader.join();
+    }
+}
+
+// The transport can be destroyed while the host isn't reading the data in flight
+TEST(destroyWithHostStalled) {
+    auto t = std::unique_ptr<Transport>(new Transport());
+    std::mt19937 rnd(9);
+    const auto conf = (*t)->config();
+    EXPECT(writeAll(t->operator->(), conf.bufferNum * AT_SDIO_BUFFER_SIZE / 2, &rnd));
+    const auto start = test::seconds();
+    t.reset();
+    // The threads check for exit at least once a second
+    EXPECT(test::seconds() - start < 1.5);
+}
+
+namespace {
+
+bool sameConfig(const AtSdioTransport::Config& a, const AtSdioTransport::Config& b) {
+    return a.bufferNum == b.bufferNum && a.queueSize == b.queueSize;
+}
+
+// Receive buffers and the TX ring, without the per-buffer bookkeeping
+size_t minBufferMemory(const AtSdioTransport::Config& conf) {
+    size_t size = conf.bufferNum * AT_SDIO_BUFFER_SIZE * 2;
+#if CONFIG_NCP_SDIO_PACKET_MODE
+    size += AT_SDIO_TX_PACKET_NUM * AT_SDIO_TX_PACKET_SIZE;
+#endif
+    return size;
+}
+
+// Transfers data in both directions at once
+void bidirectional(AtSdioTransport* t, size_t size, unsigned seed) {
+    std::thread host([&]() {
+        EXPECT(hostReadAll(size));
+    });
+    std::thread hostWriter([&]() {
+        std::vector<uint8_t> buf(size);
+        for (size_t i = 0; i < size; ++i) {
+            buf[i] = pattern(i);
+        }
+        EXPECT(sdio_host::write(buf.data(), size, HOST_TIMEOUT) == size);
+    });
+    std::thread reader([&]() {
+        std::mt19937 rnd(seed + 1);
+        EXPECT(readAll(t, size, &rnd, false));
+    });
+    std::mt19937 rnd(seed);
+    EXPECT(writeAll(t, size, &rnd));
+    host.join();
+    hostWriter.join();
+    reader.join();
+}
+
+} // anonymous
+
+// Buffer geometries other than the Kconfig defaults, down to the smallest one
+TEST(bufferGeometry) {
+    const AtSdioTransport::Config confs[] = { { 2, 1 }, { 4, 2 }, { 32, 16 }, { 64, 64 } };
+    for (const auto& conf: confs) {
+        Transport t(conf);
+        ASSERT(sameConfig(t->config(), conf));
+        const size_t mem = t->bufferMemory();
+        EXPECT(mem >= minBufferMemory(conf) && mem <= minBufferMemory(conf) + conf.bufferNum * 64);
+        bidirectional(t.operator->(), 256 * 1024, 11);
+        sdio_host::Stats s = {};
+        sdio_host::stats(&s);
+        EXPECT(s.maxSendsQueued <= conf.queueSize);
+        EXPECT(corruptions() == 0);
+    }
+}
+
+// An invalid geometry stored in NVS doesn't prevent the transport from starting
+TEST(invalidGeometryFallsBack) {
+    const auto def = AtSdioTransport::defaultConfig();
+    const AtSdioTransport::Config confs[] = { { 1, 20 }, { 65, 20 }, { 10, 0 }, { 10, 65 } };
+    for (const auto& conf: confs) {
+        EXPECT(AtSdioTransport::checkConfig(conf) == RESULT_INVALID_PARAM);
+        Transport t(conf);
+        EXPECT(sameConfig(t->config(), def));
+        EXPECT(t->bufferMemory() >= minBufferMemory(def));
+        bidirectional(t.operator->(), 64 * 1024, 12);
+    }
+}
+
+TEST(bufferMemoryBeforeInit) {
+    AtSdioTransport t;
+    EXPECT(t.bufferMemory() == 0);
+}
+
+#if CONFIG_NCP_SDIO_PACKET_MODE
+
+// Packets are sent in order with the data written before them
+TEST(packetOrdering) {
+    Transport t;
+    const size_t count = 2000;
+    std::thread host([&]() {
+        size_t offs = 0;
+        std::vector<uint8_t> buf(AT_SDIO_TX_PACKET_SIZE + 4096);
+        size_t packets = 0;
+        while (offs < count * 200) {
+            const size_t n = sdio_host::read(buf.data(), buf.size(), HOST_TIMEOUT);
+            if (n == 0) {
+                break;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                if (buf[i] != pattern(offs + i)) {
+                    fprintf(stderr, "Data mismatch at offset %u\n", (unsigned)(offs + i));
+                    EXPECT(false);
+                    return;
+                }
+            }
+            offs += n;
+            ++packets;
+        }
+        EXPECT(offs == count * 200);
+    });
+    std::mt19937 rnd(10);
+    size_t offs = 0;
+    for (size_t i = 0; i < count; ++i) {
+        // Alternate between the TX ring and the packet buffers
+        const size_t n = 200;
+        if (rnd() % 2) {
+            uint8_t* p = t->allocPacket(n, 1000);
+            ASSERT(p);
+            for (size_t j = 0; j < n; ++j) {
+                p[j] = pattern(offs + j);
+            }
+            EXPECT(t->sendPacket(p, n, 1000) == 0);
+        } else {
+            uint8_t buf[n];
+            for (size_t j = 0; j < n; ++j) {
+                buf[j] = pattern(offs + j);
+            }
+            size_t done = 0;
+            while (done < n) {
+                const int r = t->writeData(buf + done, n - done);
+                ASSERT(r >= 0);
+                done += r;
+            }
+        }
+        offs += n;
+    }
+    host.join();
+    EXPECT(t->waitWriteComplete(1000) == 0);
+    EXPECT(corruptions() == 0);
+}
+
+#endif // CONFIG_NCP_SDIO_PACKET_MODE
+
+namespace {
+
+void benchTx(unsigned linkRate, size_t queueSize, size_t chunkSize) {
+    auto conf = AtSdioTransport::defaultConfig();
+    conf.queueSize = queueSize;
+    sdio_host::setLinkRate(linkRate);
+    Transport t(conf);
+    const size_t size = linkRate ? 4 * 1024 * 1024 : 64 * 1024 * 1024;
+    std::thread host([&]() {
+        std::vector<uint8_t> buf(8192);
+        size_t offs = 0;
+        while (offs < size) {
+            const size_t n = sdio_host::read(buf.data(), buf.size(), HOST_TIMEOUT);
+            if (n == 0) {
+                break;
+            }
+            offs += n;
+        }
+        EXPECT(offs == size);
+    });
+    std::vector<uint8_t> buf(chunkSize, 0x55);
+    const auto start = test::seconds();
+    size_t offs = 0;
+    while (offs < size) {
+        const int r = t->writeData(buf.data(), std::min(chunkSize, size - offs));
+        ASSERT(r >= 0);
+        offs += r;
+    }
+    EXPECT(t->waitWriteComplete(HOST_TIMEOUT) == 0);
+    const auto elapsed = test::seconds() - start;
+    host.join();
+    sdio_host::Stats s = {};
+    sdio_host::stats(&s);
+    printf("TX: link %5.1f MB/s, queue %2u, chunk %4u: %7.1f MB/s, %u sends, max %u queued\n",
+            linkRate / 1e6, (unsigned)queueSize, (unsigned)chunkSize, size / elapsed / 1e6, (unsigned)s.sends,
+            (unsigned)s.maxSendsQueued);
+    sdio_host::setLinkRate(0);
+}
+
+} // anonymous
+
+// Throughput of the transport with an unlimited link shows the overhead of the transport itself,
+// with an emulated 25 MHz 4-bit bus (~12.5 MB/s) it shows the effect of the send queue depth
+BENCHMARK(txThroughput) {
+    for (size_t chunk: { 64, 512, 1460 }) {
+        benchTx(0, AT_SDIO_QUEUE_SIZE, chunk);
+    }
+    for (size_t queue: { 1, 2, AT_SDIO_QUEUE_SIZE }) {
+        benchTx(12500000, queue, 1460);
+    }
+}
+
+BENCHMARK(rxThroughput) {
+    for (bool borrow: { false, true }) {
+        Transport t;
+        const size_t size = 64 * 1024 * 1024;
+        std::thread host([&]() {
+            std::vector<uint8_t> buf(8192, 0xaa);
+            size_t offs = 0;
+            while (offs < size) {
+                const size_t n = sdio_host::write(buf.data(), std::min(buf.size(), size - offs), HOST_TIMEOUT);
+                if (n == 0) {
+                    break;
+                }
+                offs += n;
+            }
+        });
+        std::vector<uint8_t> buf(2048);
+        const auto start = test::seconds();
+        size_t offs = 0;
+        while (offs < size) {
+            if (t->waitData(HOST_TIMEOUT) <= 0) {
+                break;
+            }
+            int n = 0;
+            if (borrow) {
+                const uint8_t* data = nullptr;
+                n = t->borrowData(&data);
+                if (n > 0) {
+                    t->returnData(n);
+                }
+            } else {
+                n = t->readData(buf.data(), buf.size());
+            }
+            ASSERT(n >= 0);
+            offs += n;
+        }
+        const auto elapsed = test::seconds() - start;
+        host.join();
+        EXPECT(offs == size);
+        printf("RX (%s): %7.1f MB/s\n", borrow ? "borrowData" : "readData", size / elapsed / 1e6);
+    }
+}
+
+// Throughput of host writes when the reader stalls periodically, as the muxer does while it's
+// waiting for WiFi, against the memory used by the receive buffers
+BENCHMARK(rxBufferGeometry) {
+    sdio_host::setLinkRate(12500000);
+    for (size_t bufferNum: { 2, 4, 10, 32 }) {
+        auto conf = AtSdioTransport::defaultConfig();
+        conf.bufferNum = bufferNum;
+        Transport t(conf);
+        const size_t size = 8 * 1024 * 1024;
+        std::thread host([&]() {
+            std::vector<uint8_t> buf(8192, 0xaa);
+            size_t offs = 0;
+            while (offs < size) {
+                const size_t n = sdio_host::write(buf.data(), std::min(buf.size(), size - offs), HOST_TIMEOUT);
+                if (n == 0) {
+                    break;
+                }
+                offs += n;
+            }
+        });
+        std::vector<uint8_t> buf(2048);
+        const auto start = test::seconds();
+        size_t offs = 0;
+        size_t nextStall = 0;
+        while (offs < size) {
+            if (t->waitData(HOST_TIMEOUT) <= 0) {
+                break;
+            }
+            const int n = t->readData(buf.data(), buf.size());
+            ASSERT(n >= 0);
+            offs += n;
+            if (offs >= nextStall) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                nextStall += 16 * 1024;
+            }
+        }
+        const auto elapsed = test::seconds() - start;
+        host.join();
+        EXPECT(offs == size);
+        printf("RX: %2u buffers, %6.1f KB: %5.1f MB/s\n", (unsigned)bufferNum, t->bufferMemory() / 1024.0,
+                size / elapsed / 1e6);
+    }
+    sdio_host::setLinkRate(0);
+}
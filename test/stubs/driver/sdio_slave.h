@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Subset of the ESP-IDF SDIO slave driver API. The host side of the link is emulated
+// in memory, see sdio_host.h
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+#include <cstdint>
+#include <cstddef>
+
+#define HOST_SLC0_TOHOST_BIT0_INT_ENA_S 0
+
+typedef enum {
+    SDIO_SLAVE_SEND_STREAM = 0,
+    SDIO_SLAVE_SEND_PACKET = 1
+} sdio_slave_sending_mode_t;
+
+typedef enum {
+    SDIO_SLAVE_TIMING_PSEND_PSAMPLE = 0,
+    SDIO_SLAVE_TIMING_NSEND_PSAMPLE,
+    SDIO_SLAVE_TIMING_PSEND_NSAMPLE,
+    SDIO_SLAVE_TIMING_NSEND_NSAMPLE
+} sdio_slave_timing_t;
+
+typedef uint32_t sdio_slave_hostint_t;
+
+#define SDIO_SLAVE_HOSTINT_BIT0 (1 << 0)
+#define SDIO_SLAVE_HOSTINT_SEND_NEW_PACKET (1 << 23)
+
+typedef void (*sdio_event_cb_t)(uint8_t event);
+
+typedef struct {
+    sdio_slave_timing_t timing;
+    sdio_slave_sending_mode_t sending_mode;
+    int send_queue_size;
+    size_t recv_buffer_size;
+    sdio_event_cb_t event_cb;
+    uint32_t flags;
+} sdio_slave_config_t;
+
+typedef void* sdio_slave_buf_handle_t;
+
+esp_err_t sdio_slave_initialize(sdio_slave_config_t* config);
+void sdio_slave_deinit();
+esp_err_t sdio_slave_start();
+void sdio_slave_stop();
+
+sdio_slave_buf_handle_t sdio_slave_recv_register_buf(uint8_t* start);
+esp_err_t sdio_slave_recv_load_buf(sdio_slave_buf_handle_t handle);
+esp_err_t sdio_slave_recv(sdio_slave_buf_handle_t* handle_ret, uint8_t** out_addr, size_t* out_len, TickType_t wait);
+
+esp_err_t sdio_slave_send_queue(uint8_t* addr, size_t len, void* arg, TickType_t wait);
+esp_err_t sdio_slave_send_get_finished(void** out_arg, TickType_t wait);
+
+void sdio_slave_set_host_intena(sdio_slave_hostint_t ena);
+esp_err_t sdio_slave_send_host_int(uint8_t pos);
@@ -0,0 +1,105 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Subset of the ESP-IDF UART driver API. The host side of the link is emulated
+// in memory, see uart_host.h
+
+#include "esp_err.h"
+#include "driver/gpio.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#include <cstdint>
+#include <cstddef>
+
+#define UART_PIN_NO_CHANGE (-1)
+
+typedef enum {
+    UART_NUM_0 = 0,
+    UART_NUM_1 = 1,
+    UART_NUM_2 = 2,
+    UART_NUM_MAX
+} uart_port_t;
+
+typedef enum {
+    UART_DATA_5_BITS = 0,
+    UART_DATA_6_BITS = 1,
+    UART_DATA_7_BITS = 2,
+    UART_DATA_8_BITS = 3
+} uart_word_length_t;
+
+typedef enum {
+    UART_STOP_BITS_1 = 1,
+    UART_STOP_BITS_1_5 = 2,
+    UART_STOP_BITS_2 = 3
+} uart_stop_bits_t;
+
+typedef enum {
+    UART_PARITY_DISABLE = 0,
+    UART_PARITY_EVEN = 2,
+    UART_PARITY_ODD = 3
+} uart_parity_t;
+
+typedef enum {
+    UART_HW_FLOWCTRL_DISABLE = 0,
+    UART_HW_FLOWCTRL_RTS = 1,
+    UART_HW_FLOWCTRL_CTS = 2,
+    UART_HW_FLOWCTRL_CTS_RTS = 3
+} uart_hw_flowcontrol_t;
+
+typedef struct {
+    int baud_rate;
+    uart_word_length_t data_bits;
+    uart_parity_t parity;
+    uart_stop_bits_t stop_bits;
+    uart_hw_flowcontrol_t flow_ctrl;
+    uint8_t rx_flow_ctrl_thresh;
+    bool use_ref_tick;
+} uart_config_t;
+
+typedef enum {
+    UART_DATA,
+    UART_BREAK,
+    UART_BUFFER_FULL,
+    UART_FIFO_OVF,
+    UART_FRAME_ERR,
+    UART_PARITY_ERR,
+    UART_DATA_BREAK,
+    UART_PATTERN_DET,
+    UART_EVENT_MAX
+} uart_event_type_t;
+
+typedef struct {
+    uart_event_type_t type;
+    size_t size;
+    bool timeout_flag;
+} uart_event_t;
+
+esp_err_t uart_param_config(uart_port_t uart, const uart_config_t* config);
+esp_err_t uart_set_pin(uart_port_t uart, int txPin, int rxPin, int rtsPin, int ctsPin);
+esp_err_t uart_driver_install(uart_port_t uart, int rxBufferSize, int txBufferSize, int queueSize,
+        QueueHandle_t* queue, int intrAllocFlags);
+esp_err_t uart_driver_delete(uart_port_t uart);
+
+int uart_read_bytes(uart_port_t uart, uint8_t* buf, uint32_t length, TickType_t ticks);
+int uart_write_bytes(uart_port_t uart, const char* src, size_t size);
+esp_err_t uart_flush_input(uart_port_t uart);
+esp_err_t uart_get_buffered_data_len(uart_port_t uart, size_t* size);
+esp_err_t uart_wait_tx_done(uart_port_t uart, TickType_t ticks);
+esp_err_t uart_set_baudrate(uart_port_t uart, uint32_t baudRate);
@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Subset of the esp-at port API used by the transports
+
+#include <cstdint>
+
+extern "C" {
+
+typedef enum {
+    ESP_AT_STATUS_NORMAL = 0x0,
+    ESP_AT_STATUS_TRANSMIT
+} esp_at_status_type;
+
+typedef struct {
+    int32_t (*read_data)(uint8_t* data, int32_t len);
+    int32_t (*write_data)(uint8_t* data, int32_t len);
+    int32_t (*get_data_length)(void);
+    bool (*wait_write_complete)(int32_t timeout_msec);
+} esp_at_device_ops_struct;
+
+typedef struct {
+    void (*status_callback)(esp_at_status_type status);
+    void (*pre_deepsleep_callback)(void);
+    void (*pre_restart_callback)(void);
+} esp_at_custom_ops_struct;
+
+void esp_at_device_ops_regist(esp_at_device_ops_struct* ops);
+void esp_at_custom_ops_regist(esp_at_custom_ops_struct* ops);
+bool esp_at_port_recv_data_notify(int32_t len, uint32_t msec);
+
+// Host test hook called from esp_at_port_recv_data_notify()
+typedef bool (*esp_at_host_notify_cb)(int32_t len, uint32_t msec);
+void esp_at_host_set_notify_callback(esp_at_host_notify_cb cb);
+
+} // extern "C"
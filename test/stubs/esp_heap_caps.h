@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+
+#define MALLOC_CAP_DMA (1 << 3)
+#define MALLOC_CAP_8BIT (1 << 2)
+
+inline void* heap_caps_malloc(size_t size, uint32_t caps) {
+    // DMA buffers are word-aligned
+    return aligned_alloc(4, (size + 3) & ~(size_t)3);
+}
+
+inline void heap_caps_free(void* ptr) {
+    free(ptr);
+}
+
+inline bool esp_ptr_dma_capable(const void* ptr) {
+    return ((uintptr_t)ptr & 3) == 0;
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdio>
+#include <cstdint>
+#include <cstddef>
+
+typedef enum {
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+// Messages above this level are not printed
+extern esp_log_level_t g_hostLogLevel;
+
+#define ESP_LOG_LEVEL_LOCAL(_level, _tag, _fmt, ...) \
+        do { \
+            if ((_level) <= g_hostLogLevel) { \
+                fprintf(stderr, "[%s] " _fmt "\n", _tag, ##__VA_ARGS__); \
+            } \
+        } while (false)
+
+#define ESP_LOG_BUFFER_HEXDUMP(_tag, _data, _size, _level)
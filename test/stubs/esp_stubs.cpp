@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "esp_err.h"
+#include "esp_log.h"
+#include "esp_at.h"
+#include "esp_timer.h"
+#include "xtensa/hal.h"
+
+#include <atomic>
+#include <chrono>
+
+esp_log_level_t g_hostLogLevel = ESP_LOG_WARN;
+
+namespace {
+
+std::atomic<esp_at_host_notify_cb> g_notifyCb(nullptr);
+
+const auto g_startTime = std::chrono::steady_clock::now();
+
+} // anonymous
+
+const char* esp_err_to_name(esp_err_t err) {
+    switch (err) {
+    case ESP_OK:
+        return "ESP_OK";
+    case ESP_FAIL:
+        return "ESP_FAIL";
+    case ESP_ERR_NO_MEM:
+        return "ESP_ERR_NO_MEM";
+    case ESP_ERR_INVALID_ARG:
+        return "ESP_ERR_INVALID_ARG";
+    case ESP_ERR_INVALID_STATE:
+        return "ESP_ERR_INVALID_STATE";
+    case ESP_ERR_INVALID_SIZE:
+        return "ESP_ERR_INVALID_SIZE";
+    case ESP_ERR_NOT_FOUND:
+        return "ESP_ERR_NOT_FOUND";
+    case ESP_ERR_NOT_SUPPORTED:
+        return "ESP_ERR_NOT_SUPPORTED";
+    case ESP_ERR_TIMEOUT:
+        return "ESP_ERR_TIMEOUT";
+    default:
+        return "UNKNOWN ERROR";
+    }
+}
+
+void esp_at_device_ops_regist(esp_at_device_ops_struct* ops) {
+}
+
+void esp_at_custom_ops_regist(esp_at_custom_ops_struct* ops) {
+}
+
+bool esp_at_port_recv_data_notify(int32_t len, uint32_t msec) {
+    const auto cb = g_notifyCb.load();
+    return cb ? cb(len, msec) : true;
+}
+
+void esp_at_host_set_notify_callback(esp_at_host_notify_cb cb) {
+    g_notifyCb = cb;
+}
+
+int64_t esp_timer_get_time() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+            g_startTime).count();
+}
+
+uint32_t xthal_get_ccount() {
+    return (uint32_t)(esp_timer_get_time() * 240);
+}
@@ -0,0 +1,192 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flash_host.h"
+#include "esp_ota_ops.h"
+#include "esp_spi_flash.h"
+#include "rom/crc.h"
+
+#include <chrono>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+namespace {
+
+const uint32_t PARTITION_ADDRESS = 0x10000;
+
+esp_partition_t g_parts[2] = {
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, PARTITION_ADDRESS, flash_host::PARTITION_SIZE,
+            "ota_0", false },
+    { ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_1, PARTITION_ADDRESS + flash_host::PARTITION_SIZE,
+            flash_host::PARTITION_SIZE, "ota_1", false }
+};
+
+uint8_t g_data[2][flash_host::PARTITION_SIZE];
+const esp_partition_t* g_bootPart = nullptr;
+flash_host::Stats g_stats = {};
+unsigned g_writeTimePerKb = 0;
+unsigned g_eraseTimePerSector = 0;
+size_t g_failOffset = std::numeric_limits<size_t>::max();
+std::mutex g_mutex;
+
+int partitionIndex(const esp_partition_t* part) {
+    for (int i = 0; i < 2; ++i) {
+        if (part == &g_parts[i]) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool checkRange(const esp_partition_t* part, size_t offs, size_t size) {
+    return partitionIndex(part) >= 0 && offs <= part->size && size <= part->size - offs;
+}
+
+void delay(unsigned us) {
+    if (us > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+    }
+}
+
+} // anonymous
+
+esp_err_t esp_partition_read(const esp_partition_t* part, size_t offs, void* dest, size_t size) {
+    if (!checkRange(part, offs, size)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    memcpy(dest, g_data[partitionIndex(part)] + offs, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t* part, size_t offs, const void* src, size_t size) {
+    if (!checkRange(part, offs, size)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    delay((uint64_t)g_writeTimePerKb * size / 1024);
+    if (part == &g_parts[1] && g_failOffset >= offs && g_failOffset - offs < size) {
+        return ESP_FAIL;
+    }
+    uint8_t* const d = g_data[partitionIndex(part)] + offs;
+    const uint8_t* const s = (const uint8_t*)src;
+    bool erased = true;
+    for (size_t i = 0; i < size; ++i) {
+        if (d[i] != 0xff) {
+            erased = false;
+        }
+        // NOR flash can only clear bits
+        d[i] &= s[i];
+    }
+    if (!erased) {
+        ++g_stats.unerasedWrites;
+    }
+    g_stats.writtenBytes += size;
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t* part, size_t offs, size_t size) {
+    if (!checkRange(part, offs, size) || offs % SPI_FLASH_SEC_SIZE != 0 || size % SPI_FLASH_SEC_SIZE != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    std::lock_guard<std::mutex> lock(g_mutex);
+    delay(g_eraseTimePerSector * (size / SPI_FLASH_SEC_SIZE));
+    memset(g_data[partitionIndex(part)] + offs, 0xff, size);
+    g_stats.erasedSectors += size / SPI_FLASH_SEC_SIZE;
+    return ESP_OK;
+}
+
+const esp_partition_t* esp_ota_get_running_partition() {
+    return &g_parts[0];
+}
+
+const esp_partition_t* esp_ota_get_next_update_partition(const esp_partition_t* start) {
+    return &g_parts[1];
+}
+
+esp_err_t esp_ota_set_boot_partition(const esp_partition_t* part) {
+    if (partitionIndex(part) < 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    // The device verifies the image here
+    std::lock_guard<std::mutex> lock(g_mutex);
+    if (g_data[partitionIndex(part)][0] != 0xe9) {
+        return ESP_FAIL;
+    }
+    g_bootPart = part;
+    return ESP_OK;
+}
+
+uint32_t crc32_le(uint32_t crc, const uint8_t* buf, uint32_t len) {
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; ++i) {
+        crc ^= buf[i];
+        for (unsigned bit = 0; bit < 8; ++bit) {
+            crc = (crc & 1) ? ((crc >> 1) ^ 0xedb88320) : (crc >> 1);
+        }
+    }
+    return ~crc;
+}
+
+namespace flash_host {
+
+void reset() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    memset(g_data, 0xff, sizeof(g_data));
+    g_bootPart = nullptr;
+    g_stats = Stats();
+    g_writeTimePerKb = 0;
+    g_eraseTimePerSector = 0;
+    g_failOffset = std::numeric_limits<size_t>::max();
+}
+
+const esp_partition_t* runningPartition() {
+    return &g_parts[0];
+}
+
+const esp_partition_t* updatePartition() {
+    return &g_parts[1];
+}
+
+const esp_partition_t* bootPartition() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return g_bootPart;
+}
+
+uint8_t* partitionData(const esp_partition_t* part) {
+    return g_data[partitionIndex(part)];
+}
+
+void stats(Stats* stats) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    *stats = g_stats;
+}
+
+void setTiming(unsigned writeTimePerKb, unsigned eraseTimePerSector) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_writeTimePerKb = writeTimePerKb;
+    g_eraseTimePerSector = eraseTimePerSector;
+}
+
+void failWritesAt(size_t offset) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_failOffset = offset;
+}
+
+} // flash_host
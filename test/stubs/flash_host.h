@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Emulated flash holding two OTA partitions. The running partition contains the base image of
+// delta updates, the other one receives the updates
+
+#include "esp_partition.h"
+
+#include <cstdint>
+#include <cstddef>
+
+namespace flash_host {
+
+const size_t PARTITION_SIZE = 256 * 1024;
+
+// Erases both partitions and makes the first one the running partition
+void reset();
+
+const esp_partition_t* runningPartition();
+const esp_partition_t* updatePartition();
+// Partition passed to esp_ota_set_boot_partition(), or null
+const esp_partition_t* bootPartition();
+
+uint8_t* partitionData(const esp_partition_t* part);
+
+struct Stats {
+    size_t erasedSectors;
+    size_t unerasedWrites; // Number of writes to flash that hasn't been erased since it was written
+    size_t writtenBytes;
+};
+
+void stats(Stats* stats);
+
+// Makes the flash operations take time. Both durations are in microseconds
+void setTiming(unsigned writeTimePerKb, unsigned eraseTimePerSector);
+
+// Makes the writes to the update partition fail if they cover the given offset
+void failWritesAt(size_t offset);
+
+} // flash_host
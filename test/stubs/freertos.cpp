@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/event_groups.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const auto g_startTime = Clock::now();
+
+// Returns false if the condition is still false once the timeout expires
+template<typename PredT>
+bool waitFor(std::condition_variable& cond, std::unique_lock<std::mutex>& lock, TickType_t ticks, PredT pred) {
+    if (ticks == portMAX_DELAY) {
+        cond.wait(lock, pred);
+        return true;
+    }
+    if (ticks == 0) {
+        return pred();
+    }
+    return cond.wait_for(lock, std::chrono::milliseconds(ticks * portTICK_PERIOD_MS), pred);
+}
+
+thread_local HostTask* g_currentTask = nullptr;
+
+std::recursive_mutex g_criticalMutex;
+
+} // anonymous
+
+struct HostTask {
+    UBaseType_t prio;
+};
+
+struct HostQueue {
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::deque<std::vector<uint8_t>> items;
+    size_t length;
+    size_t itemSize;
+};
+
+struct HostSemaphore {
+    std::mutex mutex;
+    std::condition_variable cond;
+    UBaseType_t count;
+    UBaseType_t maxCount;
+};
+
+struct HostEventGroup {
+    std::mutex mutex;
+    std::condition_variable cond;
+    EventBits_t bits;
+};
+
+BaseType_t xTaskCreate(TaskFunction_t func, const char* name, uint32_t stackDepth, void* arg, UBaseType_t prio,
+        TaskHandle_t* handle) {
+    // Task objects are leaked, handles may be used after the task exits
+    const auto task = new HostTask();
+    task->prio = prio;
+    if (handle) {
+        *handle = task;
+    }
+    std::thread([func, arg, task]() {
+        g_currentTask = task;
+        func(arg);
+    }).detach();
+    return pdPASS;
+}
+
+void vTaskDelete(TaskHandle_t task) {
+    assert(!task || task == g_currentTask);
+}
+
+void vTaskDelay(TickType_t ticks) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ticks * portTICK_PERIOD_MS));
+}
+
+TickType_t xTaskGetTickCount() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - g_startTime).count() /
+            portTICK_PERIOD_MS;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+    return g_currentTask;
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t prio) {
+    if (!task) {
+        task = g_currentTask;
+    }
+    if (task) {
+        task->prio = prio;
+    }
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task) {
+    if (!task) {
+        task = g_currentTask;
+    }
+    return task ? task->prio : tskIDLE_PRIORITY;
+}
+
+void vPortEnterCritical(portMUX_TYPE* mux) {
+    g_criticalMutex.lock();
+    ++mux->count;
+}
+
+void vPortExitCritical(portMUX_TYPE* mux) {
+    assert(mux->count > 0);
+    --mux->count;
+    g_criticalMutex.unlock();
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+    const auto q = new HostQueue();
+    q->length = length;
+    q->itemSize = itemSize;
+    return q;
+}
+
+void vQueueDelete(QueueHandle_t queue) {
+    delete queue;
+}
+
+static BaseType_t queueSend(QueueHandle_t q, const void* item, TickType_t ticks, bool front) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!waitFor(q->cond, lock, ticks, [q]() { return q->items.size() < q->length; })) {
+        return pdFALSE;
+    }
+    std::vector<uint8_t> v((const uint8_t*)item, (const uint8_t*)item + q->itemSize);
+    if (front) {
+        q->items.push_front(std::move(v));
+    } else {
+        q->items.push_back(std::move(v));
+    }
+    q->cond.notify_all();
+    return pdTRUE;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void* item, TickType_t ticks) {
+    return queueSend(queue, item, ticks, false /* front */);
+}
+
+BaseType_t xQueueSendToFront(QueueHandle_t queue, const void* item, TickType_t ticks) {
+    return queueSend(queue, item, ticks, true /* front */);
+}
+
+static BaseType_t queueReceive(QueueHandle_t q, void* item, TickType_t ticks, bool remove) {
+    std::unique_lock<std::mutex> lock(q->mutex);
+    if (!waitFor(q->cond, lock, ticks, [q]() { return !q->items.empty(); })) {
+        return pdFALSE;
+    }
+    memcpy(item, q->items.front().data(), q->itemSize);
+    if (remove) {
+        q->items.pop_front();
+        q->cond.notify_all();
+    }
+    return pdTRUE;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void* item, TickType_t ticks) {
+    return queueReceive(queue, item, ticks, true /* remove */);
+}
+
+BaseType_t xQueuePeek(QueueHandle_t queue, void* item, TickType_t ticks) {
+    return queueReceive(queue, item, ticks, false /* remove */);
+}
+
+BaseType_t xQueueReset(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    q->items.clear();
+    q->cond.notify_all();
+    return pdPASS;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    return q->items.size();
+}
+
+UBaseType_t uxQueueSpacesAvailable(QueueHandle_t q) {
+    std::lock_guard<std::mutex> lock(q->mutex);
+    return q->length - q->items.size();
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t maxCount, UBaseType_t initialCount) {
+    const auto s = new HostSemaphore();
+    s->count = initialCount;
+    s->maxCount = maxCount;
+    return s;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary() {
+    return xSemaphoreCreateCounting(1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex() {
+    // Priority inheritance and ownership checks are not emulated
+    return xSemaphoreCreateCounting(1, 1);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem) {
+    delete sem;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t s, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(s->mutex);
+    if (!waitFor(s->cond, lock, ticks, [s]() { return s->count > 0; })) {
+        return pdFALSE;
+    }
+    --s->count;
+    return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t s) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    if (s->count >= s->maxCount) {
+        return pdFALSE;
+    }
+    ++s->count;
+    s->cond.notify_all();
+    return pdTRUE;
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t s) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    return s->count;
+}
+
+EventGroupHandle_t xEventGroupCreate() {
+    const auto g = new HostEventGroup();
+    g->bits = 0;
+    return g;
+}
+
+void vEventGroupDelete(EventGroupHandle_t group) {
+    delete group;
+}
+
+EventBits_t xEventGroupSetBits(EventGroupHandle_t g, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(g->mutex);
+    g->bits |= bits;
+    g->cond.notify_all();
+    return g->bits;
+}
+
+EventBits_t xEventGroupClearBits(EventGroupHandle_t g, EventBits_t bits) {
+    std::lock_guard<std::mutex> lock(g->mutex);
+    const auto prev = g->bits;
+    g->bits &= ~bits;
+    return prev;
+}
+
+EventBits_t xEventGroupGetBits(EventGroupHandle_t g) {
+    std::lock_guard<std::mutex> lock(g->mutex);
+    return g->bits;
+}
+
+EventBits_t xEventGroupWaitBits(EventGroupHandle_t g, EventBits_t bits, BaseType_t clearOnExit,
+        BaseType_t waitForAllBits, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(g->mutex);
+    const bool ok = waitFor(g->cond, lock, ticks, [g, bits, waitForAllBits]() {
+        return waitForAllBits ? ((g->bits & bits) == bits) : (g->bits & bits);
+    });
+    const auto ret = g->bits;
+    if (ok && clearOnExit) {
+        g->bits &= ~bits;
+    }
+    return ret;
+}
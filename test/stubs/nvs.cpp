@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "nvs_flash.h"
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace {
+
+std::mutex g_mutex;
+// Values are stored as blobs regardless of their type
+std::map<std::string, std::vector<uint8_t>> g_values;
+
+} // anonymous
+
+esp_err_t nvs_flash_init() {
+    return ESP_OK;
+}
+
+esp_err_t nvs_flash_erase() {
+    nvs_host_erase_all();
+    return ESP_OK;
+}
+
+esp_err_t nvs_open(const char* name, nvs_open_mode mode, nvs_handle* handle) {
+    *handle = 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle) {
+}
+
+esp_err_t nvs_commit(nvs_handle handle) {
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_u32(nvs_handle handle, const char* key, uint32_t* value) {
+    size_t size = sizeof(uint32_t);
+    return nvs_get_blob(handle, key, value, &size);
+}
+
+esp_err_t nvs_set_u32(nvs_handle handle, const char* key, uint32_t value) {
+    return nvs_set_blob(handle, key, &value, sizeof(value));
+}
+
+esp_err_t nvs_get_blob(nvs_handle handle, const char* key, void* value, size_t* length) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    const auto it = g_values.find(key);
+    if (it == g_values.end()) {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (value && *length < it->second.size()) {
+        return ESP_ERR_NVS_INVALID_LENGTH;
+    }
+    if (value) {
+        memcpy(value, it->second.data(), it->second.size());
+    }
+    *length = it->second.size();
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle handle, const char* key, const void* value, size_t length) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_values[key].assign((const uint8_t*)value, (const uint8_t*)value + length);
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle handle, const char* key) {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    return g_values.erase(key) ? ESP_OK : ESP_ERR_NVS_NOT_FOUND;
+}
+
+void nvs_host_erase_all() {
+    std::lock_guard<std::mutex> lock(g_mutex);
+    g_values.clear();
+}
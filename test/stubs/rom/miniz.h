@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Subset of the tinfl API of the ROM inflater used by the firmware. The host build links
+// a reference implementation with the same streaming semantics, see tinfl.cpp
+
+#include <cstdint>
+#include <cstddef>
+
+enum {
+    TINFL_FLAG_PARSE_ZLIB_HEADER = 1,
+    TINFL_FLAG_HAS_MORE_INPUT = 2,
+    TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF = 4
+};
+
+typedef enum {
+    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS = -4,
+    TINFL_STATUS_BAD_PARAM = -3,
+    TINFL_STATUS_ADLER32_MISMATCH = -2,
+    TINFL_STATUS_FAILED = -1,
+    TINFL_STATUS_DONE = 0,
+    TINFL_STATUS_NEEDS_MORE_INPUT = 1,
+    TINFL_STATUS_HAS_MORE_OUTPUT = 2
+} tinfl_status;
+
+struct TinflState;
+
+struct tinfl_decompressor {
+    TinflState* state = nullptr;
+
+    ~tinfl_decompressor();
+};
+
+void tinfl_init(tinfl_decompressor* r);
+
+// Decompresses to a circular output buffer of a power of 2 size starting at `outStart`, unless
+// TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF is set. Back references are read from that buffer
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const uint8_t* in, size_t* inSize, uint8_t* outStart,
+        uint8_t* outNext, size_t* outSize, uint32_t flags);
@@ -0,0 +1,49 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Host side of the emulated SDIO link
+
+#include <cstdint>
+#include <cstddef>
+
+namespace sdio_host {
+
+// Writes data to the slave's receive buffers, one buffer at a time. Returns the number of
+// bytes written before the timeout expired
+size_t write(const uint8_t* data, size_t size, unsigned timeoutMs);
+
+// Reads the data of the queued sends. In stream mode the data of several sends can be returned
+// at once, in packet mode the data of one send is returned. A send is reported as finished to the
+// slave once all of its data has been read
+size_t read(uint8_t* data, size_t size, unsigned timeoutMs);
+
+// Emulated bus throughput in bytes per second, 0 means unlimited
+void setLinkRate(unsigned bytesPerSec);
+
+struct Stats {
+    size_t sends; // Number of completed sends
+    size_t maxSendsQueued; // Largest number of sends queued at once
+    size_t corruptions; // Number of sends whose data was modified while they were in flight
+    size_t hostInts; // Number of interrupts sent to the host
+};
+
+void stats(Stats* stats);
+void resetStats();
+
+} // sdio_host
@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "driver/sdio_slave.h"
+#include "sdio_host.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace {
+
+struct RecvBuffer {
+    uint8_t* addr;
+    bool loaded;
+};
+
+struct Send {
+    uint8_t* addr;
+    size_t size;
+    void* arg;
+    size_t pos;
+    // Copy of the data taken when the send was queued
+    std::vector<uint8_t> data;
+};
+
+struct Link {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool started = false;
+    sdio_slave_config_t conf = {};
+    std::vector<std::unique_ptr<RecvBuffer>> recvBufs;
+    std::deque<RecvBuffer*> loaded;
+    std::deque<std::pair<RecvBuffer*, size_t>> received;
+    std::deque<Send> sends;
+    std::deque<void*> finished;
+    unsigned rate = 0;
+    sdio_host::Stats stats = {};
+};
+
+Link g_link;
+
+template<typename PredT>
+bool waitFor(std::unique_lock<std::mutex>& lock, unsigned timeoutMs, PredT pred) {
+    if (timeoutMs == portMAX_DELAY) {
+        g_link.cond.wait(lock, pred);
+        return true;
+    }
+    return g_link.cond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+}
+
+void transferDelay(size_t size, unsigned rate) {
+    if (rate > 0) {
+        std::this_thread::sleep_for(std::chrono::microseconds((uint64_t)size * 1000000 / rate));
+    }
+}
+
+// Called with the link mutex held
+void finishSend() {
+    auto& s = g_link.sends.front();
+    if (memcmp(s.addr, s.data.data(), s.size) != 0) {
+        ++g_link.stats.corruptions;
+    }
+    g_link.finished.push_back(s.arg);
+    g_link.sends.pop_front();
+    ++g_link.stats.sends;
+    g_link.cond.notify_all();
+}
+
+} // anonymous
+
+esp_err_t sdio_slave_initialize(sdio_slave_config_t* config) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    if (config->recv_buffer_size == 0 || config->send_queue_size <= 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    g_link.conf = *config;
+    g_link.started = false;
+    return ESP_OK;
+}
+
+void sdio_slave_deinit() {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.started = false;
+    g_link.recvBufs.clear();
+    g_link.loaded.clear();
+    g_link.received.clear();
+    g_link.sends.clear();
+    g_link.finished.clear();
+    g_link.cond.notify_all();
+}
+
+esp_err_t sdio_slave_start() {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.started = true;
+    g_link.cond.notify_all();
+    return ESP_OK;
+}
+
+void sdio_slave_stop() {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.started = false;
+}
+
+sdio_slave_buf_handle_t sdio_slave_recv_register_buf(uint8_t* start) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    std::unique_ptr<RecvBuffer> buf(new RecvBuffer());
+    buf->addr = start;
+    buf->loaded = false;
+    g_link.recvBufs.push_back(std::move(buf));
+    return g_link.recvBufs.back().get();
+}
+
+esp_err_t sdio_slave_recv_load_buf(sdio_slave_buf_handle_t handle) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    const auto buf = (RecvBuffer*)handle;
+    if (!buf || buf->loaded) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    buf->loaded = true;
+    g_link.loaded.push_back(buf);
+    g_link.cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t sdio_slave_recv(sdio_slave_buf_handle_t* handle_ret, uint8_t** out_addr, size_t* out_len, TickType_t wait) {
+    std::unique_lock<std::mutex> lock(g_link.mutex);
+    if (!waitFor(lock, wait * portTICK_PERIOD_MS, []() { return !g_link.received.empty(); })) {
+        return ESP_ERR_TIMEOUT;
+    }
+    const auto r = g_link.received.front();
+    g_link.received.pop_front();
+    r.first->loaded = false;
+    *handle_ret = r.first;
+    *out_addr = r.first->addr;
+    *out_len = r.second;
+    return ESP_OK;
+}
+
+esp_err_t sdio_slave_send_queue(uint8_t* addr, size_t len, void* arg, TickType_t wait) {
+    std::unique_lock<std::mutex> lock(g_link.mutex);
+    if (!addr || len == 0 || ((uintptr_t)addr & 3)) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!waitFor(lock, wait * portTICK_PERIOD_MS, []() {
+            return g_link.sends.size() < (size_t)g_link.conf.send_queue_size; })) {
+        return ESP_ERR_TIMEOUT;
+    }
+    Send s;
+    s.addr = addr;
+    s.size = len;
+    s.arg = arg;
+    s.pos = 0;
+    s.data.assign(addr, addr + len);
+    g_link.sends.push_back(std::move(s));
+    g_link.stats.maxSendsQueued = std::max(g_link.stats.maxSendsQueued, g_link.sends.size());
+    g_link.cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t sdio_slave_send_get_finished(void** out_arg, TickType_t wait) {
+    std::unique_lock<std::mutex> lock(g_link.mutex);
+    if (!waitFor(lock, wait * portTICK_PERIOD_MS, []() { return !g_link.finished.empty(); })) {
+        return ESP_ERR_TIMEOUT;
+    }
+    *out_arg = g_link.finished.front();
+    g_link.finished.pop_front();
+    return ESP_OK;
+}
+
+void sdio_slave_set_host_intena(sdio_slave_hostint_t ena) {
+}
+
+esp_err_t sdio_slave_send_host_int(uint8_t pos) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    ++g_link.stats.hostInts;
+    return ESP_OK;
+}
+
+namespace sdio_host {
+
+size_t write(const uint8_t* data, size_t size, unsigned timeoutMs) {
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    size_t offs = 0;
+    while (offs < size) {
+        size_t n = 0;
+        unsigned rate = 0;
+        {
+            std::unique_lock<std::mutex> lock(g_link.mutex);
+            if (!g_link.cond.wait_until(lock, deadline, []() { return g_link.started && !g_link.loaded.empty(); })) {
+                break;
+            }
+            const auto buf = g_link.loaded.front();
+            g_link.loaded.pop_front();
+            n = std::min(size - offs, g_link.conf.recv_buffer_size);
+            memcpy(buf->addr, data + offs, n);
+            g_link.received.push_back(std::make_pair(buf, n));
+            g_link.cond.notify_all();
+            rate = g_link.rate;
+        }
+        transferDelay(n, rate);
+        offs += n;
+    }
+    return offs;
+}
+
+size_t read(uint8_t* data, size_t size, unsigned timeoutMs) {
+    std::unique_lock<std::mutex> lock(g_link.mutex);
+    if (!waitFor(lock, timeoutMs, []() { return !g_link.sends.empty(); })) {
+        return 0;
+    }
+    const bool packetMode = (g_link.conf.sending_mode == SDIO_SLAVE_SEND_PACKET);
+    size_t offs = 0;
+    while (offs < size && !g_link.sends.empty()) {
+        auto& s = g_link.sends.front();
+        if (packetMode && size < s.size) {
+            break;
+        }
+        const size_t n = std::min(size - offs, s.size - s.pos);
+        memcpy(data + offs, s.addr + s.pos, n);
+        if (memcmp(s.addr + s.pos, s.data.data() + s.pos, n) != 0) {
+            ++g_link.stats.corruptions;
+        }
+        s.pos += n;
+        offs += n;
+        if (s.pos == s.size) {
+            const auto arg = s.arg;
+            const auto rate = g_link.rate;
+            lock.unlock();
+            // The send completes once it's been transferred over the bus
+            transferDelay(s.size, rate);
+            lock.lock();
+            if (g_link.sends.empty() || g_link.sends.front().arg != arg) {
+                break; // The link has been deinitialized
+            }
+            finishSend();
+            if (packetMode) {
+                break;
+            }
+        }
+    }
+    return offs;
+}
+
+void setLinkRate(unsigned bytesPerSec) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.rate = bytesPerSec;
+}
+
+void stats(Stats* stats) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    *stats = g_link.stats;
+}
+
+void resetStats() {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.stats = Stats();
+}
+
+} // sdio_host
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Values from the project's sdkconfig. Can be overridden on the command line
+
+#ifndef CONFIG_AT_SDIO_BLOCK_SIZE
+#define CONFIG_AT_SDIO_BLOCK_SIZE 512
+#endif
+
+#ifndef CONFIG_AT_SDIO_BUFFER_NUM
+#define CONFIG_AT_SDIO_BUFFER_NUM 10
+#endif
+
+#ifndef CONFIG_AT_SDIO_QUEUE_SIZE
+#define CONFIG_AT_SDIO_QUEUE_SIZE 20
+#endif
+
+#ifndef CONFIG_NCP_SDIO_TX_PACKET_NUM
+#define CONFIG_NCP_SDIO_TX_PACKET_NUM 8
+#endif
@@ -0,0 +1,43 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// RX interrupt threshold fields of the UART registers. They are read by the emulated driver
+// whenever it decides when to raise a data event
+
+#include <cstdint>
+
+typedef volatile struct uart_dev_s {
+    union {
+        struct {
+            uint32_t rxfifo_full_thrhd: 7;
+            uint32_t reserved7: 1;
+            uint32_t txfifo_empty_thrhd: 7;
+            uint32_t reserved15: 1;
+            uint32_t rx_flow_thrhd: 7;
+            uint32_t rx_flow_en: 1;
+            uint32_t rx_tout_thrhd: 7;
+            uint32_t rx_tout_en: 1;
+        };
+        uint32_t val;
+    } conf1;
+} uart_dev_t;
+
+extern uart_dev_t UART0;
+extern uart_dev_t UART1;
+extern uart_dev_t UART2;
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Reference implementation of the tinfl streaming inflater. Like the ROM version it decompresses
+// to a circular buffer that also serves as the window for back references, and it validates the
+// zlib header against the size of that buffer
+
+#include "rom/miniz.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace {
+
+const unsigned MAX_BITS = 15;
+const unsigned MAX_LCODES = 286;
+const unsigned MAX_DCODES = 30;
+const unsigned FIX_LCODES = 288;
+const size_t MAX_WINDOW_SIZE = 32768;
+
+const uint16_t LEN_BASE[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99,
+        115, 131, 163, 195, 227, 258 };
+const uint8_t LEN_EXTRA[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+const uint16_t DIST_BASE[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025,
+        1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+const uint8_t DIST_EXTRA[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12,
+        12, 13, 13 };
+// Order of the code length code lengths
+const uint8_t CL_ORDER[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// The input ended in the middle of the item being decoded
+struct Underflow {
+};
+
+struct InvalidData {
+};
+
+// Canonical Huffman code, decoded one bit at a time
+struct Huffman {
+    uint16_t count[MAX_BITS + 1];
+    uint16_t symbol[FIX_LCODES];
+};
+
+// Returns false if the code is over-subscribed
+bool buildHuffman(Huffman* h, const uint8_t* lengths, unsigned n) {
+    std::fill(h->count, h->count + MAX_BITS + 1, 0);
+    for (unsigned i = 0; i < n; ++i) {
+        ++h->count[lengths[i]];
+    }
+    if (h->count[0] == n) {
+        return true;
+    }
+    int left = 1;
+    for (unsigned len = 1; len <= MAX_BITS; ++len) {
+        left <<= 1;
+        left -= h->count[len];
+        if (left < 0) {
+            return false;
+        }
+    }
+    uint16_t offs[MAX_BITS + 1] = {};
+    for (unsigned len = 1; len < MAX_BITS; ++len) {
+        offs[len + 1] = offs[len] + h->count[len];
+    }
+    for (unsigned i = 0; i < n; ++i) {
+        if (lengths[i]) {
+            h->symbol[offs[lengths[i]]++] = i;
+        }
+    }
+    return true;
+}
+
+enum Phase {
+    PHASE_ZLIB_HEADER,
+    PHASE_BLOCK_HEADER,
+    PHASE_STORED,
+    PHASE_CODES,
+    PHASE_ADLER32,
+    PHASE_DONE,
+    PHASE_FAILED
+};
+
+} // anonymous
+
+struct TinflState {
+    Phase phase = PHASE_ZLIB_HEADER;
+    bool zlib = false;
+    size_t windowSize = MAX_WINDOW_SIZE;
+    // All input received so far and the position of the next bit in it
+    std::vector<uint8_t> in;
+    size_t bitPos = 0;
+    bool lastBlock = false;
+    size_t storedLeft = 0;
+    Huffman lenCode = {};
+    Huffman distCode = {};
+    // Back reference being copied
+    size_t copyLeft = 0;
+    size_t copyDist = 0;
+    uint64_t outTotal = 0;
+    uint32_t adlerA = 1;
+    uint32_t adlerB = 0;
+
+    unsigned bits(unsigned n) {
+        unsigned val = 0;
+        for (unsigned i = 0; i < n; ++i) {
+            if (bitPos >= in.size() * 8) {
+                throw Underflow();
+            }
+            val |= ((in[bitPos >> 3] >> (bitPos & 7)) & 1) << i;
+            ++bitPos;
+        }
+        return val;
+    }
+
+    void alignToByte() {
+        bitPos = (bitPos + 7) & ~(size_t)7;
+    }
+
+    unsigned decode(const Huffman& h) {
+        int code = 0;
+        int first = 0;
+        int index = 0;
+        for (unsigned len = 1; len <= MAX_BITS; ++len) {
+            code |= bits(1);
+            const int count = h.count[len];
+            if (code - count < first) {
+                return h.symbol[index + (code - first)];
+            }
+            index += count;
+            first += count;
+            first <<= 1;
+            code <<= 1;
+        }
+        throw InvalidData();
+    }
+
+    void fixedCodes() {
+        uint8_t lengths[FIX_LCODES] = {};
+        std::fill(lengths, lengths + 144, 8);
+        std::fill(lengths + 144, lengths + 256, 9);
+        std::fill(lengths + 256, lengths + 280, 7);
+        std::fill(lengths + 280, lengths + FIX_LCODES, 8);
+        buildHuffman(&lenCode, lengths, FIX_LCODES);
+        std::fill(lengths, lengths + MAX_DCODES, 5);
+        buildHuffman(&distCode, lengths, MAX_DCODES);
+    }
+
+    void dynamicCodes() {
+        const unsigned nlen = bits(5) + 257;
+        const unsigned ndist = bits(5) + 1;
+        const unsigned ncode = bits(4) + 4;
+        if (nlen > MAX_LCODES || ndist > MAX_DCODES) {
+            throw InvalidData();
+        }
+        uint8_t lengths[MAX_LCODES + MAX_DCODES] = {};
+        for (unsigned i = 0; i < ncode; ++i) {
+            lengths[CL_ORDER[i]] = bits(3);
+        }
+        Huffman clCode = {};
+        if (!buildHuffman(&clCode, lengths, 19)) {
+            throw InvalidData();
+        }
+        unsigned index = 0;
+        while (index < nlen + ndist) {
+            unsigned sym = decode(clCode);
+            if (sym < 16) {
+                lengths[index++] = sym;
+                continue;
+            }
+            uint8_t len = 0;
+            if (sym == 16) {
+                if (index == 0) {
+                    throw InvalidData();
+                }
+                len = lengths[index - 1];
+                sym = 3 + bits(2);
+            } else if (sym == 17) {
+                sym = 3 + bits(3);
+            } else {
+                sym = 11 + bits(7);
+            }
+            if (index + sym > nlen + ndist) {
+                throw InvalidData();
+            }
+            while (sym--) {
+                lengths[index++] = len;
+            }
+        }
+        if (!lengths[256] || !buildHuffman(&lenCode, lengths, nlen) || !buildHuffman(&distCode, lengths + nlen, ndist)) {
+            throw InvalidData();
+        }
+    }
+
+    void endBlock() {
+        phase = lastBlock ? (zlib ? PHASE_ADLER32 : PHASE_DONE) : PHASE_BLOCK_HEADER;
+    }
+};
+
+tinfl_decompressor::~tinfl_decompressor() {
+    delete state;
+}
+
+void tinfl_init(tinfl_decompressor* r) {
+    delete r->state;
+    r->state = new TinflState();
+}
+
+tinfl_status tinfl_decompress(tinfl_decompressor* r, const uint8_t* in, size_t* inSize, uint8_t* outStart,
+        uint8_t* outNext, size_t* outSize, uint32_t flags) {
+    const auto s = r->state;
+    size_t mask = (size_t)-1;
+    if (!(flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF)) {
+        const size_t bufSize = (outNext - outStart) + *outSize;
+        if (!bufSize || (bufSize & (bufSize - 1))) {
+            *inSize = 0;
+            *outSize = 0;
+            return TINFL_STATUS_BAD_PARAM;
+        }
+        mask = bufSize - 1;
+    }
+    const size_t inBase = s->in.size();
+    s->in.insert(s->in.end(), in, in + *inSize);
+    const size_t outBegin = outNext - outStart;
+    const size_t outEnd = outBegin + *outSize;
+    size_t outPos = outBegin;
+    const auto put = [s, outStart, mask, &outPos](uint8_t c) {
+        outStart[outPos++ & mask] = c;
+        ++s->outTotal;
+        s->adlerA = (s->adlerA + c) % 65521;
+        s->adlerB = (s->adlerB + s->adlerA) % 65521;
+    };
+    tinfl_status status = TINFL_STATUS_FAILED;
+    for (;;) {
+        const size_t checkpoint = s->bitPos;
+        try {
+            if (s->phase == PHASE_DONE) {
+                status = TINFL_STATUS_DONE;
+                break;
+            }
+            if (s->phase == PHASE_FAILED) {
+                status = TINFL_STATUS_FAILED;
+                break;
+            }
+            if (s->phase == PHASE_ZLIB_HEADER) {
+                s->zlib = flags & TINFL_FLAG_PARSE_ZLIB_HEADER;
+                if (s->zlib) {
+                    const unsigned cmf = s->bits(8);
+                    const unsigned flg = s->bits(8);
+                    if ((cmf * 256 + flg) % 31 != 0 || (flg & 0x20) || (cmf & 0x0f) != 8) {
+                        throw InvalidData();
+                    }
+                    s->windowSize = (size_t)1 << (8 + (cmf >> 4));
+                    if (s->windowSize > MAX_WINDOW_SIZE || (!(flags & TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF) &&
+                            mask + 1 < s->windowSize)) {
+                        throw InvalidData();
+                    }
+                }
+                s->phase = PHASE_BLOCK_HEADER;
+            } else if (s->phase == PHASE_BLOCK_HEADER) {
+                s->lastBlock = s->bits(1);
+                const unsigned type = s->bits(2);
+                if (type == 0) {
+                    s->alignToByte();
+                    const unsigned len = s->bits(16);
+                    if (len != (~s->bits(16) & 0xffff)) {
+                        throw InvalidData();
+                    }
+                    s->storedLeft = len;
+                    s->phase = PHASE_STORED;
+                } else if (type == 1) {
+                    s->fixedCodes();
+                    s->phase = PHASE_CODES;
+                } else if (type == 2) {
+                    s->dynamicCodes();
+                    s->phase = PHASE_CODES;
+                } else {
+                    throw InvalidData();
+                }
+            } else if (s->phase == PHASE_STORED) {
+                if (!s->storedLeft) {
+                    s->endBlock();
+                } else if (outPos == outEnd) {
+                    status = TINFL_STATUS_HAS_MORE_OUTPUT;
+                    break;
+                } else {
+                    put(s->bits(8));
+                    --s->storedLeft;
+                }
+            } else if (s->phase == PHASE_CODES) {
+                if (outPos == outEnd) {
+                    status = TINFL_STATUS_HAS_MORE_OUTPUT;
+                    break;
+                }
+                if (s->copyLeft) {
+                    put(outStart[(outPos - s->copyDist) & mask]);
+                    --s->copyLeft;
+                    continue;
+                }
+                unsigned sym = s->decode(s->lenCode);
+                if (sym < 256) {
+                    put(sym);
+                } else if (sym == 256) {
+                    s->endBlock();
+                } else {
+                    sym -= 257;
+                    if (sym >= 29) {
+                        throw InvalidData();
+                    }
+                    const size_t len = LEN_BASE[sym] + s->bits(LEN_EXTRA[sym]);
+                    const unsigned dsym = s->decode(s->distCode);
+                    if (dsym >= 30) {
+                        throw InvalidData();
+                    }
+                    const size_t dist = DIST_BASE[dsym] + s->bits(DIST_EXTRA[dsym]);
+                    if (dist > s->outTotal || dist > s->windowSize) {
+                        throw InvalidData();
+                    }
+                    s->copyLeft = len;
+                    s->copyDist = dist;
+                }
+            } else if (s->phase == PHASE_ADLER32) {
+                s->alignToByte();
+                uint32_t adler = 0;
+                for (unsigned i = 0; i < 4; ++i) {
+                    adler = (adler << 8) | s->bits(8);
+                }
+                if (adler != ((s->adlerB << 16) | s->adlerA)) {
+                    s->phase = PHASE_FAILED;
+                    status = TINFL_STATUS_ADLER32_MISMATCH;
+                    break;
+                }
+                s->phase = PHASE_DONE;
+            }
+        } catch (const Underflow&) {
+            s->bitPos = checkpoint;
+            status = (flags & TINFL_FLAG_HAS_MORE_INPUT) ? TINFL_STATUS_NEEDS_MORE_INPUT :
+                    TINFL_STATUS_FAILED_CANNOT_MAKE_PROGRESS;
+            break;
+        } catch (const InvalidData&) {
+            s->phase = PHASE_FAILED;
+            status = TINFL_STATUS_FAILED;
+            break;
+        }
+    }
+    if (s->phase == PHASE_DONE) {
+        // Input following the end of the stream is left unconsumed
+        const size_t end = (s->bitPos + 7) / 8;
+        *inSize = (end > inBase) ? std::min(end - inBase, *inSize) : 0;
+    }
+    *outSize = outPos - outBegin;
+    return status;
+}
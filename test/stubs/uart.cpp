@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "driver/uart.h"
+#include "soc/uart_struct.h"
+#include "uart_host.h"
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+uart_dev_t UART0 = {};
+uart_dev_t UART1 = {};
+uart_dev_t UART2 = {};
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+// Same as the driver defaults
+const unsigned DEFAULT_RXFIFO_FULL_THRESH = 120;
+const unsigned DEFAULT_RX_TIMEOUT_THRESH = 10;
+
+// Start, data and stop bits
+const unsigned BITS_PER_BYTE = 10;
+
+uart_dev_t* const UART_DEV[UART_NUM_MAX] = { &UART0, &UART1, &UART2 };
+
+// Only one port can be installed at a time
+struct Link {
+    std::mutex mutex;
+    std::condition_variable cond;
+    bool installed = false;
+    uart_port_t port = UART_NUM_0;
+    uart_config_t conf = {};
+    QueueHandle_t queue = nullptr;
+    size_t rxBufferSize = 0;
+    std::deque<uint8_t> rx;
+    // Bytes left in the RX FIFO because the RX buffer was full
+    std::vector<uint8_t> stash;
+    std::deque<uint8_t> tx;
+    unsigned hostBaudRate = 0;
+    uart_host::Stats stats = {};
+};
+
+Link g_link;
+
+template<typename PredT>
+bool waitFor(std::unique_lock<std::mutex>& lock, unsigned timeoutMs, PredT pred) {
+    if (timeoutMs == portMAX_DELAY) {
+        g_link.cond.wait(lock, pred);
+        return true;
+    }
+    return g_link.cond.wait_for(lock, std::chrono::milliseconds(timeoutMs), pred);
+}
+
+// Called with the link mutex held
+bool corrupted() {
+    return g_link.hostBaudRate && g_link.hostBaudRate != (unsigned)g_link.conf.baud_rate;
+}
+
+uint8_t corrupt(uint8_t c) {
+    return c ^ 0xa5;
+}
+
+// Called with the link mutex held
+void postEvent(uart_event_type_t type, size_t size, bool timeout) {
+    uart_event_t ev = {};
+    ev.type = type;
+    ev.size = size;
+    ev.timeout_flag = timeout;
+    if (xQueueSend(g_link.queue, &ev, 0) != pdTRUE) {
+        ++g_link.stats.droppedEvents;
+    }
+}
+
+// Moves the bytes left in the FIFO to the RX buffer once there's enough space for all of them.
+// Called with the link mutex held
+void drainStash() {
+    if (!g_link.stash.empty() && g_link.rx.size() + g_link.stash.size() <= g_link.rxBufferSize) {
+        g_link.rx.insert(g_link.rx.end(), g_link.stash.begin(), g_link.stash.end());
+        g_link.stash.clear();
+        g_link.cond.notify_all();
+    }
+}
+
+} // anonymous
+
+namespace uart_host {
+
+size_t write(const uint8_t* data, size_t size, unsigned timeoutMs) {
+    const auto deadline = Clock::now() + std::chrono::milliseconds(timeoutMs);
+    auto lineTime = Clock::now();
+    size_t offs = 0;
+    while (offs < size) {
+        std::unique_lock<std::mutex> lock(g_link.mutex);
+        if (!g_link.installed) {
+            break;
+        }
+        const auto dev = UART_DEV[g_link.port];
+        const size_t fifoFull = std::max<size_t>(dev->conf1.rxfifo_full_thrhd, 1);
+        const size_t n = std::min(size - offs, fifoFull);
+        const bool timeout = n < fifoFull;
+        // The interrupt fires once the last byte of the chunk is received, or the line has been
+        // idle for the timeout period
+        const unsigned baudRate = g_link.hostBaudRate ? g_link.hostBaudRate : g_link.conf.baud_rate;
+        const auto byteTime = std::chrono::nanoseconds(1000000000ull * BITS_PER_BYTE / std::max(baudRate, 1u));
+        lineTime += byteTime * n;
+        const auto eventTime = timeout ? lineTime + byteTime * (unsigned)dev->conf1.rx_tout_thrhd : lineTime;
+        lock.unlock();
+        std::this_thread::sleep_until(eventTime);
+        lock.lock();
+        if (!g_link.installed) {
+            break;
+        }
+        std::vector<uint8_t> chunk(data + offs, data + offs + n);
+        if (corrupted()) {
+            std::transform(chunk.begin(), chunk.end(), chunk.begin(), corrupt);
+        }
+        if (g_link.rx.size() + n <= g_link.rxBufferSize && g_link.stash.empty()) {
+            g_link.rx.insert(g_link.rx.end(), chunk.begin(), chunk.end());
+            ++g_link.stats.dataEvents;
+            postEvent(UART_DATA, n, timeout);
+            g_link.cond.notify_all();
+        } else if (g_link.conf.flow_ctrl & UART_HW_FLOWCTRL_RTS) {
+            // The driver stops reading the FIFO and RTS gets deasserted until the reader
+            // frees up some space
+            g_link.stash.insert(g_link.stash.end(), chunk.begin(), chunk.end());
+            ++g_link.stats.bufferFullEvents;
+            postEvent(UART_BUFFER_FULL, n, timeout);
+            if (!g_link.cond.wait_until(lock, deadline, []() { return g_link.stash.empty() || !g_link.installed; })) {
+                break;
+            }
+            lineTime = Clock::now();
+        } else {
+            g_link.stats.lostBytes += n;
+            ++g_link.stats.fifoOverflows;
+            postEvent(UART_FIFO_OVF, 0, false);
+        }
+        offs += n;
+        if (Clock::now() > deadline) {
+            break;
+        }
+    }
+    return offs;
+}
+
+size_t read(uint8_t* data, size_t size, unsigned timeoutMs) {
+    std::unique_lock<std::mutex> lock(g_link.mutex);
+    waitFor(lock, timeoutMs, []() { return !g_link.tx.empty(); });
+    const size_t n = std::min(size, g_link.tx.size());
+    std::copy(g_link.tx.begin(), g_link.tx.begin() + n, data);
+    g_link.tx.erase(g_link.tx.begin(), g_link.tx.begin() + n);
+    return n;
+}
+
+void setBaudRate(unsigned baudRate) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.hostBaudRate = baudRate;
+}
+
+unsigned deviceBaudRate() {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    return g_link.conf.baud_rate;
+}
+
+void stats(Stats* stats) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    *stats = g_link.stats;
+}
+
+void resetStats() {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.stats = Stats();
+}
+
+} // uart_host
+
+esp_err_t uart_param_config(uart_port_t uart, const uart_config_t* config) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.conf = *config;
+    return ESP_OK;
+}
+
+esp_err_t uart_set_pin(uart_port_t uart, int txPin, int rxPin, int rtsPin, int ctsPin) {
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_install(uart_port_t uart, int rxBufferSize, int txBufferSize, int queueSize,
+        QueueHandle_t* queue, int intrAllocFlags) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    if (g_link.installed || uart >= UART_NUM_MAX || rxBufferSize <= 0) {
+        return ESP_FAIL;
+    }
+    g_link.installed = true;
+    g_link.port = uart;
+    g_link.rxBufferSize = rxBufferSize;
+    g_link.rx.clear();
+    g_link.stash.clear();
+    g_link.tx.clear();
+    g_link.queue = queue ? xQueueCreate(queueSize, sizeof(uart_event_t)) : nullptr;
+    if (queue) {
+        *queue = g_link.queue;
+    }
+    UART_DEV[uart]->conf1.rxfifo_full_thrhd = DEFAULT_RXFIFO_FULL_THRESH;
+    UART_DEV[uart]->conf1.rx_tout_thrhd = DEFAULT_RX_TIMEOUT_THRESH;
+    UART_DEV[uart]->conf1.rx_tout_en = 1;
+    return ESP_OK;
+}
+
+esp_err_t uart_driver_delete(uart_port_t uart) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    if (!g_link.installed || uart != g_link.port) {
+        return ESP_OK;
+    }
+    g_link.installed = false;
+    if (g_link.queue) {
+        vQueueDelete(g_link.queue);
+        g_link.queue = nullptr;
+    }
+    g_link.cond.notify_all();
+    return ESP_OK;
+}
+
+int uart_read_bytes(uart_port_t uart, uint8_t* buf, uint32_t length, TickType_t ticks) {
+    std::unique_lock<std::mutex> lock(g_link.mutex);
+    if (!g_link.installed) {
+        return -1;
+    }
+    // Like the driver, waits for the whole requested length
+    waitFor(lock, ticks == portMAX_DELAY ? ticks : ticks * portTICK_PERIOD_MS, [length]() {
+        return g_link.rx.size() >= length || !g_link.installed;
+    });
+    const size_t n = std::min<size_t>(length, g_link.rx.size());
+    std::copy(g_link.rx.begin(), g_link.rx.begin() + n, buf);
+    g_link.rx.erase(g_link.rx.begin(), g_link.rx.begin() + n);
+    drainStash();
+    return n;
+}
+
+int uart_write_bytes(uart_port_t uart, const char* src, size_t size) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    if (!g_link.installed) {
+        return -1;
+    }
+    const bool corrupt = corrupted();
+    for (size_t i = 0; i < size; ++i) {
+        g_link.tx.push_back(corrupt ? ::corrupt(src[i]) : src[i]);
+    }
+    g_link.cond.notify_all();
+    return size;
+}
+
+esp_err_t uart_flush_input(uart_port_t uart) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.rx.clear();
+    g_link.stash.clear();
+    g_link.cond.notify_all();
+    return ESP_OK;
+}
+
+esp_err_t uart_get_buffered_data_len(uart_port_t uart, size_t* size) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    *size = g_link.rx.size();
+    return ESP_OK;
+}
+
+esp_err_t uart_wait_tx_done(uart_port_t uart, TickType_t ticks) {
+    // The written data is available to the host right away
+    return ESP_OK;
+}
+
+esp_err_t uart_set_baudrate(uart_port_t uart, uint32_t baudRate) {
+    std::lock_guard<std::mutex> lock(g_link.mutex);
+    g_link.conf.baud_rate = baudRate;
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio, gpio_mode_t mode) {
+    return ESP_OK;
+}
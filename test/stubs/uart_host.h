@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+// Host side of the emulated UART link
+
+#include <cstdint>
+#include <cstddef>
+
+namespace uart_host {
+
+// Sends data to the device at the line rate. Like the hardware, the driver raises a data event
+// each time the RX FIFO full threshold is reached, and once the line has been idle for the RX
+// timeout. With RTS flow control the call blocks while the device's RX buffer is full, without
+// it the bytes that don't fit are lost. Returns the number of bytes sent before the timeout expired
+size_t write(const uint8_t* data, size_t size, unsigned timeoutMs);
+
+// Reads the data written by the device
+size_t read(uint8_t* data, size_t size, unsigned timeoutMs);
+
+// Baud rate of the host's UART. The bytes get corrupted in both directions while it differs
+// from the device's baud rate. 0 means that the host follows the device
+void setBaudRate(unsigned baudRate);
+
+// Device's current baud rate
+unsigned deviceBaudRate();
+
+struct Stats {
+    size_t dataEvents;
+    size_t bufferFullEvents;
+    size_t fifoOverflows;
+    size_t droppedEvents; // Events lost because the event queue was full
+    size_t lostBytes;
+};
+
+void stats(Stats* stats);
+void resetStats();
+
+} // uart_host
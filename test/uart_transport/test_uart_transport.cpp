@@ -0,0 +1,848 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests and benchmarks of the UART transport running against the emulated UART driver
+
+#include "test.h"
+#include "uart_host.h"
+#include "at_transport_uart.h"
+#include "xmodem_receiver.h"
+#include "stream.h"
+#include "util/crc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace particle;
+using namespace particle::ncp;
+
+namespace {
+
+const unsigned HOST_TIMEOUT = 5000;
+const unsigned BAUD_RATE = 921600;
+
+// Deterministic test data
+uint8_t pattern(size_t offs) {
+    return (uint8_t)((offs * 131) ^ (offs >> 8));
+}
+
+// Same settings as the device build, except for the notification coalescing
+AtUartTransport::Config config(size_t coalesceBytes = 0, unsigned coalesceTimeMs = 0) {
+    AtUartTransport::Config conf = {};
+    conf.uart = UART_NUM_1;
+    conf.config.baud_rate = BAUD_RATE;
+    conf.config.data_bits = UART_DATA_8_BITS;
+    conf.config.parity = UART_PARITY_DISABLE;
+    conf.config.stop_bits = UART_STOP_BITS_1;
+    conf.config.flow_ctrl = UART_HW_FLOWCTRL_CTS_RTS;
+    conf.config.rx_flow_ctrl_thresh = 122;
+    conf.coalesceBytes = coalesceBytes;
+    conf.coalesceTimeMs = coalesceTimeMs;
+    return conf;
+}
+
+class Transport {
+public:
+    explicit Transport(const AtUartTransport::Config& conf = config()) :
+            t_(new AtUartTransport(conf)) {
+        uart_host::setBaudRate(0);
+        uart_host::resetStats();
+        t_->init();
+        t_->postInit();
+    }
+
+    ~Transport() {
+        t_->setDirectMode(false);
+        t_->destroy();
+    }
+
+    AtUartTransport* get() {
+        return t_.get();
+    }
+
+    AtUartTransport* operator->() {
+        return t_.get();
+    }
+
+private:
+    std::unique_ptr<AtUartTransport> t_;
+};
+
+double cpuSeconds(clockid_t clock) {
+    timespec ts = {};
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads the received data whenever the transport reports some, the same way the AT parser and
+// the muxer do, and checks it against the test pattern
+class Reader {
+public:
+    explicit Reader(AtUartTransport* t) :
+            t_(t),
+            notifications_(0),
+            notifiedBytes_(0),
+            wakeups_(0),
+            read_(0),
+            lastNotifyTime_(0),
+            cpuTime_(0),
+            ok_(true),
+            paused_(false),
+            stop_(false) {
+        t_->setDirectMode(true, notify, this);
+        thread_ = std::thread([this]() {
+            run();
+        });
+    }
+
+    ~Reader() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stop_ = true;
+            cond_.notify_all();
+        }
+        thread_.join();
+        t_->setDirectMode(false);
+    }
+
+    // Waits until `size` bytes have been reported and read
+    bool wait(size_t size, unsigned timeoutMs = HOST_TIMEOUT) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cond_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, size]() {
+            return read_ >= size && notifiedBytes_ >= size;
+        });
+    }
+
+    // Waits until there are more than `n` notifications, returns the time of the last one. The
+    // notification can arrive before the host has finished writing, see notifications()
+    double waitNotification(size_t n, unsigned timeoutMs = HOST_TIMEOUT) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!cond_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this, n]() { return notifications_ > n; })) {
+            return 0;
+        }
+        return lastNotifyTime_;
+    }
+
+    void pause(bool paused) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        paused_ = paused;
+        cond_.notify_all();
+    }
+
+    size_t notifications() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return notifications_;
+    }
+
+    size_t notifiedBytes() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return notifiedBytes_;
+    }
+
+    // Number of times the reader had to wake up
+    size_t wakeups() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return wakeups_;
+    }
+
+    // CPU time used by the reader thread
+    double cpuTime() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return cpuTime_;
+    }
+
+    bool ok() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return ok_;
+    }
+
+private:
+    AtUartTransport* t_;
+    std::thread thread_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    size_t notifications_;
+    size_t notifiedBytes_;
+    size_t wakeups_;
+    size_t read_;
+    double lastNotifyTime_;
+    double cpuTime_;
+    bool ok_;
+    bool paused_;
+    bool stop_;
+
+    static void notify(size_t len, void* ctx) {
+        const auto self = static_cast<Reader*>(ctx);
+        std::lock_guard<std::mutex> lock(self->mutex_);
+        ++self->notifications_;
+        self->notifiedBytes_ += len;
+        self->lastNotifyTime_ = test::seconds();
+        self->cond_.notify_all();
+    }
+
+    void run() {
+        std::vector<uint8_t> buf(4096);
+        size_t seen = 0;
+        std::unique_lock<std::mutex> lock(mutex_);
+        for (;;) {
+            cond_.wait(lock, [this, &seen]() {
+                return stop_ || (notifications_ > seen && !paused_);
+            });
+            if (stop_) {
+                break;
+            }
+            seen = notifications_;
+            ++wakeups_;
+            lock.unlock();
+            size_t total = 0;
+            bool ok = true;
+            for (;;) {
+                const int len = t_->getDataLength();
+                if (len <= 0) {
+                    break;
+                }
+                const int n = t_->readData(buf.data(), std::min<size_t>(len, buf.size()), 0);
+                if (n <= 0) {
+                    break;
+                }
+                for (int i = 0; i < n; ++i) {
+                    if (buf[i] != pattern(read_ + total + i)) {
+                        ok = false;
+                    }
+                }
+                total += n;
+            }
+            lock.lock();
+            read_ += total;
+            ok_ = ok_ && ok;
+            cpuTime_ = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+            cond_.notify_all();
+        }
+    }
+};
+
+// Sends `size` bytes of the test pattern from the host, starting at `offs`
+bool hostWrite(size_t offs, size_t size) {
+    std::vector<uint8_t> buf(size);
+    for (size_t i = 0; i < size; ++i) {
+        buf[i] = pattern(offs + i);
+    }
+    return uart_host::write(buf.data(), size, HOST_TIMEOUT) == size;
+}
+
+uart_host::Stats hostStats() {
+    uart_host::Stats s = {};
+    uart_host::stats(&s);
+    return s;
+}
+
+struct TransferStats {
+    double seconds;
+    double cpuSeconds;
+    double readerCpuSeconds;
+    size_t dataEvents;
+    size_t bufferFullEvents;
+    size_t notifications;
+    size_t wakeups;
+};
+
+// Bulk transfer from the host with the reader keeping up
+bool bulkTransfer(Transport& t, size_t size, TransferStats* stats) {
+    Reader r(t.get());
+    const auto cpu = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID);
+    const auto start = test::seconds();
+    if (!hostWrite(0, size) || !r.wait(size) || !r.ok()) {
+        return false;
+    }
+    stats->seconds = test::seconds() - start;
+    stats->cpuSeconds = cpuSeconds(CLOCK_PROCESS_CPUTIME_ID) - cpu;
+    stats->readerCpuSeconds = r.cpuTime();
+    const auto host = hostStats();
+    stats->dataEvents = host.dataEvents;
+    stats->bufferFullEvents = host.bufferFullEvents;
+    stats->notifications = r.notifications();
+    stats->wakeups = r.wakeups();
+    return true;
+}
+
+// Host link settings of the link profiles, see LinkProfile::settings(). link_profile.cpp can't be
+// built here as it depends on the muxer library
+struct Profile {
+    const char* name;
+    AtUartTransport::Thresholds thresholds; // 0 - maximum RX FIFO full threshold
+    AtUartTransport::Coalescing coalescing;
+};
+
+const Profile PROFILES[] = {
+    { "default", { 120, 10 }, { 512, 2 } },
+    { "latency", { 32, 2 }, { 0, 2 } },
+    { "throughput", { 0, 10 }, { 1024, 5 } }
+};
+
+// Same as LinkProfile::apply()
+bool applyProfile(AtUartTransport* t, const Profile& p) {
+    auto thresh = p.thresholds;
+    thresh.rxFifoFull = thresh.rxFifoFull ? std::min(thresh.rxFifoFull, t->maxRxFifoFullThreshold()) :
+            t->maxRxFifoFullThreshold();
+    return t->setThresholds(thresh) == 0 && t->setCoalescing(p.coalescing) == 0;
+}
+
+} // anonymous
+
+TEST(rxIntegrity) {
+    for (size_t coalesceBytes: { 0, 512 }) {
+        Transport t(config(coalesceBytes));
+        Reader r(t.get());
+        std::mt19937 rnd(1);
+        const size_t size = 64 * 1024;
+        size_t offs = 0;
+        while (offs < size) {
+            const size_t n = std::min<size_t>(size - offs, rnd() % 1500 + 1);
+            ASSERT(hostWrite(offs, n));
+            offs += n;
+            if (rnd() % 4 == 0) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(rnd() % 5));
+            }
+        }
+        EXPECT(r.wait(size));
+        EXPECT(r.ok());
+        // Every received byte is reported exactly once
+        EXPECT(r.notifiedBytes() == size);
+        EXPECT(hostStats().lostBytes == 0);
+    }
+}
+
+TEST(rxEveryEventReportedWithoutCoalescing) {
+    Transport t(config(0));
+    TransferStats s = {};
+    ASSERT(bulkTransfer(t, 32 * 1024, &s));
+    // The reader may fall behind on a loaded host, a full buffer is reported too
+    EXPECT(s.notifications == s.dataEvents + s.bufferFullEvents);
+}
+
+TEST(rxCoalescingBatchesEvents) {
+    Transport t(config(512, 20));
+    TransferStats s = {};
+    ASSERT(bulkTransfer(t, 32 * 1024, &s));
+    // One notification per 512 bytes, plus the one at the start of the burst and the remainder
+    EXPECT(s.notifications <= 32 * 1024 / 512 + 2);
+    EXPECT(s.notifications * 3 < s.dataEvents);
+    AtUartTransport::Stats st = {};
+    t->stats(&st);
+    EXPECT(st.notifications == s.notifications);
+}
+
+// The first data of a burst is reported right away, the data following it within the coalescing
+// period waits for the timer, and the burst ends after a whole period without data
+TEST(rxCoalescingTimer) {
+    const unsigned timeMs = 50;
+    Transport t(config(4096, timeMs));
+    Reader r(t.get());
+    auto n = r.notifications();
+    auto start = test::seconds();
+    ASSERT(hostWrite(0, 8));
+    auto notified = r.waitNotification(n);
+    ASSERT(notified > 0);
+    EXPECT(notified - start < timeMs / 2000.0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    n = r.notifications();
+    start = test::seconds();
+    ASSERT(hostWrite(8, 8));
+    notified = r.waitNotification(n);
+    ASSERT(notified > 0);
+    EXPECT(notified - start > timeMs / 2000.0);
+    EXPECT(notified - start < timeMs * 2 / 1000.0);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(timeMs * 3));
+    n = r.notifications();
+    start = test::seconds();
+    ASSERT(hostWrite(16, 8));
+    notified = r.waitNotification(n);
+    ASSERT(notified > 0);
+    EXPECT(notified - start < timeMs / 2000.0);
+    EXPECT(r.wait(24));
+    EXPECT(r.ok());
+}
+
+// A full RX buffer is reported without waiting for the coalescing threshold or timer
+TEST(rxBufferFullReportedImmediately) {
+    const unsigned timeMs = 100;
+    Transport t(config(64 * 1024, timeMs));
+    Reader r(t.get());
+    r.pause(true);
+    const size_t size = 8 * 1024;
+    std::thread host([&]() {
+        EXPECT(hostWrite(0, size));
+    });
+    // The first event starts a burst
+    ASSERT(r.waitNotification(0) > 0);
+    const auto start = test::seconds();
+    // The buffer fills up in about 25 ms at this baud rate
+    const auto notified = r.waitNotification(1);
+    ASSERT(notified > 0);
+    EXPECT(notified - start < timeMs / 1000.0 * 0.8);
+    EXPECT(hostStats().bufferFullEvents > 0);
+    r.pause(false);
+    EXPECT(r.wait(size));
+    host.join();
+    EXPECT(r.ok());
+    EXPECT(r.notifiedBytes() == size);
+    EXPECT(hostStats().lostBytes == 0);
+}
+
+const unsigned NEW_BAUD_RATE = 460800;
+const unsigned HANDSHAKE_TIMEOUT = 1000;
+
+bool hostSend(const char* str) {
+    const size_t n = strlen(str);
+    return uart_host::write((const uint8_t*)str, n, HOST_TIMEOUT) == n;
+}
+
+// Waits for the device to switch to the given baud rate
+bool waitDeviceBaudRate(unsigned rate) {
+    const double t = test::seconds();
+    while (uart_host::deviceBaudRate() != rate) {
+        if (test::seconds() - t > 1) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+TEST(baudRateHandshake) {
+    // Variants of the host's output at the new baud rate
+    for (const char* handshake: { "AT\r", "\x80\xfe\x13" "AT\r", "AAT\r", "ATAT\r" }) {
+        Transport t;
+        std::thread host([&]() {
+            EXPECT(waitDeviceBaudRate(NEW_BAUD_RATE));
+            uart_host::setBaudRate(NEW_BAUD_RATE);
+            EXPECT(hostSend(handshake));
+        });
+        EXPECT(t->changeBaudRate(NEW_BAUD_RATE, HANDSHAKE_TIMEOUT) == 0);
+        host.join();
+        EXPECT(t->baudRate() == NEW_BAUD_RATE);
+        EXPECT(uart_host::deviceBaudRate() == NEW_BAUD_RATE);
+        EXPECT(!t->isDirectMode());
+        // The handshake is not passed to the AT parser
+        EXPECT(t->getDataLength() == 0);
+    }
+}
+
+TEST(baudRateHandshakeTimeout) {
+    // Nothing, an incomplete handshake, and the handshake sent with a different line ending
+    for (const char* handshake: { "", "AT", "AT\n" }) {
+        Transport t;
+        std::thread host([&]() {
+            EXPECT(waitDeviceBaudRate(NEW_BAUD_RATE));
+            uart_host::setBaudRate(NEW_BAUD_RATE);
+            if (*handshake) {
+                EXPECT(hostSend(handshake));
+            }
+        });
+        const double start = test::seconds();
+        EXPECT(t->changeBaudRate(NEW_BAUD_RATE, HANDSHAKE_TIMEOUT) == RESULT_TIMEOUT);
+        const double elapsed = test::seconds() - start;
+        host.join();
+        EXPECT(elapsed >= HANDSHAKE_TIMEOUT / 1000.0 * 0.95 && elapsed < HANDSHAKE_TIMEOUT / 1000.0 * 1.5);
+        EXPECT(t->baudRate() == BAUD_RATE);
+        EXPECT(uart_host::deviceBaudRate() == BAUD_RATE);
+        EXPECT(!t->isDirectMode());
+    }
+}
+
+// The host didn't switch its UART and keeps sending the handshake at the previous baud rate. The
+// device switches back and the link works again
+TEST(baudRateHostAtPreviousRate) {
+    Transport t;
+    uart_host::setBaudRate(BAUD_RATE);
+    std::atomic_bool done(false);
+    std::thread host([&]() {
+        EXPECT(waitDeviceBaudRate(NEW_BAUD_RATE));
+        while (!done && uart_host::deviceBaudRate() == NEW_BAUD_RATE) {
+            EXPECT(hostSend("AT\r"));
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        }
+    });
+    EXPECT(t->changeBaudRate(NEW_BAUD_RATE, HANDSHAKE_TIMEOUT) == RESULT_TIMEOUT);
+    done = true;
+    host.join();
+    EXPECT(t->baudRate() == BAUD_RATE);
+    EXPECT(t->getDataLength() == 0);
+    ASSERT(hostSend("AT\r"));
+    char buf[4] = {};
+    EXPECT(t->readData((uint8_t*)buf, 3, 100) == 3);
+    EXPECT(strcmp(buf, "AT\r") == 0);
+}
+
+TEST(baudRateChangeInDirectMode) {
+    Transport t;
+    t->setDirectMode(true);
+    EXPECT(t->changeBaudRate(NEW_BAUD_RATE, HANDSHAKE_TIMEOUT) == RESULT_INVALID_STATE);
+    EXPECT(uart_host::deviceBaudRate() == BAUD_RATE);
+}
+
+// Waits until the transport has received `size` bytes
+bool waitDataLength(AtUartTransport* t, size_t size) {
+    const double start = test::seconds();
+    while (t->getDataLength() < (int)size) {
+        if (test::seconds() - start > 1) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return true;
+}
+
+TEST(waitDataBlocksUntilDataArrives) {
+    Transport t;
+    t->setDirectMode(true);
+    std::thread host([]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        hostWrite(0, 16);
+    });
+    const auto cpu = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    const auto start = test::seconds();
+    const int n = t->waitData(HOST_TIMEOUT);
+    const auto elapsed = test::seconds() - start;
+    const auto cpuUsed = cpuSeconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    host.join();
+    EXPECT(n > 0);
+    EXPECT(elapsed >= 0.15 && elapsed < 1);
+    // The caller sleeps instead of polling the transport
+    EXPECT(cpuUsed < 0.02);
+}
+
+TEST(waitDataTimeout) {
+    Transport t;
+    t->setDirectMode(true);
+    const auto cpu = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    const auto start = test::seconds();
+    EXPECT(t->waitData(300) == 0);
+    const auto elapsed = test::seconds() - start;
+    EXPECT(elapsed >= 0.25 && elapsed < 1);
+    EXPECT(cpuSeconds(CLOCK_THREAD_CPUTIME_ID) - cpu < 0.02);
+}
+
+TEST(waitDataReturnsBufferedData) {
+    Transport t;
+    t->setDirectMode(true);
+    ASSERT(hostWrite(0, 16));
+    ASSERT(waitDataLength(t.get(), 16));
+    const auto start = test::seconds();
+    EXPECT(t->waitData(0) == 16);
+    EXPECT(t->waitData(HOST_TIMEOUT) == 16);
+    EXPECT(test::seconds() - start < 0.05);
+}
+
+TEST(waitDataIgnoresStaleNotification) {
+    Transport t;
+    t->setDirectMode(true);
+    ASSERT(hostWrite(0, 16));
+    ASSERT(waitDataLength(t.get(), 16));
+    uint8_t buf[16] = {};
+    ASSERT(t->readData(buf, sizeof(buf), 0) == sizeof(buf));
+    // The notification of the data that has already been read doesn't wake up the caller
+    EXPECT(t->waitData(0) == 0);
+    const auto start = test::seconds();
+    EXPECT(t->waitData(300) == 0);
+    EXPECT(test::seconds() - start >= 0.25);
+}
+
+// Destination stream of the XMODEM receiver
+class BufferStream: public OutputStream {
+public:
+    int write(const char* data, size_t size) override {
+        data_.insert(data_.end(), data, data + size);
+        return size;
+    }
+
+    const std::vector<char>& data() const {
+        return data_;
+    }
+
+private:
+    std::vector<char> data_;
+};
+
+// Minimal XMODEM-1K sender running on the host side of the link. The sender waits `startDelayMs`
+// after the receiver has requested the transfer
+bool xmodemSend(const std::vector<char>& file, unsigned startDelayMs) {
+    const size_t dataSize = 1024;
+    uint8_t c = 0;
+    do {
+        if (uart_host::read(&c, 1, HOST_TIMEOUT) != 1) {
+            return false;
+        }
+    } while (c != 0x43); // C
+    std::this_thread::sleep_for(std::chrono::milliseconds(startDelayMs));
+    uint8_t num = 1;
+    for (size_t offs = 0; offs < file.size(); offs += dataSize, ++num) {
+        std::vector<uint8_t> p(dataSize + 5, 0x1a);
+        p[0] = 0x02; // STX
+        p[1] = num;
+        p[2] = 255 - num;
+        const size_t n = std::min(file.size() - offs, dataSize);
+        memcpy(&p[3], &file[offs], n);
+        const uint16_t crc = util::calcCrc16((const char*)&p[3], dataSize);
+        p[dataSize + 3] = crc >> 8;
+        p[dataSize + 4] = crc & 0xff;
+        if (uart_host::write(p.data(), p.size(), HOST_TIMEOUT) != p.size() ||
+                uart_host::read(&c, 1, HOST_TIMEOUT) != 1 || c != 0x06) { // ACK
+            return false;
+        }
+    }
+    c = 0x04; // EOT
+    return uart_host::write(&c, 1, HOST_TIMEOUT) == 1 && uart_host::read(&c, 1, HOST_TIMEOUT) == 1 && c == 0x06;
+}
+
+TEST(xmodemTransfer) {
+    Transport t;
+    t->setDirectMode(true);
+    std::vector<char> file(10000);
+    std::mt19937 rnd(1);
+    for (auto& b: file) {
+        b = rnd();
+    }
+    AtTransportStream src(t.get());
+    BufferStream dest;
+    XmodemReceiver recv;
+    ASSERT(recv.init(&src, &dest, file.size()) == 0);
+    bool sent = false;
+    std::thread host([&file, &sent]() {
+        sent = xmodemSend(file, 1000);
+    });
+    const auto cpu = cpuSeconds(CLOCK_THREAD_CPUTIME_ID);
+    int r = 0;
+    while ((r = recv.run()) == XmodemReceiver::RUNNING) {
+    }
+    const auto cpuUsed = cpuSeconds(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    host.join();
+    EXPECT(r == XmodemReceiver::DONE);
+    EXPECT(sent);
+    EXPECT(dest.data() == file);
+    // The receiver blocks in waitData() while the sender is idle instead of spinning
+    EXPECT(cpuUsed < 0.1);
+}
+
+// Counter increments of a tuning period of 1 s
+AtUartTransport::Stats tunePeriod(uint32_t events, uint32_t bytes, uint32_t overflows = 0, uint32_t stalledMs = 0) {
+    AtUartTransport::Stats s = {};
+    s.dataEvents = events;
+    s.rxBytes = bytes;
+    s.fifoOverflows = overflows;
+    s.stalledMs = stalledMs;
+    return s;
+}
+
+TEST(tuneOverflowLowersFifoThreshold) {
+    AtUartTransport::Thresholds t = { 120, 10 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(100, 12000, 1), 1000, 114, &t) == AtUartTransport::TUNE_OVERFLOW);
+    EXPECT(t.rxFifoFull == 104 && t.rxTimeout == 10);
+    // Not below the minimum
+    t = { 40, 10 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(100, 4000, 1), 1000, 114, &t) == AtUartTransport::TUNE_OVERFLOW);
+    EXPECT(t.rxFifoFull == 32);
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(100, 3200, 5), 1000, 114, &t) == AtUartTransport::TUNE_OVERFLOW);
+    EXPECT(t.rxFifoFull == 32);
+    // An overflow takes precedence over a stalled reader
+    t = { 120, 10 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(100, 12000, 1, 500), 1000, 114, &t) == AtUartTransport::TUNE_OVERFLOW);
+}
+
+TEST(tuneStalledReaderKeepsThresholds) {
+    AtUartTransport::Thresholds t = { 64, 10 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(100, 6400, 0, 101), 1000, 114, &t) == AtUartTransport::TUNE_STALLED);
+    EXPECT(t.rxFifoFull == 64 && t.rxTimeout == 10);
+    // Stalled for 10% of the period or less
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(100, 6400, 0, 100), 1000, 114, &t) == AtUartTransport::TUNE_BULK);
+}
+
+TEST(tuneNeedsEnoughEvents) {
+    AtUartTransport::Thresholds t = { 64, 5 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(15, 15 * 64), 1000, 114, &t) == AtUartTransport::TUNE_NONE);
+    EXPECT(t.rxFifoFull == 64 && t.rxTimeout == 5);
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(0, 0), 1000, 114, &t) == AtUartTransport::TUNE_NONE);
+}
+
+// A bulk transfer raises the FIFO full threshold step by step up to the maximum
+TEST(tuneBulkRaisesFifoThreshold) {
+    AtUartTransport::Thresholds t = { 32, 2 };
+    unsigned prev = t.rxFifoFull;
+    for (unsigned i = 0; i < 10; ++i) {
+        EXPECT(AtUartTransport::tuneThresholds(tunePeriod(1000, 1000 * t.rxFifoFull), 1000, 114, &t) ==
+                AtUartTransport::TUNE_BULK);
+        EXPECT(t.rxFifoFull == std::min(prev + 16, 114u));
+        EXPECT(t.rxTimeout == 10);
+        prev = t.rxFifoFull;
+    }
+    EXPECT(t.rxFifoFull == 114);
+    // Some of the events are timeouts at the end of the bursts
+    t = { 48, 10 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(1001, 1000 * 48 + 10), 1000, 114, &t) == AtUartTransport::TUNE_BULK);
+    EXPECT(t.rxFifoFull == 64);
+}
+
+TEST(tuneShortBurstsLowerTimeout) {
+    AtUartTransport::Thresholds t = { 120, 10 };
+    EXPECT(AtUartTransport::tuneThresholds(tunePeriod(50, 50 * 16), 1000, 114, &t) == AtUartTransport::TUNE_INTERACTIVE);
+    EXPECT(t.rxFifoFull == 120 && t.rxTimeout == 2);
+}
+
+// The tuning applied to the running transport by the transport thread
+TEST(autoTune) {
+    auto conf = config();
+    conf.autoTune = true;
+    // See rxProfileChangedWhileReceiving
+    conf.eventQueueSize = 256;
+    Transport t(conf);
+    // Start from the thresholds of the latency profile
+    ASSERT(t->setThresholds({ 32, 2 }) == 0);
+    {
+        // Bulk transfer over two tuning periods
+        Reader r(t.get());
+        ASSERT(hostWrite(0, 200 * 1024));
+        EXPECT(r.wait(200 * 1024));
+        EXPECT(r.ok());
+    }
+    AtUartTransport::Stats s = {};
+    t->stats(&s);
+    AtUartTransport::Thresholds th = {};
+    t->thresholds(&th);
+    EXPECT(s.decision == AtUartTransport::TUNE_BULK);
+    EXPECT(s.adjustments > 0);
+    EXPECT(th.rxFifoFull > 32 && th.rxFifoFull <= t->maxRxFifoFullThreshold());
+    EXPECT(th.rxTimeout == 10);
+    // Short commands
+    Reader r(t.get());
+    size_t offs = 0;
+    const double start = test::seconds();
+    while (test::seconds() - start < 2.2) {
+        ASSERT(hostWrite(offs, 8));
+        offs += 8;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    EXPECT(r.wait(offs));
+    t->stats(&s);
+    t->thresholds(&th);
+    EXPECT(s.decision == AtUartTransport::TUNE_INTERACTIVE);
+    EXPECT(th.rxTimeout == 2);
+}
+
+TEST(rxCoalescingSettings) {
+    Transport t(config(512, 3));
+    AtUartTransport::Coalescing c = {};
+    t->coalescing(&c);
+    EXPECT(c.bytes == 512 && c.timeMs == 3);
+    EXPECT(t->setCoalescing({ 1024, 0 }) == RESULT_INVALID_PARAM);
+    EXPECT(t->setCoalescing({ 1024, 101 }) == RESULT_INVALID_PARAM);
+    EXPECT(t->setCoalescing({ 1024, 5 }) == 0);
+    t->coalescing(&c);
+    EXPECT(c.bytes == 1024 && c.timeMs == 5);
+    // The timer is irrelevant when coalescing is disabled
+    EXPECT(t->setCoalescing({ 0, 0 }) == 0);
+}
+
+// Reader wakeups and CPU time of a bulk transfer with and without notification coalescing.
+// The total CPU time includes the emulated driver and the host side of the link
+BENCHMARK(rxCoalescingWakeups) {
+    const size_t size = 256 * 1024;
+    const struct {
+        size_t bytes;
+        unsigned timeMs;
+    } settings[] = { { 0, 0 }, { 512, 2 }, { 1024, 5 } };
+    for (const auto& c: settings) {
+        Transport t(config(c.bytes, c.timeMs));
+        TransferStats s = {};
+        ASSERT(bulkTransfer(t, size, &s));
+        printf("Coalescing %4u bytes / %u ms: %5u events, %5u notifications, %5u wakeups, %6.0f wakeups/s, "
+                "CPU %5.1f ms/MB (reader %4.1f ms/MB)\n", (unsigned)c.bytes, c.timeMs, (unsigned)s.dataEvents,
+                (unsigned)s.notifications, (unsigned)s.wakeups, s.wakeups / s.seconds,
+                s.cpuSeconds * 1000 / (size / 1048576.0), s.readerCpuSeconds * 1000 / (size / 1048576.0));
+    }
+}
+
+// Link profiles switched back and forth while the data is being received
+TEST(rxProfileChangedWhileReceiving) {
+    auto conf = config(512, 2);
+    // With the FIFO threshold of the latency profile, the default event queue can overflow if the
+    // transport thread doesn't get enough CPU time on the host, and the dropped events are never
+    // reported to the reader
+    conf.eventQueueSize = 256;
+    Transport t(conf);
+    Reader r(t.get());
+    std::atomic_bool done(false);
+    std::thread changer([&]() {
+        size_t i = 0;
+        while (!done) {
+            EXPECT(applyProfile(t.get(), PROFILES[i++ % (sizeof(PROFILES) / sizeof(PROFILES[0]))]));
+            std::this_thread::sleep_for(std::chrono::microseconds(500));
+        }
+    });
+    const size_t size = 64 * 1024;
+    EXPECT(hostWrite(0, size));
+    EXPECT(r.wait(size));
+    done = true;
+    changer.join();
+    EXPECT(r.ok());
+    EXPECT(r.notifiedBytes() == size);
+    EXPECT(hostStats().lostBytes == 0);
+}
+
+// Bulk transfer wakeups and the latency of short commands with the UART settings of each link
+// profile. Thread priorities are not emulated
+BENCHMARK(linkProfiles) {
+    const size_t bulkSize = 256 * 1024;
+    for (const auto& p: PROFILES) {
+        TransferStats s = {};
+        {
+            Transport t;
+            ASSERT(applyProfile(t.get(), p));
+            ASSERT(bulkTransfer(t, bulkSize, &s));
+        }
+        // Host sends a command, waits for it to be reported and pauses a bit, as AT exchanges do
+        Transport t;
+        ASSERT(applyProfile(t.get(), p));
+        Reader r(t.get());
+        const size_t commands = 100;
+        const size_t commandSize = 16;
+        double total = 0;
+        double worst = 0;
+        for (size_t i = 0; i < commands; ++i) {
+            const auto start = test::seconds();
+            ASSERT(hostWrite(i * commandSize, commandSize));
+            ASSERT(r.wait((i + 1) * commandSize));
+            const auto latency = test::seconds() - start;
+            total += latency;
+            worst = std::max(worst, latency);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        EXPECT(r.ok());
+        printf("%-10s: bulk %5u events, %5u wakeups, %4.1f ms/MB reader CPU; command latency %5.0f us, max %5.0f us\n",
+                p.name, (unsigned)s.dataEvents, (unsigned)s.wakeups, s.readerCpuSeconds * 1000 / (bulkSize / 1048576.0),
+                total / commands * 1e6, worst * 1e6);
+    }
+}
@@ -0,0 +1,833 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests of the updates applied by the update manager to the emulated flash
+
+#include "test.h"
+#include "flash_host.h"
+#include "update_manager.h"
+#include "stream.h"
+#include "util.h"
+#include "mbedtls/sha256.h"
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace particle;
+using namespace particle::ncp;
+
+namespace {
+
+// Formats of the firmware's compressed and delta images, see update_manager.cpp
+const uint32_t COMPRESSED_IMAGE_MAGIC = 0x5a50434e;
+const uint8_t COMPRESSED_IMAGE_FLAG_ZLIB = 0x01;
+const uint32_t DELTA_IMAGE_MAGIC = 0x4450434e;
+const uint8_t PATCH_OP_COPY = 0x01;
+const uint8_t PATCH_OP_DATA = 0x02;
+const size_t DELTA_HEADER_SIZE = 80;
+const size_t PATCH_OP_SIZE = 9;
+
+// Size of the chunks the update manager passes to its writer thread
+const size_t WRITE_CHUNK_SIZE = 4096;
+
+// Flash sector size
+const size_t SECTOR_SIZE = 4096;
+
+// Interval at which the progress of a resumable update is saved
+const size_t CHECKPOINT_INTERVAL = 16 * 1024;
+
+// Offset of the CRC-32 in the checkpoint stored in NVS
+const size_t CHECKPOINT_CRC_OFFSET = 8;
+
+const char IMAGE_ID[] = "image-1";
+
+typedef std::vector<uint8_t> Bytes;
+
+void sha256(const Bytes& data, uint8_t* hash) {
+    mbedtls_sha256_context ctx;
+    mbedtls_sha256_init(&ctx);
+    mbedtls_sha256_starts_ret(&ctx, 0);
+    mbedtls_sha256_update_ret(&ctx, data.data(), data.size());
+    mbedtls_sha256_finish_ret(&ctx, hash);
+    mbedtls_sha256_free(&ctx);
+}
+
+void append32(Bytes* b, uint32_t val) {
+    for (unsigned i = 0; i < 4; ++i) {
+        b->push_back((uint8_t)(val >> (i * 8)));
+    }
+}
+
+// Builds a patch and the image it produces
+class Patch {
+public:
+    explicit Patch(const Bytes& base) :
+            base_(base) {
+    }
+
+    Patch& copy(size_t offset, size_t size) {
+        op(PATCH_OP_COPY, size, offset);
+        if (offset < base_.size()) {
+            const size_t n = std::min(size, base_.size() - offset);
+            target_.insert(target_.end(), base_.begin() + offset, base_.begin() + offset + n);
+        }
+        return *this;
+    }
+
+    Patch& data(const Bytes& data) {
+        op(PATCH_OP_DATA, data.size(), 0);
+        patch_.insert(patch_.end(), data.begin(), data.end());
+        target_.insert(target_.end(), data.begin(), data.end());
+        return *this;
+    }
+
+    Patch& raw(const Bytes& data) {
+        patch_.insert(patch_.end(), data.begin(), data.end());
+        return *this;
+    }
+
+    // Size of the delta image built so far
+    size_t size() const {
+        return DELTA_HEADER_SIZE + patch_.size();
+    }
+
+    const Bytes& target() const {
+        return target_;
+    }
+
+    Bytes image() const {
+        Bytes b;
+        append32(&b, DELTA_IMAGE_MAGIC);
+        b.push_back(0); // flags
+        b.push_back(0); // windowBits
+        b.push_back(0); // reserved
+        b.push_back(0);
+        append32(&b, target_.size());
+        append32(&b, base_.size());
+        uint8_t h[32] = {};
+        sha256(base_, h);
+        b.insert(b.end(), h, h + sizeof(h));
+        sha256(target_, h);
+        b.insert(b.end(), h, h + sizeof(h));
+        b.insert(b.end(), patch_.begin(), patch_.end());
+        return b;
+    }
+
+private:
+    const Bytes& base_;
+    Bytes patch_;
+    Bytes target_;
+
+    void op(uint8_t type, size_t size, size_t offset) {
+        patch_.push_back(type);
+        append32(&patch_, size);
+        append32(&patch_, offset);
+    }
+};
+
+Bytes randomBytes(size_t size, std::mt19937* rnd) {
+    Bytes b(size);
+    for (auto& v: b) {
+        v = (uint8_t)(*rnd)();
+    }
+    return b;
+}
+
+// Writes an ESP32 image to the running partition
+Bytes makeBase(size_t size, std::mt19937* rnd) {
+    flash_host::reset();
+    Bytes base = randomBytes(size, rnd);
+    base[0] = 0xe9;
+    memcpy(flash_host::partitionData(flash_host::runningPartition()), base.data(), base.size());
+    return base;
+}
+
+// Full ESP32 image
+Bytes makeImage(size_t size, std::mt19937* rnd) {
+    Bytes image = randomBytes(size, rnd);
+    image[0] = 0xe9;
+    return image;
+}
+
+// Full ESP32 image with repeated fragments at distances of up to `maxDist` bytes
+Bytes makeCompressibleImage(size_t size, size_t maxDist, std::mt19937* rnd) {
+    Bytes image = randomBytes(64, rnd);
+    while (image.size() < size) {
+        if ((*rnd)() % 2) {
+            const Bytes b = randomBytes((*rnd)() % 32 + 1, rnd);
+            image.insert(image.end(), b.begin(), b.end());
+        } else {
+            const size_t dist = (*rnd)() % std::min(maxDist, image.size()) + 1;
+            const size_t len = (*rnd)() % 256 + 3;
+            for (size_t i = 0; i < len; ++i) {
+                image.push_back(image[image.size() - dist]);
+            }
+        }
+    }
+    image.resize(size);
+    image[0] = 0xe9;
+    return image;
+}
+
+// Compressed image with a zlib stream made with the given window size
+Bytes compressImage(const Bytes& image, unsigned windowBits, int streamWindowBits) {
+    z_stream z = {};
+    if (deflateInit2(&z, Z_BEST_COMPRESSION, Z_DEFLATED, streamWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return Bytes();
+    }
+    Bytes stream(deflateBound(&z, image.size()));
+    z.next_in = (Bytef*)image.data();
+    z.avail_in = image.size();
+    z.next_out = stream.data();
+    z.avail_out = stream.size();
+    const int ret = deflate(&z, Z_FINISH);
+    stream.resize(z.total_out);
+    deflateEnd(&z);
+    if (ret != Z_STREAM_END) {
+        return Bytes();
+    }
+    Bytes b;
+    append32(&b, COMPRESSED_IMAGE_MAGIC);
+    b.push_back(COMPRESSED_IMAGE_FLAG_ZLIB);
+    b.push_back(windowBits);
+    b.push_back(0); // reserved
+    b.push_back(0);
+    append32(&b, image.size());
+    b.insert(b.end(), stream.begin(), stream.end());
+    return b;
+}
+
+// Passes the image to the update manager in pieces of the given size
+int update(const Bytes& image, size_t writeSize, const uint8_t* hash = nullptr) {
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    int ret = mgr->beginUpdate(image.size(), &strm, nullptr, hash);
+    if (ret < 0) {
+        return ret;
+    }
+    for (size_t offs = 0; offs < image.size(); offs += writeSize) {
+        ret = strm->write((const char*)image.data() + offs, std::min(writeSize, image.size() - offs));
+        if (ret < 0) {
+            mgr->cancelUpdate();
+            return ret;
+        }
+    }
+    return mgr->finishUpdate();
+}
+
+// Starts a resumable update and interrupts it after `size` bytes of the image have been passed to
+// the update manager. Returns the offset of the last checkpoint, or 0 if no checkpoint was saved
+size_t interruptUpdate(const Bytes& image, size_t size, const uint8_t* hash = nullptr) {
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    if (mgr->beginUpdate(image.size(), &strm, IMAGE_ID, hash) < 0) {
+        return 0;
+    }
+    for (size_t offs = 0; offs < size; offs += 1000) {
+        const size_t n = std::min<size_t>(1000, size - offs);
+        if (strm->write((const char*)image.data() + offs, n) != (int)n) {
+            mgr->cancelUpdate();
+            return 0;
+        }
+    }
+    // The data is written asynchronously, wait until the checkpoint preceding the interruption is saved
+    const size_t expected = size / CHECKPOINT_INTERVAL * CHECKPOINT_INTERVAL;
+    UpdateManager::Checkpoint cp = {};
+    const double t = test::seconds();
+    while (expected > 0 && (mgr->getCheckpoint(&cp) < 0 || cp.offset < expected)) {
+        if (test::seconds() - t > 2) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    mgr->cancelUpdate();
+    return (mgr->getCheckpoint(&cp) == 0) ? cp.offset : 0;
+}
+
+// Resumes an interrupted update and passes the rest of the image to the update manager in pieces
+// of the given size
+int resumeUpdate(const Bytes& image, size_t writeSize, size_t* resumedAt = nullptr, const uint8_t* hash = nullptr) {
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    size_t offs = 0;
+    int ret = mgr->resumeUpdate(image.size(), IMAGE_ID, &offs, &strm, hash);
+    if (ret < 0) {
+        return ret;
+    }
+    if (resumedAt) {
+        *resumedAt = offs;
+    }
+    for (; offs < image.size(); offs += writeSize) {
+        ret = strm->write((const char*)image.data() + offs, std::min(writeSize, image.size() - offs));
+        if (ret < 0) {
+            mgr->cancelUpdate();
+            return ret;
+        }
+    }
+    return mgr->finishUpdate();
+}
+
+// Fills the update partition with the data of a previous update, so that a write to a sector that
+// hasn't been erased is detected. Returns the data
+Bytes fillUpdatePartition(std::mt19937* rnd) {
+    Bytes b = randomBytes(flash_host::PARTITION_SIZE, rnd);
+    memcpy(flash_host::partitionData(flash_host::updatePartition()), b.data(), b.size());
+    return b;
+}
+
+// Passes the image to the update manager in pieces of the given size, each taking `linkTime`
+// microseconds to arrive, so that the writer erases the flash ahead while it's idle
+int pacedUpdate(const Bytes& image, size_t writeSize, unsigned linkTime) {
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    int ret = mgr->beginUpdate(image.size(), &strm);
+    if (ret < 0) {
+        return ret;
+    }
+    for (size_t offs = 0; offs < image.size(); offs += writeSize) {
+        std::this_thread::sleep_for(std::chrono::microseconds(linkTime));
+        ret = strm->write((const char*)image.data() + offs, std::min(writeSize, image.size() - offs));
+        if (ret < 0) {
+            mgr->cancelUpdate();
+            return ret;
+        }
+    }
+    return mgr->finishUpdate();
+}
+
+size_t erasedSectors() {
+    flash_host::Stats s = {};
+    flash_host::stats(&s);
+    return s.erasedSectors;
+}
+
+size_t sectorCount(size_t size) {
+    return (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+}
+
+bool hasCheckpoint() {
+    UpdateManager::Checkpoint cp = {};
+    return UpdateManager::instance()->getCheckpoint(&cp) == 0;
+}
+
+bool updatedTo(const Bytes& target) {
+    const auto part = flash_host::updatePartition();
+    flash_host::Stats s = {};
+    flash_host::stats(&s);
+    return flash_host::bootPartition() == part && s.unerasedWrites == 0 &&
+            memcmp(flash_host::partitionData(part), target.data(), target.size()) == 0;
+}
+
+} // anonymous
+
+TEST(sha256KnownAnswer) {
+    // FIPS 180-2, appendix B.1
+    const Bytes abc = { 'a', 'b', 'c' };
+    const uint8_t expected[32] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+    };
+    uint8_t h[32] = {};
+    sha256(abc, h);
+    EXPECT(memcmp(h, expected, sizeof(h)) == 0);
+}
+
+TEST(deltaCopyAndData) {
+    std::mt19937 rnd(1);
+    const Bytes base = makeBase(64 * 1024, &rnd);
+    Patch p(base);
+    p.copy(0, 10000).data(randomBytes(500, &rnd)).copy(20000, 30000).data(randomBytes(3000, &rnd))
+            .copy(60000, 4000).copy(0, 1);
+    const Bytes image = p.image();
+    for (size_t writeSize: { 1, 9, 1000, 4096, 65536 }) {
+        flash_host::reset();
+        memcpy(flash_host::partitionData(flash_host::runningPartition()), base.data(), base.size());
+        EXPECT(update(image, writeSize) == 0);
+        EXPECT(updatedTo(p.target()));
+    }
+}
+
+TEST(patchOpSplitAcrossChunks) {
+    std::mt19937 rnd(2);
+    const Bytes base = makeBase(16 * 1024, &rnd);
+    // Place every byte of an operation at the end of the first chunk in turn, for both operation types
+    for (uint8_t type: { PATCH_OP_COPY, PATCH_OP_DATA }) {
+        for (size_t split = 1; split < PATCH_OP_SIZE; ++split) {
+            Patch p(base);
+            p.copy(0, 1000);
+            // Header of the data operation below and its data
+            const size_t dataSize = WRITE_CHUNK_SIZE - split - p.size() - PATCH_OP_SIZE;
+            p.data(randomBytes(dataSize, &rnd));
+            ASSERT(p.size() == WRITE_CHUNK_SIZE - split);
+            if (type == PATCH_OP_COPY) {
+                p.copy(5000, 3000);
+            } else {
+                p.data(randomBytes(2000, &rnd));
+            }
+            p.copy(100, 200);
+            flash_host::reset();
+            memcpy(flash_host::partitionData(flash_host::runningPartition()), base.data(), base.size());
+            EXPECT(update(p.image(), 512) == 0);
+            EXPECT(updatedTo(p.target()));
+        }
+    }
+}
+
+TEST(copyOutOfRange) {
+    std::mt19937 rnd(3);
+    const Bytes base = makeBase(8 * 1024, &rnd);
+    Patch p(base);
+    p.copy(0, 100).copy(base.size() - 10, 20);
+    EXPECT(update(p.image(), 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+TEST(baseMismatch) {
+    std::mt19937 rnd(4);
+    const Bytes base = makeBase(8 * 1024, &rnd);
+    Patch p(base);
+    p.copy(0, 8 * 1024);
+    // The running image is not the one the patch was made for
+    flash_host::partitionData(flash_host::runningPartition())[100] ^= 0x01;
+    EXPECT(update(p.image(), 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+TEST(truncatedPatch) {
+    std::mt19937 rnd(5);
+    const Bytes base = makeBase(8 * 1024, &rnd);
+    Patch p(base);
+    p.copy(0, 1000).data(randomBytes(100, &rnd)).copy(2000, 500);
+    Bytes image = p.image();
+    // Cut the last operation in the middle
+    image.resize(image.size() - 4);
+    EXPECT(update(image, 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+TEST(invalidPatchOp) {
+    std::mt19937 rnd(6);
+    const Bytes base = makeBase(8 * 1024, &rnd);
+    Patch p(base);
+    p.copy(0, 1000).raw({ 0x07, 0, 0, 0, 0, 0, 0, 0, 0 });
+    EXPECT(update(p.image(), 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+TEST(rawImage) {
+    std::mt19937 rnd(7);
+    const Bytes image = makeImage(100 * 1024 + 17, &rnd);
+    for (size_t writeSize: { 1, 1000, 4096, 5000 }) {
+        flash_host::reset();
+        EXPECT(update(image, writeSize) == 0);
+        EXPECT(updatedTo(image));
+    }
+}
+
+TEST(writeErrorReported) {
+    std::mt19937 rnd(8);
+    const Bytes image = makeImage(128 * 1024, &rnd);
+    // The error is reported either by a write of the data following the failed chunk or by finishUpdate()
+    for (size_t failOffs: { (size_t)40000, image.size() - 1 }) {
+        flash_host::reset();
+        flash_host::failWritesAt(failOffs);
+        EXPECT(update(image, 1024) < 0);
+        EXPECT(flash_host::bootPartition() == nullptr);
+    }
+}
+
+TEST(cancelDiscardsQueuedData) {
+    std::mt19937 rnd(9);
+    const Bytes image = makeImage(64 * 1024, &rnd);
+    flash_host::reset();
+    // 80 ms per chunk
+    flash_host::setTiming(20000, 0);
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    ASSERT(mgr->beginUpdate(image.size(), &strm) == 0);
+    // One more chunk than there are buffers, the last write waits for the first chunk to be written
+    const size_t size = 4 * WRITE_CHUNK_SIZE;
+    EXPECT(strm->write((const char*)image.data(), size) == (int)size);
+    const double t = test::seconds();
+    mgr->cancelUpdate();
+    // At most the chunk being programmed is finished, the queued ones are dropped
+    EXPECT(test::seconds() - t < 0.2);
+    flash_host::Stats s = {};
+    flash_host::stats(&s);
+    EXPECT(s.writtenBytes < size);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+TEST(compressedImage) {
+    std::mt19937 rnd(11);
+    for (unsigned windowBits: { 9, 12 }) {
+        const Bytes image = makeCompressibleImage(150 * 1024 + 3, 1 << windowBits, &rnd);
+        const Bytes compressed = compressImage(image, windowBits, windowBits);
+        ASSERT(!compressed.empty());
+        EXPECT(compressed.size() < image.size() / 2);
+        for (size_t writeSize: { 1000, 4096 }) {
+            flash_host::reset();
+            EXPECT(update(compressed, writeSize) == 0);
+            EXPECT(updatedTo(image));
+        }
+    }
+    // A stream with a smaller window than the one allocated
+    const Bytes image = makeCompressibleImage(64 * 1024, 1 << 10, &rnd);
+    flash_host::reset();
+    EXPECT(update(compressImage(image, 12, 10), 4096) == 0);
+    EXPECT(updatedTo(image));
+}
+
+TEST(compressedImageTruncated) {
+    std::mt19937 rnd(12);
+    const Bytes image = makeCompressibleImage(100 * 1024, 4096, &rnd);
+    const Bytes compressed = compressImage(image, 12, 12);
+    // Cut in the middle of the deflate stream and in its Adler-32 checksum
+    for (size_t cut: { compressed.size() / 2, (size_t)1 }) {
+        flash_host::reset();
+        EXPECT(update(Bytes(compressed.begin(), compressed.end() - cut), 4096) < 0);
+        EXPECT(flash_host::bootPartition() == nullptr);
+    }
+}
+
+TEST(compressedImageCorrupted) {
+    std::mt19937 rnd(13);
+    const Bytes image = makeCompressibleImage(100 * 1024, 4096, &rnd);
+    Bytes compressed = compressImage(image, 12, 12);
+    compressed[compressed.size() / 2] ^= 0x10;
+    flash_host::reset();
+    EXPECT(update(compressed, 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+// The stream's window doesn't fit in the dictionary allocated for the window size given in
+// the image header. The image is rejected before anything is decompressed
+TEST(compressedImageWindowTooLarge) {
+    std::mt19937 rnd(14);
+    const Bytes image = makeCompressibleImage(100 * 1024, 32768, &rnd);
+    for (int streamWindowBits: { 13, 15 }) {
+        flash_host::reset();
+        EXPECT(update(compressImage(image, 12, streamWindowBits), 4096) < 0);
+        flash_host::Stats s = {};
+        flash_host::stats(&s);
+        EXPECT(s.writtenBytes == 0);
+        EXPECT(flash_host::bootPartition() == nullptr);
+    }
+    // Larger than the maximum window size supported by the firmware
+    flash_host::reset();
+    EXPECT(update(compressImage(image, 13, 13), 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+// Invalid zlib stream headers
+TEST(compressedImageInvalidZlibHeader) {
+    std::mt19937 rnd(15);
+    const Bytes image = makeCompressibleImage(16 * 1024, 4096, &rnd);
+    const Bytes compressed = compressImage(image, 12, 12);
+    const size_t cmfOffs = 12;
+    Bytes b = compressed;
+    b[cmfOffs + 1] ^= 0x01; // FCHECK
+    flash_host::reset();
+    EXPECT(update(b, 4096) < 0);
+    b = compressed;
+    b[cmfOffs] = (b[cmfOffs] & 0xf0) | 0x07; // Compression method
+    b[cmfOffs + 1] = 0;
+    b[cmfOffs + 1] = 31 - ((b[cmfOffs] << 8) % 31);
+    flash_host::reset();
+    EXPECT(update(b, 4096) < 0);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+// The update is interrupted exactly at a checkpoint and in the middle of a write chunk, with
+// the data following the checkpoint partially written to flash
+TEST(resumeAfterInterruption) {
+    std::mt19937 rnd(16);
+    const Bytes image = makeImage(100 * 1024 + 123, &rnd);
+    for (size_t interruptAt: { 2 * CHECKPOINT_INTERVAL, 2 * CHECKPOINT_INTERVAL + 6000, (size_t)1000 * 99 }) {
+        flash_host::reset();
+        const size_t cpOffs = interruptAt / CHECKPOINT_INTERVAL * CHECKPOINT_INTERVAL;
+        EXPECT(interruptUpdate(image, interruptAt) == cpOffs);
+        for (size_t writeSize: { (size_t)1000, WRITE_CHUNK_SIZE }) {
+            size_t resumedAt = 0;
+            EXPECT(resumeUpdate(image, writeSize, &resumedAt) == 0);
+            EXPECT(resumedAt == cpOffs);
+            // The sectors following the checkpoint are erased again before they are written
+            EXPECT(updatedTo(image));
+            EXPECT(!hasCheckpoint());
+            // Interrupt the update again for the next write size
+            if (writeSize == 1000) {
+                EXPECT(interruptUpdate(image, interruptAt) == cpOffs);
+            }
+        }
+    }
+    // No checkpoint is saved before the first interval has been written
+    flash_host::reset();
+    EXPECT(interruptUpdate(image, CHECKPOINT_INTERVAL - 1) == 0);
+    EXPECT(resumeUpdate(image, 1000) < 0);
+}
+
+// The data written before the interruption doesn't match the CRC-32 of the checkpoint
+TEST(resumeBadCrcRejected) {
+    std::mt19937 rnd(17);
+    const Bytes image = makeImage(64 * 1024, &rnd);
+    const auto part = flash_host::updatePartition();
+    // Data modified in flash
+    flash_host::reset();
+    ASSERT(interruptUpdate(image, 40000) == 2 * CHECKPOINT_INTERVAL);
+    flash_host::partitionData(part)[CHECKPOINT_INTERVAL + 5] ^= 0x01;
+    EXPECT(resumeUpdate(image, 1000) == RESULT_NOT_FOUND);
+    // The checkpoint is discarded
+    EXPECT(!hasCheckpoint());
+    EXPECT(flash_host::bootPartition() == nullptr);
+    // CRC modified in the stored checkpoint
+    flash_host::reset();
+    ASSERT(interruptUpdate(image, 40000) == 2 * CHECKPOINT_INTERVAL);
+    uint8_t cp[256] = {};
+    size_t size = sizeof(cp);
+    ASSERT(util::nvsReadSetting(util::NVS_SETTING_UPDATE_CHECKPOINT, cp, &size) == 0);
+    cp[CHECKPOINT_CRC_OFFSET] ^= 0x01;
+    ASSERT(util::nvsWriteSetting(util::NVS_SETTING_UPDATE_CHECKPOINT, cp, size) == 0);
+    EXPECT(resumeUpdate(image, 1000) == RESULT_NOT_FOUND);
+    EXPECT(!hasCheckpoint());
+    EXPECT(flash_host::bootPartition() == nullptr);
+    // A new update can be started
+    EXPECT(update(image, 4096) == 0);
+    EXPECT(updatedTo(image));
+}
+
+// The checkpoint was saved for a different image
+TEST(resumeImageMismatchRejected) {
+    std::mt19937 rnd(18);
+    const Bytes image = makeImage(64 * 1024, &rnd);
+    flash_host::reset();
+    ASSERT(interruptUpdate(image, 40000) == 2 * CHECKPOINT_INTERVAL);
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    size_t offs = 0;
+    EXPECT(mgr->resumeUpdate(image.size(), "image-2", &offs, &strm) == RESULT_NOT_FOUND);
+    EXPECT(mgr->resumeUpdate(image.size() + 1, IMAGE_ID, &offs, &strm) == RESULT_NOT_FOUND);
+    EXPECT(mgr->resumeUpdate(image.size() - 1, IMAGE_ID, &offs, &strm) == RESULT_NOT_FOUND);
+    // The checkpoint is kept for the image it belongs to
+    EXPECT(resumeUpdate(image, 1000) == 0);
+    EXPECT(updatedTo(image));
+}
+
+TEST(imageHash) {
+    std::mt19937 rnd(19);
+    const Bytes image = makeImage(100 * 1024 + 5, &rnd);
+    uint8_t h[UpdateManager::HASH_SIZE] = {};
+    sha256(image, h);
+    flash_host::reset();
+    EXPECT(update(image, 1000, h) == 0);
+    EXPECT(updatedTo(image));
+    // The hash of a compressed image is the hash of the decompressed data
+    const Bytes compressible = makeCompressibleImage(64 * 1024, 4096, &rnd);
+    uint8_t ch[UpdateManager::HASH_SIZE] = {};
+    sha256(compressible, ch);
+    flash_host::reset();
+    EXPECT(update(compressImage(compressible, 12, 12), 4096, ch) == 0);
+    EXPECT(updatedTo(compressible));
+}
+
+// The image is rejected before the boot partition is changed
+TEST(imageHashMismatchRejected) {
+    std::mt19937 rnd(20);
+    const Bytes image = makeImage(64 * 1024, &rnd);
+    uint8_t h[UpdateManager::HASH_SIZE] = {};
+    sha256(image, h);
+    // Wrong hash
+    uint8_t badHash[UpdateManager::HASH_SIZE] = {};
+    memcpy(badHash, h, sizeof(h));
+    badHash[31] ^= 0x01;
+    flash_host::reset();
+    EXPECT(update(image, 1000, badHash) == RESULT_INVALID_FORMAT);
+    EXPECT(flash_host::bootPartition() == nullptr);
+    // Image corrupted on the way
+    Bytes corrupted = image;
+    corrupted[40000] ^= 0x01;
+    flash_host::reset();
+    EXPECT(update(corrupted, 1000, h) == RESULT_INVALID_FORMAT);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+// The hash of the data written before the interruption is calculated again when the update is resumed
+TEST(resumeWithImageHash) {
+    std::mt19937 rnd(21);
+    const Bytes image = makeImage(100 * 1024, &rnd);
+    uint8_t h[UpdateManager::HASH_SIZE] = {};
+    sha256(image, h);
+    flash_host::reset();
+    ASSERT(interruptUpdate(image, 40000, h) == 2 * CHECKPOINT_INTERVAL);
+    size_t resumedAt = 0;
+    EXPECT(resumeUpdate(image, 1000, &resumedAt, h) == 0);
+    EXPECT(resumedAt == 2 * CHECKPOINT_INTERVAL);
+    EXPECT(updatedTo(image));
+    // The rest of the image differs from the one the hash was given for
+    Bytes other = image;
+    other[90000] ^= 0x01;
+    flash_host::reset();
+    ASSERT(interruptUpdate(image, 40000, h) == 2 * CHECKPOINT_INTERVAL);
+    EXPECT(resumeUpdate(other, 1000, nullptr, h) == RESULT_INVALID_FORMAT);
+    EXPECT(flash_host::bootPartition() == nullptr);
+    // The hash passed on resumption is not the one of the image
+    flash_host::reset();
+    ASSERT(interruptUpdate(image, 40000, h) == 2 * CHECKPOINT_INTERVAL);
+    uint8_t badHash[UpdateManager::HASH_SIZE] = {};
+    memcpy(badHash, h, sizeof(h));
+    badHash[0] ^= 0x01;
+    EXPECT(resumeUpdate(image, 1000, nullptr, badHash) == RESULT_INVALID_FORMAT);
+    EXPECT(flash_host::bootPartition() == nullptr);
+}
+
+// Writes that start and end at various positions within the sectors, with the flash erased ahead
+// of the write position in between. Every sector of the image is erased once before it's written
+TEST(eraseAheadAcrossSectorBoundaries) {
+    std::mt19937 rnd(22);
+    const Bytes image = makeImage(24 * SECTOR_SIZE + 100, &rnd);
+    for (size_t writeSize: { (size_t)1, (size_t)1000, SECTOR_SIZE - 1, SECTOR_SIZE + 1, (size_t)10000 }) {
+        flash_host::reset();
+        fillUpdatePartition(&rnd);
+        flash_host::setTiming(100, 500);
+        const unsigned linkTime = (writeSize == 1) ? 0 : 300;
+        EXPECT(pacedUpdate(image, writeSize, linkTime) == 0);
+        EXPECT(updatedTo(image));
+        EXPECT(erasedSectors() == sectorCount(image.size()));
+    }
+}
+
+// The last sector of the image is erased but nothing after it, including when the image fills
+// the partition
+TEST(eraseAheadTailSector) {
+    std::mt19937 rnd(23);
+    for (size_t size: { 10 * SECTOR_SIZE, 10 * SECTOR_SIZE + 1, 11 * SECTOR_SIZE - 1, flash_host::PARTITION_SIZE - 1,
+            flash_host::PARTITION_SIZE }) {
+        const Bytes image = makeImage(size, &rnd);
+        flash_host::reset();
+        const Bytes stale = fillUpdatePartition(&rnd);
+        flash_host::setTiming(100, 500);
+        EXPECT(pacedUpdate(image, 1000, 300) == 0);
+        EXPECT(updatedTo(image));
+        EXPECT(erasedSectors() == sectorCount(size));
+        const size_t end = sectorCount(size) * SECTOR_SIZE;
+        EXPECT(memcmp(flash_host::partitionData(flash_host::updatePartition()) + end, stale.data() + end,
+                flash_host::PARTITION_SIZE - end) == 0);
+    }
+    // Larger than the partition
+    flash_host::reset();
+    const Bytes image = makeImage(flash_host::PARTITION_SIZE + 1, &rnd);
+    EXPECT(update(image, 4096) == RESULT_TOO_LARGE_DATA);
+    EXPECT(erasedSectors() == 0);
+}
+
+// The sectors erased ahead of the interruption may have been written since, they are erased again
+// when the update is resumed
+TEST(eraseAheadAfterResume) {
+    std::mt19937 rnd(24);
+    const Bytes image = makeImage(100 * 1024, &rnd);
+    flash_host::reset();
+    fillUpdatePartition(&rnd);
+    flash_host::setTiming(100, 500);
+    // Interrupted while the writer erases ahead of the write position
+    const size_t interruptAt = 2 * CHECKPOINT_INTERVAL + 3 * SECTOR_SIZE + 500;
+    ASSERT(interruptUpdate(image, interruptAt) == 2 * CHECKPOINT_INTERVAL);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    const size_t erased = erasedSectors();
+    const auto mgr = UpdateManager::instance();
+    OutputStream* strm = nullptr;
+    size_t offs = 0;
+    ASSERT(mgr->resumeUpdate(image.size(), IMAGE_ID, &offs, &strm) == 0);
+    for (; offs < image.size(); offs += 1000) {
+        std::this_thread::sleep_for(std::chrono::microseconds(300));
+        const size_t n = std::min<size_t>(1000, image.size() - offs);
+        ASSERT(strm->write((const char*)image.data() + offs, n) == (int)n);
+    }
+    ASSERT(mgr->finishUpdate() == 0);
+    EXPECT(updatedTo(image));
+    EXPECT(erasedSectors() - erased == sectorCount(image.size()) - 2 * CHECKPOINT_INTERVAL / SECTOR_SIZE);
+}
+
+BENCHMARK(pipelinedWrites) {
+    std::mt19937 rnd(10);
+    const Bytes image = makeImage(128 * 1024, &rnd);
+    const size_t packetSize = 1024;
+    // Typical SPI flash of the ESP32 modules: about 3 ms to program 1 KB, 45 ms to erase a sector
+    const unsigned flashWriteTime = 3000;
+    const unsigned flashEraseTime = 45000;
+    // Time to receive 1 KB at 921600 bps over UART and over a faster link
+    for (unsigned linkTime: { 11000, 2000 }) {
+        flash_host::reset();
+        flash_host::setTiming(flashWriteTime, flashEraseTime);
+        const auto mgr = UpdateManager::instance();
+        OutputStream* strm = nullptr;
+        ASSERT(mgr->beginUpdate(image.size(), &strm) == 0);
+        const double t = test::seconds();
+        for (size_t offs = 0; offs < image.size(); offs += packetSize) {
+            std::this_thread::sleep_for(std::chrono::microseconds(linkTime));
+            ASSERT(strm->write((const char*)image.data() + offs, packetSize) == (int)packetSize);
+        }
+        ASSERT(mgr->finishUpdate() == 0);
+        const double total = test::seconds() - t;
+        const unsigned kb = image.size() / 1024;
+        const double link = kb * linkTime / 1e6;
+        const double flash = (kb * flashWriteTime + image.size() / 4096 * flashEraseTime) / 1e6;
+        printf("%3u ms/KB link: %4.0f ms, transfer alone %4.0f ms, flash alone %4.0f ms, serial %4.0f ms\n",
+                linkTime / 1000, total * 1000, link * 1000, flash * 1000, (link + flash) * 1000);
+    }
+}
+
+// Time from the start of an update until the first packet is accepted, with the flash erased lazily
+// ahead of the write position and with the image area erased up front, as esp_ota_begin() does
+BENCHMARK(timeToFirstPacket) {
+    std::mt19937 rnd(25);
+    const size_t packetSize = 1024;
+    const unsigned flashWriteTime = 3000;
+    const unsigned flashEraseTime = 45000;
+    const unsigned linkTime = 11000;
+    for (size_t size: { (size_t)128 * 1024, flash_host::PARTITION_SIZE }) {
+        const Bytes image = makeImage(size, &rnd);
+        for (bool upFront: { true, false }) {
+            flash_host::reset();
+            flash_host::setTiming(flashWriteTime, flashEraseTime);
+            const auto mgr = UpdateManager::instance();
+            OutputStream* strm = nullptr;
+            const double t = test::seconds();
+            if (upFront) {
+                ASSERT(esp_partition_erase_range(flash_host::updatePartition(), 0,
+                        sectorCount(size) * SECTOR_SIZE) == ESP_OK);
+                // The update manager erases the sectors again, which costs nothing here
+                flash_host::setTiming(flashWriteTime, 0);
+            }
+            ASSERT(mgr->beginUpdate(image.size(), &strm) == 0);
+            ASSERT(strm->write((const char*)image.data(), packetSize) == (int)packetSize);
+            const double first = test::seconds() - t;
+            for (size_t offs = packetSize; offs < image.size(); offs += packetSize) {
+                std::this_thread::sleep_for(std::chrono::microseconds(linkTime));
+                ASSERT(strm->write((const char*)image.data() + offs, packetSize) == (int)packetSize);
+            }
+            ASSERT(mgr->finishUpdate() == 0);
+            const double total = test::seconds() - t;
+            printf("%3u KB image, %-8s erase: first packet after %6.1f ms, total %5.0f ms\n", (unsigned)(size / 1024),
+                    upFront ? "up-front" : "lazy", first * 1000, total * 1000);
+        }
+    }
+}
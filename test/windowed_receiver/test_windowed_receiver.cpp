@@ -0,0 +1,483 @@
+/*
+ * Copyright (c) 2020 Particle Industries, Inc.  All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation, either
+ * version 3 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Tests of the sliding window protocol receiver against a simulated sender over a lossy link
+
+#include "test.h"
+#include "windowed_receiver.h"
+#include "channel_buffer.h"
+#include "stream.h"
+#include "util/crc.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <vector>
+
+using namespace particle;
+using particle::ncp::ChannelBuffer;
+
+namespace {
+
+const char STX = 0x02;
+const char EOT = 0x04;
+const char ACK = 0x06;
+const char NAK = 0x15;
+const char CAN = 0x18;
+const char START = 0x57;
+
+const size_t PAYLOAD_SIZE = 1024;
+
+// Time the sender waits for a reply before sending the first unacknowledged packet again
+const unsigned SENDER_TIMEOUT = 1500;
+// Maximum duration of a transfer
+const double TRANSFER_TIMEOUT = 60;
+
+// One direction of the link
+class Pipe {
+public:
+    // Makes the pipe buffer the data like the AT channel of the muxer: every write is a frame that
+    // is dropped if it doesn't fit in the buffer
+    void channelBuffer(ChannelBuffer* buf) {
+        buf_ = buf;
+    }
+
+    void write(const char* data, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (buf_) {
+            if (buf_->put((const uint8_t*)data, size) < 0) {
+                return;
+            }
+        } else {
+            data_.insert(data_.end(), data, data + size);
+        }
+        cond_.notify_all();
+    }
+
+    size_t read(char* data, size_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (buf_) {
+            return std::max(buf_->get((uint8_t*)data, size), 0);
+        }
+        const size_t n = std::min(size, data_.size());
+        std::copy(data_.begin(), data_.begin() + n, data);
+        data_.erase(data_.begin(), data_.begin() + n);
+        return n;
+    }
+
+    // Returns false if there's still no data after the timeout
+    bool wait(unsigned timeoutMs) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        return cond_.wait_for(lock, std::chrono::milliseconds(timeoutMs), [this]() {
+            return !data_.empty() || (buf_ && buf_->data() > 0) || closed_;
+        });
+    }
+
+    // Wakes up the waiting reader
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        cond_.notify_all();
+    }
+
+private:
+    std::deque<char> data_;
+    ChannelBuffer* buf_ = nullptr;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+};
+
+struct Link {
+    Pipe toReceiver;
+    Pipe toSender;
+    double replyLoss = 0; // Probability of a reply of the receiver getting lost
+    std::mt19937 rnd;
+    std::mutex rndMutex;
+
+    bool lose(double p) {
+        std::lock_guard<std::mutex> lock(rndMutex);
+        return std::uniform_real_distribution<double>(0, 1)(rnd) < p;
+    }
+};
+
+// Receiver's end of the link
+class ReceiverStream: public Stream {
+public:
+    explicit ReceiverStream(Link* link) :
+            link_(link) {
+    }
+
+    int read(char* data, size_t size) override {
+        return link_->toReceiver.read(data, size);
+    }
+
+    int write(const char* data, size_t size) override {
+        // The receiver writes a complete reply at once
+        if (!link_->lose(link_->replyLoss)) {
+            link_->toSender.write(data, size);
+        }
+        return size;
+    }
+
+    int waitEvent(unsigned flags, unsigned timeout) override {
+        unsigned events = flags & WRITABLE;
+        if ((flags & READABLE) && link_->toReceiver.wait(events ? 0 : timeout)) {
+            events |= READABLE;
+        }
+        return events;
+    }
+
+private:
+    Link* link_;
+};
+
+class BufferStream: public OutputStream {
+public:
+    // Makes every write take some time, like a write to the flash
+    explicit BufferStream(unsigned writeDelayMs = 0) :
+            writeDelayMs_(writeDelayMs) {
+    }
+
+    int write(const char* data, size_t size) override {
+        if (writeDelayMs_ > 0) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(writeDelayMs_));
+        }
+        data_.insert(data_.end(), data, data + size);
+        return size;
+    }
+
+    const std::vector<char>& data() const {
+        return data_;
+    }
+
+private:
+    std::vector<char> data_;
+    unsigned writeDelayMs_;
+};
+
+// Sends a file using the sliding window protocol. Packets can be dropped or corrupted on the way
+class Sender {
+public:
+    Sender(Link* link, const std::vector<char>& file) :
+            link_(link),
+            file_(file),
+            packetLoss_(0),
+            packetCorruption_(0),
+            badSize_(false),
+            cancel_(false),
+            stop_(false),
+            packetsSent_(0) {
+    }
+
+    ~Sender() {
+        stop();
+    }
+
+    Sender& packetLoss(double p) {
+        packetLoss_ = p;
+        return *this;
+    }
+
+    Sender& packetCorruption(double p) {
+        packetCorruption_ = p;
+        return *this;
+    }
+
+    // Makes the sender send a first packet of a wrong size
+    Sender& badSize() {
+        badSize_ = true;
+        return *this;
+    }
+
+    // Makes the sender cancel the transfer after the first acknowledgement
+    Sender& cancel() {
+        cancel_ = true;
+        return *this;
+    }
+
+    void start() {
+        thread_ = std::thread([this]() {
+            run();
+        });
+    }
+
+    void stop() {
+        stop_ = true;
+        link_->toSender.close();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    unsigned packetsSent() const {
+        return packetsSent_;
+    }
+
+private:
+    Link* link_;
+    const std::vector<char>& file_;
+    double packetLoss_;
+    double packetCorruption_;
+    bool badSize_;
+    bool cancel_;
+    std::atomic_bool stop_;
+    std::atomic<unsigned> packetsSent_;
+    std::thread thread_;
+
+    void run() {
+        const unsigned total = (file_.size() + PAYLOAD_SIZE - 1) / PAYLOAD_SIZE;
+        unsigned window = 0;
+        unsigned base = 0;
+        unsigned next = 0;
+        bool eot = false;
+        char reply[3] = {};
+        size_t replySize = 0;
+        while (!stop_) {
+            if (window > 0 && !eot) {
+                while (next < total && next < base + window) {
+                    sendPacket(next++);
+                }
+            }
+            if (!link_->toSender.wait(SENDER_TIMEOUT)) {
+                // Timeout
+                if (eot) {
+                    sendEot();
+                } else if (window > 0 && base < total) {
+                    sendPacket(base);
+                }
+                continue;
+            }
+            while (!stop_) {
+                if (replySize == 0) {
+                    // Look for the start of a reply
+                    char c = 0;
+                    if (!link_->toSender.read(&c, 1)) {
+                        break;
+                    }
+                    if (c != START && c != ACK && c != NAK) {
+                        continue;
+                    }
+                    reply[replySize++] = c;
+                    continue;
+                }
+                const size_t n = link_->toSender.read(reply + replySize, sizeof(reply) - replySize);
+                if (n == 0) {
+                    break;
+                }
+                replySize += n;
+                if (replySize < sizeof(reply)) {
+                    continue;
+                }
+                replySize = 0;
+                const unsigned val = (uint8_t)reply[1] | ((unsigned)(uint8_t)reply[2] << 8);
+                if (reply[0] == START) {
+                    window = val;
+                } else if (reply[0] == ACK) {
+                    if (cancel_) {
+                        const char can[] = { CAN, CAN };
+                        link_->toReceiver.write(can, sizeof(can));
+                        return;
+                    }
+                    if (val == base && base < next && !eot) {
+                        // Repeated acknowledgement, the first unacknowledged packet got lost
+                        sendPacket(base);
+                    }
+                    base = std::max(base, val);
+                    next = std::max(next, base);
+                    if (base == total && !eot) {
+                        eot = true;
+                        sendEot();
+                    }
+                } else if (reply[0] == NAK) {
+                    base = std::max(base, val);
+                    next = std::max(next, base);
+                    if (val < total) {
+                        sendPacket(val);
+                    }
+                }
+            }
+        }
+    }
+
+    void sendPacket(unsigned num) {
+        const size_t offs = num * PAYLOAD_SIZE;
+        size_t size = std::min(PAYLOAD_SIZE, file_.size() - offs);
+        if (badSize_ && num == 0) {
+            size -= 1;
+        }
+        std::vector<char> p;
+        p.push_back(STX);
+        p.push_back(num & 0xff);
+        p.push_back((num >> 8) & 0xff);
+        p.push_back(size & 0xff);
+        p.push_back((size >> 8) & 0xff);
+        p.insert(p.end(), file_.begin() + offs, file_.begin() + offs + size);
+        const uint16_t crc = util::calcCrc16(p.data() + 1, p.size() - 1);
+        p.push_back(crc >> 8);
+        p.push_back(crc & 0xff);
+        ++packetsSent_;
+        if (link_->lose(packetLoss_)) {
+            return;
+        }
+        if (link_->lose(packetCorruption_)) {
+            std::lock_guard<std::mutex> lock(link_->rndMutex);
+            p[link_->rnd() % p.size()] ^= 0x5a;
+        }
+        link_->toReceiver.write(p.data(), p.size());
+    }
+
+    void sendEot() {
+        link_->toReceiver.write(&EOT, 1);
+    }
+};
+
+std::vector<char> randomFile(size_t size, std::mt19937* rnd) {
+    std::vector<char> f(size);
+    for (auto& c: f) {
+        c = (char)(*rnd)();
+    }
+    return f;
+}
+
+// Runs the receiver until the transfer is finished
+int receive(Link* link, size_t size, BufferStream* dest) {
+    ReceiverStream src(link);
+    WindowedReceiver receiver;
+    int ret = receiver.init(&src, dest, size);
+    if (ret < 0) {
+        return ret;
+    }
+    const double start = test::seconds();
+    do {
+        ret = receiver.run();
+        if (test::seconds() - start > TRANSFER_TIMEOUT) {
+            return RESULT_TIMEOUT;
+        }
+    } while (ret == WindowedReceiver::RUNNING);
+    return ret;
+}
+
+} // anonymous
+
+TEST(transfer) {
+    std::mt19937 rnd(1);
+    // The last packet is not full
+    const auto file = randomFile(100 * PAYLOAD_SIZE + 123, &rnd);
+    Link link;
+    Sender sender(&link, file);
+    sender.start();
+    BufferStream dest;
+    EXPECT(receive(&link, file.size(), &dest) == WindowedReceiver::DONE);
+    sender.stop();
+    EXPECT(dest.data() == file);
+    // Nothing is sent twice over a reliable link
+    EXPECT(sender.packetsSent() == 101);
+}
+
+TEST(lossyLink) {
+    std::mt19937 rnd(2);
+    const auto file = randomFile(64 * PAYLOAD_SIZE, &rnd);
+    Link link;
+    link.rnd.seed(3);
+    link.replyLoss = 0.05;
+    // The packets are received via a channel buffer that holds a full window, as during an update
+    // over the muxer
+    uint8_t bufData[2048];
+    ChannelBuffer buf(bufData, sizeof(bufData));
+    ASSERT(buf.reserve(WindowedReceiver::maxInFlightSize()) == 0);
+    link.toReceiver.channelBuffer(&buf);
+    Sender sender(&link, file);
+    sender.packetLoss(0.05).packetCorruption(0.05).start();
+    BufferStream dest(2);
+    EXPECT(receive(&link, file.size(), &dest) == WindowedReceiver::DONE);
+    sender.stop();
+    EXPECT(dest.data() == file);
+    // Some packets were sent again, but none of them were dropped by the receiver
+    EXPECT(sender.packetsSent() > 64);
+    EXPECT(buf.droppedFrames() == 0);
+}
+
+TEST(windowFitsInChannelBuffer) {
+    std::mt19937 rnd(6);
+    const auto file = randomFile(64 * PAYLOAD_SIZE, &rnd);
+    Link link;
+    uint8_t bufData[2048];
+    ChannelBuffer buf(bufData, sizeof(bufData));
+    ASSERT(buf.reserve(WindowedReceiver::maxInFlightSize()) == 0);
+    link.toReceiver.channelBuffer(&buf);
+    Sender sender(&link, file);
+    sender.start();
+    // The receiver is slower than the sender
+    BufferStream dest(5);
+    EXPECT(receive(&link, file.size(), &dest) == WindowedReceiver::DONE);
+    sender.stop();
+    EXPECT(dest.data() == file);
+    EXPECT(buf.droppedFrames() == 0);
+    EXPECT(sender.packetsSent() == 64);
+    // The default buffer is restored
+    EXPECT(buf.reserve(0) == 0);
+    EXPECT(buf.capacity() == sizeof(bufData));
+}
+
+TEST(channelBufferOverflow) {
+    std::mt19937 rnd(7);
+    const auto file = randomFile(16 * PAYLOAD_SIZE, &rnd);
+    Link link;
+    // The default buffer of the AT channel can't hold a full window
+    uint8_t bufData[2048];
+    ChannelBuffer buf(bufData, sizeof(bufData));
+    link.toReceiver.channelBuffer(&buf);
+    Sender sender(&link, file);
+    sender.start();
+    BufferStream dest(5);
+    EXPECT(receive(&link, file.size(), &dest) == WindowedReceiver::DONE);
+    sender.stop();
+    // The dropped packets are whole and get sent again
+    EXPECT(dest.data() == file);
+    EXPECT(buf.droppedFrames() > 0);
+    EXPECT(sender.packetsSent() > 16);
+}
+
+TEST(cancelledBySender) {
+    std::mt19937 rnd(4);
+    const auto file = randomFile(16 * PAYLOAD_SIZE, &rnd);
+    Link link;
+    Sender sender(&link, file);
+    sender.cancel().start();
+    BufferStream dest;
+    EXPECT(receive(&link, file.size(), &dest) == RESULT_CANCELLED);
+    sender.stop();
+}
+
+TEST(unexpectedPacketSize) {
+    std::mt19937 rnd(5);
+    const auto file = randomFile(4 * PAYLOAD_SIZE, &rnd);
+    Link link;
+    Sender sender(&link, file);
+    sender.badSize().start();
+    BufferStream dest;
+    EXPECT(receive(&link, file.size(), &dest) == RESULT_PROTOCOL_ERROR);
+    sender.stop();
+    EXPECT(dest.data().empty());
+}